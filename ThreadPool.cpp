@@ -1,45 +1,123 @@
 #include "ThreadPool.h"
-#include <iostream>
-#include <functional>
-#include <thread>
 #include <cassert>
-#include <mutex>
+#include "commonops.h"
 
-void ThreadPool::worker() {
-    while (true) {
-        std::unique_lock<std::mutex> lock(mu);
-        
-        // Wait until there's something in the queue
-        not_empty.wait(lock, [this]{ return !queue.empty(); });
+// the pool and the index of the worker running on this thread
+static thread_local const ThreadPool* t_pool = nullptr;
+static thread_local size_t t_idx = 0;
 
-        // Get the next task
-        Task task = queue.front();
-        queue.pop_front();
+void ThreadPool::push(Worker* w, Task task) {
+    std::lock_guard<std::mutex> lock(w->mu);
+    if (w->len == w->ring.size()) {
+        // full, double it and unwrap the tasks to the front
+        std::vector<Task> ring(w->ring.empty() ? 64 : w->ring.size() * 2);
+        for (size_t i = 0; i < w->len; i++) {
+            ring[i] = w->ring[(w->head + i) & (w->ring.size() - 1)];
+        }
+        w->ring.swap(ring);
+        w->head = 0;
+    }
+    w->ring[(w->head + w->len) & (w->ring.size() - 1)] = task;
+    w->len++;
+    w->depth = w->len;
+}
 
-        lock.unlock();  // Unlock mutex while processing the task
+// the owner and the thieves both take the oldest task, so tasks start
+// roughly in the order they were produced
+bool ThreadPool::pop(Worker* w, Task& task) {
+    std::lock_guard<std::mutex> lock(w->mu);
+    if (w->len == 0) {
+        return false;
+    }
+    task = w->ring[w->head];
+    w->head = (w->head + 1) & (w->ring.size() - 1);
+    w->len--;
+    w->depth = w->len;
+    pending--;
+    return true;
+}
 
-        // Execute the task
-        task.f(task.arg);
+void ThreadPool::worker(size_t idx) {
+    t_pool = this;
+    t_idx = idx;
+    Worker* self = workers[idx].get();
+    size_t n = workers.size();
+    while (true) {
+        // our own queue first, then the others starting from our neighbour
+        Task task;
+        bool found = pop(self, task);
+        for (size_t i = 1; !found && i < n; i++) {
+            found = pop(workers[(idx + i) % n].get(), task);
+            self->steals += found;
+        }
+        if (found) {
+            uint64_t start_us = get_monotonic_usecs();
+            task.f(task.arg);
+            self->busy_us += get_monotonic_usecs() - start_us;
+            self->tasks++;
+            continue;
+        }
+        // `pending` is checked under `sleep_mu`, which produce() takes
+        // before notifying, so a wakeup can't be lost
+        std::unique_lock<std::mutex> lock(sleep_mu);
+        not_empty.wait(lock, [this]{ return pending > 0 || stopping; });
+        if (pending == 0 && stopping) {
+            return;
+        }
     }
 }
 
 void ThreadPool::init(size_t num_threads) {
-    assert(num_threads > 0);
+    assert(num_threads > 0 && workers.empty());
 
-    threads.resize(num_threads);
-    
     for (size_t i = 0; i < num_threads; ++i) {
-        threads[i] = std::thread(&ThreadPool::worker, this);
+        workers.emplace_back(new Worker());
+    }
+    // started once every queue exists, as they steal from each other
+    for (size_t i = 0; i < num_threads; ++i) {
+        workers[i]->thread = std::thread(&ThreadPool::worker, this, i);
+    }
+}
+
+void ThreadPool::produce(task_fn f, void* arg) {
+    assert(!stopping && !workers.empty());
+    size_t idx = t_pool == this ? t_idx : next++ % workers.size();
+    // counted first, so that pop() never takes `pending` below zero
+    pending++;
+    push(workers[idx].get(), Task{f, arg});
+    {
+        std::lock_guard<std::mutex> lock(sleep_mu);
+    }
+    not_empty.notify_one();
+}
+
+void ThreadPool::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mu);
+        stopping = true;
+    }
+    not_empty.notify_all();
+    for (std::unique_ptr<Worker>& w : workers) {
+        if (w->thread.joinable()) {
+            w->thread.join();
+        }
     }
 }
 
-void ThreadPool::produce(std::function<void(void*)> f, void* arg) {
-    // Lock the mutex to safely modify the queue
-    std::lock_guard<std::mutex> lock(mu);
+ThreadPool::~ThreadPool() {
+    shutdown();
+}
 
-    // Create a task and add it to the queue
-    queue.push_back(Task(f, arg));
+size_t ThreadPool::size() const {
+    return workers.size();
+}
 
-    // Notify one waiting worker thread that a new task is available
-    not_empty.notify_one();
-}
\ No newline at end of file
+WorkerStats ThreadPool::worker_stats(size_t idx) const {
+    const Worker* w = workers[idx].get();
+    WorkerStats st;
+    st.depth = w->depth;
+    st.busy_us = w->busy_us;
+    st.tasks = w->tasks;
+    st.steals = w->steals;
+    return st;
+}
@@ -1,30 +1,67 @@
+// 1. Every worker owns a queue of tasks; tasks from the event loop are dealt
+//    round robin over the queues, tasks produced by a worker go to its own
+// 2. A worker with an empty queue steals from the others before sleeping,
+//    so one slow task (an fsync) doesn't hold up the tasks queued behind it
+// 3. A task is a function pointer and its argument, queues are rings that
+//    only grow, so producing never allocates once they are warm
+// 4. shutdown() lets the workers drain every queued task, then joins them
+
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <memory>
 #include <thread>
 #include <vector>
-#include <deque>
 #include <mutex>
 #include <condition_variable>
-#include <functional>
 
-class Task {
-public:
-    std::function<void(*void)> f = nullptr;
+typedef void (*task_fn)(void*);
+
+struct Task {
+    task_fn f = nullptr;
     void *arg = nullptr;
+};
 
-    Task(std::function<void(void*)> func, void* argument) : f(func), arg(argument) {}
+struct WorkerStats {
+    size_t depth = 0;           // tasks queued
+    uint64_t busy_us = 0;       // time spent running tasks
+    uint64_t tasks = 0;         // tasks run, stolen ones included
+    uint64_t steals = 0;        // tasks taken from another worker's queue
 };
 
 class ThreadPool {
 public:
-    std::vector<std::thread> threads;
-    std::deque<Task> queue;
-    std::mutex mu;
-    std::condition_variable not_empty;
-
+    ~ThreadPool();
     void init(size_t num_threads);
-    void produce(std::function<void(void*)> f, void* arg);
+    void produce(task_fn f, void* arg);
+    // runs what is queued, then stops and joins the workers
+    void shutdown();
+    size_t size() const;
+    WorkerStats worker_stats(size_t idx) const;
 private:
-    void worker();
-};
\ No newline at end of file
+    // its own cache line, the loop and the thieves touch it concurrently
+    struct alignas(64) Worker {
+        std::mutex mu;
+        std::vector<Task> ring;     // power of two sized
+        size_t head = 0;            // the oldest task
+        size_t len = 0;
+        std::atomic<size_t> depth{0};
+        std::atomic<uint64_t> busy_us{0};
+        std::atomic<uint64_t> tasks{0};
+        std::atomic<uint64_t> steals{0};
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> next{0};        // round robin for the event loop
+    std::atomic<size_t> pending{0};     // tasks queued over all workers
+    std::atomic<bool> stopping{false};
+    std::mutex sleep_mu;
+    std::condition_variable not_empty;
+
+    void push(Worker* w, Task task);
+    bool pop(Worker* w, Task& task);
+    void worker(size_t idx);
+};
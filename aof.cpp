@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <vector>
+#include "aof.h"
+#include "config.h"
+#include "ThreadPool.h"
+#include "commonops.h"
+#include "constants.h"
+#include "rwloop.h"
+#include "errhelp.h"
+
+static struct {
+    int fd = -1;
+    std::string path;
+    std::vector<uint8_t> buf;           // the batch of the current iteration
+    std::vector<uint8_t> rewrite_buf;   // commands received during a rewrite
+    // the pool appends `rewrite_head` to `rewrite_tmp` and syncs it
+    std::string rewrite_tmp;
+    std::vector<uint8_t> rewrite_head;
+    int rewrite_fd = -1;
+    bool rewrite_ok = false;
+    bool finishing = false;
+    std::atomic<bool> rewrite_done{false};
+    uint64_t last_fsync_us = 0;
+    std::atomic<bool> fsync_in_flight{false};
+    AofStats stats;
+} g_aof;
+
+bool aof_enabled(){
+    return g_aof.fd >= 0;
+}
+
+bool aof_open(const char* path){
+    int fd = open(path, O_WRONLY|O_APPEND|O_CREAT, 0644);
+    if (fd < 0){
+        msg_err("aof open() error");
+        return false;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    g_aof.fd = fd;
+    g_aof.path = path;
+    g_aof.stats.size = (uint64_t)st.st_size;
+    g_aof.last_fsync_us = get_monotonic_usecs();
+    return true;
+}
+
+void aof_append(const uint8_t* frame, size_t len){
+    g_aof.buf.insert(g_aof.buf.end(), frame, frame+len);
+    if (g_aof.stats.rewriting){
+        g_aof.rewrite_buf.insert(g_aof.rewrite_buf.end(), frame, frame+len);
+    }
+    g_aof.stats.pending = g_aof.buf.size();
+}
+
+bool aof_pending(){
+    return !g_aof.buf.empty();
+}
+
+static void aof_fsync_task(void* arg){
+    fdatasync((int)(intptr_t)arg);
+    g_aof.fsync_in_flight = false;
+}
+
+// writes as much of the batch as it can and drops that from it, so a write
+// failing part way (ENOSPC) leaves a log the retry continues, not repeats
+static bool aof_write_buf(){
+    size_t done = 0;
+    while (done < g_aof.buf.size()){
+        ssize_t ret = write(g_aof.fd, &g_aof.buf[done], g_aof.buf.size() - done);
+        if (ret <= 0){
+            break;
+        }
+        done += (size_t)ret;
+    }
+    g_aof.stats.size += done;
+    g_aof.buf.erase(g_aof.buf.begin(), g_aof.buf.begin() + done);
+    g_aof.stats.pending = g_aof.buf.size();
+    return g_aof.buf.empty();
+}
+
+void aof_flush(uint32_t fsync_policy, ThreadPool* pool){
+    if (g_aof.fd < 0){
+        return;
+    }
+    if (!g_aof.buf.empty()){
+        if (!aof_write_buf()){
+            // the rest of the batch is retried on the next iteration
+            msg_err("aof write() error");
+            g_aof.stats.last_write_ok = false;
+            if (fsync_policy == FSYNC_ALWAYS){
+                die("cannot persist acknowledged writes");
+            }
+            return;
+        }
+        g_aof.stats.last_write_ok = true;
+        if (fsync_policy == FSYNC_ALWAYS){
+            // one fsync for every write of this iteration, replies go out after it
+            if (fdatasync(g_aof.fd) < 0){
+                die("aof fdatasync() error");
+            }
+            g_aof.stats.fsyncs++;
+            g_aof.last_fsync_us = get_monotonic_usecs();
+        }
+    }
+    if (fsync_policy == FSYNC_EVERYSEC && !g_aof.fsync_in_flight){
+        uint64_t now_us = get_monotonic_usecs();
+        if (now_us - g_aof.last_fsync_us >= 1000*1000){
+            g_aof.fsync_in_flight = true;
+            g_aof.last_fsync_us = now_us;
+            g_aof.stats.fsyncs++;
+            pool->produce(&aof_fsync_task, (void*)(intptr_t)g_aof.fd);
+        }
+    }
+}
+
+bool aof_load(const char* path, bool (*apply)(const uint8_t* frame, size_t len)){
+    int fd = open(path, O_RDWR);
+    if (fd < 0){
+        return false;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    std::vector<uint8_t> data((size_t)st.st_size);
+    if (!data.empty() && read_full(fd, (char*)data.data(), data.size()) < 0){
+        close(fd);
+        return false;
+    }
+    size_t pos = 0;
+    while (pos + 4 <= data.size()){
+        uint32_t len = 0;
+        memcpy(&len, &data[pos], 4);
+        if (len > k_max_msg){
+            close(fd);
+            return false;
+        }
+        if (pos + 4 + len > data.size()){
+            break;      // torn tail
+        }
+        if (!apply(&data[pos+4], len)){
+            close(fd);
+            return false;
+        }
+        pos += 4 + len;
+    }
+    if (pos != data.size()){
+        fprintf(stderr, "aof has a torn tail of %zu bytes, truncating\n", data.size() - pos);
+        if (ftruncate(fd, (off_t)pos) < 0){
+            msg_err("aof ftruncate() error");
+        }
+    }
+    close(fd);
+    return true;
+}
+
+void aof_rewrite_begin(){
+    g_aof.stats.rewriting = true;
+    g_aof.rewrite_buf.clear();
+}
+
+void aof_rewrite_abort(){
+    g_aof.stats.rewriting = false;
+    g_aof.rewrite_buf.clear();
+    g_aof.rewrite_buf.shrink_to_fit();
+}
+
+static void aof_rewrite_task(void*){
+    int fd = open(g_aof.rewrite_tmp.c_str(), O_WRONLY|O_APPEND);
+    g_aof.rewrite_ok = fd >= 0
+        && write_all(fd, (const char*)g_aof.rewrite_head.data(), g_aof.rewrite_head.size()) == 0
+        && fdatasync(fd) == 0;
+    g_aof.rewrite_fd = fd;
+    g_aof.rewrite_done = true;
+}
+
+void aof_rewrite_finish(const char* tmp_path, ThreadPool* pool){
+    // `rewriting` stays set, the commands received from now on are
+    // appended by aof_rewrite_poll()
+    g_aof.rewrite_tmp = tmp_path;
+    g_aof.rewrite_head.swap(g_aof.rewrite_buf);
+    g_aof.rewrite_buf.clear();
+    g_aof.rewrite_fd = -1;
+    g_aof.rewrite_done = false;
+    g_aof.finishing = true;
+    pool->produce(&aof_rewrite_task, nullptr);
+}
+
+bool aof_rewrite_poll(uint32_t fsync_policy, bool* ok){
+    // an everysec fsync may still hold the old descriptor
+    if (!g_aof.finishing || !g_aof.rewrite_done || g_aof.fsync_in_flight){
+        return false;
+    }
+    g_aof.finishing = false;
+    int fd = g_aof.rewrite_fd;
+    // the tail is a few iterations of commands, `always` syncs it before the
+    // log takes the place of the old one
+    *ok = g_aof.rewrite_ok
+        && write_all(fd, (const char*)g_aof.rewrite_buf.data(), g_aof.rewrite_buf.size()) == 0
+        && (fsync_policy != FSYNC_ALWAYS || fdatasync(fd) == 0)
+        && rename(g_aof.rewrite_tmp.c_str(), g_aof.path.c_str()) == 0;
+    aof_rewrite_abort();
+    g_aof.rewrite_head.clear();
+    g_aof.rewrite_head.shrink_to_fit();
+    if (!*ok){
+        msg_err("aof rewrite error");
+        if (fd >= 0){
+            close(fd);
+        }
+        unlink(g_aof.rewrite_tmp.c_str());
+        return true;
+    }
+    // swap the descriptors, the pending batch is already in the new file
+    close(g_aof.fd);
+    g_aof.fd = fd;
+    g_aof.buf.clear();
+    g_aof.stats.pending = 0;
+    struct stat st;
+    fstat(fd, &st);
+    g_aof.stats.size = (uint64_t)st.st_size;
+    return true;
+}
+
+const AofStats& aof_stats(){
+    return g_aof.stats;
+}
@@ -0,0 +1,46 @@
+// 1. Every successful write is appended to the log as a request frame, the
+//    same framing clients use, so replaying it is just parsing and executing
+// 2. Commands are batched in memory during a loop iteration and written at
+//    its end, with one fsync per batch for `always` (group commit), a pool
+//    worker fsync once per second for `everysec`, or none at all
+// 3. BGREWRITEAOF writes a compacted log from a forked child, the commands
+//    received meanwhile are kept aside; a pool worker appends and syncs them,
+//    then the loop appends the few received since and swaps the logs
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+class ThreadPool;
+
+struct AofStats {
+    uint64_t size = 0;          // bytes in the current log
+    uint64_t fsyncs = 0;
+    uint64_t pending = 0;       // bytes not written yet
+    bool last_write_ok = true;
+    bool rewriting = false;
+};
+
+bool aof_enabled();
+// opens the log for appending
+bool aof_open(const char* path);
+void aof_append(const uint8_t* frame, size_t len);
+// batched bytes waiting for the end of the loop iteration
+bool aof_pending();
+// writes the batch and fsyncs according to the policy
+void aof_flush(uint32_t fsync_policy, ThreadPool* pool);
+// replays every complete frame, a torn frame at the tail (a crash in the
+// middle of a write) is cut off; returns false if the log is corrupted
+bool aof_load(const char* path, bool (*apply)(const uint8_t* frame, size_t len));
+
+// the child writes into `tmp_path`, the parent buffers new commands until
+// aof_rewrite_finish() has the pool append them, a later aof_rewrite_poll()
+// appends the rest and renames the file over the log
+void aof_rewrite_begin();
+void aof_rewrite_finish(const char* tmp_path, ThreadPool* pool);
+// true once the rewrite is over, `ok` tells whether the logs were swapped
+bool aof_rewrite_poll(uint32_t fsync_policy, bool* ok);
+void aof_rewrite_abort();
+const AofStats& aof_stats();
@@ -65,7 +65,7 @@ static AVLNode* avl_balance_left(AVLNode* node){
 // when the right subtree of node is taller by 2
 static AVLNode* avl_balance_right(AVLNode* node){
     if (avl_height(node->right->left) > avl_height(node->right->right)) {
-        node->left = avl_rot_right(node->left);
+        node->right = avl_rot_right(node->right);
     }
     return avl_rot_left(node);
 }
@@ -92,7 +92,7 @@ AVLNode* avl_balance(AVLNode* node){
         // result assigned to parent as height may be changed
         if (hl == hr+2){
             *from = avl_balance_left(node);
-        } else {
+        } else if (hl+2 == hr) {
             *from = avl_balance_right(node);
         }
         
@@ -189,6 +189,16 @@ AVLNode* avl_offset(AVLNode* node, int64_t offset) {
     return node;
 }
 
+int64_t avl_rank(AVLNode* node) {
+    int64_t rank = avl_size(node->left);
+    for (; node->parent; node = node->parent) {
+        if (node->parent->right == node) {
+            rank += avl_size(node->parent->left) + 1;
+        }
+    }
+    return rank;
+}
+
 
 
 /*
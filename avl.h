@@ -31,4 +31,6 @@ inline uint32_t avl_size(AVLNode *node){
 // APIs
 AVLNode* avl_balance(AVLNode *node);
 AVLNode* avl_del(AVLNode *node);
-AVLNode* avl_offset(AVLNode* node, int64_t offset);
\ No newline at end of file
+AVLNode* avl_offset(AVLNode* node, int64_t offset);
+// the number of nodes before `node` in its tree
+int64_t  avl_rank(AVLNode* node);
\ No newline at end of file
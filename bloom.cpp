@@ -0,0 +1,208 @@
+#include <string.h>
+#include <math.h>
+#include "bloom.h"
+#include "commonops.h"
+
+const size_t k_bloom_header = 8 + 8 + 4;
+const size_t k_bloom_layer_header = 8 + 8 + 8 + 4;
+const uint32_t k_bloom_max_layers = 32;
+const uint64_t k_bloom_seed1 = 0x9747b28cULL;
+const uint64_t k_bloom_seed2 = 0xc2b2ae35ULL;
+
+struct BloomLayer {
+    uint64_t nbits = 0;
+    uint64_t count = 0;
+    uint64_t capacity = 0;
+    uint32_t k = 0;
+    size_t bits = 0;            // offset of the bits in the image
+};
+
+//===============================layout===============================//
+
+static uint32_t img_nlayers(const std::string &img){
+    uint32_t n = 0;
+    memcpy(&n, &img[16], 4);
+    return n;
+}
+
+// the layer at `off`, returns the offset of the next one
+static size_t layer_read(const std::string &img, size_t off, BloomLayer* l){
+    memcpy(&l->nbits, &img[off], 8);
+    memcpy(&l->count, &img[off + 8], 8);
+    memcpy(&l->capacity, &img[off + 16], 8);
+    memcpy(&l->k, &img[off + 24], 4);
+    l->bits = off + k_bloom_layer_header;
+    return l->bits + l->nbits/8;
+}
+
+// the size of layer `i` of a filter of `capacity` at `error`
+static void layer_plan(uint64_t capacity, double error, uint32_t i, BloomLayer* l){
+    double err = error * pow(0.5, i);
+    l->capacity = capacity << i;
+    l->k = (uint32_t)ceil(-log2(err));
+    double nbits = ceil((double)l->capacity * -log(err) / (log(2.0)*log(2.0)));
+    if (nbits > 0x1p62){
+        nbits = 0x1p62;     // past any limit, it is only compared against one
+    }
+    l->nbits = ((uint64_t)nbits + 63) / 64 * 64;
+    l->count = 0;
+}
+
+static void layer_append(std::string &img, const BloomLayer &l){
+    size_t off = img.size();
+    img.resize(off + k_bloom_layer_header + l.nbits/8, '\0');
+    memcpy(&img[off], &l.nbits, 8);
+    memcpy(&img[off + 8], &l.count, 8);
+    memcpy(&img[off + 16], &l.capacity, 8);
+    memcpy(&img[off + 24], &l.k, 4);
+    uint32_t n = img_nlayers(img) + 1;
+    memcpy(&img[16], &n, 4);
+}
+
+//===============================bits===============================//
+
+struct BloomHash {
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+};
+
+static BloomHash bloom_hash(const char* val, size_t len){
+    BloomHash h;
+    h.h1 = hash64((const uint8_t*)val, len, k_bloom_seed1);
+    h.h2 = hash64((const uint8_t*)val, len, k_bloom_seed2) | 1;
+    return h;
+}
+
+static bool layer_has(const std::string &img, const BloomLayer &l, const BloomHash &h){
+    const uint8_t* bits = (const uint8_t*)img.data() + l.bits;
+    for (uint32_t i = 0; i < l.k; i++){
+        uint64_t bit = (h.h1 + i*h.h2) % l.nbits;
+        if (!(bits[bit/8] & (1u << (bit & 7)))){
+            return false;
+        }
+    }
+    return true;
+}
+
+static void layer_set(std::string &img, const BloomLayer &l, const BloomHash &h){
+    uint8_t* bits = (uint8_t*)&img[l.bits];
+    for (uint32_t i = 0; i < l.k; i++){
+        uint64_t bit = (h.h1 + i*h.h2) % l.nbits;
+        bits[bit/8] |= (uint8_t)(1u << (bit & 7));
+    }
+}
+
+//===============================interface===============================//
+
+void bloom_init(std::string &img, uint64_t capacity, double error){
+    img.assign(k_bloom_header, '\0');
+    memcpy(&img[0], &capacity, 8);
+    memcpy(&img[8], &error, 8);
+    BloomLayer l;
+    layer_plan(capacity, error, 0, &l);
+    layer_append(img, l);
+}
+
+size_t bloom_size(uint64_t capacity, double error){
+    BloomLayer l;
+    layer_plan(capacity, error, 0, &l);
+    return k_bloom_header + k_bloom_layer_header + l.nbits/8;
+}
+
+bool bloom_valid(const std::string &img){
+    if (img.size() < k_bloom_header){
+        return false;
+    }
+    uint64_t capacity = 0;
+    double error = 0;
+    memcpy(&capacity, &img[0], 8);
+    memcpy(&error, &img[8], 8);
+    uint32_t n = img_nlayers(img);
+    if (capacity == 0 || capacity > k_bloom_max_capacity || !(error > 0 && error < 1) || n == 0 || n > k_bloom_max_layers){
+        return false;
+    }
+    size_t off = k_bloom_header;
+    for (uint32_t i = 0; i < n; i++){
+        if (img.size() - off < k_bloom_layer_header){
+            return false;
+        }
+        BloomLayer l;
+        size_t next = layer_read(img, off, &l);
+        if (l.nbits == 0 || l.nbits % 64 || l.k == 0 || l.k > 64
+            || l.nbits/8 > img.size() - off - k_bloom_layer_header)
+        {
+            return false;
+        }
+        off = next;
+    }
+    return off == img.size();
+}
+
+static BloomLayer last_layer(const std::string &img){
+    BloomLayer l;
+    size_t off = k_bloom_header;
+    for (uint32_t i = 0, n = img_nlayers(img); i < n; i++){
+        off = layer_read(img, off, &l);
+    }
+    return l;
+}
+
+static void next_layer(const std::string &img, BloomLayer* l){
+    uint64_t capacity = 0;
+    double error = 0;
+    memcpy(&capacity, &img[0], 8);
+    memcpy(&error, &img[8], 8);
+    layer_plan(capacity, error, img_nlayers(img), l);
+}
+
+size_t bloom_next_size(const std::string &img){
+    BloomLayer l = last_layer(img);
+    if (l.count < l.capacity){
+        return img.size();
+    }
+    if (img_nlayers(img) >= k_bloom_max_layers){
+        return (size_t)-1;
+    }
+    next_layer(img, &l);
+    return img.size() + k_bloom_layer_header + l.nbits/8;
+}
+
+bool bloom_add(std::string &img, const char* val, size_t len){
+    if (bloom_exists(img, val, len)){
+        return false;
+    }
+    BloomLayer l = last_layer(img);
+    if (l.count >= l.capacity){
+        next_layer(img, &l);
+        layer_append(img, l);
+        l = last_layer(img);
+    }
+    layer_set(img, l, bloom_hash(val, len));
+    l.count++;
+    memcpy(&img[l.bits - k_bloom_layer_header + 8], &l.count, 8);
+    return true;
+}
+
+bool bloom_exists(const std::string &img, const char* val, size_t len){
+    BloomHash h = bloom_hash(val, len);
+    size_t off = k_bloom_header;
+    for (uint32_t i = 0, n = img_nlayers(img); i < n; i++){
+        BloomLayer l;
+        off = layer_read(img, off, &l);
+        if (layer_has(img, l, h)){
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t bloom_count(const std::string &img){
+    uint64_t count = 0;
+    size_t off = k_bloom_header;
+    for (uint32_t i = 0, n = img_nlayers(img); i < n; i++){
+        BloomLayer l;
+        off = layer_read(img, off, &l);
+        count += l.count;
+    }
+    return count;
+}
@@ -0,0 +1,37 @@
+// 1. A scalable Bloom filter: a stack of bit arrays (layers), an element
+//    sets k bits of one layer, found at h1 + i*h2 from two 64 bit hashes,
+//    and may be in the filter if all k bits of some layer are set
+// 2. A layer takes `capacity` elements at its error rate; once full a new
+//    layer is added with twice the capacity and half the error rate, so the
+//    overall false positive rate stays under twice the first one however
+//    many elements are added
+// 3. The image is a byte string, the value of a T_BLOOM entry:
+//    +----------+-------+---------+-------+-----+-------+
+//    | capacity | error | nlayers | layer | ... | layer |
+//    +----------+-------+---------+-------+-----+-------+
+//         u64      f64     u32
+//    layer := nbits:u64 count:u64 capacity:u64 k:u32 + nbits/8 bytes,
+//    of the first layer; nbits is a multiple of 64
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+const uint64_t k_bloom_max_capacity = (uint64_t)1 << 32;   // of the first layer
+
+// an empty filter, `error` in (0, 1)
+void     bloom_init(std::string &img, uint64_t capacity, double error);
+// the size of the image of a new filter
+size_t   bloom_size(uint64_t capacity, double error);
+// whether an image from a snapshot or RESTORE is well formed
+bool     bloom_valid(const std::string &img);
+// the size of the image after the next bloom_add(), larger if the last
+// layer is full, for refusing to grow past a limit
+size_t   bloom_next_size(const std::string &img);
+// false if it may already have been added, then nothing changes
+bool     bloom_add(std::string &img, const char* val, size_t len);
+bool     bloom_exists(const std::string &img, const char* val, size_t len);
+// elements added
+uint64_t bloom_count(const std::string &img);
@@ -1,16 +1,12 @@
 #include "cache.h"
 #include <vector>
 
-static size_t heap_left(size_t i){
-    return 2*i+1;
-}
-
-static size_t heap_right(size_t i){
-    return 2*i+2;
+static size_t heap_child(size_t i){
+    return k_heap_arity*i+1;
 }
 
 static size_t heap_parent(size_t i){
-    return (i+1)/2 - 1;
+    return (i-1)/k_heap_arity;
 }
 
 // update the node's position when it becomes smaller than its parents
@@ -20,6 +16,7 @@ static void heap_float(HeapNode* arr, size_t pos){
     while(pos > 0 && arr[heap_parent(pos)].ttl_val > t.ttl_val){
         // swap with the parent
         arr[pos] = arr[heap_parent(pos)];
+        *arr[pos].ref = pos;
         pos = heap_parent(pos);
     }
     arr[pos] = t;
@@ -30,23 +27,26 @@ static void heap_float(HeapNode* arr, size_t pos){
 static void heap_sink(HeapNode* arr, size_t pos, size_t len){
     HeapNode t = arr[pos];
     while(true){
-        size_t l = heap_left(pos);
-        size_t r = heap_right(pos);
+        // the children are contiguous and share a cache line
+        size_t first = heap_child(pos);
+        size_t last = first + k_heap_arity;
+        if (last > len){
+            last = len;
+        }
         size_t min_pos = pos;
         uint64_t min_val = t.ttl_val;
-        if (l < len && arr[l].ttl_val < min_val){
-            min_pos = l;
-            min_val = arr[l].ttl_val;
-        }
-        if (r < len && arr[r].ttl_val < min_val){
-            min_pos = r;
-            min_val = arr[r].ttl_val;
+        for (size_t c = first; c < last; c++){
+            if (arr[c].ttl_val < min_val){
+                min_pos = c;
+                min_val = arr[c].ttl_val;
+            }
         }
         if (min_pos == pos){
             break;
         }
-        // swap with the smaller child
+        // swap with the smallest child
         arr[pos] = arr[min_pos];
+        *arr[pos].ref = pos;
         pos = min_pos;
     }
     arr[pos] = t;
@@ -63,7 +63,7 @@ void heap_update_pos(HeapNode* arr, size_t pos, size_t len){
     }
 }
 
-void heap_delete(std::vector<HeapNode>& arr, size_t pos){
+void heap_delete(HeapArray& arr, size_t pos){
     // swap erased item with the last item
     arr[pos] = arr.back();
     arr.pop_back();
@@ -73,7 +73,7 @@ void heap_delete(std::vector<HeapNode>& arr, size_t pos){
 }
 
 // update or insert an entry
-void heap_upsert(std::vector<HeapNode>& arr, size_t pos, HeapNode t){
+void heap_upsert(HeapArray& arr, size_t pos, HeapNode t){
     if (pos < arr.size()){
         arr[pos] = t;
     } else {
@@ -81,4 +81,43 @@ void heap_upsert(std::vector<HeapNode>& arr, size_t pos, HeapNode t){
         arr.push_back(t);
     }
     heap_update_pos(arr.data(), pos, arr.size());
-}
\ No newline at end of file
+}
+
+// sink every internal node, from the last one up to the root
+void heap_build(HeapNode* arr, size_t len){
+    for (size_t i = 0; i < len; i++){
+        *arr[i].ref = i;
+    }
+    if (len < 2){
+        return;
+    }
+    for (size_t pos = heap_parent(len-1)+1; pos-- > 0;){
+        heap_sink(arr, pos, len);
+    }
+}
+
+void heap_bulk_upsert(HeapArray& arr, const HeapNode* items, size_t n){
+    // n sifts cost about n*log(len), a rebuild about 2*len
+    size_t len = arr.size() + n;
+    size_t levels = 1;
+    for (size_t x = len; x > k_heap_arity; x /= k_heap_arity){
+        levels++;
+    }
+    if (n*levels < 2*len){
+        for (size_t i = 0; i < n; i++){
+            heap_upsert(arr, *items[i].ref, items[i]);
+        }
+        return;
+    }
+    arr.reserve(len);
+    for (size_t i = 0; i < n; i++){
+        size_t pos = *items[i].ref;
+        if (pos < arr.size()){
+            arr[pos] = items[i];
+        } else {
+            *items[i].ref = arr.size();
+            arr.push_back(items[i]);
+        }
+    }
+    heap_build(arr.data(), arr.size());
+}
@@ -1,17 +1,62 @@
 // 1. For TTL cache we use a heap as the timeout value is not fixed
 // 2. We use an array-encoded heap for this one, meaning no dynamic allocations
+// 3. The heap is d-ary, the children of node i are [d*i+1, d*i+d], they are
+//    placed on whole cache lines so a sink step touches one line per level
+//    and there are log_d(n) levels instead of log_2(n)
 
 # pragma once
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <new>
 #include <vector>
 
+// build with -DHEAP_ARITY=2/4/8, 4 children of 16 bytes fill a cache line
+#ifndef HEAP_ARITY
+#define HEAP_ARITY 4
+#endif
+
+const size_t k_heap_arity = HEAP_ARITY;
+const size_t k_cache_line = 64;
+
 struct HeapNode {
     uint64_t ttl_val;
     size_t* ref;        // points to Entry::heap_idx
 };
 
+// the allocation is shifted so element 1, the first child of the root,
+// starts a cache line, every group of siblings is then line aligned
+template <class T>
+struct HeapAlloc {
+    typedef T value_type;
+    static const size_t k_shift = k_cache_line - sizeof(T);
+
+    HeapAlloc() = default;
+    template <class U> HeapAlloc(const HeapAlloc<U> &) {}
+
+    T* allocate(size_t n){
+        size_t bytes = (n*sizeof(T) + k_shift + k_cache_line-1) / k_cache_line * k_cache_line;
+        char* raw = (char*)aligned_alloc(k_cache_line, bytes);
+        if (!raw){
+            throw std::bad_alloc();
+        }
+        return (T*)(raw + k_shift);
+    }
+    void deallocate(T* p, size_t){
+        free((char*)p - k_shift);
+    }
+    template <class U> bool operator==(const HeapAlloc<U> &) const { return true; }
+    template <class U> bool operator!=(const HeapAlloc<U> &) const { return false; }
+};
+
+typedef std::vector<HeapNode, HeapAlloc<HeapNode>> HeapArray;
+
 void heap_update_pos(HeapNode* arr, size_t pos, size_t len);
-void heap_delete(std::vector<HeapNode>& arr, size_t pos);
-void heap_upsert(std::vector<HeapNode>& arr, size_t pos, HeapNode t);
\ No newline at end of file
+void heap_delete(HeapArray& arr, size_t pos);
+void heap_upsert(HeapArray& arr, size_t pos, HeapNode t);
+// bottom-up heapify in O(n), also refreshes every `ref`
+void heap_build(HeapNode* arr, size_t len);
+// inserts or updates many nodes at once, rebuilding the heap when that is
+// cheaper than sifting each node, nodes with `*ref == -1` are new
+void heap_bulk_upsert(HeapArray& arr, const HeapNode* items, size_t n);
@@ -0,0 +1,177 @@
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <atomic>
+#include <mutex>
+#include "capture.h"
+#include "ThreadPool.h"
+#include "constants.h"
+#include "rwloop.h"
+#include "errhelp.h"
+
+// a handed over buffer and its block header
+struct CaptureBlock {
+    std::string header;
+    std::string data;
+    uint32_t frames = 0;
+};
+
+static struct {
+    int fd = -1;
+    std::string path;
+    ThreadPool* pool = nullptr;
+    uint64_t session = 0;           // bumped by every start, outdates the buffers
+    uint32_t next_conn_id = 0;
+    uint64_t requests = 0;          // the loop's only
+    bool stopping = false;          // stopped, the file closes once `in_flight` is 0
+    std::mutex write_mu;            // the file, between pool workers
+    std::atomic<uint32_t> in_flight{0};     // blocks handed over
+    std::atomic<uint64_t> pending{0};
+    std::atomic<uint64_t> blocks{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> dropped{0};
+} g_cap;
+
+static void put_u32(std::string &out, uint32_t v){
+    out.append((const char*)&v, 4);
+}
+
+static void put_u64(std::string &out, uint64_t v){
+    out.append((const char*)&v, 8);
+}
+
+static void put_varint(std::string &out, uint64_t v){
+    while (v >= 0x80){
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+bool capture_start(const char* path, ThreadPool* pool){
+    if (g_cap.fd >= 0){
+        return false;
+    }
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, 0644);
+    if (fd < 0){
+        msg_err("capture open() error");
+        return false;
+    }
+    std::string header(k_capture_magic, 4);
+    put_u32(header, k_capture_version);
+    if (write_all(fd, header.data(), header.size()) < 0){
+        msg_err("capture write() error");
+        close(fd);
+        return false;
+    }
+    g_cap.fd = fd;
+    g_cap.path = path;
+    g_cap.pool = pool;
+    g_cap.session++;
+    g_cap.requests = 0;
+    g_cap.blocks = 0;
+    g_cap.bytes = header.size();
+    g_cap.dropped = 0;
+    return true;
+}
+
+void capture_stop(){
+    if (g_cap.fd >= 0){
+        g_cap.stopping = true;
+    }
+}
+
+bool capture_poll(){
+    if (!g_cap.stopping || g_cap.in_flight > 0){
+        return g_cap.stopping;
+    }
+    close(g_cap.fd);
+    g_cap.fd = -1;
+    g_cap.stopping = false;
+    return false;
+}
+
+bool capture_active(){
+    return g_cap.fd >= 0 && !g_cap.stopping;
+}
+
+void capture_request(CaptureBuf &buf, uint64_t now_us, const uint8_t* frame, size_t len){
+    if (!capture_active()){
+        return;
+    }
+    // the first request of this connection since the capture started
+    if (buf.session != g_cap.session){
+        buf.session = g_cap.session;
+        buf.conn_id = g_cap.next_conn_id++;
+        buf.data.clear();
+    }
+    if (buf.data.empty()){
+        buf.base_us = buf.last_us = now_us;
+        buf.frames = 0;
+    }
+    put_varint(buf.data, now_us - buf.last_us);
+    buf.data.append((const char*)frame, len);
+    buf.last_us = now_us;
+    buf.frames++;
+    g_cap.requests++;
+    if (buf.data.size() >= k_capture_block){
+        capture_flush(buf);
+    }
+}
+
+static void capture_write_task(void* arg){
+    CaptureBlock* block = (CaptureBlock*) arg;
+    {
+        std::lock_guard<std::mutex> lock(g_cap.write_mu);
+        if (write_all(g_cap.fd, block->header.data(), block->header.size()) < 0
+            || write_all(g_cap.fd, block->data.data(), block->data.size()) < 0)
+        {
+            msg_err("capture write() error");
+            g_cap.dropped += block->frames;
+        } else {
+            g_cap.blocks++;
+            g_cap.bytes += block->header.size() + block->data.size();
+        }
+    }
+    g_cap.pending -= block->data.size();
+    delete block;
+    g_cap.in_flight--;
+}
+
+void capture_flush(CaptureBuf &buf){
+    if (buf.data.empty()){
+        return;
+    }
+    if (!capture_active() || buf.session != g_cap.session){
+        buf.data.clear();
+        return;
+    }
+    if (g_cap.pending + buf.data.size() > k_capture_max_pending){
+        g_cap.dropped += buf.frames;
+        buf.data.clear();
+        return;
+    }
+    CaptureBlock* block = new CaptureBlock();
+    block->frames = buf.frames;
+    put_u32(block->header, buf.conn_id);
+    put_u64(block->header, buf.base_us);
+    put_u32(block->header, buf.frames);
+    put_u32(block->header, (uint32_t)buf.data.size());
+    block->data.swap(buf.data);
+    g_cap.pending += block->data.size();
+    g_cap.in_flight++;
+    g_cap.pool->produce(&capture_write_task, block);
+}
+
+CaptureStats capture_stats(){
+    CaptureStats st;
+    st.active = capture_active();
+    st.stopping = g_cap.stopping;
+    st.path = g_cap.path;
+    st.requests = g_cap.requests;
+    st.blocks = g_cap.blocks;
+    st.bytes = g_cap.bytes;
+    st.pending = g_cap.pending;
+    st.dropped = g_cap.dropped;
+    return st;
+}
@@ -0,0 +1,69 @@
+// 1. Traffic capture: while it is on, every request a client sends is
+//    recorded with its arrival time and connection into a compact binary
+//    file, which replay.cpp sends again against a test server
+// 2. The loop only appends the request frame and a varint time delta to a
+//    buffer of the connection, no lock and no syscall; a full buffer, a
+//    closing connection and a periodic sweep hand the buffer to the thread
+//    pool, which writes it under the file's own lock
+// 3. One block holds requests of one connection only and in order, but the
+//    blocks of a connection may be written by different pool workers and so
+//    land out of order, a reader merges them by their start time
+// 4. If the disk falls behind by more than k_capture_max_pending bytes new
+//    blocks are dropped and counted, the server never waits for the file
+//
+// +--------+---------+    +---------+---------+--------+-------+---------+
+// | "CAPT" | version |    | conn id | base_us | frames | bytes | records |
+// +--------+---------+    +---------+---------+--------+-------+---------+
+//     the file header           u32       u64      u32     u32    `bytes`
+//
+// a record is a varint of the microseconds since the previous record of the
+// block (the first one since `base_us`) then the request frame, as sent in
+// our protocol whatever the client spoke; times are from the monotonic clock,
+// only their differences mean anything
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+class ThreadPool;
+
+const char k_capture_magic[4] = {'C', 'A', 'P', 'T'};
+const uint32_t k_capture_version = 1;
+
+// the requests of a connection not handed over yet
+struct CaptureBuf {
+    uint64_t session = 0;       // of the capture it was filled for
+    uint32_t conn_id = 0;
+    uint64_t base_us = 0;
+    uint64_t last_us = 0;
+    uint32_t frames = 0;
+    std::string data;
+};
+
+struct CaptureStats {
+    bool active = false;
+    bool stopping = false;      // stopped, blocks still being written
+    std::string path;
+    uint64_t requests = 0;      // recorded
+    uint64_t blocks = 0;        // written
+    uint64_t bytes = 0;         // in the file
+    uint64_t pending = 0;       // bytes handed over and not written yet
+    uint64_t dropped = 0;       // requests lost to a slow disk or a write error
+};
+
+// truncates `path` (not through a symlink) and starts recording, not while
+// the last capture is stopping
+bool capture_start(const char* path, ThreadPool* pool);
+// stops recording, flush the buffers first; the file is closed by
+// capture_poll() once the blocks handed over are written
+void capture_stop();
+// true while a stopped capture still has blocks to write, from the loop
+bool capture_poll();
+// recording, and so neither stopping nor stopped
+bool capture_active();
+// appends one request frame, hands the buffer over once it is large enough
+void capture_request(CaptureBuf &buf, uint64_t now_us, const uint8_t* frame, size_t len);
+void capture_flush(CaptureBuf &buf);
+CaptureStats capture_stats();
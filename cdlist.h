@@ -1,5 +1,7 @@
 // circular doubly linked list for timers
 
+#pragma once
+
 #include <stddef.h>
 
 struct CDNode {
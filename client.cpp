@@ -0,0 +1,435 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "client.h"
+
+const size_t k_client_chunk = 64<<10;       // socket read size, replies share it
+const size_t k_client_max_reply = 32<<20;   // the server's k_max_msg
+const int k_client_max_depth = 64;          // nested arrays in a reply
+
+static uint32_t load_u32(const uint8_t* p){
+    uint32_t v = 0;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+//================================== reply decoding ==================================//
+
+// the size of the value at `p`, which has been checked
+static size_t value_size(const uint8_t* p){
+    switch (p[0]){
+    case TAG_ERR:
+        return 9 + load_u32(p + 5);
+    case TAG_STR:
+        return 5 + load_u32(p + 1);
+    case TAG_INT:
+    case TAG_DBL:
+        return 9;
+    case TAG_ARR:
+    case TAG_MAP: {
+        uint64_t n = (uint64_t)load_u32(p + 1) * (p[0] == TAG_MAP ? 2 : 1);
+        const uint8_t* cur = p + 5;
+        for (uint64_t i = 0; i < n; i++){
+            cur += value_size(cur);
+        }
+        return cur - p;
+    }
+    default:
+        return 1;
+    }
+}
+
+// the size of the value at `p`, 0 if it is malformed or runs past `end`
+static size_t value_check(const uint8_t* p, const uint8_t* end, int depth){
+    size_t avail = end - p;
+    if (avail < 1){
+        return 0;
+    }
+    switch (p[0]){
+    case TAG_NIL:
+        return 1;
+    case TAG_ERR:
+        return avail >= 9 && avail - 9 >= load_u32(p + 5) ? 9 + load_u32(p + 5) : 0;
+    case TAG_STR:
+        return avail >= 5 && avail - 5 >= load_u32(p + 1) ? 5 + load_u32(p + 1) : 0;
+    case TAG_INT:
+    case TAG_DBL:
+        return avail >= 9 ? 9 : 0;
+    case TAG_ARR:
+    case TAG_MAP: {
+        if (avail < 5 || depth >= k_client_max_depth){
+            return 0;
+        }
+        uint64_t n = (uint64_t)load_u32(p + 1) * (p[0] == TAG_MAP ? 2 : 1);
+        const uint8_t* cur = p + 5;
+        for (uint64_t i = 0; i < n; i++){
+            size_t size = value_check(cur, end, depth + 1);
+            if (!size){
+                return 0;
+            }
+            cur += size;
+        }
+        return cur - p;
+    }
+    default:
+        return 0;
+    }
+}
+
+std::string_view ReplyValue::str() const {
+    return std::string_view((const char*)p + 5, load_u32(p + 1));
+}
+
+int64_t ReplyValue::integer() const {
+    int64_t v = 0;
+    memcpy(&v, p + 1, 8);
+    return v;
+}
+
+double ReplyValue::dbl() const {
+    double v = 0;
+    memcpy(&v, p + 1, 8);
+    return v;
+}
+
+uint32_t ReplyValue::err_code() const {
+    return load_u32(p + 1);
+}
+
+std::string_view ReplyValue::err_msg() const {
+    return std::string_view((const char*)p + 9, load_u32(p + 5));
+}
+
+uint32_t ReplyValue::len() const {
+    return load_u32(p + 1);
+}
+
+ReplyValue ReplyValue::first() const {
+    ReplyValue v;
+    v.p = p + 5;
+    return v;
+}
+
+ReplyValue ReplyValue::next() const {
+    ReplyValue v;
+    v.p = p + value_size(p);
+    return v;
+}
+
+std::vector<ReplyValue> ReplyValue::elems() const {
+    std::vector<ReplyValue> out;
+    size_t n = (size_t)len() * (tag() == TAG_MAP ? 2 : 1);
+    out.reserve(n);
+    for (ReplyValue v = first(); out.size() < n; v = v.next()){
+        out.push_back(v);
+    }
+    return out;
+}
+
+//================================== connection ==================================//
+
+// +-----+------+-----+------+-----+------+
+// | len | nstr | len | str1 | ... | strn |
+// +-----+------+-----+------+-----+------+
+static void req_append(std::string &out, const std::vector<std::string_view> &args){
+    uint32_t len = 4;
+    for (std::string_view a : args){
+        len += 4 + (uint32_t)a.size();
+    }
+    uint32_t nstr = (uint32_t)args.size();
+    out.append((const char*)&len, 4);
+    out.append((const char*)&nstr, 4);
+    for (std::string_view a : args){
+        uint32_t n = (uint32_t)a.size();
+        out.append((const char*)&n, 4);
+        out.append(a.data(), a.size());
+    }
+}
+
+// like write_all(), without SIGPIPE on a connection the server closed
+static int32_t send_all(int fd, const char* buf, size_t n){
+    while (n > 0){
+        ssize_t rv = ::send(fd, buf, n, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR){
+            continue;
+        }
+        if (rv <= 0){
+            return -1;
+        }
+        buf += rv;
+        n -= (size_t)rv;
+    }
+    return 0;
+}
+
+// what a failed call completes with, shared by all of them
+Reply Client::error_reply(){
+    static const std::shared_ptr<const std::string> k_buf = []{
+        const char msg[] = "connection lost or bad reply";
+        uint32_t code = ERR_CLIENT;
+        uint32_t len = sizeof(msg) - 1;
+        std::string buf(1, (char)TAG_ERR);
+        buf.append((const char*)&code, 4);
+        buf.append((const char*)&len, 4);
+        buf.append(msg, len);
+        return std::make_shared<const std::string>(std::move(buf));
+    }();
+    Reply r;
+    r.p = (const uint8_t*)k_buf->data();
+    r.chunk = k_buf;
+    return r;
+}
+
+static void finish(std::promise<Reply> &promise, ReplyCallback &cb, Reply &&r){
+    if (cb){
+        cb(std::move(r));
+    } else {
+        promise.set_value(std::move(r));
+    }
+}
+
+Client::~Client(){
+    close();
+}
+
+int Client::connect(const std::string &addr){
+    if (addr.empty()){
+        errno = EINVAL;
+        return -1;
+    }
+    if (addr[0] == '/'){
+        struct sockaddr_un sun = {};
+        sun.sun_family = AF_UNIX;
+        if (addr.size() >= sizeof(sun.sun_path)){
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(sun.sun_path, addr.c_str(), addr.size() + 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && ::connect(fd, (const struct sockaddr*)&sun, sizeof(sun)) < 0){
+            ::close(fd);
+            fd = -1;
+        }
+    } else {
+        size_t colon = addr.rfind(':');
+        std::string host = addr.substr(0, colon);
+        int port = colon == std::string::npos ? 0 : atoi(addr.c_str() + colon + 1);
+        struct sockaddr_in sin = {};
+        sin.sin_family = AF_INET;
+        if (host == "localhost"){
+            host = "127.0.0.1";
+        }
+        if (port <= 0 || port > 65535 || inet_pton(AF_INET, host.c_str(), &sin.sin_addr) != 1){
+            errno = EINVAL;
+            return -1;
+        }
+        sin.sin_port = htons((uint16_t)port);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0 && ::connect(fd, (const struct sockaddr*)&sin, sizeof(sin)) < 0){
+            ::close(fd);
+            fd = -1;
+        }
+        int one = 1;
+        if (fd >= 0){
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+    }
+    if (fd < 0){
+        return -1;
+    }
+    reader = std::thread(&Client::read_loop, this);
+    return 0;
+}
+
+// not while calls are being made
+void Client::close(){
+    if (fd < 0){
+        return;
+    }
+    ::shutdown(fd, SHUT_RDWR);
+    if (reader.joinable()){
+        reader.join();
+    }
+    ::close(fd);
+    fd = -1;
+}
+
+std::future<Reply> Client::call(const std::vector<std::string_view> &args){
+    Pending p;
+    std::future<Reply> f = p.promise.get_future();
+    send(args, std::move(p));
+    return f;
+}
+
+void Client::call(const std::vector<std::string_view> &args, ReplyCallback cb){
+    Pending p;
+    p.cb = std::move(cb);
+    send(args, std::move(p));
+}
+
+// the caller that finds nobody writing writes for everyone, until the
+// requests queued meanwhile are all out
+void Client::send(const std::vector<std::string_view> &args, Pending &&p){
+    std::unique_lock<std::mutex> lock(mu);
+    if (is_broken.load(std::memory_order_relaxed)){
+        lock.unlock();
+        finish(p.promise, p.cb, error_reply());
+        return;
+    }
+    req_append(out, args);
+    pending.push_back(std::move(p));
+    pending_n.fetch_add(1, std::memory_order_relaxed);
+    if (writing){
+        return;
+    }
+    writing = true;
+    while (!out.empty()){
+        wbuf.swap(out);
+        lock.unlock();
+        int32_t rv = send_all(fd, wbuf.data(), wbuf.size());
+        wbuf.clear();
+        lock.lock();
+        if (rv < 0){
+            // the reader sees it too and fails the pending calls
+            out.clear();
+            ::shutdown(fd, SHUT_RDWR);
+            break;
+        }
+    }
+    writing = false;
+}
+
+// the oldest pending call gets `r`
+void Client::complete(Reply &&r){
+    std::unique_lock<std::mutex> lock(mu);
+    Pending p(std::move(pending.front()));
+    pending.pop_front();
+    lock.unlock();
+    pending_n.fetch_sub(1, std::memory_order_relaxed);
+    finish(p.promise, p.cb, std::move(r));
+}
+
+void Client::fail_all(){
+    std::deque<Pending> failed;
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        is_broken.store(true, std::memory_order_relaxed);
+        failed.swap(pending);
+    }
+    pending_n.store(0, std::memory_order_relaxed);
+    for (Pending &p : failed){
+        finish(p.promise, p.cb, error_reply());
+    }
+}
+
+/*
+    Replies are cut out of `chunk` in place, a new chunk is started when the
+    current one is full or too small for the next reply, and only the part
+    of a reply already read is copied into it; a chunk that no Reply holds
+    any more is reused
+*/
+void Client::read_loop(){
+    std::shared_ptr<std::string> chunk = std::make_shared<std::string>(k_client_chunk, '\0');
+    size_t begin = 0;       // the first reply not handed out
+    size_t filled = 0;
+    while (true){
+        if (begin == filled && chunk.use_count() == 1){
+            // no reply points into it, pairs with the release of the last one
+            std::atomic_thread_fence(std::memory_order_acquire);
+            begin = filled = 0;
+        }
+        size_t tail = filled - begin;
+        size_t need = 0;
+        if (tail >= 4){
+            need = 4 + (size_t)load_u32((const uint8_t*)chunk->data() + begin);
+            if (need - 4 > k_client_max_reply){
+                break;
+            }
+        }
+        if (filled == chunk->size() || chunk->size() - begin < need){
+            size_t cap = need > k_client_chunk ? need : k_client_chunk;
+            std::shared_ptr<std::string> fresh = std::make_shared<std::string>(cap, '\0');
+            memcpy(&(*fresh)[0], chunk->data() + begin, tail);
+            chunk.swap(fresh);
+            begin = 0;
+            filled = tail;
+        }
+        ssize_t rv = ::read(fd, &(*chunk)[filled], chunk->size() - filled);
+        if (rv < 0 && errno == EINTR){
+            continue;
+        }
+        if (rv <= 0){
+            break;
+        }
+        filled += (size_t)rv;
+
+        // every complete reply
+        bool bad = false;
+        while (filled - begin >= 4){
+            const uint8_t* data = (const uint8_t*)chunk->data() + begin;
+            uint32_t len = load_u32(data);
+            if (filled - begin - 4 < len){
+                break;
+            }
+            if (len > k_client_max_reply || value_check(data + 4, data + 4 + len, 0) != len
+                || pending_n.load(std::memory_order_relaxed) == 0)
+            {
+                bad = true;
+                break;
+            }
+            Reply r;
+            r.p = data + 4;
+            r.chunk = chunk;
+            complete(std::move(r));
+            begin += 4 + len;
+        }
+        if (bad){
+            break;
+        }
+    }
+    fail_all();
+}
+
+//================================== pool ==================================//
+
+int ClientPool::init(const std::string &addr, size_t n){
+    clients.clear();
+    for (size_t i = 0; i < n; i++){
+        std::unique_ptr<Client> c(new Client());
+        if (c->connect(addr) < 0){
+            clients.clear();
+            return -1;
+        }
+        clients.push_back(std::move(c));
+    }
+    return n ? 0 : -1;
+}
+
+// the least busy connection, starting the scan round robin so that ties
+// are spread; broken connections are skipped while there is another
+Client* ClientPool::pick(){
+    size_t n = clients.size();
+    size_t start = next.fetch_add(1, std::memory_order_relaxed) % n;
+    Client* best = nullptr;
+    for (size_t i = 0; i < n; i++){
+        Client* c = clients[(start + i) % n].get();
+        if (!c->broken() && (!best || c->inflight() < best->inflight())){
+            best = c;
+        }
+    }
+    return best ? best : clients[start].get();
+}
+
+std::future<Reply> ClientPool::call(const std::vector<std::string_view> &args){
+    return pick()->call(args);
+}
+
+void ClientPool::call(const std::vector<std::string_view> &args, ReplyCallback cb){
+    pick()->call(args, std::move(cb));
+}
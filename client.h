@@ -0,0 +1,132 @@
+// 1. A client for the server's own protocol. Calls can be made from any
+//    thread and return a std::future, or take a callback; concurrent calls
+//    on one connection are pipelined: whichever caller finds the socket idle
+//    writes everything queued so far in one write(), the others only append
+//    their request, so N callers cost far less than N round trips
+// 2. One reader thread per connection completes the calls in order as the
+//    replies arrive, callbacks run on that thread
+// 3. Replies are decoded in place. The socket is read into shared chunks, a
+//    Reply keeps its chunk alive and its values are views into it (strings
+//    are std::string_view), nothing is copied out of the read buffer except
+//    the head of a reply cut by the end of a chunk; copy what must outlive
+//    the Reply, a held Reply pins its whole chunk
+// 4. A lost connection or a malformed reply completes every pending call
+//    with an ERR_CLIENT error, later calls fail straight away
+// 5. ClientPool spreads calls over a few connections, each call goes to the
+//    one with the fewest replies outstanding; calls are ordered within a
+//    connection only, so dependent calls through a pool wait for each other
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// value tags and error codes, as sent by the server
+enum {
+    TAG_NIL = 0,
+    TAG_ERR = 1,
+    TAG_STR = 2,
+    TAG_INT = 3,
+    TAG_DBL = 4,
+    TAG_ARR = 5,
+    TAG_MAP = 6,        // n key value pairs
+};
+
+enum {
+    ERR_UNKNOWN = 1,
+    ERR_TOO_BIG = 2,
+    ERR_BAD_TYP = 3,
+    ERR_BAD_ARG = 4,
+    ERR_OOM     = 5,
+    ERR_READONLY= 6,
+    ERR_CLIENT  = 100,  // made up by the client: connection lost or bad reply
+};
+
+// one value of a reply, only valid while its Reply is alive
+class ReplyValue {
+public:
+    uint8_t tag() const { return p ? p[0] : (uint8_t)TAG_NIL; }
+    bool is_nil() const { return tag() == TAG_NIL; }
+    bool is_err() const { return tag() == TAG_ERR; }
+    // the accessors below expect the matching tag
+    std::string_view str() const;
+    int64_t integer() const;
+    double dbl() const;
+    uint32_t err_code() const;
+    std::string_view err_msg() const;
+    // elements of an array, pairs of a map
+    uint32_t len() const;
+    // the first element of an array or map, then the one after `this`
+    ReplyValue first() const;
+    ReplyValue next() const;
+    std::vector<ReplyValue> elems() const;
+protected:
+    const uint8_t* p = nullptr;
+    friend class Client;
+};
+
+class Reply : public ReplyValue {
+private:
+    std::shared_ptr<const std::string> chunk;
+    friend class Client;
+};
+
+typedef std::function<void(Reply)> ReplyCallback;
+
+class Client {
+public:
+    ~Client();
+    // "ip:port" or a unix socket path, -1 with errno set on failure
+    int connect(const std::string &addr);
+    std::future<Reply> call(const std::vector<std::string_view> &args);
+    void call(const std::vector<std::string_view> &args, ReplyCallback cb);
+    // calls sent and not answered yet
+    size_t inflight() const { return pending_n.load(std::memory_order_relaxed); }
+    bool broken() const { return is_broken.load(std::memory_order_relaxed); }
+    void close();
+private:
+    struct Pending {
+        std::promise<Reply> promise;
+        ReplyCallback cb;       // if set, instead of `promise`
+    };
+
+    int fd = -1;
+    std::mutex mu;
+    std::string out;            // requests not written yet
+    std::string wbuf;           // being written, by the caller that took it
+    bool writing = false;
+    std::deque<Pending> pending;
+    std::atomic<size_t> pending_n{0};
+    std::atomic<bool> is_broken{false};
+    std::thread reader;
+
+    void send(const std::vector<std::string_view> &args, Pending &&p);
+    void read_loop();
+    void complete(Reply &&r);
+    void fail_all();
+    static Reply error_reply();
+};
+
+class ClientPool {
+public:
+    // `n` connections to `addr`, -1 if any of them fails
+    int init(const std::string &addr, size_t n);
+    std::future<Reply> call(const std::vector<std::string_view> &args);
+    void call(const std::vector<std::string_view> &args, ReplyCallback cb);
+    size_t size() const { return clients.size(); }
+private:
+    std::vector<std::unique_ptr<Client>> clients;
+    std::atomic<size_t> next{0};
+
+    Client* pick();
+};
@@ -2,6 +2,8 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
 
 // intrusive data structure
 #define container_of(ptr, type, member) ({                  \
@@ -16,4 +18,50 @@ inline uint64_t str_hash(const uint8_t* data, size_t len){
         h = (h+data[i])*0x01000193;
     }
     return h;
-}
\ No newline at end of file
+}
+
+// MurmurHash64A, for the sketches whose accuracy depends on every bit of
+// the hash being well mixed, which FNV is not
+inline uint64_t hash64(const uint8_t* data, size_t len, uint64_t seed){
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+    size_t n = len / 8;
+    for (size_t i = 0; i < n; i++){
+        uint64_t k = 0;
+        memcpy(&k, data + 8*i, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    const uint8_t* tail = data + 8*n;
+    switch (len & 7){
+    case 7: h ^= (uint64_t)tail[6] << 48;   // fall through
+    case 6: h ^= (uint64_t)tail[5] << 40;   // fall through
+    case 5: h ^= (uint64_t)tail[4] << 32;   // fall through
+    case 4: h ^= (uint64_t)tail[3] << 24;   // fall through
+    case 3: h ^= (uint64_t)tail[2] << 16;   // fall through
+    case 2: h ^= (uint64_t)tail[1] << 8;    // fall through
+    case 1: h ^= (uint64_t)tail[0];
+            h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// monotonic clock in microseconds, for budgeting work inside one loop iteration
+inline uint64_t get_monotonic_usecs(){
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec)*1000*1000+tv.tv_nsec/1000;
+}
+// monotonic clock in nanoseconds, for latency measurements
+inline uint64_t get_monotonic_nsecs(){
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec)*1000*1000*1000+uint64_t(tv.tv_nsec);
+}
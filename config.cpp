@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "config.h"
+
+Config g_config;
+
+enum {
+    CFG_UINT    = 0,    // uint32_t
+    CFG_BYTES   = 1,    // uint64_t, accepts kb/mb/gb suffixes
+    CFG_ENUM    = 2,    // uint32_t, one of `names`
+    CFG_STR     = 3,    // std::string
+    CFG_BOOL    = 4,    // bool, yes/no
+};
+
+struct ConfigDef {
+    const char *name;
+    uint32_t type;
+    void *ptr;
+    const char *const *names;   // for CFG_ENUM, null terminated
+    bool startup_only = false;  // only from the command line
+    uint64_t min = 0;           // for CFG_UINT and CFG_BYTES
+    uint64_t max = UINT64_MAX;
+};
+
+static const char *const k_policy_names[] = {
+    "noeviction", "allkeys-lru", "allkeys-lfu", "volatile-lru", "volatile-ttl", nullptr,
+};
+
+static const char *const k_fsync_names[] = {
+    "no", "always", "everysec", nullptr,
+};
+
+static const char *const k_bgsave_names[] = {
+    "fork", "nofork", nullptr,
+};
+
+static const ConfigDef k_configs[] = {
+    {"port",                     CFG_UINT,   &g_config.port,                       nullptr, true},
+    {"unixsocket",               CFG_STR,    &g_config.unixsocket,                 nullptr, true},
+    {"maxmemory",                CFG_BYTES,  &g_config.maxmemory,                  nullptr},
+    {"maxmemory-policy",         CFG_ENUM,   &g_config.maxmemory_policy,           k_policy_names},
+    {"maxmemory-samples",        CFG_UINT,   &g_config.maxmemory_samples,          nullptr, false, 1, 64},
+    {"dbfilename",               CFG_STR,    &g_config.dbfilename,                 nullptr, true},
+    {"bgsave-mode",              CFG_ENUM,   &g_config.bgsave_mode,                k_bgsave_names},
+    {"appendonly",               CFG_BOOL,   &g_config.appendonly,                 nullptr, true},
+    {"appendfilename",           CFG_STR,    &g_config.appendfilename,             nullptr, true},
+    {"appendfsync",              CFG_ENUM,   &g_config.appendfsync,                k_fsync_names},
+    {"replicaof",                CFG_STR,    &g_config.replicaof,                  nullptr, true},
+    {"repl-backlog-size",        CFG_BYTES,  &g_config.repl_backlog_size,          nullptr, false, 16<<10, 1ull<<40},
+    {"pool-threads",             CFG_UINT,   &g_config.pool_threads,               nullptr, true},
+    {"io-threads",               CFG_UINT,   &g_config.io_threads,                 nullptr, true},
+    {"slowlog-log-slower-than",  CFG_UINT,   &g_config.slowlog_slower_than,        nullptr},
+    {"slowlog-max-len",          CFG_UINT,   &g_config.slowlog_max_len,            nullptr},
+    {"slowlog-loop-slower-than", CFG_UINT,   &g_config.slowlog_loop_slower_than,   nullptr},
+    {"hash-max-packed-entries",  CFG_UINT,   &g_config.hash_max_packed_entries,    nullptr},
+    {"hash-max-packed-value",    CFG_UINT,   &g_config.hash_max_packed_value,      nullptr},
+    {"list-chunk-size",          CFG_BYTES,  &g_config.list_chunk_size,            nullptr},
+    {"list-compress-depth",      CFG_UINT,   &g_config.list_compress_depth,        nullptr},
+    {"hll-sparse-max-bytes",     CFG_UINT,   &g_config.hll_sparse_max_bytes,       nullptr},
+    {"pubsub-hard-limit",        CFG_BYTES,  &g_config.pubsub_hard_limit,          nullptr},
+    {"pubsub-soft-limit",        CFG_BYTES,  &g_config.pubsub_soft_limit,          nullptr},
+    {"pubsub-soft-seconds",      CFG_UINT,   &g_config.pubsub_soft_seconds,        nullptr},
+    {"capture-dir",              CFG_STR,    &g_config.capture_dir,                nullptr, true},
+};
+
+static const ConfigDef *config_find(const std::string &name){
+    for (const ConfigDef &def : k_configs){
+        if (strcasecmp(def.name, name.c_str()) == 0){
+            return &def;
+        }
+    }
+    return nullptr;
+}
+
+// "100", "64kb", "512mb", "2gb"
+static bool parse_bytes(const std::string &s, uint64_t &out){
+    char *endp = nullptr;
+    unsigned long long val = strtoull(s.c_str(), &endp, 10);
+    if (endp == s.c_str()){
+        return false;
+    }
+    uint64_t unit = 1;
+    if (strcasecmp(endp, "kb") == 0){
+        unit = 1ull<<10;
+    } else if (strcasecmp(endp, "mb") == 0){
+        unit = 1ull<<20;
+    } else if (strcasecmp(endp, "gb") == 0){
+        unit = 1ull<<30;
+    } else if (*endp){
+        return false;
+    }
+    out = (uint64_t)val * unit;
+    return true;
+}
+
+static bool config_apply(const ConfigDef *def, const std::string &name, const std::string &val, std::string &err){
+    switch (def->type){
+    case CFG_UINT: {
+        char *endp = nullptr;
+        unsigned long v = strtoul(val.c_str(), &endp, 10);
+        if (val.empty() || *endp || v > UINT32_MAX){
+            err = "Expected uint32";
+            return false;
+        }
+        if (v < def->min || v > def->max){
+            err = name + " must be from " + std::to_string(def->min) + " to " + std::to_string(def->max);
+            return false;
+        }
+        *(uint32_t*)def->ptr = (uint32_t)v;
+        return true;
+    }
+    case CFG_BYTES: {
+        uint64_t v = 0;
+        if (!parse_bytes(val, v)){
+            err = "Expected a size";
+            return false;
+        }
+        if (v < def->min || v > def->max){
+            err = name + " must be from " + std::to_string(def->min) + " to " + std::to_string(def->max) + " bytes";
+            return false;
+        }
+        *(uint64_t*)def->ptr = v;
+        return true;
+    }
+    case CFG_ENUM:
+        for (uint32_t i = 0; def->names[i]; i++){
+            if (strcasecmp(def->names[i], val.c_str()) == 0){
+                *(uint32_t*)def->ptr = i;
+                return true;
+            }
+        }
+        err = "Bad value for " + name;
+        return false;
+    case CFG_STR:
+        *(std::string*)def->ptr = val;
+        return true;
+    case CFG_BOOL:
+        if (strcasecmp(val.c_str(), "yes") != 0 && strcasecmp(val.c_str(), "no") != 0){
+            err = "Expected yes or no";
+            return false;
+        }
+        *(bool*)def->ptr = strcasecmp(val.c_str(), "yes") == 0;
+        return true;
+    }
+    return false;
+}
+
+bool config_set(const std::string &name, const std::string &val, std::string &err){
+    const ConfigDef *def = config_find(name);
+    if (!def){
+        err = "Unknown config: " + name;
+        return false;
+    }
+    if (def->startup_only){
+        err = name + " can only be set at startup";
+        return false;
+    }
+    return config_apply(def, name, val, err);
+}
+
+bool config_get(const std::string &name, std::string &out, std::string &err){
+    const ConfigDef *def = config_find(name);
+    if (!def){
+        err = "Unknown config: " + name;
+        return false;
+    }
+    switch (def->type){
+    case CFG_UINT:
+        out = std::to_string(*(uint32_t*)def->ptr);
+        break;
+    case CFG_BYTES:
+        out = std::to_string(*(uint64_t*)def->ptr);
+        break;
+    case CFG_ENUM:
+        out = def->names[*(uint32_t*)def->ptr];
+        break;
+    case CFG_STR:
+        out = *(std::string*)def->ptr;
+        break;
+    case CFG_BOOL:
+        out = *(bool*)def->ptr ? "yes" : "no";
+        break;
+    }
+    return true;
+}
+
+void config_parse_args(int argc, char **argv){
+    for (int i = 1; i < argc; i += 2){
+        if (strncmp(argv[i], "--", 2) != 0 || i+1 >= argc){
+            fprintf(stderr, "usage: %s [--name value]...\n", argv[0]);
+            exit(1);
+        }
+        std::string err;
+        const ConfigDef *def = config_find(argv[i]+2);
+        if (!def){
+            err = std::string("Unknown config: ") + (argv[i]+2);
+        }
+        if (!def || !config_apply(def, argv[i]+2, argv[i+1], err)){
+            fprintf(stderr, "%s\n", err.c_str());
+            exit(1);
+        }
+    }
+}
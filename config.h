@@ -0,0 +1,64 @@
+// 1. Runtime settings live in one global struct, read directly by the code that uses them
+// 2. Every setting is described once in a table in config.cpp, which serves
+//    both the command line (--name value) and `CONFIG GET/SET`
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+enum {
+    EVICT_NOEVICTION    = 0,
+    EVICT_ALLKEYS_LRU   = 1,
+    EVICT_ALLKEYS_LFU   = 2,
+    EVICT_VOLATILE_LRU  = 3,
+    EVICT_VOLATILE_TTL  = 4,
+};
+
+enum {
+    FSYNC_NO        = 0,    // left to the kernel
+    FSYNC_ALWAYS    = 1,    // before replies are sent, once per loop iteration
+    FSYNC_EVERYSEC  = 2,    // by a pool worker, at most once per second
+};
+
+enum {
+    BGSAVE_FORK     = 0,    // a forked child writes from copy-on-write memory
+    BGSAVE_NOFORK   = 1,    // a thread walks the keyspace, the loop copies before writing
+};
+
+struct Config {
+    uint32_t port = 1234;
+    std::string unixsocket;             // also listen on this path if set
+    uint64_t maxmemory = 0;             // 0 means no limit
+    uint32_t maxmemory_policy = EVICT_NOEVICTION;
+    uint32_t maxmemory_samples = 5;     // keys sampled per eviction
+    std::string dbfilename = "dump.rdb";// snapshot file, loaded at startup
+    uint32_t bgsave_mode = BGSAVE_FORK;
+    bool appendonly = false;            // log writes, replayed at startup instead of the snapshot
+    std::string appendfilename = "appendonly.aof";
+    uint32_t appendfsync = FSYNC_EVERYSEC;
+    std::string replicaof;              // "host:port" or a unix socket path, empty on a primary
+    uint64_t repl_backlog_size = 1<<20; // stream kept for partial resyncs
+    uint32_t pool_threads = 4;          // workers of the thread pool
+    uint32_t io_threads = 1;            // socket reads and writes, the loop thread included
+    uint32_t slowlog_slower_than = 10000;       // us, commands logged from this long on
+    uint32_t slowlog_max_len = 128;
+    uint32_t slowlog_loop_slower_than = 20000;  // us, loop iterations, not counting the wait in poll()
+    uint32_t hash_max_packed_entries = 128;     // a hash moves to a table past this many fields
+    uint32_t hash_max_packed_value = 64;        // or once a field or value is longer
+    uint64_t list_chunk_size = 8<<10;           // bytes of elements packed in a list chunk
+    uint32_t list_compress_depth = 0;           // list chunks kept plain at each end, 0 compresses none
+    uint32_t hll_sparse_max_bytes = 3000;       // a HyperLogLog turns dense past this many bytes of registers
+    uint64_t pubsub_hard_limit = 32<<20;        // unsent bytes that drop a subscriber, 0 for no limit
+    uint64_t pubsub_soft_limit = 8<<20;         // or that drop it when held for longer than
+    uint32_t pubsub_soft_seconds = 60;          // this
+    std::string capture_dir = ".";              // CAPTURE START files are created here
+};
+
+extern Config g_config;
+
+// both return false and fill `err` on unknown names or bad values
+bool config_set(const std::string &name, const std::string &val, std::string &err);
+bool config_get(const std::string &name, std::string &out, std::string &err);
+// parses `--name value` pairs, dies on errors
+void config_parse_args(int argc, char **argv);
@@ -6,5 +6,43 @@
 const size_t k_max_msg = 32<<20;                // likely larger than the kernel buffer
 const size_t k_max_args = 200 * 1000;           // limit for number of queries/requests
 const uint64_t k_idle_timeout_ms = 5*1000;      // timeout value for idle connections
-const size_t k_max_works = 2000;                // limit for expired timer processing
+const uint64_t k_expire_budget_us = 250;        // active expiry time budget per loop iteration
+const uint64_t k_expire_budget_max_us = 1000;   // the budget when every sampled TTL key has expired
+const size_t k_expire_check_every = 16;         // keys expired between two clock reads
+const uint32_t k_expire_samples = 16;           // heap samples for estimating the expired share
+const size_t k_lazyfree_min_items = 1000;       // containers larger than this are freed lazily
+const size_t k_lazyfree_min_str = 256<<10;      // so are strings larger than this (munmap() scales with pages)
+const size_t k_lazyfree_slice = 256;            // items freed between two budget checks
+const uint64_t k_lazyfree_budget_us = 1000;     // lazy free time budget per loop iteration
+const size_t k_lazyfree_backlog_bytes = 256<<20;// above this the budget is raised
+const uint64_t k_evict_budget_us = 500;         // eviction time budget per write command
+const uint64_t k_load_report_ms = 1000;         // snapshot loading progress
+const uint64_t k_child_poll_ms = 100;           // how often a forked child is checked on
+const uint64_t k_nofork_batch_us = 50;          // nofork save walk between two lock releases
+const uint64_t k_repl_cron_ms = 100;            // replication housekeeping interval
+const uint64_t k_repl_ping_ms = 1000;           // primary pings and replica acknowledgements
+const uint64_t k_repl_retry_ms = 1000;          // between two connection attempts of a replica
+const uint64_t k_repl_timeout_ms = 60*1000;     // a silent link to the primary is dropped
+const size_t k_offload_min_items = 64<<10;      // KEYS and ZQUERY replies built by the pool above this
+const size_t k_offload_chunk_items = 16<<10;    // items per pool task of such a reply
+const uint32_t k_io_spin = 10000;               // yields of an idle I/O thread before it sleeps
+const size_t k_io_min_per_thread = 2;           // smaller I/O batches are done by the loop alone
+const uint64_t k_ops_sample_ms = 100;           // ops/s sampling interval
+const size_t k_ops_samples = 16;                // ops/s samples kept, must cover the window
+const uint64_t k_ops_window_ms = 1000;          // ops/s is averaged over this
+const size_t k_slowlog_max_args = 32;           // args kept by a slow log entry, the last one counts the rest
+const size_t k_slowlog_max_arg_len = 128;       // bytes kept of each of them
+const size_t k_resp_max_inline = 64<<10;        // RESP inline commands and header lines
+const size_t k_capture_block = 64<<10;          // a connection's captured requests handed over at this size
+const size_t k_capture_max_pending = 64<<20;    // captured bytes not written yet, more are dropped
+const uint64_t k_capture_flush_ms = 1000;       // every buffered capture is handed over this often
+const double k_block_max_timeout_s = 1e10;      // longer blocking pop timeouts wait this long, about 300 years
+const uint64_t k_bloom_capacity = 100;          // of the filters BF.ADD creates
+const double k_bloom_error = 0.01;              // and their false positive rate
+const size_t k_bloom_max_size = 16<<20;         // bytes a Bloom filter may grow to, BF.ADD fails past it
+const uint64_t k_memreport_samples = 10000;     // keys sampled by MEMORY REPORT by default
+const uint64_t k_memreport_max_samples = 1000000; // its largest sample
+const uint64_t k_memreport_budget_us = 500;     // MEMORY REPORT sampling time budget per loop iteration
+const size_t k_memreport_top_prefixes = 20;     // prefixes it reports
+const size_t k_max_iov = 64;                    // queued buffers sent by one writev()
 static const ZSet k_empty_zset;                 // dummy empty zset used to tell if a zset exists or not
\ No newline at end of file
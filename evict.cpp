@@ -0,0 +1,68 @@
+#include "evict.h"
+#include "config.h"
+#include "commonops.h"
+
+const uint32_t k_access_mask = (1u<<k_access_bits)-1;
+const uint32_t k_lfu_init_val = 5;          // new keys are not evicted right away
+const uint32_t k_lfu_log_factor = 10;       // the counter saturates at about 1M hits
+const uint32_t k_lfu_decay_minutes = 1;     // the counter drops by one per idle period
+
+static uint32_t lru_clock(){
+    return (uint32_t)(get_monotonic_usecs()/1000/1000) & k_access_mask;
+}
+
+static uint32_t lfu_minutes(){
+    return (uint32_t)(get_monotonic_usecs()/1000/1000/60) & 0xffff;
+}
+
+// the counter decays by one for each elapsed period since the last access
+static uint32_t lfu_decayed(uint32_t meta){
+    uint32_t last = meta >> 8;
+    uint32_t counter = meta & 0xff;
+    uint32_t elapsed = (lfu_minutes() - last) & 0xffff;
+    uint32_t periods = elapsed / k_lfu_decay_minutes;
+    return periods > counter ? 0 : counter - periods;
+}
+
+// logarithmic increment, the more hits the less likely another increment is
+static uint32_t lfu_incr(uint32_t counter){
+    if (counter == 255){
+        return counter;
+    }
+    double r = (double)(evict_rand() % 1000000) / 1000000.0;
+    double base = counter > k_lfu_init_val ? counter - k_lfu_init_val : 0;
+    double p = 1.0 / (base*k_lfu_log_factor + 1);
+    return r < p ? counter+1 : counter;
+}
+
+uint32_t access_init(uint32_t policy){
+    if (policy == EVICT_ALLKEYS_LFU){
+        return (lfu_minutes() << 8) | k_lfu_init_val;
+    }
+    return lru_clock();
+}
+
+uint32_t access_touch(uint32_t meta, uint32_t policy){
+    if (policy == EVICT_ALLKEYS_LFU){
+        uint32_t counter = lfu_incr(lfu_decayed(meta));
+        return (lfu_minutes() << 8) | counter;
+    }
+    return lru_clock();
+}
+
+uint64_t access_score(uint32_t meta, uint32_t policy){
+    if (policy == EVICT_ALLKEYS_LFU){
+        return 255 - lfu_decayed(meta);
+    }
+    // idle seconds, the clock wraps after 194 days
+    return (lru_clock() - meta) & k_access_mask;
+}
+
+// xorshift64*
+uint64_t evict_rand(){
+    static uint64_t x = 0x9E3779B97F4A7C15ull ^ get_monotonic_usecs();
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    return x * 0x2545F4914F6CDD1Dull;
+}
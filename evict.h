@@ -0,0 +1,21 @@
+// 1. Each Entry packs 24 bits of access metadata next to its type, its meaning
+//    depends on the eviction policy
+//    - LRU: the low 24 bits of a clock in seconds at the last access
+//    - LFU: 16 bits of minutes at the last decay + an 8 bit logarithmic counter
+// 2. No global list is kept, victims are picked as the best of a few random
+//    samples, so the cost per eviction is O(1) regardless of the key count
+
+#pragma once
+
+#include <stdint.h>
+
+const uint32_t k_access_bits = 24;
+
+// metadata for a newly created entry
+uint32_t access_init(uint32_t policy);
+// metadata after an access
+uint32_t access_touch(uint32_t meta, uint32_t policy);
+// how good an eviction candidate the entry is, the higher the better
+uint64_t access_score(uint32_t meta, uint32_t policy);
+// cheap pseudo random numbers for sampling
+uint64_t evict_rand();
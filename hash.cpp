@@ -0,0 +1,267 @@
+#include <string.h>
+#include <stdlib.h>
+#include "hash.h"
+#include "commonops.h"
+
+//===============================packed encoding===============================//
+
+// a pair of the packed buffer, [begin, end) is its extent
+struct PackedPair {
+    size_t begin = 0;
+    size_t end = 0;
+    const char* field = nullptr;
+    size_t flen = 0;
+    const char* val = nullptr;
+    size_t vlen = 0;
+};
+
+static void put_varint(std::string &out, size_t v){
+    while (v >= 0x80){
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+static size_t get_varint(const char* p, size_t* v){
+    size_t n = 0;
+    *v = 0;
+    for (uint32_t shift = 0; ; shift += 7){
+        uint8_t b = (uint8_t)p[n++];
+        *v |= (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)){
+            return n;
+        }
+    }
+}
+
+// the pair at `pos`, false past the last one
+static bool packed_at(const std::string &packed, size_t pos, PackedPair* pair){
+    if (pos >= packed.size()){
+        return false;
+    }
+    const char* base = packed.data();
+    pair->begin = pos;
+    pos += get_varint(base + pos, &pair->flen);
+    pair->field = base + pos;
+    pos += pair->flen;
+    pos += get_varint(base + pos, &pair->vlen);
+    pair->val = base + pos;
+    pair->end = pos + pair->vlen;
+    return true;
+}
+
+static bool packed_find(Hash* hash, const char* field, size_t flen, PackedPair* pair){
+    for (size_t pos = 0; packed_at(hash->packed, pos, pair); pos = pair->end){
+        if (pair->flen == flen && memcmp(pair->field, field, flen) == 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+static void packed_pair(std::string &out, const char* field, size_t flen, const char* val, size_t vlen){
+    put_varint(out, flen);
+    out.append(field, flen);
+    put_varint(out, vlen);
+    out.append(val, vlen);
+}
+
+//===============================table encoding===============================//
+
+struct HKey {
+    HNode node;
+    const char* field = nullptr;
+    size_t flen = 0;
+};
+
+static bool hcmp(HNode* node, HNode* key){
+    HashField* hf = container_of(node, HashField, node);
+    HKey* hkey = container_of(key, HKey, node);
+    return hf->flen == hkey->flen && memcmp(hf->data, hkey->field, hf->flen) == 0;
+}
+
+static HashField* field_new(const char* field, size_t flen, const char* val, size_t vlen){
+    HashField* hf = (HashField*) malloc(sizeof(HashField) + flen + vlen);
+    hf->node.next = nullptr;
+    hf->node.hval = str_hash((uint8_t*)field, flen);
+    hf->flen = (uint32_t)flen;
+    hf->vlen = (uint32_t)vlen;
+    memcpy(hf->data, field, flen);
+    memcpy(hf->data + flen, val, vlen);
+    return hf;
+}
+
+static size_t field_size(HashField* hf){
+    return sizeof(HashField) + hf->flen + hf->vlen;
+}
+
+static HashField* table_find(Hash* hash, const char* field, size_t flen){
+    HKey key;
+    key.node.hval = str_hash((uint8_t*)field, flen);
+    key.field = field;
+    key.flen = flen;
+    HNode* node = hm_lookup(&hash->hmap, &key.node, &hcmp);
+    return node ? container_of(node, HashField, node) : nullptr;
+}
+
+static void table_insert(Hash* hash, HashField* hf){
+    hm_insert(&hash->hmap, &hf->node);
+    hash->node_bytes += field_size(hf);
+}
+
+static void table_remove(Hash* hash, HashField* hf){
+    hm_delete(&hash->hmap, &hf->node, &hnode_same);
+    hash->node_bytes -= field_size(hf);
+    free(hf);
+}
+
+// moves every packed pair into the table
+static void hash_convert(Hash* hash){
+    hm_reserve(&hash->hmap, hash->packed_n + 1);
+    PackedPair pair;
+    for (size_t pos = 0; packed_at(hash->packed, pos, &pair); pos = pair.end){
+        table_insert(hash, field_new(pair.field, pair.flen, pair.val, pair.vlen));
+    }
+    std::string().swap(hash->packed);
+    hash->packed_n = 0;
+    hash->table = true;
+}
+
+//===============================interface===============================//
+
+bool hash_get(Hash* hash, const char* field, size_t flen, const char** val, size_t* vlen){
+    if (hash->table){
+        HashField* hf = table_find(hash, field, flen);
+        if (!hf){
+            return false;
+        }
+        *val = hf->data + hf->flen;
+        *vlen = hf->vlen;
+        return true;
+    }
+    PackedPair pair;
+    if (!packed_find(hash, field, flen, &pair)){
+        return false;
+    }
+    *val = pair.val;
+    *vlen = pair.vlen;
+    return true;
+}
+
+bool hash_set(Hash* hash, const char* field, size_t flen, const char* val, size_t vlen,
+    size_t max_packed, size_t max_packed_len)
+{
+    if (!hash->table){
+        PackedPair pair;
+        bool found = packed_find(hash, field, flen, &pair);
+        bool fits = flen <= max_packed_len && vlen <= max_packed_len
+            && (found || hash->packed_n + 1 <= max_packed);
+        if (found && fits && pair.vlen == vlen){
+            memcpy(&hash->packed[pair.val - hash->packed.data()], val, vlen);
+            return false;
+        }
+        if (found && fits){
+            std::string enc;
+            packed_pair(enc, field, flen, val, vlen);
+            hash->packed.replace(pair.begin, pair.end - pair.begin, enc);
+            return false;
+        }
+        if (fits){
+            packed_pair(hash->packed, field, flen, val, vlen);
+            hash->packed_n++;
+            return true;
+        }
+        hash_convert(hash);
+    }
+    HashField* old = table_find(hash, field, flen);
+    if (old && old->vlen == vlen){
+        memcpy(old->data + old->flen, val, vlen);
+        return false;
+    }
+    if (old){
+        table_remove(hash, old);
+    }
+    table_insert(hash, field_new(field, flen, val, vlen));
+    return !old;
+}
+
+bool hash_del(Hash* hash, const char* field, size_t flen){
+    if (hash->table){
+        HashField* hf = table_find(hash, field, flen);
+        if (hf){
+            table_remove(hash, hf);
+        }
+        return hf != nullptr;
+    }
+    PackedPair pair;
+    if (!packed_find(hash, field, flen, &pair)){
+        return false;
+    }
+    hash->packed.erase(pair.begin, pair.end - pair.begin);
+    hash->packed_n--;
+    return true;
+}
+
+size_t hash_len(Hash* hash){
+    return hash->table ? hm_size(&hash->hmap) : hash->packed_n;
+}
+
+struct ForeachArg {
+    bool (*f)(const char*, size_t, const char*, size_t, void*);
+    void* arg;
+};
+
+static bool cb_field(HNode* node, void* arg){
+    ForeachArg* fa = (ForeachArg*) arg;
+    HashField* hf = container_of(node, HashField, node);
+    return fa->f(hf->data, hf->flen, hf->data + hf->flen, hf->vlen, fa->arg);
+}
+
+void hash_foreach(Hash* hash,
+    bool (*f)(const char* field, size_t flen, const char* val, size_t vlen, void* arg), void* arg)
+{
+    if (hash->table){
+        ForeachArg fa = {f, arg};
+        hm_foreach(&hash->hmap, &cb_field, &fa);
+        return;
+    }
+    PackedPair pair;
+    for (size_t pos = 0; packed_at(hash->packed, pos, &pair); pos = pair.end){
+        if (!f(pair.field, pair.flen, pair.val, pair.vlen, arg)){
+            return;
+        }
+    }
+}
+
+static void cb_free_field(HNode* node, void* arg){
+    Hash* hash = (Hash*) arg;
+    HashField* hf = container_of(node, HashField, node);
+    hash->node_bytes -= field_size(hf);
+    free(hf);
+}
+
+bool hash_dispose(Hash* hash, size_t max_work){
+    if (hash->table && !hm_dispose(&hash->hmap, max_work, &cb_free_field, hash)){
+        return false;
+    }
+    std::string().swap(hash->packed);
+    hash->packed_n = 0;
+    hash->table = false;
+    return true;
+}
+
+void hash_clear(Hash* hash){
+    while (!hash_dispose(hash, (size_t)-1)) {}
+}
+
+size_t hash_mem(Hash* hash){
+    size_t slots = 0;
+    if (hash->hmap.newer.tab){
+        slots += hash->hmap.newer.mask+1;
+    }
+    if (hash->hmap.older.tab){
+        slots += hash->hmap.older.mask+1;
+    }
+    return hash->packed.capacity() + hash->node_bytes + slots*sizeof(HNode*);
+}
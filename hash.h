@@ -0,0 +1,48 @@
+// 1. A hash maps fields to values, in one of two encodings. A small hash is
+//    packed: its pairs sit back to back in one buffer, each field and value
+//    prefixed by a varint length, and lookups scan it; this costs 2 bytes a
+//    pair instead of a node, an allocation and a slot, and a short scan of
+//    one buffer beats hashing at that size
+// 2. Past `max_packed` pairs, or once a field or value is longer than
+//    `max_packed_len`, the pairs move to HashField nodes on the intrusive
+//    HMap, field and value embedded in the node; a hash never goes back
+// 3. The packed form keeps insertion order, updates are done in place when
+//    the value keeps its length
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include "hashtable.h"
+
+struct HashField {
+    HNode node;
+    uint32_t flen = 0;
+    uint32_t vlen = 0;
+    char data[0];       // the field then the value
+};
+
+struct Hash {
+    std::string packed;         // the packed encoding, until `table`
+    size_t packed_n = 0;        // pairs in `packed`
+    bool table = false;
+    HMap hmap;                  // the table encoding, of HashField
+    size_t node_bytes = 0;      // memory held by the nodes
+};
+
+// the value is not copied, it is valid until the hash changes
+bool   hash_get(Hash* hash, const char* field, size_t flen, const char** val, size_t* vlen);
+// returns whether the field is new
+bool   hash_set(Hash* hash, const char* field, size_t flen, const char* val, size_t vlen,
+            size_t max_packed, size_t max_packed_len);
+bool   hash_del(Hash* hash, const char* field, size_t flen);
+size_t hash_len(Hash* hash);
+// invoke the callback on each pair until it returns false
+void   hash_foreach(Hash* hash,
+            bool (*f)(const char* field, size_t flen, const char* val, size_t vlen, void* arg), void* arg);
+// frees up to `max_work` nodes, true once the hash is empty
+bool   hash_dispose(Hash* hash, size_t max_work);
+void   hash_clear(Hash* hash);
+// bytes held by the hash, excluding the Hash struct itself
+size_t hash_mem(Hash* hash);
@@ -82,6 +82,7 @@ static void hm_rehash(HMap *hmap){
     if (hmap->older.size == 0 && hmap->older.tab) {
         free(hmap->older.tab);
         hmap->older = HTab{};
+        hmap->migrate_pos = 0;
     }
 }
 
@@ -94,7 +95,9 @@ static void hm_trigger_rehash(HMap* hmap){
 
 // during reshashing we may need to lookup both tables
 HNode* hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode*, HNode*)){
-    hm_rehash(hmap);
+    if (!hmap->frozen){
+        hm_rehash(hmap);
+    }
     HNode **from = h_lookup(&hmap->newer, key, eq);
     if (!from){
         from = h_lookup(&hmap->older, key, eq);
@@ -132,6 +135,17 @@ void hm_insert(HMap *hmap, HNode *node){
     hm_rehash(hmap);    // migrate some keys
 }
 
+// the smallest table that holds `n` keys under the maximum load factor
+void hm_reserve(HMap* hmap, size_t n){
+    assert(hm_size(hmap) == 0);
+    size_t slots = 4;
+    while (slots*k_max_load_factor <= n){
+        slots *= 2;
+    }
+    hm_clear(hmap);
+    h_init(&hmap->newer, slots);
+}
+
 void hm_clear(HMap *hmap){
     free(hmap->newer.tab);
     free(hmap->older.tab);
@@ -142,6 +156,69 @@ size_t hm_size(HMap *hmap){
     return hmap->newer.size+hmap->older.size;
 }
 
+bool hm_rehash_step(HMap* hmap){
+    if (!hmap->older.tab){
+        return false;
+    }
+    hm_rehash(hmap);
+    return hmap->older.tab != nullptr;
+}
+
+// pick a table in proportion to its size, then a slot, then a node of its chain
+// empty slots are skipped by probing forward, which slightly favours the nodes
+// after a run of empty slots, good enough for sampling
+HNode* hm_random(HMap* hmap, uint64_t rnd){
+    size_t total = hm_size(hmap);
+    if (total == 0){
+        return nullptr;
+    }
+    HTab* htab = (rnd % total) < hmap->older.size ? &hmap->older : &hmap->newer;
+    rnd = rnd * 0x9E3779B97F4A7C15ull + 1;
+    size_t start = (rnd >> 16) & htab->mask;
+    for (size_t i = 0; i <= htab->mask; i++){
+        HNode* head = htab->tab[(start+i) & htab->mask];
+        if (!head){
+            continue;
+        }
+        size_t len = 0;
+        for (HNode* node = head; node; node = node->next){
+            len++;
+        }
+        size_t pick = (rnd >> 40) % len;
+        while (pick--){
+            head = head->next;
+        }
+        return head;
+    }
+    return nullptr;
+}
+
+// a map being disposed is never rehashed again, so `migrate_pos` is reused
+// as the scan cursor, the older table first as its leading slots are already empty
+bool hm_dispose(HMap* hmap, size_t max_work, void (*f)(HNode*, void*), void* arg){
+    size_t nwork = 0;
+    while (nwork < max_work && hm_size(hmap) > 0){
+        if (hmap->older.tab && hmap->older.size == 0){
+            free(hmap->older.tab);
+            hmap->older = HTab{};
+            hmap->migrate_pos = 0;
+        }
+        HTab* htab = hmap->older.tab ? &hmap->older : &hmap->newer;
+        HNode** from = &htab->tab[hmap->migrate_pos];
+        nwork++;    // empty slots are cheap but still count towards the budget
+        if (!*from){
+            hmap->migrate_pos++;
+            continue;
+        }
+        f(h_detach(htab, from), arg);
+    }
+    if (hm_size(hmap) > 0){
+        return false;
+    }
+    hm_clear(hmap);
+    return true;
+}
+
 static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg){
     for (size_t i = 0; htab->mask != 0 && i <= htab->mask; i++){
         for (HNode *node = htab->tab[i]; node != nullptr; node = node->next){
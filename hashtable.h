@@ -26,6 +26,7 @@ struct HMap{
     HTab newer;
     HTab older;
     size_t migrate_pos = 0;
+    uint32_t frozen = 0;    // read by other threads, lookups don't migrate keys
 };
 
 // the set, get, del interfaces
@@ -33,7 +34,16 @@ HNode* hm_lookup(HMap* hmap, HNode* key, bool (*eq)(HNode* , HNode*));
 void   hm_insert(HMap* hmap, HNode* node);
 HNode* hm_delete(HMap* hmap, HNode* key, bool (*eq)(HNode* , HNode*));
 void   hm_clear(HMap* hmap);
+// sizes an empty map for `n` keys, so inserting them never triggers a rehash
+void   hm_reserve(HMap* hmap, size_t n);
 size_t hm_size(HMap* hmap);
+// detach up to `max_work` nodes and hand them to the callback, for tearing
+// down a map in slices, returns true once the map is empty and its slots freed
+bool   hm_dispose(HMap* hmap, size_t max_work, void (*f)(HNode*, void*), void* arg);
+// moves some keys of a pending rehash, false once none is pending
+bool   hm_rehash_step(HMap* hmap);
+// a random node from a random slot, for sampling, null if the map is empty
+HNode* hm_random(HMap* hmap, uint64_t rnd);
 // invoke the callback on each node until it returns false
 void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
 // used to check if 2 hnode pointers are pointing to the same one or not
@@ -0,0 +1,108 @@
+// standalone benchmark for the TTL heap in cache.cpp
+// the arity is a compile time option, build one binary per arity and compare:
+//   for d in 2 4 8; do
+//       g++ -O2 -std=gnu++17 -DHEAP_ARITY=$d heap_bench.cpp cache.cpp -o heap_bench$d
+//   done
+//   ./heap_bench4 [n...]      (default: 1000000 10000000 50000000)
+// 50M timers need about 2.5GB, the timers are spread over a shuffled array
+// so that the writes through HeapNode::ref miss the cache like real entries do
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include "cache.h"
+#include "commonops.h"
+
+// stands in for Entry, only `heap_idx` is touched
+struct Timer {
+    size_t heap_idx = -1;
+    uint64_t pad[3];
+};
+
+static uint64_t g_rng = 0x853c49e6748fea9bull;
+
+// splitmix64
+static uint64_t rnd(){
+    uint64_t z = (g_rng += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static double ns_per_op(uint64_t start_us, size_t n){
+    return (double)(get_monotonic_usecs() - start_us) * 1000.0 / (double)n;
+}
+
+static bool heap_valid(const HeapArray &heap){
+    for (size_t i = 1; i < heap.size(); i++){
+        if (heap[(i-1)/k_heap_arity].ttl_val > heap[i].ttl_val || *heap[i].ref != i){
+            return false;
+        }
+    }
+    return true;
+}
+
+static void bench(size_t n){
+    std::vector<Timer> timers(n);
+    // visit the timers in a random order so consecutive refs are far apart
+    std::vector<uint32_t> order(n);
+    for (size_t i = 0; i < n; i++){
+        order[i] = (uint32_t)i;
+    }
+    for (size_t i = n; i > 1; i--){
+        std::swap(order[i-1], order[rnd() % i]);
+    }
+
+    HeapArray heap;
+    uint64_t start = get_monotonic_usecs();
+    for (size_t i = 0; i < n; i++){
+        Timer &t = timers[order[i]];
+        heap_upsert(heap, t.heap_idx, HeapNode{rnd() % (n*16), &t.heap_idx});
+    }
+    double insert_ns = ns_per_op(start, n);
+
+    start = get_monotonic_usecs();
+    for (size_t i = 0; i < n; i++){
+        Timer &t = timers[rnd() % n];
+        heap_upsert(heap, t.heap_idx, HeapNode{rnd() % (n*16), &t.heap_idx});
+    }
+    double update_ns = ns_per_op(start, n);
+    bool valid = heap_valid(heap);
+
+    start = get_monotonic_usecs();
+    while (!heap.empty()){
+        *heap[0].ref = -1;
+        heap_delete(heap, 0);
+    }
+    double delmin_ns = ns_per_op(start, n);
+
+    std::vector<HeapNode> items(n);
+    for (size_t i = 0; i < n; i++){
+        Timer &t = timers[order[i]];
+        items[i] = HeapNode{rnd() % (n*16), &t.heap_idx};
+    }
+    start = get_monotonic_usecs();
+    heap_bulk_upsert(heap, items.data(), n);
+    double heapify_ns = ns_per_op(start, n);
+    valid = valid && heap_valid(heap);
+
+    printf("arity=%zu n=%zu insert_ns=%.1f update_ns=%.1f delmin_ns=%.1f heapify_ns=%.1f valid=%d\n",
+        k_heap_arity, n, insert_ns, update_ns, delmin_ns, heapify_ns, (int)valid);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv){
+    std::vector<size_t> sizes;
+    for (int i = 1; i < argc; i++){
+        sizes.push_back((size_t)strtoull(argv[i], nullptr, 10));
+    }
+    if (sizes.empty()){
+        sizes = {1000000, 10000000, 50000000};
+    }
+    for (size_t n : sizes){
+        bench(n);
+    }
+    return 0;
+}
@@ -0,0 +1,305 @@
+#include <string.h>
+#include <math.h>
+#include "hll.h"
+#include "commonops.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+enum {
+    HLL_SPARSE  = 1,
+    HLL_DENSE   = 2,
+};
+
+const size_t k_hll_header = 9;
+const size_t k_hll_dense_bytes = (k_hll_registers*6 + 7)/8 + 1;
+const uint32_t k_hll_q = 64 - k_hll_p;          // bits left for the run, the largest value is q + 1
+const uint64_t k_hll_seed = 0xadc83b19ULL;
+
+//===============================registers===============================//
+
+// the register of an element and its value
+static uint32_t hll_pos(const char* val, size_t len, uint8_t* rank){
+    uint64_t h = hash64((const uint8_t*)val, len, k_hll_seed);
+    uint32_t idx = (uint32_t)(h & (k_hll_registers - 1));
+    h >>= k_hll_p;
+    h |= (uint64_t)1 << k_hll_q;                // so the run ends by q + 1
+    *rank = (uint8_t)(__builtin_ctzll(h) + 1);
+    return idx;
+}
+
+static uint8_t dense_get(const uint8_t* p, size_t idx){
+    size_t bit = idx*6;
+    uint32_t v = (uint32_t)p[bit/8] | (uint32_t)p[bit/8 + 1] << 8;
+    return (uint8_t)(v >> (bit & 7) & 63);
+}
+
+static void dense_set(uint8_t* p, size_t idx, uint8_t val){
+    size_t bit = idx*6;
+    uint32_t v = (uint32_t)p[bit/8] | (uint32_t)p[bit/8 + 1] << 8;
+    v &= ~(63u << (bit & 7));
+    v |= (uint32_t)val << (bit & 7);
+    p[bit/8] = (uint8_t)v;
+    p[bit/8 + 1] = (uint8_t)(v >> 8);
+}
+
+// 4 registers fill 3 bytes exactly
+static void dense_unpack(uint8_t* raw, const uint8_t* p){
+    for (size_t i = 0; i < k_hll_registers; i += 4, p += 3){
+        uint32_t v = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+        raw[i] = v & 63;
+        raw[i+1] = v >> 6 & 63;
+        raw[i+2] = v >> 12 & 63;
+        raw[i+3] = v >> 18 & 63;
+    }
+}
+
+static uint32_t sparse_word(const uint8_t* p){
+    return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+}
+
+static void sparse_put(uint8_t* p, uint32_t idx, uint8_t val){
+    uint32_t w = idx << 6 | val;
+    p[0] = (uint8_t)(w >> 16);
+    p[1] = (uint8_t)(w >> 8);
+    p[2] = (uint8_t)w;
+}
+
+static uint8_t* img_regs(std::string &img){
+    return (uint8_t*)&img[k_hll_header];
+}
+
+static const uint8_t* img_regs(const std::string &img){
+    return (const uint8_t*)img.data() + k_hll_header;
+}
+
+static void img_set_count(std::string &img, uint64_t count){
+    memcpy(&img[1], &count, 8);
+}
+
+static void sparse_to_dense(std::string &img){
+    std::string dense(k_hll_header + k_hll_dense_bytes, '\0');
+    dense[0] = HLL_DENSE;
+    uint8_t* regs = (uint8_t*)&dense[k_hll_header];
+    const uint8_t* p = img_regs(img);
+    size_t n = (img.size() - k_hll_header)/3;
+    for (size_t i = 0; i < n; i++, p += 3){
+        uint32_t w = sparse_word(p);
+        dense_set(regs, w >> 6, w & 63);
+    }
+    img.swap(dense);
+}
+
+//===============================estimate===============================//
+
+// the two series of the improved estimator, see Ertl, "New cardinality
+// estimation algorithms for HyperLogLog sketches"
+static double hll_tau(double x){
+    if (x == 0 || x == 1){
+        return 0;
+    }
+    double y = 1, z = 1 - x, prev = 0;
+    do {
+        x = sqrt(x);
+        prev = z;
+        y *= 0.5;
+        z -= (1 - x)*(1 - x)*y;
+    } while (prev != z);
+    return z/3;
+}
+
+static double hll_sigma(double x){
+    if (x == 1){
+        return INFINITY;
+    }
+    double y = 1, z = x, prev = 0;
+    do {
+        x *= x;
+        prev = z;
+        z += x*y;
+        y += y;
+    } while (prev != z);
+    return z;
+}
+
+// from the number of registers holding each value
+static uint64_t hll_estimate(const uint32_t* hist){
+    double m = (double)k_hll_registers;
+    double z = m * hll_tau((m - hist[k_hll_q + 1])/m);
+    for (uint32_t j = k_hll_q; j >= 1; j--){
+        z += hist[j];
+        z *= 0.5;
+    }
+    z += m * hll_sigma(hist[0]/m);
+    const double alpha_inf = 0.5/log(2.0);
+    return (uint64_t)llround(alpha_inf*m*m/z);
+}
+
+//===============================interface===============================//
+
+void hll_init(std::string &img){
+    img.assign(k_hll_header, '\0');
+    img[0] = HLL_SPARSE;
+}
+
+bool hll_valid(const std::string &img){
+    if (img.size() < k_hll_header){
+        return false;
+    }
+    if (img[0] == HLL_DENSE){
+        if (img.size() != k_hll_header + k_hll_dense_bytes){
+            return false;
+        }
+        for (size_t i = 0; i < k_hll_registers; i++){
+            if (dense_get(img_regs(img), i) > k_hll_q + 1){
+                return false;
+            }
+        }
+        return true;
+    }
+    if (img[0] != HLL_SPARSE || (img.size() - k_hll_header) % 3){
+        return false;
+    }
+    const uint8_t* p = img_regs(img);
+    size_t n = (img.size() - k_hll_header)/3;
+    for (size_t i = 0; i < n; i++, p += 3){
+        uint32_t w = sparse_word(p);
+        uint32_t val = w & 63;
+        bool ordered = i == 0 || (w >> 6) > (sparse_word(p - 3) >> 6);
+        if ((w >> 6) >= k_hll_registers || val == 0 || val > k_hll_q + 1 || !ordered){
+            return false;
+        }
+    }
+    return true;
+}
+
+bool hll_add(std::string &img, const char* val, size_t len, size_t sparse_max){
+    uint8_t rank = 0;
+    uint32_t idx = hll_pos(val, len, &rank);
+    if (img[0] == HLL_DENSE){
+        uint8_t* regs = img_regs(img);
+        if (dense_get(regs, idx) >= rank){
+            return false;
+        }
+        dense_set(regs, idx, rank);
+        img_set_count(img, k_hll_stale);
+        return true;
+    }
+    // binary search for the word of `idx` or where it goes
+    size_t lo = 0, hi = (img.size() - k_hll_header)/3;
+    while (lo < hi){
+        size_t mid = (lo + hi)/2;
+        if (sparse_word(img_regs(img) + 3*mid) >> 6 < idx){
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    size_t pos = k_hll_header + 3*lo;
+    if (pos < img.size() && sparse_word((const uint8_t*)&img[pos]) >> 6 == idx){
+        if ((sparse_word((const uint8_t*)&img[pos]) & 63) >= rank){
+            return false;
+        }
+    } else {
+        if (img.size() + 3 - k_hll_header > sparse_max){
+            sparse_to_dense(img);
+            return hll_add(img, val, len, sparse_max);
+        }
+        img.insert(pos, 3, '\0');
+    }
+    sparse_put((uint8_t*)&img[pos], idx, rank);
+    img_set_count(img, k_hll_stale);
+    return true;
+}
+
+bool hll_stale(const std::string &img){
+    uint64_t count = 0;
+    memcpy(&count, &img[1], 8);
+    return count & k_hll_stale;
+}
+
+uint64_t hll_count(std::string &img){
+    uint64_t count = 0;
+    memcpy(&count, &img[1], 8);
+    if (!(count & k_hll_stale)){
+        return count;
+    }
+    uint32_t hist[64] = {};
+    const uint8_t* p = img_regs(img);
+    if (img[0] == HLL_DENSE){
+        for (size_t i = 0; i < k_hll_registers; i += 4, p += 3){
+            uint32_t v = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+            hist[v & 63]++;
+            hist[v >> 6 & 63]++;
+            hist[v >> 12 & 63]++;
+            hist[v >> 18 & 63]++;
+        }
+    } else {
+        size_t n = (img.size() - k_hll_header)/3;
+        hist[0] = (uint32_t)(k_hll_registers - n);
+        for (size_t i = 0; i < n; i++, p += 3){
+            hist[sparse_word(p) & 63]++;
+        }
+    }
+    count = hll_estimate(hist);
+    img_set_count(img, count);
+    return count;
+}
+
+void hll_merge(uint8_t* raw, const std::string &img){
+    const uint8_t* p = img_regs(img);
+    if (img[0] == HLL_DENSE){
+        uint8_t tmp[k_hll_registers];
+        dense_unpack(tmp, p);
+        return hll_max(raw, tmp);
+    }
+    size_t n = (img.size() - k_hll_header)/3;
+    for (size_t i = 0; i < n; i++, p += 3){
+        uint32_t w = sparse_word(p);
+        uint8_t val = w & 63;
+        if (raw[w >> 6] < val){
+            raw[w >> 6] = val;
+        }
+    }
+}
+
+void hll_max(uint8_t* dst, const uint8_t* src){
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= k_hll_registers; i += 16){
+        __m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_max_epu8(a, b));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= k_hll_registers; i += 16){
+        vst1q_u8(dst + i, vmaxq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+    }
+#endif
+    for (; i < k_hll_registers; i++){
+        dst[i] = dst[i] < src[i] ? src[i] : dst[i];
+    }
+}
+
+uint64_t hll_count_raw(const uint8_t* raw){
+    uint32_t hist[64] = {};
+    for (size_t i = 0; i < k_hll_registers; i++){
+        hist[raw[i]]++;
+    }
+    return hll_estimate(hist);
+}
+
+void hll_from_raw(std::string &img, const uint8_t* raw){
+    img.assign(k_hll_header + k_hll_dense_bytes, '\0');
+    img[0] = HLL_DENSE;
+    uint8_t* p = img_regs(img);
+    for (size_t i = 0; i < k_hll_registers; i += 4, p += 3){
+        uint32_t v = raw[i] | raw[i+1] << 6 | raw[i+2] << 12 | (uint32_t)raw[i+3] << 18;
+        p[0] = (uint8_t)v;
+        p[1] = (uint8_t)(v >> 8);
+        p[2] = (uint8_t)(v >> 16);
+    }
+    img_set_count(img, k_hll_stale);
+}
@@ -0,0 +1,45 @@
+// 1. A HyperLogLog estimates the number of distinct elements added to it in
+//    fixed memory: 2^14 registers each keep the longest run of trailing zero
+//    bits (+1) seen among the hashes that land on it, the standard error is
+//    0.81%; the estimate uses the improved estimator of Ertl, which needs no
+//    bias tables and holds from 0 to billions
+// 2. The image is a byte string, the value of a T_HLL entry:
+//    +----------+-------+-----------+
+//    | encoding | count | registers |
+//    +----------+-------+-----------+
+//        u8       u64
+//    `count` caches the last estimate, k_hll_stale is set on every change
+// 3. Sparse: the registers that are not 0 as 3 byte big endian words of
+//    index << 6 | value, sorted by index; a few bytes for a few elements,
+//    changed to dense once past `sparse_max` bytes
+//    Dense: 6 bits a register packed little endian, 12KB, plus a byte of
+//    padding so the last register reads like the others
+// 4. Merges and multi key counts unpack to one byte a register and take
+//    the maximum 16 registers at a time with SSE2 (or NEON)
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+const uint32_t k_hll_p = 14;
+const size_t k_hll_registers = (size_t)1 << k_hll_p;
+const uint64_t k_hll_stale = (uint64_t)1 << 63;
+
+// an empty sparse image
+void     hll_init(std::string &img);
+// whether an image from a snapshot or RESTORE is well formed
+bool     hll_valid(const std::string &img);
+// true if a register changed
+bool     hll_add(std::string &img, const char* val, size_t len, size_t sparse_max);
+// whether hll_count() has to compute the estimate, and so change the image
+bool     hll_stale(const std::string &img);
+uint64_t hll_count(std::string &img);
+// raises the registers in `raw` (one byte each) to those of the image
+void     hll_merge(uint8_t* raw, const std::string &img);
+// dst[i] = max(dst[i], src[i]) for all the registers
+void     hll_max(uint8_t* dst, const uint8_t* src);
+uint64_t hll_count_raw(const uint8_t* raw);
+// a dense image of the registers in `raw`
+void     hll_from_raw(std::string &img, const uint8_t* raw);
@@ -0,0 +1,100 @@
+#include <assert.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "iothreads.h"
+#include "constants.h"
+
+// one per extra thread, its own cache line as the loop polls `done`
+struct alignas(64) IoThread {
+    std::thread thread;
+    std::atomic<uint64_t> gen{0};   // the batch it was given
+    std::atomic<uint64_t> done{0};  // the batch it finished
+    std::vector<void*> items;
+};
+
+static struct {
+    std::vector<IoThread*> threads;
+    void (*fn)(void*) = nullptr;
+    std::mutex mu;
+    std::condition_variable cv;
+    IoStats stats;
+} g_io;
+
+static void io_thread_main(IoThread* t){
+    uint64_t seen = 0;
+    while (true){
+        // spin first, a busy loop hands out a batch every iteration
+        for (uint32_t i = 0; i < k_io_spin && t->gen == seen; i++){
+            std::this_thread::yield();
+        }
+        if (t->gen == seen){
+            std::unique_lock<std::mutex> lock(g_io.mu);
+            g_io.cv.wait(lock, [&]{ return t->gen != seen; });
+        }
+        seen = t->gen;
+        for (void* item : t->items){
+            g_io.fn(item);
+        }
+        t->done = seen;
+    }
+}
+
+void io_threads_init(size_t n){
+    assert(n > 0 && g_io.threads.empty());
+    for (size_t i = 1; i < n; i++){
+        IoThread* t = new IoThread();
+        t->thread = std::thread(&io_thread_main, t);
+        t->thread.detach();     // lives as long as the process
+        g_io.threads.push_back(t);
+    }
+}
+
+size_t io_threads_count(){
+    return g_io.threads.size() + 1;
+}
+
+void io_threads_run(void (*fn)(void*), void* const* items, size_t n){
+    size_t nthreads = io_threads_count();
+    g_io.stats.items += n;
+    if (n < nthreads * k_io_min_per_thread){
+        g_io.stats.inline_batches++;
+        for (size_t i = 0; i < n; i++){
+            fn(items[i]);
+        }
+        return;
+    }
+    g_io.stats.batches++;
+    g_io.fn = fn;
+    for (IoThread* t : g_io.threads){
+        t->items.clear();
+    }
+    // dealt round robin, the loop thread takes every `nthreads`th item
+    for (size_t i = 0; i < n; i++){
+        if (i % nthreads != 0){
+            g_io.threads[i % nthreads - 1]->items.push_back(items[i]);
+        }
+    }
+    {
+        // under `mu` so a thread about to sleep sees the new batch
+        std::lock_guard<std::mutex> lock(g_io.mu);
+        for (IoThread* t : g_io.threads){
+            t->gen++;
+        }
+    }
+    g_io.cv.notify_all();
+    for (size_t i = 0; i < n; i += nthreads){
+        fn(items[i]);
+    }
+    for (IoThread* t : g_io.threads){
+        while (t->done != t->gen){
+            std::this_thread::yield();
+        }
+    }
+}
+
+const IoStats& io_threads_stats(){
+    return g_io.stats;
+}
@@ -0,0 +1,26 @@
+// 1. Socket reads with request framing and parsing, and reply writes, are
+//    spread over a few threads, command execution stays on the event loop
+//    thread so the data structures need no locking (the Redis 6 model)
+// 2. Work is handed out in batches: the loop deals the ready connections
+//    over the threads, does its own share and waits until all are done,
+//    nothing runs in parallel with the loop itself
+// 3. Between batches the threads spin for a while, then sleep on a
+//    condition variable, so an idle server doesn't burn the cores
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct IoStats {
+    uint64_t batches = 0;       // run on the threads
+    uint64_t inline_batches = 0;// too small to be worth waking the threads
+    uint64_t items = 0;
+};
+
+// `n` counts the loop thread, 1 means no extra threads
+void io_threads_init(size_t n);
+size_t io_threads_count();
+// calls `fn` on every item and returns when all calls are done
+void io_threads_run(void (*fn)(void*), void* const* items, size_t n);
+const IoStats& io_threads_stats();
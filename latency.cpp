@@ -0,0 +1,81 @@
+#include "latency.h"
+
+// `v += d` for a counter with a single writer
+static inline void counter_add(std::atomic<uint64_t>& c, uint64_t d){
+    c.store(c.load(std::memory_order_relaxed) + d, std::memory_order_relaxed);
+}
+
+size_t lat_bucket(uint64_t ns){
+    const uint64_t linear = 1ull << k_lat_sub_bits;
+    if (ns < linear){
+        return (size_t)ns;
+    }
+    uint32_t msb = 63 - (uint32_t)__builtin_clzll(ns);
+    uint32_t shift = msb - k_lat_sub_bits + 1;
+    // the top k_lat_sub_bits bits, in [linear/2, linear)
+    uint64_t top = ns >> shift;
+    return (size_t)(shift << (k_lat_sub_bits - 1)) + (size_t)top;
+}
+
+uint64_t lat_bucket_max(size_t idx){
+    const uint64_t linear = 1ull << k_lat_sub_bits;
+    if (idx < linear){
+        return idx;
+    }
+    uint32_t shift = (uint32_t)(idx >> (k_lat_sub_bits - 1)) - 1;
+    uint64_t top = (idx & ((linear >> 1) - 1)) + (linear >> 1);
+    if (shift + k_lat_sub_bits >= 64 && top == linear - 1){
+        return UINT64_MAX;
+    }
+    return ((top + 1) << shift) - 1;
+}
+
+void lat_record(LatencyHist* h, uint64_t ns){
+    counter_add(h->counts[lat_bucket(ns)], 1);
+    counter_add(h->calls, 1);
+    counter_add(h->total_ns, ns);
+    if (ns > h->max_ns.load(std::memory_order_relaxed)){
+        h->max_ns.store(ns, std::memory_order_relaxed);
+    }
+}
+
+void lat_reset(LatencyHist* h){
+    h->calls.store(0, std::memory_order_relaxed);
+    h->total_ns.store(0, std::memory_order_relaxed);
+    h->max_ns.store(0, std::memory_order_relaxed);
+    for (std::atomic<uint64_t>& c : h->counts){
+        c.store(0, std::memory_order_relaxed);
+    }
+}
+
+void lat_merge(LatencyHist* dst, const LatencyHist* src){
+    for (size_t i = 0; i < k_lat_buckets; i++){
+        counter_add(dst->counts[i], src->counts[i].load(std::memory_order_relaxed));
+    }
+    counter_add(dst->calls, src->calls.load(std::memory_order_relaxed));
+    counter_add(dst->total_ns, src->total_ns.load(std::memory_order_relaxed));
+    uint64_t max = src->max_ns.load(std::memory_order_relaxed);
+    if (max > dst->max_ns.load(std::memory_order_relaxed)){
+        dst->max_ns.store(max, std::memory_order_relaxed);
+    }
+}
+
+uint64_t lat_quantile(const LatencyHist* h, double q){
+    uint64_t calls = h->calls.load(std::memory_order_relaxed);
+    if (calls == 0){
+        return 0;
+    }
+    // the rank of the quantile, at least the first value
+    uint64_t rank = (uint64_t)(q * (double)calls + 0.5);
+    rank = rank < 1 ? 1 : rank;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < k_lat_buckets; i++){
+        seen += h->counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank){
+            uint64_t hi = lat_bucket_max(i);
+            uint64_t max = h->max_ns.load(std::memory_order_relaxed);
+            return hi < max ? hi : max;
+        }
+    }
+    return h->max_ns.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,36 @@
+// 1. A log-linear (HDR style) histogram of latencies in nanoseconds: values
+//    below 2^k_lat_sub_bits get a bucket each, above that every power of
+//    two is split into 2^(k_lat_sub_bits-1) buckets, so any value is off by
+//    at most 1/16 of itself and the whole 64 bit range fits in ~1000 buckets
+// 2. Recording is a bucket index computed with a count-leading-zeros and
+//    three relaxed stores; there is a single writer, the event loop thread,
+//    so no read-modify-write is needed and readers on any thread see
+//    consistent (if slightly stale) counters without locks
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+const uint32_t k_lat_sub_bits = 5;
+// the groups of the linear part and of msb k_lat_sub_bits to 63
+const size_t k_lat_buckets = (64 - k_lat_sub_bits + 2) << (k_lat_sub_bits - 1);
+
+struct LatencyHist {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> max_ns{0};
+    std::atomic<uint64_t> counts[k_lat_buckets] = {};
+};
+
+// from the single writer thread only
+void lat_record(LatencyHist* h, uint64_t ns);
+void lat_reset(LatencyHist* h);
+// adds the samples of `src` to `dst`, `dst`'s writer only
+void lat_merge(LatencyHist* dst, const LatencyHist* src);
+// the highest value of the bucket holding the `q` quantile, 0 if empty
+uint64_t lat_quantile(const LatencyHist* h, double q);
+size_t lat_bucket(uint64_t ns);
+// the highest value that falls into bucket `idx`
+uint64_t lat_bucket_max(size_t idx);
@@ -0,0 +1,52 @@
+#include <deque>
+#include "lazyfree.h"
+#include "commonops.h"
+#include "constants.h"
+
+struct LazyJob {
+    lazyfree_step_fn step = nullptr;
+    void* obj = nullptr;
+    size_t bytes = 0;
+};
+
+static std::deque<LazyJob> g_jobs;
+static LazyFreeStats g_stats;
+
+void lazyfree_push(lazyfree_step_fn step, void* obj, size_t bytes){
+    g_jobs.push_back(LazyJob{step, obj, bytes});
+    g_stats.pending_jobs++;
+    g_stats.pending_bytes += bytes;
+}
+
+bool lazyfree_pending(){
+    return !g_jobs.empty();
+}
+
+void lazyfree_run(uint64_t budget_us){
+    if (g_jobs.empty()){
+        return;
+    }
+    // backpressure: spend more of each iteration when the backlog piles up
+    if (g_stats.pending_bytes > k_lazyfree_backlog_bytes){
+        budget_us *= 4;
+    }
+    uint64_t start_us = get_monotonic_usecs();
+    while (!g_jobs.empty()){
+        // copied out, a step may queue more jobs (e.g. a flushed keyspace)
+        LazyJob job = g_jobs.front();
+        if (job.step(job.obj, k_lazyfree_slice)){
+            g_jobs.pop_front();
+            g_stats.pending_jobs--;
+            g_stats.pending_bytes -= job.bytes;
+            g_stats.freed_jobs++;
+            g_stats.freed_bytes += job.bytes;
+        }
+        if (get_monotonic_usecs() - start_us >= budget_us){
+            break;
+        }
+    }
+}
+
+const LazyFreeStats& lazyfree_stats(){
+    return g_stats;
+}
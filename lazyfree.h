@@ -0,0 +1,25 @@
+// 1. Large values are not destroyed inline, they are queued here and torn down
+//    by the event loop in small slices, bounded by a time budget per iteration
+// 2. Each job knows how to free a few items of its object at a time, so a
+//    50M member zset or a whole keyspace never stalls the loop in one go
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// frees at most `max_work` items of `obj`, returns true once `obj` is gone
+typedef bool (*lazyfree_step_fn)(void* obj, size_t max_work);
+
+struct LazyFreeStats {
+    size_t pending_jobs = 0;
+    size_t pending_bytes = 0;   // estimated bytes still waiting to be released
+    size_t freed_jobs = 0;
+    size_t freed_bytes = 0;
+};
+
+void lazyfree_push(lazyfree_step_fn step, void* obj, size_t bytes);
+bool lazyfree_pending();
+// runs queued jobs until the queue is empty or the budget is used up
+void lazyfree_run(uint64_t budget_us);
+const LazyFreeStats& lazyfree_stats();
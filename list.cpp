@@ -0,0 +1,324 @@
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include "list.h"
+#include "lzf.h"
+#include "commonops.h"
+
+const size_t k_list_min_compress = 64;      // smaller chunks are left plain
+
+//===============================element encoding===============================//
+
+static size_t put_varint(char* p, size_t v){
+    size_t n = 0;
+    while (v >= 0x80){
+        p[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (char)v;
+    return n;
+}
+
+// the bytes of put_varint() in reverse, read from the end by get_backvarint()
+static size_t put_backvarint(char* p, size_t v){
+    char tmp[10];
+    size_t n = put_varint(tmp, v);
+    for (size_t i = 0; i < n; i++){
+        p[i] = tmp[n - 1 - i];
+    }
+    return n;
+}
+
+static size_t get_varint(const char* p, size_t* v){
+    size_t n = 0;
+    *v = 0;
+    for (uint32_t shift = 0; ; shift += 7){
+        uint8_t b = (uint8_t)p[n++];
+        *v |= (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)){
+            return n;
+        }
+    }
+}
+
+// `end` is one past the last byte
+static size_t get_backvarint(const char* end, size_t* v){
+    size_t n = 0;
+    *v = 0;
+    for (uint32_t shift = 0; ; shift += 7){
+        uint8_t b = (uint8_t)*(end - ++n);
+        *v |= (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)){
+            return n;
+        }
+    }
+}
+
+// writes the length, the bytes and the length backwards, returns the size
+static size_t elem_encode(char* p, const char* val, size_t len){
+    size_t n = put_varint(p, len);
+    memcpy(p + n, val, len);
+    put_backvarint(p + n + len, len);
+    return len + 2*n;
+}
+
+static size_t elem_size(size_t len){
+    char tmp[10];
+    return len + 2*put_varint(tmp, len);
+}
+
+//===============================chunks===============================//
+
+static ListChunk* chunk_of(CDNode* node){
+    return container_of(node, ListChunk, link);
+}
+
+static size_t chunk_mem(ListChunk* c){
+    return sizeof(ListChunk) + c->data.capacity();
+}
+
+// the first or the last chunk, null if there is none
+static ListChunk* chunk_end(List* list, bool front){
+    CDNode* node = front ? list->head.next : list->head.prev;
+    return node != &list->head ? chunk_of(node) : nullptr;
+}
+
+static ListChunk* chunk_new(List* list, bool front){
+    ListChunk* c = new ListChunk();
+    cdlist_insert_before(front ? list->head.next : &list->head, &c->link);
+    list->nchunks++;
+    list->mem += chunk_mem(c);
+    return c;
+}
+
+static void chunk_free(List* list, ListChunk* c){
+    cdlist_detach(&c->link);
+    list->nchunks--;
+    list->len -= c->count;
+    list->mem -= chunk_mem(c);
+    delete c;
+}
+
+// replaces the data, keeping `mem` in step
+static void chunk_swap_data(List* list, ListChunk* c, std::string &data){
+    list->mem -= chunk_mem(c);
+    c->data.swap(data);
+    list->mem += chunk_mem(c);
+}
+
+// kept only if it saves an eighth
+static void chunk_compress(List* list, ListChunk* c){
+    if (c->compressed || c->raw_len < k_list_min_compress){
+        return;
+    }
+    std::string img(c->raw_len - c->raw_len/8, '\0');
+    size_t n = lzf_compress((const uint8_t*)c->data.data(), c->raw_len, (uint8_t*)&img[0], img.size());
+    if (!n){
+        return;
+    }
+    img.resize(n);
+    img.shrink_to_fit();
+    chunk_swap_data(list, c, img);
+    c->compressed = true;
+}
+
+static void chunk_decompress(List* list, ListChunk* c){
+    if (!c->compressed){
+        return;
+    }
+    std::string raw(c->raw_len, '\0');
+    bool ok = lzf_decompress((const uint8_t*)c->data.data(), c->data.size(), (uint8_t*)&raw[0], raw.size());
+    assert(ok);
+    (void)ok;
+    chunk_swap_data(list, c, raw);
+    c->compressed = false;
+}
+
+// the packed elements of a chunk, decompressed to `scratch` if needed
+static const char* chunk_view(ListChunk* c, std::string &scratch){
+    if (!c->compressed){
+        return c->data.data();
+    }
+    scratch.resize(c->raw_len);
+    bool ok = lzf_decompress((const uint8_t*)c->data.data(), c->data.size(), (uint8_t*)&scratch[0], c->raw_len);
+    assert(ok);
+    (void)ok;
+    return scratch.data();
+}
+
+// after the chunks at one end changed: the first `depth` from that end are
+// plain, the next one is compressed unless it is that close to the other end
+static void list_fix_end(List* list, bool front, uint32_t depth){
+    if (!depth){
+        return;
+    }
+    CDNode* node = front ? list->head.next : list->head.prev;
+    for (uint32_t i = 0; i <= depth && node != &list->head; i++){
+        if (i < depth){
+            chunk_decompress(list, chunk_of(node));
+        } else if (list->nchunks > 2*(size_t)depth){
+            chunk_compress(list, chunk_of(node));
+        }
+        node = front ? node->next : node->prev;
+    }
+}
+
+//===============================interface===============================//
+
+void list_push(List* list, bool front, const char* val, size_t len, size_t chunk_size, uint32_t depth){
+    size_t size = elem_size(len);
+    ListChunk* c = chunk_end(list, front);
+    bool fresh = !c || (c->count > 0 && c->raw_len + size > chunk_size);
+    if (fresh){
+        c = chunk_new(list, front);
+    }
+    // the end chunks are plain unless `depth` was lowered since
+    chunk_decompress(list, c);
+    list->mem -= chunk_mem(c);
+    // doubles like a string would, but not past `chunk_size`; reserve() on
+    // the string itself would double regardless
+    size_t need = c->raw_len + size;
+    if (need > c->data.capacity()){
+        size_t cap = std::min(std::max(2*c->data.capacity(), need), chunk_size);
+        std::string grown;
+        grown.reserve(std::max(cap, need));
+        grown.assign(c->data);
+        c->data.swap(grown);
+    }
+    if (front){
+        c->data.insert(0, size, '\0');
+        elem_encode(&c->data[0], val, len);
+    } else {
+        c->data.resize(c->raw_len + size);
+        elem_encode(&c->data[c->raw_len], val, len);
+    }
+    list->mem += chunk_mem(c);
+    c->raw_len += (uint32_t)size;
+    c->count++;
+    list->len++;
+    if (fresh){
+        list_fix_end(list, front, depth);
+    }
+}
+
+// removes `n` elements from a plain chunk, `n` is less than its count
+static void chunk_drop(List* list, ListChunk* c, bool front, size_t n){
+    const char* data = c->data.data();
+    size_t bytes = 0, len = 0;
+    for (size_t i = 0; i < n; i++){
+        if (front){
+            bytes += 2*get_varint(data + bytes, &len) + len;
+        } else {
+            bytes += 2*get_backvarint(data + c->raw_len - bytes, &len) + len;
+        }
+    }
+    list->mem -= chunk_mem(c);
+    if (front){
+        c->data.erase(0, bytes);
+    } else {
+        c->data.resize(c->raw_len - bytes);
+    }
+    list->mem += chunk_mem(c);
+    c->raw_len -= (uint32_t)bytes;
+    c->count -= (uint32_t)n;
+    list->len -= n;
+}
+
+bool list_pop(List* list, bool front, std::string &out, uint32_t depth){
+    ListChunk* c = chunk_end(list, front);
+    if (!c){
+        return false;
+    }
+    chunk_decompress(list, c);
+    size_t len = 0;
+    if (front){
+        size_t n = get_varint(c->data.data(), &len);
+        out.assign(c->data.data() + n, len);
+    } else {
+        const char* end = c->data.data() + c->raw_len;
+        size_t n = get_backvarint(end, &len);
+        out.assign(end - n - len, len);
+    }
+    if (c->count > 1){
+        chunk_drop(list, c, front, 1);
+        return true;
+    }
+    chunk_free(list, c);
+    list_fix_end(list, front, depth);
+    return true;
+}
+
+size_t list_len(List* list){
+    return list->len;
+}
+
+void list_range(List* list, size_t start, size_t stop,
+    bool (*f)(const char* val, size_t len, void* arg), void* arg)
+{
+    // the chunk holding `start`, walking from the nearer end
+    CDNode* node = nullptr;
+    size_t idx = 0;     // of the first element of `node`
+    if (start < list->len/2){
+        node = list->head.next;
+        while (idx + chunk_of(node)->count <= start){
+            idx += chunk_of(node)->count;
+            node = node->next;
+        }
+    } else {
+        node = list->head.prev;
+        idx = list->len - chunk_of(node)->count;
+        while (idx > start){
+            node = node->prev;
+            idx -= chunk_of(node)->count;
+        }
+    }
+    std::string scratch;
+    for (; node != &list->head && idx <= stop; node = node->next){
+        ListChunk* c = chunk_of(node);
+        const char* p = chunk_view(c, scratch);
+        const char* end = p + c->raw_len;
+        for (; p < end && idx <= stop; idx++){
+            size_t len = 0;
+            size_t n = get_varint(p, &len);
+            if (idx >= start && !f(p + n, len, arg)){
+                return;
+            }
+            p += 2*n + len;
+        }
+    }
+}
+
+// removes `n` elements from one end, whole chunks first
+static void list_drop(List* list, bool front, size_t n, uint32_t depth){
+    bool freed = false;
+    for (ListChunk* c = chunk_end(list, front); n > 0 && c->count <= n; c = chunk_end(list, front)){
+        n -= c->count;
+        chunk_free(list, c);
+        freed = true;
+    }
+    if (freed){
+        list_fix_end(list, front, depth);
+    }
+    if (n > 0){
+        ListChunk* c = chunk_end(list, front);
+        chunk_decompress(list, c);
+        chunk_drop(list, c, front, n);
+    }
+}
+
+void list_trim(List* list, size_t start, size_t stop, uint32_t depth){
+    size_t back = list->len - 1 - stop;
+    list_drop(list, true, start, depth);
+    list_drop(list, false, back, depth);
+}
+
+bool list_dispose(List* list, size_t max_work){
+    for (size_t i = 0; i < max_work && list->nchunks > 0; i++){
+        chunk_free(list, chunk_end(list, true));
+    }
+    return list->nchunks == 0;
+}
+
+size_t list_mem(List* list){
+    return list->mem;
+}
@@ -0,0 +1,51 @@
+// 1. A list is a doubly linked list of chunks, each a buffer of elements
+//    packed back to back, so an element costs its bytes plus a length before
+//    and after it (1 byte each below 128 bytes) and a share of one chunk header
+// 2. The length after an element is its varint written backwards, so the
+//    last element of a chunk is found without scanning it; pushes and pops
+//    touch only an end chunk, both are O(1) for a bounded `chunk_size`
+// 3. A chunk takes elements until it would exceed `chunk_size` bytes, a
+//    larger element gets a chunk of its own; an emptied chunk is freed
+// 4. With `depth` > 0 the chunks further than `depth` from both ends are LZF
+//    compressed (see lzf.h) when that saves space, the ends stay plain;
+//    LRANGE decompresses them to a scratch buffer, the list keeps them compressed
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include "cdlist.h"
+
+struct ListChunk {
+    CDNode link;
+    std::string data;           // the packed elements, or their LZF image if `compressed`
+    uint32_t count = 0;
+    uint32_t raw_len = 0;       // bytes of the packed elements
+    bool compressed = false;
+};
+
+struct List {
+    CDNode head;                // dummy node, `head.next` is the first chunk
+    size_t len = 0;
+    size_t nchunks = 0;
+    size_t mem = 0;             // bytes held by the chunks
+    List(){
+        cdlist_init(&head);
+    }
+};
+
+void   list_push(List* list, bool front, const char* val, size_t len, size_t chunk_size, uint32_t depth);
+// false if the list is empty
+bool   list_pop(List* list, bool front, std::string &out, uint32_t depth);
+size_t list_len(List* list);
+// invoke the callback on the elements in [start, stop] until it returns
+// false, the indexes are within the list
+void   list_range(List* list, size_t start, size_t stop,
+            bool (*f)(const char* val, size_t len, void* arg), void* arg);
+// keeps the elements in [start, stop], the indexes are within the list
+void   list_trim(List* list, size_t start, size_t stop, uint32_t depth);
+// frees up to `max_work` chunks, true once the list is empty
+bool   list_dispose(List* list, size_t max_work);
+// bytes held by the list, excluding the List struct itself
+size_t list_mem(List* list);
@@ -0,0 +1,427 @@
+// load generator for the server's own protocol
+//   g++ -O2 -std=gnu++17 -pthread loadgen.cpp rwloop.cpp latency.cpp -o loadgen
+//   ./loadgen [--host 127.0.0.1] [--port 1234] [--threads 4] [--conns 50]
+//             [--pipeline 1] [--requests 1000000 | --duration 10] [--keys 100000]
+//             [--value-size 64 | --value-size 16-1024] [--rate 0]
+//             [--mix get=80,set=20,zadd=0,zquery=0,expire=0]
+// 1. Closed loop (the default): each thread drives its share of the
+//    connections, sends `pipeline` requests on each of them, then reads all
+//    the replies; a request's latency runs from its batch being sent
+// 2. Open loop (--rate ops/s): requests are due at fixed intervals whatever
+//    the server does, each thread sends what is due on its share of the
+//    connections and has a second one polling them for the replies, and
+//    latency is measured from when the request was due rather than when it
+//    could be sent, so a stalled server shows up in the percentiles instead
+//    of slowing the load (coordinated omission)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "rwloop.h"
+#include "latency.h"
+#include "commonops.h"
+
+enum { OP_GET, OP_SET, OP_ZADD, OP_ZQUERY, OP_EXPIRE, OP_COUNT };
+
+static const char *const k_op_names[OP_COUNT] = {"get", "set", "zadd", "zquery", "expire"};
+const size_t k_max_reply = 32<<20;
+const size_t k_zset_keys = 16;      // ZADD and ZQUERY spread over this many zsets
+
+static struct {
+    std::string host = "127.0.0.1";
+    uint32_t port = 1234;
+    uint32_t threads = 4;
+    uint32_t conns = 50;
+    uint32_t pipeline = 1;
+    uint64_t requests = 1000000;
+    double duration = 0;            // seconds, overrides `requests`
+    uint64_t keys = 100000;
+    uint32_t value_min = 64;
+    uint32_t value_max = 64;
+    double rate = 0;                // ops/s over all connections, 0 for closed loop
+    uint32_t mix[OP_COUNT] = {80, 20, 0, 0, 0};
+} g_opt;
+
+// what one thread measured, merged at the end
+struct Result {
+    LatencyHist hist;
+    uint64_t errors = 0;
+};
+
+static void die_usage(const char *msg){
+    fprintf(stderr, "loadgen: %s\n", msg);
+    exit(1);
+}
+
+// splitmix64, one state per thread
+static uint64_t rnd(uint64_t &state){
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static void parse_mix(const char *s){
+    memset(g_opt.mix, 0, sizeof(g_opt.mix));
+    std::string str = s;
+    size_t pos = 0;
+    while (pos < str.size()){
+        size_t comma = str.find(',', pos);
+        std::string item = str.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        size_t eq = item.find('=');
+        bool found = false;
+        for (uint32_t op = 0; op < OP_COUNT && eq != std::string::npos; op++){
+            if (item.compare(0, eq, k_op_names[op]) == 0){
+                g_opt.mix[op] = (uint32_t)atoi(item.c_str() + eq + 1);
+                found = true;
+            }
+        }
+        if (!found){
+            die_usage("bad --mix, expected name=weight,...");
+        }
+        pos = comma == std::string::npos ? str.size() : comma + 1;
+    }
+}
+
+static void parse_args(int argc, char **argv){
+    for (int i = 1; i < argc; i += 2){
+        if (i + 1 >= argc){
+            die_usage("missing value");
+        }
+        std::string name = argv[i];
+        const char *val = argv[i+1];
+        if (name == "--host"){
+            g_opt.host = val;
+        } else if (name == "--port"){
+            g_opt.port = (uint32_t)atoi(val);
+        } else if (name == "--threads"){
+            g_opt.threads = (uint32_t)atoi(val);
+        } else if (name == "--conns"){
+            g_opt.conns = (uint32_t)atoi(val);
+        } else if (name == "--pipeline"){
+            g_opt.pipeline = (uint32_t)atoi(val);
+        } else if (name == "--requests"){
+            g_opt.requests = strtoull(val, nullptr, 10);
+        } else if (name == "--duration"){
+            g_opt.duration = atof(val);
+        } else if (name == "--keys"){
+            g_opt.keys = strtoull(val, nullptr, 10);
+        } else if (name == "--value-size"){
+            // "n" or "min-max", uniform
+            const char *dash = strchr(val, '-');
+            g_opt.value_min = (uint32_t)atoi(val);
+            g_opt.value_max = dash ? (uint32_t)atoi(dash + 1) : g_opt.value_min;
+        } else if (name == "--rate"){
+            g_opt.rate = atof(val);
+        } else if (name == "--mix"){
+            parse_mix(val);
+        } else {
+            die_usage(("unknown option " + name).c_str());
+        }
+    }
+    uint32_t total = 0;
+    for (uint32_t w : g_opt.mix){
+        total += w;
+    }
+    if (!total || !g_opt.threads || !g_opt.conns || !g_opt.pipeline || !g_opt.keys
+        || g_opt.value_min > g_opt.value_max)
+    {
+        die_usage("bad arguments");
+    }
+    g_opt.threads = g_opt.threads > g_opt.conns ? g_opt.conns : g_opt.threads;
+}
+
+// +-----+------+-----+------+-----+------+
+// | len | nstr | len | str1 | ... | strn |
+// +-----+------+-----+------+-----+------+
+static void req_append(std::string &out, const std::vector<std::string> &args){
+    uint32_t len = 4;
+    for (const std::string &a : args){
+        len += 4 + (uint32_t)a.size();
+    }
+    uint32_t nstr = (uint32_t)args.size();
+    out.append((const char*)&len, 4);
+    out.append((const char*)&nstr, 4);
+    for (const std::string &a : args){
+        uint32_t n = (uint32_t)a.size();
+        out.append((const char*)&n, 4);
+        out.append(a);
+    }
+}
+
+// a random request from the mix
+static void req_random(std::string &out, uint64_t &rng, const std::string &value_pool){
+    uint32_t total = 0;
+    for (uint32_t w : g_opt.mix){
+        total += w;
+    }
+    uint32_t pick = (uint32_t)(rnd(rng) % total);
+    uint32_t op = 0;
+    while (pick >= g_opt.mix[op]){
+        pick -= g_opt.mix[op++];
+    }
+    std::string key = "key:" + std::to_string(rnd(rng) % g_opt.keys);
+    std::string zkey = "zset:" + std::to_string(rnd(rng) % k_zset_keys);
+    switch (op){
+    case OP_GET:
+        return req_append(out, {"GET", key});
+    case OP_SET: {
+        uint32_t span = g_opt.value_max - g_opt.value_min + 1;
+        size_t size = g_opt.value_min + rnd(rng) % span;
+        return req_append(out, {"SET", key, value_pool.substr(0, size)});
+    }
+    case OP_ZADD:
+        return req_append(out, {"ZADD", zkey, std::to_string(rnd(rng) % 1000000), key});
+    case OP_ZQUERY:
+        return req_append(out, {"ZQUERY", zkey, std::to_string(rnd(rng) % 1000000), "", "0", "10"});
+    default:
+        return req_append(out, {"EXPIRE", key, "60"});
+    }
+}
+
+// reads one reply, returns false on a broken connection
+static bool reply_read(int fd, std::string &buf, uint64_t &errors){
+    uint32_t len = 0;
+    if (read_full(fd, (char*)&len, 4) < 0 || len == 0 || len > k_max_reply){
+        return false;
+    }
+    buf.resize(len);
+    if (read_full(fd, &buf[0], len) < 0){
+        return false;
+    }
+    errors += buf[0] == 1;      // TAG_ERR
+    return true;
+}
+
+static int conn_open(){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)g_opt.port);
+    if (fd < 0 || inet_pton(AF_INET, g_opt.host.c_str(), &addr.sin_addr) != 1
+        || connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        perror("loadgen: connect");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// the requests of connection `idx` out of `g_opt.requests`
+static uint64_t conn_share(uint32_t idx){
+    return g_opt.requests / g_opt.conns + (idx < g_opt.requests % g_opt.conns);
+}
+
+static bool time_up(uint64_t start_ns){
+    return g_opt.duration > 0 && get_monotonic_nsecs() - start_ns >= (uint64_t)(g_opt.duration * 1e9);
+}
+
+static void closed_loop(uint32_t tid, uint64_t start_ns, Result* res){
+    std::vector<int> fds;
+    std::vector<uint64_t> left;
+    for (uint32_t i = tid; i < g_opt.conns; i += g_opt.threads){
+        fds.push_back(conn_open());
+        left.push_back(g_opt.duration > 0 ? UINT64_MAX : conn_share(i));
+    }
+    uint64_t rng = 0x853c49e6748fea9bull + tid;
+    std::string value_pool(g_opt.value_max, 'x');
+    std::string out, reply;
+    std::vector<uint32_t> sent(fds.size());
+    bool active = true;
+    while (active && !time_up(start_ns)){
+        active = false;
+        uint64_t batch_ns = get_monotonic_nsecs();
+        for (size_t c = 0; c < fds.size(); c++){
+            out.clear();
+            sent[c] = (uint32_t)(left[c] < g_opt.pipeline ? left[c] : g_opt.pipeline);
+            for (uint32_t i = 0; i < sent[c]; i++){
+                req_random(out, rng, value_pool);
+            }
+            left[c] -= sent[c];
+            active |= left[c] > 0;
+            if (!out.empty() && write_all(fds[c], out.data(), out.size()) < 0){
+                die_usage("write() error");
+            }
+        }
+        for (size_t c = 0; c < fds.size(); c++){
+            for (uint32_t i = 0; i < sent[c]; i++){
+                if (!reply_read(fds[c], reply, res->errors)){
+                    die_usage("connection lost");
+                }
+                lat_record(&res->hist, get_monotonic_nsecs() - batch_ns);
+            }
+        }
+    }
+    for (int fd : fds){
+        close(fd);
+    }
+}
+
+static void sleep_until(uint64_t ns){
+    struct timespec ts = {(time_t)(ns / 1000000000), (long)(ns % 1000000000)};
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+}
+
+// request `i` of a connection is due at `start_ns + i*interval_ns`, the
+// sender and the reader both derive it from `i`, so they share nothing
+static uint64_t open_due(uint64_t start_ns, double interval_ns, uint64_t i){
+    return start_ns + (uint64_t)(i * interval_ns);
+}
+
+// reads the replies of a thread's connections as they arrive, so a slow
+// connection doesn't delay the timing of the others
+static void open_reader(const std::vector<int>* fds, const std::vector<uint64_t>* total,
+    uint64_t start_ns, double interval_ns, Result* res)
+{
+    std::vector<struct pollfd> pfds;
+    size_t active = 0;
+    for (size_t c = 0; c < fds->size(); c++){
+        bool wait = (*total)[c] > 0;
+        pfds.push_back({wait ? (*fds)[c] : -1, POLLIN, 0});
+        active += wait;
+    }
+    std::vector<std::string> bufs(fds->size());
+    std::vector<uint64_t> done(fds->size());
+    char tmp[64<<10];
+    while (active > 0){
+        if (poll(pfds.data(), (nfds_t)pfds.size(), -1) < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            die_usage("poll() error");
+        }
+        for (size_t c = 0; c < pfds.size(); c++){
+            if (pfds[c].fd < 0 || !pfds[c].revents){
+                continue;
+            }
+            ssize_t n = read(pfds[c].fd, tmp, sizeof(tmp));
+            if (n <= 0){
+                die_usage("connection lost");
+            }
+            std::string &buf = bufs[c];
+            buf.append(tmp, (size_t)n);
+            size_t pos = 0;
+            while (buf.size() - pos >= 4){
+                uint32_t len = 0;
+                memcpy(&len, &buf[pos], 4);
+                if (len == 0 || len > k_max_reply){
+                    die_usage("connection lost");
+                }
+                if (buf.size() - pos - 4 < len){
+                    break;
+                }
+                res->errors += buf[pos + 4] == 1;      // TAG_ERR
+                lat_record(&res->hist, get_monotonic_nsecs() - open_due(start_ns, interval_ns, done[c]));
+                pos += 4 + len;
+                if (++done[c] == (*total)[c]){
+                    pfds[c].fd = -1;
+                    active--;
+                    break;
+                }
+            }
+            buf.erase(0, pos);
+        }
+    }
+}
+
+// a thread sends what is due on each of its connections, its reader
+// records the replies
+static void open_loop(uint32_t tid, uint64_t start_ns, Result* res){
+    double interval_ns = 1e9 * g_opt.conns / g_opt.rate;
+    std::vector<int> fds;
+    std::vector<uint64_t> total;
+    for (uint32_t i = tid; i < g_opt.conns; i += g_opt.threads){
+        fds.push_back(conn_open());
+        total.push_back(g_opt.duration > 0 ? (uint64_t)(g_opt.duration * 1e9 / interval_ns) : conn_share(i));
+    }
+    std::thread reader(&open_reader, &fds, &total, start_ns, interval_ns, res);
+    uint64_t rng = 0x853c49e6748fea9bull + tid;
+    std::string value_pool(g_opt.value_max, 'x');
+    std::string out;
+    std::vector<uint64_t> sent(fds.size());
+    while (true){
+        uint64_t now_ns = get_monotonic_nsecs();
+        uint64_t next_ns = UINT64_MAX;
+        for (size_t c = 0; c < fds.size(); c++){
+            // everything due by now, up to a pipeline's worth
+            out.clear();
+            uint32_t n = 0;
+            while (sent[c] < total[c] && n < g_opt.pipeline && open_due(start_ns, interval_ns, sent[c]) <= now_ns){
+                req_random(out, rng, value_pool);
+                sent[c]++;
+                n++;
+            }
+            if (!out.empty() && write_all(fds[c], out.data(), out.size()) < 0){
+                die_usage("write() error");
+            }
+            if (sent[c] < total[c]){
+                uint64_t due_ns = open_due(start_ns, interval_ns, sent[c]);
+                next_ns = due_ns < next_ns ? due_ns : next_ns;
+            }
+        }
+        if (next_ns == UINT64_MAX){
+            break;
+        }
+        if (next_ns > get_monotonic_nsecs()){
+            sleep_until(next_ns);
+        }
+    }
+    reader.join();
+    for (int fd : fds){
+        close(fd);
+    }
+}
+
+int main(int argc, char **argv){
+    parse_args(argc, argv);
+    bool open = g_opt.rate > 0;
+    std::vector<Result*> results;
+    for (size_t i = 0; i < g_opt.threads; i++){
+        results.push_back(new Result());
+    }
+
+    uint64_t start_ns = get_monotonic_nsecs();
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < g_opt.threads; i++){
+        if (open){
+            threads.emplace_back(&open_loop, i, start_ns, results[i]);
+        } else {
+            threads.emplace_back(&closed_loop, i, start_ns, results[i]);
+        }
+    }
+    for (std::thread &t : threads){
+        t.join();
+    }
+    double secs = (double)(get_monotonic_nsecs() - start_ns) / 1e9;
+
+    Result* total = new Result();
+    for (Result* r : results){
+        lat_merge(&total->hist, &r->hist);
+        total->errors += r->errors;
+    }
+    uint64_t ops = total->hist.calls;
+    printf("mode        %s\n", open ? "open loop" : "closed loop");
+    printf("requests    %llu in %.2f s, %llu errors\n",
+        (unsigned long long)ops, secs, (unsigned long long)total->errors);
+    printf("throughput  %.0f ops/s\n", (double)ops / secs);
+    printf("latency_us  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+        (double)lat_quantile(&total->hist, 0.5) / 1000,
+        (double)lat_quantile(&total->hist, 0.99) / 1000,
+        (double)lat_quantile(&total->hist, 0.999) / 1000,
+        (double)total->hist.max_ns / 1000);
+    return 0;
+}
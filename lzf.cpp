@@ -0,0 +1,116 @@
+#include <string.h>
+#include "lzf.h"
+
+const uint32_t k_lzf_hlog = 13;         // hash table of the last position of each 3 byte prefix
+const size_t k_lzf_max_lit = 32;
+const size_t k_lzf_max_off = 1<<13;
+const size_t k_lzf_max_ref = 2 + 7 + 255;
+
+static uint32_t lzf_hash(const uint8_t* p){
+    uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    return (v * 2654435761u) >> (32 - k_lzf_hlog);
+}
+
+size_t lzf_compress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap){
+    uint32_t htab[1 << k_lzf_hlog];     // position + 1, 0 is empty
+    memset(htab, 0, sizeof(htab));
+    if (out_cap == 0){
+        return 0;
+    }
+    // the control byte of the pending literal run is at out[op - lit - 1]
+    size_t ip = 0, op = 1, lit = 0;
+    while (ip < in_len){
+        size_t from = 0, len = 0;
+        if (ip + 2 < in_len){
+            uint32_t h = lzf_hash(in + ip);
+            from = htab[h];
+            htab[h] = (uint32_t)(ip + 1);
+        }
+        if (from-- && ip - from <= k_lzf_max_off && memcmp(in + from, in + ip, 3) == 0){
+            size_t max_len = in_len - ip < k_lzf_max_ref ? in_len - ip : k_lzf_max_ref;
+            len = 3;
+            while (len < max_len && in[from + len] == in[ip + len]){
+                len++;
+            }
+        }
+        if (!len){
+            if (op >= out_cap){
+                return 0;
+            }
+            out[op++] = in[ip++];
+            if (++lit == k_lzf_max_lit){
+                out[op - lit - 1] = (uint8_t)(lit - 1);
+                lit = 0;
+                if (op++ >= out_cap){
+                    return 0;
+                }
+            }
+            continue;
+        }
+        // close the literal run, or give back its unused control byte
+        if (lit){
+            out[op - lit - 1] = (uint8_t)(lit - 1);
+            lit = 0;
+        } else {
+            op--;
+        }
+        // the reference and the control byte of the next run
+        if (op + 4 > out_cap){
+            return 0;
+        }
+        size_t off = ip - from - 1;
+        size_t n = len - 2;
+        if (n < 7){
+            out[op++] = (uint8_t)(n << 5 | off >> 8);
+        } else {
+            out[op++] = (uint8_t)(7 << 5 | off >> 8);
+            out[op++] = (uint8_t)(n - 7);
+        }
+        out[op++] = (uint8_t)off;
+        op++;
+        ip += len;
+    }
+    if (lit){
+        out[op - lit - 1] = (uint8_t)(lit - 1);
+    } else {
+        op--;
+    }
+    return op;
+}
+
+bool lzf_decompress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_len){
+    size_t ip = 0, op = 0;
+    while (ip < in_len){
+        uint32_t ctrl = in[ip++];
+        if (ctrl < k_lzf_max_lit){
+            size_t n = ctrl + 1;
+            if (ip + n > in_len || op + n > out_len){
+                return false;
+            }
+            memcpy(out + op, in + ip, n);
+            ip += n;
+            op += n;
+            continue;
+        }
+        size_t len = ctrl >> 5;
+        if (len == 7){
+            if (ip >= in_len){
+                return false;
+            }
+            len += in[ip++];
+        }
+        if (ip >= in_len){
+            return false;
+        }
+        size_t off = ((ctrl & 0x1f) << 8 | in[ip++]) + 1;
+        len += 2;
+        if (off > op || op + len > out_len){
+            return false;
+        }
+        // may overlap, byte by byte on purpose
+        for (size_t i = 0; i < len; i++, op++){
+            out[op] = out[op - off];
+        }
+    }
+    return op == out_len;
+}
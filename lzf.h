@@ -0,0 +1,18 @@
+// 1. LZF, a byte oriented LZ77 with no entropy coding: a few hundred MB/s
+//    either way, for data kept in memory where speed matters more than ratio
+// 2. The stream is a sequence of
+//    literal run := ctrl:u8 (< 32, run length - 1) + bytes
+//    back ref    := ctrl:u8 (len - 2 in the top 3 bits, 7 means another u8
+//                   follows to add, offset - 1 high bits) + [u8] + offset - 1 low byte
+//    back references reach 8KB behind and copy up to 264 bytes
+// 3. Neither side allocates, the caller keeps the uncompressed length
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// returns the compressed length, 0 if it doesn't fit in `out_cap`
+size_t lzf_compress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap);
+// false on a malformed stream or one that doesn't decode to exactly `out_len` bytes
+bool   lzf_decompress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_len);
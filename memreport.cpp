@@ -0,0 +1,111 @@
+#include <algorithm>
+#include "memreport.h"
+#include "commonops.h"
+
+// the lookup key of a prefix
+struct PrefixKey {
+    HNode node;
+    const char* data = nullptr;
+    size_t len = 0;
+};
+
+static bool prefix_eq(HNode* node, HNode* key){
+    MemPrefix* p = container_of(node, MemPrefix, node);
+    PrefixKey* pk = container_of(key, PrefixKey, node);
+    return p->prefix.size() == pk->len && p->prefix.compare(0, pk->len, pk->data, pk->len) == 0;
+}
+
+static MemPrefix* prefix_get(MemReport* r, const char* data, size_t len, bool capped = true){
+    PrefixKey pk;
+    pk.data = data;
+    pk.len = len;
+    pk.node.hval = str_hash((const uint8_t*)data, len);
+    HNode* node = hm_lookup(&r->prefixes, &pk.node, &prefix_eq);
+    if (node){
+        return container_of(node, MemPrefix, node);
+    }
+    if (capped && hm_size(&r->prefixes) >= k_memreport_max_prefixes){
+        return prefix_get(r, "(other)", 7, false);     // one past the cap
+    }
+    MemPrefix* p = new MemPrefix();
+    p->prefix.assign(data, len);
+    p->node.hval = pk.node.hval;
+    hm_insert(&r->prefixes, &p->node);
+    return p;
+}
+
+static bool largest_cmp(const MemKey &a, const MemKey &b){
+    return a.bytes > b.bytes;       // a min heap
+}
+
+void memreport_add(MemReport* r, const std::string &key, uint32_t type, uint64_t bytes){
+    r->taken++;
+    MemStat &t = r->types[type < k_memreport_types ? type : 0];
+    t.keys++;
+    t.bytes += bytes;
+    size_t colon = key.find(':');
+    MemPrefix* p = colon == std::string::npos ? prefix_get(r, "(none)", 6)
+        : prefix_get(r, key.data(), colon + 1);
+    p->stat.keys++;
+    p->stat.bytes += bytes;
+    // the largest keys, each once
+    std::vector<MemKey> &v = r->largest;
+    if (v.size() == k_memreport_largest && bytes <= v.front().bytes){
+        return;
+    }
+    for (const MemKey &k : v){
+        if (k.key == key){
+            return;
+        }
+    }
+    if (v.size() == k_memreport_largest){
+        std::pop_heap(v.begin(), v.end(), &largest_cmp);
+        v.pop_back();
+    }
+    v.push_back(MemKey{key, type, bytes});
+    std::push_heap(v.begin(), v.end(), &largest_cmp);
+}
+
+static bool cb_collect(HNode* node, void* arg){
+    ((std::vector<const MemPrefix*>*) arg)->push_back(container_of(node, MemPrefix, node));
+    return true;
+}
+
+static bool prefix_cmp(const MemPrefix* a, const MemPrefix* b){
+    return a->stat.bytes > b->stat.bytes;
+}
+
+std::vector<const MemPrefix*> memreport_prefixes(MemReport* r, size_t n){
+    std::vector<const MemPrefix*> v;
+    hm_foreach(&r->prefixes, &cb_collect, &v);
+    std::sort(v.begin(), v.end(), &prefix_cmp);
+    if (v.size() > n){
+        v.resize(n);
+    }
+    return v;
+}
+
+std::vector<MemKey> memreport_largest(const MemReport* r){
+    std::vector<MemKey> v = r->largest;
+    std::sort(v.begin(), v.end(), &largest_cmp);
+    return v;
+}
+
+static void cb_free_prefix(HNode* node, void*){
+    delete container_of(node, MemPrefix, node);
+}
+
+void memreport_clear(MemReport* r){
+    hm_dispose(&r->prefixes, (size_t)-1, &cb_free_prefix, nullptr);
+    *r = MemReport();
+}
+
+void memreport_restart(MemReport* r){
+    MemReport kept;
+    kept.nkeys = r->nkeys;
+    kept.samples = r->samples;
+    kept.start_us = r->start_us;
+    kept.exact = r->exact;
+    memreport_clear(r);
+    *r = kept;
+}
@@ -0,0 +1,61 @@
+// 1. MEMORY REPORT estimates where the memory goes from a random sample of
+//    keys scaled to the whole keyspace: bytes by type, by key prefix (up to
+//    and including the first ':') and the largest keys seen
+// 2. The server draws the sample a slice at a time under a time budget,
+//    the client waiting meanwhile, so a large keyspace takes more loop
+//    iterations rather than a longer one; this file only aggregates
+// 3. Keys are drawn with replacement and a key drawn twice counts twice,
+//    the largest keys are kept distinct; a keyspace no larger than the
+//    sample is walked instead, each key counted once (`exact`)
+// 4. Past k_memreport_max_prefixes distinct prefixes the new ones are
+//    counted under "(other)", keys without a ':' under "(none)"
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "hashtable.h"
+
+const uint32_t k_memreport_types = 8;           // entry types, by their number
+const size_t k_memreport_max_prefixes = 1024;
+const size_t k_memreport_largest = 10;          // keys kept
+
+struct MemStat {
+    uint64_t keys = 0;
+    uint64_t bytes = 0;
+};
+
+struct MemKey {
+    std::string key;
+    uint32_t type = 0;
+    uint64_t bytes = 0;
+};
+
+struct MemPrefix {
+    HNode node;
+    std::string prefix;
+    MemStat stat;
+};
+
+struct MemReport {
+    uint64_t nkeys = 0;             // in the keyspace when it started
+    uint64_t samples = 0;           // wanted
+    uint64_t taken = 0;
+    uint64_t start_us = 0;
+    bool exact = false;             // walked rather than sampled
+    MemStat types[k_memreport_types];
+    HMap prefixes;                  // of MemPrefix
+    std::vector<MemKey> largest;    // a min heap on `bytes`
+};
+
+void memreport_add(MemReport* r, const std::string &key, uint32_t type, uint64_t bytes);
+// the `n` prefixes holding the most bytes, the largest first
+std::vector<const MemPrefix*> memreport_prefixes(MemReport* r, size_t n);
+// the largest keys, the largest first
+std::vector<MemKey> memreport_largest(const MemReport* r);
+// back to an empty report
+void memreport_clear(MemReport* r);
+// drops what was counted, for a walk starting over
+void memreport_restart(MemReport* r);
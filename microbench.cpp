@@ -0,0 +1,616 @@
+// microbenchmarks for the core data structures: the hash table, the AVL
+// tree, the zset and the TTL heap
+//   g++ -O2 -std=gnu++17 microbench.cpp hashtable.cpp avl.cpp zset.cpp cache.cpp -o microbench
+//   ./microbench [--sizes 1000,1000000] [--suites hm,avl,zset,heap]
+//                [--dists uniform,zipf] [--ops 1000000] [--zipf-s 0.99]
+// 1. Every (suite, size, key distribution) builds its structure, then times
+//    each operation over `--ops` keys drawn beforehand, so the generator
+//    isn't measured; inserts, deletes and scans cover all `n` elements
+// 2. One line per measurement, `key=value` pairs in a fixed order, so two
+//    runs can be diffed or loaded into anything that splits on spaces
+// 3. Cache misses and branch mispredicts per op come from perf_event_open
+//    when the kernel allows it (perf_event_paranoid, containers), "na" if not
+// 4. Sizes up to 10^8 work given the memory, about 40 bytes per element for
+//    the hash table and the tree, twice that for the zset
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "hashtable.h"
+#include "avl.h"
+#include "zset.h"
+#include "cache.h"
+#include "commonops.h"
+
+static struct {
+    std::vector<size_t> sizes = {1000, 10000, 100000, 1000000};
+    std::vector<std::string> suites = {"hm", "avl", "zset", "heap"};
+    std::vector<std::string> dists = {"uniform", "zipf"};
+    size_t ops = 1000000;
+    double zipf_s = 0.99;
+} g_opt;
+
+static uint64_t g_rng = 0x853c49e6748fea9bull;
+
+// splitmix64
+static uint64_t mix64(uint64_t z){
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static uint64_t rnd(){
+    return mix64(g_rng += 0x9E3779B97F4A7C15ull);
+}
+
+static double rnd01(){
+    return (double)(rnd() >> 11) / (double)(1ull << 53);
+}
+
+//================================== key distributions ==================================//
+
+/*
+    Zipf over [1, n] by rejection-inversion (Hörmann and Derflinger), constant
+    memory and time per sample, so it works for 10^8 keys without a table
+*/
+struct Zipf {
+    double s = 0;
+    double n = 0;
+    double h_x1 = 0;        // H(1.5) - 1
+    double h_n = 0;         // H(n + 0.5)
+    double sv = 0;
+};
+
+static double zipf_helper1(double x){
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0/3 - 0.25 * x));
+}
+
+static double zipf_helper2(double x){
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+}
+
+static double zipf_h(const Zipf &z, double x){
+    return exp(-z.s * log(x));
+}
+
+static double zipf_hint(const Zipf &z, double x){
+    double lx = log(x);
+    return zipf_helper2((1 - z.s) * lx) * lx;
+}
+
+static double zipf_hint_inv(const Zipf &z, double x){
+    double t = x * (1 - z.s);
+    t = t < -1 ? -1 : t;
+    return exp(zipf_helper1(t) * x);
+}
+
+static void zipf_init(Zipf &z, size_t n, double s){
+    z.s = s;
+    z.n = (double)n;
+    z.h_x1 = zipf_hint(z, 1.5) - 1;
+    z.h_n = zipf_hint(z, z.n + 0.5);
+    z.sv = 2 - zipf_hint_inv(z, zipf_hint(z, 2.5) - zipf_h(z, 2));
+}
+
+static size_t zipf_next(const Zipf &z){
+    while (true){
+        double u = z.h_n + rnd01() * (z.h_x1 - z.h_n);
+        double x = zipf_hint_inv(z, u);
+        double k = floor(x + 0.5);
+        k = k < 1 ? 1 : (k > z.n ? z.n : k);
+        if (k - x <= z.sv || u >= zipf_hint(z, k + 0.5) - zipf_h(z, k)){
+            return (size_t)k;
+        }
+    }
+}
+
+// `ops` element indices in [0, n), the popular ones of zipf scattered
+static std::vector<size_t> draw_keys(const std::string &dist, size_t n, size_t ops){
+    std::vector<size_t> keys(ops);
+    if (dist == "uniform"){
+        for (size_t &k : keys){
+            k = rnd() % n;
+        }
+        return keys;
+    }
+    Zipf z;
+    zipf_init(z, n, g_opt.zipf_s);
+    for (size_t &k : keys){
+        k = mix64(zipf_next(z)) % n;
+    }
+    return keys;
+}
+
+// 0..n-1 shuffled
+static std::vector<size_t> permutation(size_t n){
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++){
+        order[i] = i;
+    }
+    for (size_t i = n; i > 1; i--){
+        std::swap(order[i-1], order[rnd() % i]);
+    }
+    return order;
+}
+
+//================================== measurement ==================================//
+
+static struct {
+    int cache_fd = -1;
+    int branch_fd = -1;
+    const char *suite = "";
+    const char *dist = "";
+    size_t n = 0;
+    uint64_t start_ns = 0;
+    uint64_t sink = 0;      // results fed here so the loops aren't optimised out
+} g_run;
+
+static int perf_open(uint64_t config){
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perf_init(){
+    g_run.cache_fd = perf_open(PERF_COUNT_HW_CACHE_MISSES);
+    g_run.branch_fd = perf_open(PERF_COUNT_HW_BRANCH_MISSES);
+}
+
+static void counter_start(int fd){
+    if (fd >= 0){
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+// per op, or "na"
+static std::string counter_stop(int fd, size_t ops){
+    uint64_t val = 0;
+    if (fd < 0){
+        return "na";
+    }
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &val, sizeof(val)) != sizeof(val)){
+        return "na";
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3f", (double)val / (double)ops);
+    return buf;
+}
+
+static void bench_start(){
+    counter_start(g_run.cache_fd);
+    counter_start(g_run.branch_fd);
+    g_run.start_ns = get_monotonic_nsecs();
+}
+
+static void bench_stop(const char *op, size_t ops){
+    uint64_t ns = get_monotonic_nsecs() - g_run.start_ns;
+    std::string cache = counter_stop(g_run.cache_fd, ops);
+    std::string branch = counter_stop(g_run.branch_fd, ops);
+    printf("suite=%s op=%s dist=%s n=%zu ops=%zu ns_per_op=%.2f cache_misses_per_op=%s branch_misses_per_op=%s\n",
+        g_run.suite, op, g_run.dist, g_run.n, ops, (double)ns / (double)ops, cache.c_str(), branch.c_str());
+    fflush(stdout);
+}
+
+//================================== hash table ==================================//
+
+struct HKey {
+    HNode node;
+    uint64_t key = 0;
+};
+
+static bool hkey_eq(HNode* lhs, HNode* rhs){
+    return container_of(lhs, HKey, node)->key == container_of(rhs, HKey, node)->key;
+}
+
+static void hkey_init(HKey &k, uint64_t key){
+    k.node.next = nullptr;
+    k.node.hval = mix64(key);
+    k.key = key;
+}
+
+static bool cb_count(HNode*, void* arg){
+    (*(size_t*)arg)++;
+    return true;
+}
+
+static void bench_hm(const std::vector<size_t> &keys){
+    size_t n = g_run.n;
+    std::vector<HKey> nodes(n);
+    for (size_t i = 0; i < n; i++){
+        hkey_init(nodes[i], i);
+    }
+    HMap map;
+    bench_start();
+    for (size_t i = 0; i < n; i++){
+        hm_insert(&map, &nodes[i].node);
+    }
+    bench_stop("insert", n);
+
+    HKey probe;
+    bench_start();
+    for (size_t k : keys){
+        hkey_init(probe, k);
+        g_run.sink += hm_lookup(&map, &probe.node, &hkey_eq) != nullptr;
+    }
+    bench_stop("lookup_hit", keys.size());
+
+    bench_start();
+    for (size_t k : keys){
+        hkey_init(probe, k + n);
+        g_run.sink += hm_lookup(&map, &probe.node, &hkey_eq) != nullptr;
+    }
+    bench_stop("lookup_miss", keys.size());
+
+    // 90% lookups, 10% delete and insert back, the size stays put
+    bench_start();
+    for (size_t i = 0; i < keys.size(); i++){
+        hkey_init(probe, keys[i]);
+        if (i % 10 == 0){
+            HNode* node = hm_delete(&map, &probe.node, &hkey_eq);
+            hm_insert(&map, node);
+        } else {
+            g_run.sink += hm_lookup(&map, &probe.node, &hkey_eq) != nullptr;
+        }
+    }
+    bench_stop("mixed", keys.size());
+
+    size_t count = 0;
+    bench_start();
+    hm_foreach(&map, &cb_count, &count);
+    bench_stop("scan", n);
+    g_run.sink += count;
+
+    std::vector<size_t> order = permutation(n);
+    bench_start();
+    for (size_t i : order){
+        hm_delete(&map, &nodes[i].node, &hkey_eq);
+    }
+    bench_stop("delete", n);
+    hm_clear(&map);
+}
+
+//================================== AVL tree ==================================//
+
+// keys are even so odd ones miss
+struct TNode {
+    AVLNode tree;
+    uint64_t key = 0;
+};
+
+static TNode* tnode(AVLNode* node){
+    return container_of(node, TNode, tree);
+}
+
+static AVLNode* tree_insert(AVLNode* root, TNode* node){
+    AVLNode* parent = nullptr;
+    AVLNode** from = &root;
+    while (*from){
+        parent = *from;
+        from = node->key < tnode(parent)->key ? &parent->left : &parent->right;
+    }
+    avl_init(&node->tree);
+    *from = &node->tree;
+    node->tree.parent = parent;
+    return avl_balance(&node->tree);
+}
+
+static AVLNode* tree_find(AVLNode* node, uint64_t key){
+    while (node && tnode(node)->key != key){
+        node = key < tnode(node)->key ? node->left : node->right;
+    }
+    return node;
+}
+
+static void bench_avl(const std::vector<size_t> &keys){
+    size_t n = g_run.n;
+    std::vector<TNode> nodes(n);
+    for (size_t i = 0; i < n; i++){
+        nodes[i].key = 2*i;
+    }
+    std::vector<size_t> order = permutation(n);
+    AVLNode* root = nullptr;
+    bench_start();
+    for (size_t i : order){
+        root = tree_insert(root, &nodes[i]);
+    }
+    bench_stop("insert", n);
+
+    bench_start();
+    for (size_t k : keys){
+        g_run.sink += tree_find(root, 2*k) != nullptr;
+    }
+    bench_stop("lookup_hit", keys.size());
+
+    bench_start();
+    for (size_t k : keys){
+        g_run.sink += tree_find(root, 2*k + 1) != nullptr;
+    }
+    bench_stop("lookup_miss", keys.size());
+
+    bench_start();
+    for (size_t k : keys){
+        g_run.sink += (uint64_t)avl_rank(&nodes[k].tree);
+    }
+    bench_stop("rank", keys.size());
+
+    // up to 1000 places either way
+    bench_start();
+    for (size_t i = 0; i < keys.size(); i++){
+        int64_t delta = (int64_t)(mix64(i) % 2001) - 1000;
+        g_run.sink += avl_offset(&nodes[keys[i]].tree, delta) != nullptr;
+    }
+    bench_stop("offset", keys.size());
+
+    // 100 successors from each key, per node visited
+    size_t visited = 0;
+    bench_start();
+    for (size_t i = 0; i < keys.size(); i += 100){
+        AVLNode* node = &nodes[keys[i]].tree;
+        for (size_t j = 0; j < 100 && node; j++, visited++){
+            g_run.sink += tnode(node)->key;
+            node = avl_offset(node, +1);
+        }
+    }
+    bench_stop("range_scan", visited ? visited : 1);
+
+    // 90% lookups, 10% delete and insert back
+    bench_start();
+    for (size_t i = 0; i < keys.size(); i++){
+        if (i % 10 == 0){
+            TNode* node = &nodes[keys[i]];
+            root = avl_del(&node->tree);
+            root = tree_insert(root, node);
+        } else {
+            g_run.sink += tree_find(root, 2*keys[i]) != nullptr;
+        }
+    }
+    bench_stop("mixed", keys.size());
+
+    order = permutation(n);
+    bench_start();
+    for (size_t i : order){
+        root = avl_del(&nodes[i].tree);
+    }
+    bench_stop("delete", n);
+}
+
+//================================== zset ==================================//
+
+// "m<i>", fast enough not to dominate what is measured
+static size_t member_name(char* buf, uint64_t i){
+    char tmp[24];
+    size_t len = 0;
+    do {
+        tmp[len++] = (char)('0' + i % 10);
+        i /= 10;
+    } while (i);
+    buf[0] = 'm';
+    for (size_t j = 0; j < len; j++){
+        buf[1 + j] = tmp[len - 1 - j];
+    }
+    return len + 1;
+}
+
+static void bench_zset(const std::vector<size_t> &keys){
+    size_t n = g_run.n;
+    ZSet zset;
+    char name[32];
+    std::vector<size_t> order = permutation(n);
+    bench_start();
+    for (size_t i : order){
+        size_t len = member_name(name, i);
+        zset_insert(&zset, name, len, (double)mix64(i) / (double)UINT64_MAX);
+    }
+    bench_stop("insert", n);
+
+    bench_start();
+    for (size_t k : keys){
+        size_t len = member_name(name, k);
+        g_run.sink += zset_lookup(&zset, name, len) != nullptr;
+    }
+    bench_stop("lookup_hit", keys.size());
+
+    bench_start();
+    for (size_t k : keys){
+        size_t len = member_name(name, k + n);
+        g_run.sink += zset_lookup(&zset, name, len) != nullptr;
+    }
+    bench_stop("lookup_miss", keys.size());
+
+    std::vector<ZNode*> found(keys.size());
+    for (size_t i = 0; i < keys.size(); i++){
+        size_t len = member_name(name, keys[i]);
+        found[i] = zset_lookup(&zset, name, len);
+    }
+    bench_start();
+    for (ZNode* node : found){
+        g_run.sink += (uint64_t)avl_rank(&node->tree);
+    }
+    bench_stop("rank", found.size());
+
+    bench_start();
+    for (size_t i = 0; i < found.size(); i++){
+        int64_t delta = (int64_t)(mix64(i) % 2001) - 1000;
+        g_run.sink += znode_offset(found[i], delta) != nullptr;
+    }
+    bench_stop("offset", found.size());
+
+    // ZQUERY: seek a score, then 10 members from there
+    bench_start();
+    for (size_t k : keys){
+        ZNode* node = zset_seekge(&zset, (double)mix64(k + n) / (double)UINT64_MAX, "", 0);
+        for (size_t j = 0; j < 10 && node; j++){
+            g_run.sink += node->len;
+            node = znode_offset(node, +1);
+        }
+    }
+    bench_stop("range_query", keys.size());
+
+    // 70% lookups, 20% score updates, 10% range queries
+    bench_start();
+    for (size_t i = 0; i < keys.size(); i++){
+        size_t len = member_name(name, keys[i]);
+        uint64_t r = i % 10;
+        if (r < 7){
+            g_run.sink += zset_lookup(&zset, name, len) != nullptr;
+        } else if (r < 9){
+            zset_insert(&zset, name, len, rnd01());
+        } else {
+            ZNode* node = zset_seekge(&zset, rnd01(), "", 0);
+            for (size_t j = 0; j < 10 && node; j++){
+                node = znode_offset(node, +1);
+            }
+        }
+    }
+    bench_stop("mixed", keys.size());
+
+    bench_start();
+    for (size_t i : order){
+        size_t len = member_name(name, i);
+        zset_delete(&zset, zset_lookup(&zset, name, len));
+    }
+    bench_stop("delete", n);
+    zset_clear(&zset);
+}
+
+//================================== TTL heap ==================================//
+
+// stands in for Entry, only `heap_idx` is touched
+struct Timer {
+    size_t heap_idx = -1;
+    uint64_t pad[3];
+};
+
+static void bench_heap(const std::vector<size_t> &keys){
+    size_t n = g_run.n;
+    std::vector<Timer> timers(n);
+    std::vector<size_t> order = permutation(n);
+    HeapArray heap;
+    bench_start();
+    for (size_t i : order){
+        Timer &t = timers[i];
+        heap_upsert(heap, t.heap_idx, HeapNode{rnd() % (n*16), &t.heap_idx});
+    }
+    bench_stop("insert", n);
+
+    // EXPIRE on a key that has a TTL
+    bench_start();
+    for (size_t k : keys){
+        Timer &t = timers[k];
+        heap_upsert(heap, t.heap_idx, HeapNode{rnd() % (n*16), &t.heap_idx});
+    }
+    bench_stop("update", keys.size());
+
+    // 80% updates, 20% expiry of the top, put back with a later deadline
+    bench_start();
+    for (size_t i = 0; i < keys.size(); i++){
+        if (i % 5 == 0){
+            size_t* ref = heap[0].ref;
+            uint64_t ttl = heap[0].ttl_val + n*16;
+            heap_delete(heap, 0);
+            *ref = -1;
+            heap_upsert(heap, *ref, HeapNode{ttl, ref});
+        } else {
+            Timer &t = timers[keys[i]];
+            heap_upsert(heap, t.heap_idx, HeapNode{rnd() % (n*16), &t.heap_idx});
+        }
+    }
+    bench_stop("mixed", keys.size());
+
+    bench_start();
+    while (!heap.empty()){
+        *heap[0].ref = -1;
+        heap_delete(heap, 0);
+    }
+    bench_stop("delete_min", n);
+}
+
+//================================== main ==================================//
+
+static std::vector<std::string> split(const char *s){
+    std::vector<std::string> out;
+    std::string str = s;
+    size_t pos = 0;
+    while (pos <= str.size()){
+        size_t comma = str.find(',', pos);
+        comma = comma == std::string::npos ? str.size() : comma;
+        if (comma > pos){
+            out.push_back(str.substr(pos, comma - pos));
+        }
+        pos = comma + 1;
+    }
+    return out;
+}
+
+static void parse_args(int argc, char **argv){
+    for (int i = 1; i + 1 < argc; i += 2){
+        std::string name = argv[i];
+        const char *val = argv[i+1];
+        if (name == "--sizes"){
+            g_opt.sizes.clear();
+            for (const std::string &s : split(val)){
+                g_opt.sizes.push_back((size_t)strtod(s.c_str(), nullptr));
+            }
+        } else if (name == "--suites"){
+            g_opt.suites = split(val);
+        } else if (name == "--dists"){
+            g_opt.dists = split(val);
+        } else if (name == "--ops"){
+            g_opt.ops = (size_t)strtod(val, nullptr);
+        } else if (name == "--zipf-s"){
+            g_opt.zipf_s = atof(val);
+        } else {
+            fprintf(stderr, "microbench: unknown option %s\n", name.c_str());
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char **argv){
+    parse_args(argc, argv);
+    perf_init();
+    if (g_run.cache_fd < 0){
+        fprintf(stderr, "microbench: no hardware counters, see perf_event_paranoid\n");
+    }
+    for (const std::string &suite : g_opt.suites){
+        void (*fn)(const std::vector<size_t> &) =
+            suite == "hm" ? &bench_hm : suite == "avl" ? &bench_avl :
+            suite == "zset" ? &bench_zset : suite == "heap" ? &bench_heap : nullptr;
+        if (!fn){
+            fprintf(stderr, "microbench: unknown suite %s\n", suite.c_str());
+            return 1;
+        }
+        for (size_t n : g_opt.sizes){
+            for (const std::string &dist : g_opt.dists){
+                if (dist != "uniform" && dist != "zipf"){
+                    fprintf(stderr, "microbench: unknown distribution %s\n", dist.c_str());
+                    return 1;
+                }
+                g_run.suite = suite.c_str();
+                g_run.dist = dist.c_str();
+                g_run.n = n;
+                fn(draw_keys(dist, n, g_opt.ops));
+            }
+        }
+    }
+    // keeps `sink` alive
+    fprintf(stderr, "microbench: done (%llu)\n", (unsigned long long)(g_run.sink & 1));
+    return 0;
+}
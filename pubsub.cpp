@@ -0,0 +1,262 @@
+#include "pubsub.h"
+#include "hashtable.h"
+#include "commonops.h"
+
+struct PubSubChannel {
+    HNode node;
+    std::string name;
+    std::vector<PubSubClient*> subs;
+};
+
+struct PubSubPattern {
+    std::string pattern;
+    std::vector<PubSubClient*> subs;
+};
+
+static struct {
+    HMap channels;
+    std::vector<PubSubPattern> patterns;
+} g_pubsub;
+
+//===============================helpers===============================//
+
+// the lookup key of a channel name
+struct ChannelKey {
+    HNode node;
+    const std::string* name = nullptr;
+};
+
+static bool channel_eq(HNode* node, HNode* key){
+    PubSubChannel* ch = container_of(node, PubSubChannel, node);
+    ChannelKey* ck = container_of(key, ChannelKey, node);
+    return ch->name == *ck->name;
+}
+
+static void channel_key(ChannelKey* ck, const std::string &name){
+    ck->name = &name;
+    ck->node.hval = str_hash((const uint8_t*)name.data(), name.size());
+}
+
+static PubSubChannel* channel_find(const std::string &name){
+    ChannelKey ck;
+    channel_key(&ck, name);
+    HNode* node = hm_lookup(&g_pubsub.channels, &ck.node, &channel_eq);
+    return node ? container_of(node, PubSubChannel, node) : nullptr;
+}
+
+static PubSubPattern* pattern_find(const std::string &pattern){
+    for (PubSubPattern &p : g_pubsub.patterns){
+        if (p.pattern == pattern){
+            return &p;
+        }
+    }
+    return nullptr;
+}
+
+// the order doesn't matter, the last one takes the place of the removed one
+template <class T>
+static bool vec_remove(std::vector<T> &v, const T &item){
+    for (size_t i = 0; i < v.size(); i++){
+        if (v[i] == item){
+            v[i] = v.back();
+            v.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool vec_has(const std::vector<std::string> &v, const std::string &item){
+    for (const std::string &s : v){
+        if (s == item){
+            return true;
+        }
+    }
+    return false;
+}
+
+//===============================interface===============================//
+
+bool pubsub_subscribe(PubSubClient* c, const std::string &channel){
+    if (vec_has(c->channels, channel)){
+        return false;
+    }
+    PubSubChannel* ch = channel_find(channel);
+    if (!ch){
+        ch = new PubSubChannel();
+        ch->name = channel;
+        ch->node.hval = str_hash((const uint8_t*)channel.data(), channel.size());
+        hm_insert(&g_pubsub.channels, &ch->node);
+    }
+    ch->subs.push_back(c);
+    c->channels.push_back(channel);
+    return true;
+}
+
+bool pubsub_unsubscribe(PubSubClient* c, const std::string &channel){
+    if (!vec_remove(c->channels, channel)){
+        return false;
+    }
+    PubSubChannel* ch = channel_find(channel);
+    vec_remove(ch->subs, c);
+    if (ch->subs.empty()){
+        ChannelKey ck;
+        channel_key(&ck, channel);
+        hm_delete(&g_pubsub.channels, &ck.node, &channel_eq);
+        delete ch;
+    }
+    return true;
+}
+
+bool pubsub_psubscribe(PubSubClient* c, const std::string &pattern){
+    if (vec_has(c->patterns, pattern)){
+        return false;
+    }
+    PubSubPattern* p = pattern_find(pattern);
+    if (!p){
+        g_pubsub.patterns.push_back(PubSubPattern());
+        p = &g_pubsub.patterns.back();
+        p->pattern = pattern;
+    }
+    p->subs.push_back(c);
+    c->patterns.push_back(pattern);
+    return true;
+}
+
+bool pubsub_punsubscribe(PubSubClient* c, const std::string &pattern){
+    if (!vec_remove(c->patterns, pattern)){
+        return false;
+    }
+    PubSubPattern* p = pattern_find(pattern);
+    vec_remove(p->subs, c);
+    if (p->subs.empty()){
+        std::vector<PubSubPattern> &v = g_pubsub.patterns;
+        v[p - v.data()] = std::move(v.back());
+        v.pop_back();
+    }
+    return true;
+}
+
+void pubsub_forget(PubSubClient* c){
+    while (!c->channels.empty()){
+        std::string name = c->channels.back();
+        pubsub_unsubscribe(c, name);
+    }
+    while (!c->patterns.empty()){
+        std::string pattern = c->patterns.back();
+        pubsub_punsubscribe(c, pattern);
+    }
+}
+
+size_t pubsub_count(const PubSubClient* c){
+    return c->channels.size() + c->patterns.size();
+}
+
+size_t pubsub_publish(const std::string &channel,
+    void (*f)(PubSubClient* c, const std::string* pattern, void* arg), void* arg)
+{
+    size_t n = 0;
+    PubSubChannel* ch = channel_find(channel);
+    if (ch){
+        for (PubSubClient* c : ch->subs){
+            f(c, nullptr, arg);
+        }
+        n += ch->subs.size();
+    }
+    for (PubSubPattern &p : g_pubsub.patterns){
+        if (!glob_match(p.pattern.data(), p.pattern.size(), channel.data(), channel.size())){
+            continue;
+        }
+        for (PubSubClient* c : p.subs){
+            f(c, &p.pattern, arg);
+        }
+        n += p.subs.size();
+    }
+    return n;
+}
+
+size_t pubsub_nchannels(){
+    return hm_size(&g_pubsub.channels);
+}
+
+size_t pubsub_npatterns(){
+    return g_pubsub.patterns.size();
+}
+
+//===============================glob===============================//
+
+// matches the class starting after `[` at `*pi`, which is left past the `]`
+static bool glob_class(const char* pat, size_t plen, size_t* pi, char c){
+    size_t i = *pi;
+    bool negate = i < plen && pat[i] == '^';
+    i += negate;
+    bool found = false;
+    for (; i < plen && pat[i] != ']'; i++){
+        char lo = pat[i];
+        if (lo == '\\' && i + 1 < plen){
+            lo = pat[++i];
+        }
+        char hi = lo;
+        if (i + 2 < plen && pat[i + 1] == '-' && pat[i + 2] != ']'){
+            hi = pat[i + 2];
+            i += 2;
+            if (hi == '\\' && i + 1 < plen){
+                hi = pat[++i];
+            }
+            if (lo > hi){
+                char t = lo; lo = hi; hi = t;
+            }
+        }
+        found |= c >= lo && c <= hi;
+    }
+    *pi = i < plen ? i + 1 : i;     // an unclosed class runs to the end
+    return found != negate;
+}
+
+// iterative, a `*` remembers where to resume from so a mismatch after it
+// retries one character further instead of recursing
+bool glob_match(const char* pat, size_t plen, const char* str, size_t slen){
+    size_t pi = 0, si = 0;
+    size_t star_pi = (size_t)-1, star_si = 0;
+    while (si < slen){
+        if (pi < plen){
+            char pc = pat[pi];
+            if (pc == '*'){
+                star_pi = ++pi;
+                star_si = si;
+                continue;
+            }
+            if (pc == '?'){
+                pi++;
+                si++;
+                continue;
+            }
+            if (pc == '['){
+                size_t next = pi + 1;
+                if (glob_class(pat, plen, &next, str[si])){
+                    pi = next;
+                    si++;
+                    continue;
+                }
+            } else {
+                if (pc == '\\' && pi + 1 < plen){
+                    pc = pat[++pi];
+                }
+                if (pc == str[si]){
+                    pi++;
+                    si++;
+                    continue;
+                }
+            }
+        }
+        if (star_pi == (size_t)-1){
+            return false;
+        }
+        pi = star_pi;
+        si = ++star_si;
+    }
+    while (pi < plen && pat[pi] == '*'){
+        pi++;
+    }
+    return pi == plen;
+}
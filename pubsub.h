@@ -0,0 +1,38 @@
+// 1. The channel and pattern subscriptions, the delivery is up to the server:
+//    each subscriber is a PubSubClient embedded in its connection, the
+//    channels map to the list of their subscribers and the connection keeps
+//    the names it is subscribed to, for unsubscribing everything at once
+// 2. A publish visits the subscribers of the channel, then every pattern in
+//    turn, so the server builds one message per pattern and shares it with
+//    all the subscribers of that pattern
+// 3. Patterns are globs: `*`, `?`, `[abc]`, `[a-z]`, `[^a]` and `\` escapes;
+//    they are few in practice and are matched one by one on each publish
+
+#pragma once
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+struct PubSubClient {
+    std::vector<std::string> channels;
+    std::vector<std::string> patterns;
+};
+
+// false if it already was subscribed, or wasn't for the unsubscribes
+bool   pubsub_subscribe(PubSubClient* c, const std::string &channel);
+bool   pubsub_unsubscribe(PubSubClient* c, const std::string &channel);
+bool   pubsub_psubscribe(PubSubClient* c, const std::string &pattern);
+bool   pubsub_punsubscribe(PubSubClient* c, const std::string &pattern);
+// drops all the subscriptions of a closing connection
+void   pubsub_forget(PubSubClient* c);
+size_t pubsub_count(const PubSubClient* c);
+// invokes the callback on the subscribers of `channel`, then on those of each
+// matching pattern with that pattern, null for the channel itself; returns
+// the number of calls
+size_t pubsub_publish(const std::string &channel,
+            void (*f)(PubSubClient* c, const std::string* pattern, void* arg), void* arg);
+size_t pubsub_nchannels();
+size_t pubsub_npatterns();
+
+bool   glob_match(const char* pat, size_t plen, const char* str, size_t slen);
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "repl.h"
+#include "commonops.h"
+
+std::string repl_new_id(){
+    uint8_t rnd[k_replid_len/2] = {};
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, rnd, sizeof(rnd)) != (ssize_t)sizeof(rnd)){
+        // not secret, only has to differ between histories
+        uint64_t seed = get_monotonic_usecs() ^ ((uint64_t)getpid() << 32);
+        for (size_t i = 0; i < sizeof(rnd); i++){
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            rnd[i] = (uint8_t)(seed >> 56);
+        }
+    }
+    if (fd >= 0){
+        close(fd);
+    }
+    std::string id;
+    char hex[3];
+    for (uint8_t c : rnd){
+        snprintf(hex, sizeof(hex), "%02x", c);
+        id += hex;
+    }
+    return id;
+}
+
+void backlog_reset(ReplBacklog* b, size_t size, uint64_t offset){
+    b->ring.assign(size, 0);
+    b->head = 0;
+    b->start = b->end = offset;
+}
+
+void backlog_resize(ReplBacklog* b, size_t size){
+    uint64_t keep = b->end - b->start < size ? b->end - b->start : size;
+    std::vector<uint8_t> tail;
+    backlog_copy(b, b->end - keep, tail);
+    b->ring.assign(size, 0);
+    memcpy(b->ring.data(), tail.data(), (size_t)keep);
+    b->head = (size_t)keep % size;
+    b->start = b->end - keep;
+}
+
+void backlog_feed(ReplBacklog* b, const uint8_t* data, size_t len){
+    size_t size = b->ring.size();
+    if (size == 0){
+        return;
+    }
+    b->end += len;
+    // only the last `size` bytes can be kept
+    if (len > size){
+        data += len - size;
+        len = size;
+    }
+    while (len > 0){
+        size_t n = size - b->head < len ? size - b->head : len;
+        memcpy(&b->ring[b->head], data, n);
+        b->head = (b->head + n) % size;
+        data += n;
+        len -= n;
+    }
+    if (b->end - b->start > size){
+        b->start = b->end - size;
+    }
+}
+
+bool backlog_has(const ReplBacklog* b, uint64_t offset){
+    return !b->ring.empty() && offset >= b->start && offset <= b->end;
+}
+
+void backlog_copy(const ReplBacklog* b, uint64_t offset, std::vector<uint8_t>& out){
+    size_t size = b->ring.size();
+    size_t len = (size_t)(b->end - offset);
+    // the newest byte is just before `head`, and `len` is at most `size`
+    size_t pos = (b->head + size - len) % size;
+    while (len > 0){
+        size_t n = size - pos < len ? size - pos : len;
+        out.insert(out.end(), &b->ring[pos], &b->ring[pos] + n);
+        pos = (pos + n) % size;
+        len -= n;
+    }
+}
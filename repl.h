@@ -0,0 +1,34 @@
+// 1. The replication stream is the sequence of write commands as request
+//    messages, the same frames the append-only log holds; a byte offset into
+//    it identifies how far a replica got, together with the id of the history
+// 2. The backlog keeps the tail of the stream in a fixed size ring, so a
+//    replica that reconnects with an offset still in the ring continues from
+//    there (partial resync) instead of taking a full snapshot again
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+const size_t k_replid_len = 40;
+
+struct ReplBacklog {
+    std::vector<uint8_t> ring;
+    size_t head = 0;            // where the next byte goes
+    uint64_t start = 0;         // stream offset of the oldest byte held
+    uint64_t end = 0;           // stream offset after the newest byte
+};
+
+// a random id for a new history
+std::string repl_new_id();
+// empties the backlog and starts it at `offset`
+void backlog_reset(ReplBacklog* b, size_t size, uint64_t offset);
+// changes the size of a started backlog, keeping as much of its tail as fits
+void backlog_resize(ReplBacklog* b, size_t size);
+void backlog_feed(ReplBacklog* b, const uint8_t* data, size_t len);
+// whether the stream can be served from `offset` on
+bool backlog_has(const ReplBacklog* b, uint64_t offset);
+// appends the stream from `offset` to the end
+void backlog_copy(const ReplBacklog* b, uint64_t offset, std::vector<uint8_t>& out);
@@ -0,0 +1,353 @@
+// replays a traffic capture (see capture.h and CAPTURE START) against a server
+//   g++ -O2 -std=gnu++17 -pthread replay.cpp rwloop.cpp latency.cpp -o replay
+//   ./replay capture.bin [--host 127.0.0.1] [--port 1234] [--speed 1 | --speed max]
+//            [--conns 256] [--window 64]
+// 1. Each captured connection is replayed on a connection of its own, with
+//    its requests in their original order; above --conns captured
+//    connections share the replay connections by id, merged by time
+// 2. --speed 1 keeps the captured timing, 2 plays it twice as fast and so
+//    on; requests are sent when due whatever the server does (open loop)
+//    and latency runs from when they were due, as in loadgen.cpp
+// 3. --speed max sends as fast as the server answers, with at most --window
+//    requests outstanding per connection, latency runs from the send
+// 4. The keyspace is not part of the capture, start the server from the
+//    snapshot the capture was taken against to get the same hits and misses
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "rwloop.h"
+#include "latency.h"
+#include "capture.h"
+#include "commonops.h"
+
+const size_t k_max_reply = 32<<20;
+const size_t k_send_batch = 64;     // due requests written at once
+
+static struct {
+    std::string path;
+    std::string host = "127.0.0.1";
+    uint32_t port = 1234;
+    double speed = 1;               // 0 for max
+    uint32_t conns = 256;
+    uint32_t window = 64;
+} g_opt;
+
+// a request of the capture
+struct Rec {
+    uint64_t t_us = 0;              // capture clock
+    size_t pos = 0;                 // of its frame in the file
+    uint32_t size = 0;
+};
+
+// a replay connection
+struct Slot {
+    std::vector<Rec> recs;
+    std::vector<uint64_t> sent_ns;  // for --speed max
+    size_t acked = 0;               // replies read, under `mu`
+    std::mutex mu;
+    std::condition_variable cv;
+    LatencyHist hist;
+    uint64_t errors = 0;
+    uint64_t max_late_ns = 0;       // behind the schedule when sending
+};
+
+static std::string g_file;
+
+static void die_usage(const char *msg){
+    fprintf(stderr, "replay: %s\n", msg);
+    exit(1);
+}
+
+static void parse_args(int argc, char **argv){
+    if (argc < 2){
+        die_usage("usage: replay capture.bin [--host h] [--port p] [--speed x|max] [--conns n] [--window n]");
+    }
+    g_opt.path = argv[1];
+    for (int i = 2; i < argc; i += 2){
+        if (i + 1 >= argc){
+            die_usage("missing value");
+        }
+        std::string name = argv[i];
+        const char *val = argv[i+1];
+        if (name == "--host"){
+            g_opt.host = val;
+        } else if (name == "--port"){
+            g_opt.port = (uint32_t)atoi(val);
+        } else if (name == "--speed"){
+            g_opt.speed = strcmp(val, "max") == 0 ? 0 : atof(val);
+            if (g_opt.speed < 0 || (g_opt.speed == 0 && strcmp(val, "max") != 0)){
+                die_usage("bad --speed");
+            }
+        } else if (name == "--conns"){
+            g_opt.conns = (uint32_t)atoi(val);
+        } else if (name == "--window"){
+            g_opt.window = (uint32_t)atoi(val);
+        } else {
+            die_usage(("unknown option " + name).c_str());
+        }
+    }
+    if (!g_opt.conns || !g_opt.window){
+        die_usage("bad arguments");
+    }
+}
+
+static uint32_t load_u32(const char* p){
+    uint32_t v = 0;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint64_t load_u64(const char* p){
+    uint64_t v = 0;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+// false if it runs past `end`
+static bool get_varint(const char* &cur, const char* end, uint64_t &v){
+    v = 0;
+    for (uint32_t shift = 0; cur < end && shift < 64; shift += 7){
+        uint8_t b = (uint8_t)*cur++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)){
+            return true;
+        }
+    }
+    return false;
+}
+
+// the requests of each captured connection, in order; a torn block at the
+// end (the server died mid-write) is left out
+static std::map<uint32_t, std::vector<Rec>> load_capture(){
+    int fd = open(g_opt.path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0){
+        die_usage("cannot open the capture");
+    }
+    g_file.resize((size_t)st.st_size);
+    if (!g_file.empty() && read_full(fd, &g_file[0], g_file.size()) < 0){
+        die_usage("cannot read the capture");
+    }
+    close(fd);
+    if (g_file.size() < 8 || memcmp(g_file.data(), k_capture_magic, 4) != 0
+        || load_u32(&g_file[4]) != k_capture_version)
+    {
+        die_usage("not a capture file");
+    }
+    std::map<uint32_t, std::vector<Rec>> conns;
+    const char* data = g_file.data();
+    size_t pos = 8;
+    while (pos + 20 <= g_file.size()){
+        uint32_t id = load_u32(data + pos);
+        uint64_t t_us = load_u64(data + pos + 4);
+        uint32_t frames = load_u32(data + pos + 12);
+        uint32_t bytes = load_u32(data + pos + 16);
+        if (pos + 20 + bytes > g_file.size()){
+            break;
+        }
+        const char* cur = data + pos + 20;
+        const char* end = cur + bytes;
+        std::vector<Rec> &recs = conns[id];
+        for (uint32_t i = 0; i < frames; i++){
+            uint64_t delta = 0;
+            if (!get_varint(cur, end, delta) || end - cur < 4 || (size_t)(end - cur - 4) < load_u32(cur)){
+                die_usage("corrupted capture block");
+            }
+            t_us += delta;
+            Rec r;
+            r.t_us = t_us;
+            r.pos = cur - data;
+            r.size = 4 + load_u32(cur);
+            recs.push_back(r);
+            cur += r.size;
+        }
+        pos += 20 + bytes;
+    }
+    if (pos != g_file.size()){
+        fprintf(stderr, "replay: ignoring a torn block of %zu bytes at the end\n", g_file.size() - pos);
+    }
+    // blocks of one connection are written by different pool workers, so
+    // may be out of order, the requests within a block never are
+    for (auto &kv : conns){
+        std::stable_sort(kv.second.begin(), kv.second.end(),
+            [](const Rec &a, const Rec &b){ return a.t_us < b.t_us; });
+    }
+    return conns;
+}
+
+static int conn_open(){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)g_opt.port);
+    if (fd < 0 || inet_pton(AF_INET, g_opt.host.c_str(), &addr.sin_addr) != 1
+        || connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        perror("replay: connect");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// reads one reply, returns false on a broken connection
+static bool reply_read(int fd, std::string &buf, uint64_t &errors){
+    uint32_t len = 0;
+    if (read_full(fd, (char*)&len, 4) < 0 || len == 0 || len > k_max_reply){
+        return false;
+    }
+    buf.resize(len);
+    if (read_full(fd, &buf[0], len) < 0){
+        return false;
+    }
+    errors += buf[0] == 1;      // TAG_ERR
+    return true;
+}
+
+static void sleep_until(uint64_t ns){
+    struct timespec ts = {(time_t)(ns / 1000000000), (long)(ns % 1000000000)};
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+}
+
+// when request `r` is due, the capture's first request is due at `start_ns`
+static uint64_t due_ns(const Rec &r, uint64_t t0_us, uint64_t start_ns){
+    return start_ns + (uint64_t)((double)(r.t_us - t0_us) * 1000 / g_opt.speed);
+}
+
+static void replay_slot(Slot* s, uint64_t t0_us, uint64_t start_ns){
+    int fd = conn_open();
+    bool max = g_opt.speed == 0;
+    size_t total = s->recs.size();
+    s->sent_ns.resize(total);
+    std::thread reader([&]{
+        std::string reply;
+        for (size_t i = 0; i < total; i++){
+            if (!reply_read(fd, reply, s->errors)){
+                die_usage("connection lost");
+            }
+            uint64_t now_ns = get_monotonic_nsecs();
+            std::unique_lock<std::mutex> lock(s->mu);
+            uint64_t from_ns = max ? s->sent_ns[i] : due_ns(s->recs[i], t0_us, start_ns);
+            s->acked = i + 1;
+            lock.unlock();
+            s->cv.notify_one();
+            lat_record(&s->hist, now_ns - from_ns);
+        }
+    });
+    std::string out;
+    size_t i = 0;
+    while (i < total){
+        uint64_t now_ns = get_monotonic_nsecs();
+        if (!max){
+            uint64_t next_ns = due_ns(s->recs[i], t0_us, start_ns);
+            if (next_ns > now_ns){
+                sleep_until(next_ns);
+                continue;
+            }
+            s->max_late_ns = std::max(s->max_late_ns, now_ns - next_ns);
+        }
+        // what is due, or what the window allows
+        std::unique_lock<std::mutex> lock(s->mu);
+        if (max){
+            s->cv.wait(lock, [&]{ return i - s->acked < g_opt.window; });
+        }
+        size_t limit = max ? s->acked + g_opt.window : total;
+        out.clear();
+        size_t n = 0;
+        while (i < total && i < limit && n < k_send_batch
+            && (max || due_ns(s->recs[i], t0_us, start_ns) <= now_ns))
+        {
+            const Rec &r = s->recs[i];
+            out.append(g_file.data() + r.pos, r.size);
+            s->sent_ns[i] = now_ns;
+            i++;
+            n++;
+        }
+        lock.unlock();
+        if (write_all(fd, out.data(), out.size()) < 0){
+            die_usage("write() error");
+        }
+    }
+    reader.join();
+    close(fd);
+}
+
+int main(int argc, char **argv){
+    parse_args(argc, argv);
+    std::map<uint32_t, std::vector<Rec>> captured = load_capture();
+    if (captured.empty()){
+        die_usage("the capture has no requests");
+    }
+
+    // captured connections onto replay connections, merged by time
+    size_t nslots = std::min((size_t)g_opt.conns, captured.size());
+    std::vector<Slot*> slots;
+    for (size_t i = 0; i < nslots; i++){
+        slots.push_back(new Slot());
+    }
+    size_t idx = 0;
+    uint64_t t0_us = UINT64_MAX;
+    for (auto &kv : captured){
+        std::vector<Rec> &recs = slots[idx++ % nslots]->recs;
+        recs.insert(recs.end(), kv.second.begin(), kv.second.end());
+        t0_us = std::min(t0_us, kv.second.front().t_us);
+    }
+    for (Slot* s : slots){
+        std::stable_sort(s->recs.begin(), s->recs.end(),
+            [](const Rec &a, const Rec &b){ return a.t_us < b.t_us; });
+    }
+
+    uint64_t start_ns = get_monotonic_nsecs();
+    std::vector<std::thread> threads;
+    for (Slot* s : slots){
+        threads.emplace_back(&replay_slot, s, t0_us, start_ns);
+    }
+    for (std::thread &t : threads){
+        t.join();
+    }
+    double secs = (double)(get_monotonic_nsecs() - start_ns) / 1e9;
+
+    LatencyHist* total = new LatencyHist();
+    uint64_t errors = 0;
+    uint64_t max_late_ns = 0;
+    for (Slot* s : slots){
+        lat_merge(total, &s->hist);
+        errors += s->errors;
+        max_late_ns = std::max(max_late_ns, s->max_late_ns);
+    }
+    uint64_t ops = total->calls;
+    printf("capture     %zu connections replayed on %zu\n", captured.size(), nslots);
+    if (g_opt.speed == 0){
+        printf("speed       max, window %u\n", g_opt.window);
+    } else {
+        printf("speed       %.2fx, sends up to %.1f ms behind schedule\n", g_opt.speed, (double)max_late_ns / 1e6);
+    }
+    printf("requests    %llu in %.2f s, %llu errors\n",
+        (unsigned long long)ops, secs, (unsigned long long)errors);
+    printf("throughput  %.0f ops/s\n", (double)ops / secs);
+    printf("latency_us  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+        (double)lat_quantile(total, 0.5) / 1000,
+        (double)lat_quantile(total, 0.99) / 1000,
+        (double)lat_quantile(total, 0.999) / 1000,
+        (double)total->max_ns / 1000);
+    return 0;
+}
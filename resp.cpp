@@ -0,0 +1,120 @@
+#include <string.h>
+#include "resp.h"
+#include "constants.h"
+
+// the end of the line starting at `cur`, at its "\r\n", or null if not there yet
+static const uint8_t* line_end(const uint8_t* cur, const uint8_t* end){
+    const uint8_t* cr = (const uint8_t*) memchr(cur, '\r', end - cur);
+    if (!cr || cr + 1 >= end){
+        return nullptr;
+    }
+    return cr;
+}
+
+// "<prefix><integer>" up to `end`
+static bool line_int(const uint8_t* cur, const uint8_t* end, int64_t &out){
+    bool neg = cur < end && *cur == '-';
+    cur += neg;
+    if (cur == end || end - cur > 18){
+        return false;
+    }
+    int64_t v = 0;
+    for (; cur < end; cur++){
+        if (*cur < '0' || *cur > '9'){
+            return false;
+        }
+        v = v*10 + (*cur - '0');
+    }
+    out = neg ? -v : v;
+    return true;
+}
+
+static void parser_reset(RespParser* p){
+    p->pos = 0;
+    p->nargs = -1;
+    p->bulk_len = -1;
+    p->args.clear();
+}
+
+// a line of words, `pos` is how far the newline was searched for
+static int parse_inline(RespParser* p, const uint8_t* data, size_t size,
+    std::vector<std::string> &out, size_t* used)
+{
+    const uint8_t* nl = (const uint8_t*) memchr(data + p->pos, '\n', size - p->pos);
+    if (!nl){
+        p->pos = size;
+        return size > k_resp_max_inline ? -1 : 0;
+    }
+    const uint8_t* end = nl > data && nl[-1] == '\r' ? nl - 1 : nl;
+    out.clear();
+    for (const uint8_t* cur = data; cur < end; ){
+        if (*cur == ' ' || *cur == '\t'){
+            cur++;
+            continue;
+        }
+        const uint8_t* word = cur;
+        while (cur < end && *cur != ' ' && *cur != '\t'){
+            cur++;
+        }
+        out.emplace_back((const char*) word, cur - word);
+    }
+    *used = nl + 1 - data;
+    parser_reset(p);
+    return 1;
+}
+
+int resp_parse(RespParser* p, const uint8_t* data, size_t size,
+    std::vector<std::string> &out, size_t* used)
+{
+    if (size == 0){
+        return 0;
+    }
+    if (data[0] != '*'){
+        return parse_inline(p, data, size, out, used);
+    }
+    const uint8_t* end = data + size;
+    if (p->nargs < 0){
+        const uint8_t* eol = line_end(data, end);
+        if (!eol){
+            return size > k_resp_max_inline ? -1 : 0;
+        }
+        int64_t n = 0;
+        if (eol[1] != '\n' || !line_int(data + 1, eol, n) || n > (int64_t)k_max_args){
+            return -1;
+        }
+        p->nargs = n < 0 ? 0 : n;
+        p->pos = eol + 2 - data;
+        p->args.reserve(p->nargs < 1024 ? p->nargs : 1024);
+    }
+    while ((int64_t)p->args.size() < p->nargs){
+        const uint8_t* cur = data + p->pos;
+        if (p->bulk_len < 0){
+            const uint8_t* eol = line_end(cur, end);
+            if (!eol){
+                return end - cur > (ptrdiff_t)k_resp_max_inline ? -1 : 0;
+            }
+            int64_t len = 0;
+            if (*cur != '$' || eol[1] != '\n' || !line_int(cur + 1, eol, len)
+                || len < 0 || len > (int64_t)k_max_msg)
+            {
+                return -1;
+            }
+            p->bulk_len = len;
+            p->pos = eol + 2 - data;
+            cur = data + p->pos;
+        }
+        if (end - cur < p->bulk_len + 2){
+            return 0;
+        }
+        if (cur[p->bulk_len] != '\r' || cur[p->bulk_len + 1] != '\n'){
+            return -1;
+        }
+        p->args.emplace_back((const char*) cur, (size_t) p->bulk_len);
+        p->pos += p->bulk_len + 2;
+        p->bulk_len = -1;
+    }
+    out.swap(p->args);
+    *used = p->pos;
+    parser_reset(p);
+    return 1;
+}
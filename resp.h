@@ -0,0 +1,30 @@
+// 1. RESP requests, as sent by redis-cli, redis-benchmark and the usual client
+//    libraries: a multibulk "*<n>\r\n" followed by n "$<len>\r\n<bytes>\r\n",
+//    or an inline command, one line of space separated words
+// 2. The parser is incremental, it keeps its position and the arguments
+//    decoded so far between reads, so a request arriving in many pieces is
+//    scanned once; each argument is copied once, from the read buffer into
+//    its string, and a bulk is only copied when it is complete
+// 3. Replies are not handled here, the server encodes them in its own format
+//    and converts them, see the serialisation section of server.cpp
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct RespParser {
+    size_t pos = 0;             // bytes of the request consumed so far
+    int64_t nargs = -1;         // of the multibulk, -1 before its header
+    int64_t bulk_len = -1;      // of the next argument, -1 before its header
+    std::vector<std::string> args;
+};
+
+// parses the request at the start of `data`, the same request on every call
+// until it is complete; returns 1 with the arguments in `out` (empty for an
+// empty line) and the request size in `used`, 0 when more data is needed,
+// -1 on a protocol error
+int resp_parse(RespParser* p, const uint8_t* data, size_t size,
+    std::vector<std::string> &out, size_t* used);
@@ -1,4 +1,7 @@
 #include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <string>
 #include <stddef.h>
 #include <stdint.h>
 #include <assert.h>
@@ -28,4 +31,16 @@ int32_t write_all(int fd, const char* buf, size_t n){
         buf += ret;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+int32_t fsync_dir(const char* path){
+    const char* slash = strrchr(path, '/');
+    std::string dir = !slash ? "." : slash == path ? "/" : std::string(path, slash - path);
+    int fd = open(dir.c_str(), O_RDONLY|O_DIRECTORY);
+    if (fd < 0){
+        return -1;
+    }
+    int rv = fsync(fd);
+    close(fd);
+    return rv < 0 ? -1 : 0;
+}
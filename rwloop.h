@@ -6,5 +6,7 @@
 
 int32_t read_full(int fd, char* buf, size_t n);
 int32_t write_all(int fd, const char* buf, size_t n);
+// fsyncs the directory holding `path`, so a rename() into it is durable
+int32_t fsync_dir(const char* path);
 
 #endif
\ No newline at end of file
@@ -1,14 +1,27 @@
 #include <stddef.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <errno.h>
 #include <arpa/inet.h>
 #include <netinet/ip.h>
 #include <stdint.h>
+#include <math.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <deque>
+#include <memory>
 #include "errhelp.h"
 #include "constants.h"
 #include <vector>
@@ -19,9 +32,27 @@
 #include "hashtable.h"
 #include "commonops.h"
 #include "zset.h"
+#include "hash.h"
+#include "list.h"
+#include "hll.h"
+#include "bloom.h"
 #include "cdlist.h"
 #include "cache.h"
 #include "ThreadPool.h"
+#include "lazyfree.h"
+#include "config.h"
+#include "evict.h"
+#include "snapshot.h"
+#include "aof.h"
+#include "rwloop.h"
+#include "repl.h"
+#include "iothreads.h"
+#include "latency.h"
+#include "slowlog.h"
+#include "resp.h"
+#include "capture.h"
+#include "pubsub.h"
+#include "memreport.h"
 
 
 //========================================= utility functions =========================================//
@@ -64,6 +95,13 @@ static uint64_t get_monotonic_msecs(){
     return uint64_t(tv.tv_sec)*1000+tv.tv_nsec/1000/1000;
 }
 
+// wall clock time, only for what outlives the process such as TTLs on disk
+static uint64_t get_unix_msecs(){
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec)*1000+tv.tv_nsec/1000/1000;
+}
+
 
 //========================================= event loop connection state =========================================//
 
@@ -79,9 +117,58 @@ static void buf_remove(Buffer &buf, size_t len){
     buf.erase(buf.begin(), buf.begin()+len);
 };
 
+// the role of a connection in replication
+enum {
+    REPL_NONE       = 0,    // a normal client
+    // on a replica, the link to the primary
+    REPL_HANDSHAKE  = 1,    // PSYNC sent, waiting for the reply
+    REPL_TRANSFER   = 2,    // receiving the snapshot
+    REPL_STREAM     = 3,    // applying the command stream
+    // on the primary, a replica
+    REPL_WAIT_FORK  = 4,    // needs a snapshot, waiting for the child slot
+    REPL_WAIT_SAVE  = 5,    // its snapshot is being written, the stream is buffered
+    REPL_SEND_BULK  = 6,    // sending the snapshot file
+    REPL_ONLINE     = 7,    // the stream goes straight to `outgoing`
+};
+
+struct OffloadJob;
+
+// a request parsed by an I/O thread
+struct ParsedReq {
+    std::vector<std::string> cmd;
+    size_t bytes = 0;               // of `incoming`
+    uint64_t parse_ns = 0;
+};
+
+// the protocol of a connection, from its first bytes
+enum {
+    PROTO_UNKNOWN   = 0,
+    PROTO_BIN       = 1,    // length prefixed, see the parsing section
+    PROTO_RESP2     = 2,
+    PROTO_RESP3     = 3,    // after HELLO 3
+};
+
+// a slow log entry whose reply is still being sent
+struct SlowPending {
+    uint64_t id = 0;
+    uint64_t reply_begin = 0;       // in `Conn::written` bytes
+    uint64_t reply_end = 0;
+};
+
+// a shared message queued on a connection, see the pub/sub section
+struct OutRef {
+    std::shared_ptr<const Buffer> buf;
+    size_t pos = 0;                 // bytes of it already sent
+};
+
 // stores per-connection state for event loop
+struct BlockReq;
+
 struct Conn {
     int fd = -1;
+    std::string addr;               // of the client, for the slow log
+    uint32_t proto = PROTO_UNKNOWN;
+    RespParser resp;                // the RESP request being parsed
     // application's intention, for the event loop
     bool want_read = false;     
     bool want_write = false;
@@ -89,9 +176,32 @@ struct Conn {
     // buffered input and output
     Buffer incoming;      
     Buffer outgoing;
+    // sent before `outgoing`, messages shared with other subscribers and
+    // the replies that were in `outgoing` when they arrived
+    std::deque<OutRef> outq;
+    size_t outq_bytes = 0;          // not sent yet
+    uint64_t out_soft_ms = 0;       // since when over the soft limit, 0 if under it
+    PubSubClient pubsub;            // subscriptions, see pubsub.h
+    // the requests at the front of `incoming` already parsed by an I/O thread
+    std::deque<ParsedReq> parsed;
+    size_t parsed_bytes = 0;
+    uint64_t written = 0;           // bytes sent so far
+    std::vector<SlowPending> slow_pending;
+    CaptureBuf capture;             // requests recorded, see capture.h
     // timer
     uint64_t last_active_ms = 0;
     CDNode idle_node; 
+    // replication, these connections never time out
+    uint32_t repl_state = REPL_NONE;
+    int bulk_fd = -1;               // the snapshot being sent
+    Buffer repl_pending;            // the stream since the snapshot, sent after it
+    uint64_t repl_ack_offset = 0;   // acknowledged by the replica
+    uint64_t repl_ack_ms = 0;
+    // waiting, with reading stopped, see the offloaded replies section
+    OffloadJob* offload = nullptr;  // for its reply to be built by the pool
+    bool parked = false;            // a write, for the keyspace to thaw
+    BlockReq* block = nullptr;      // a blocking pop, for data, see the blocking pops section
+    bool memreport = false;         // MEMORY REPORT, for the sample, see the memory introspection section
 };
 
 /*
@@ -101,14 +211,110 @@ static struct{
     HMap db;
     std::vector<Conn*> fd2conn;
     CDNode idle_list;
-    std::vector<HeapNode> cache;
+    HeapArray cache;
     ThreadPool thread_pool;
+    size_t mem_used = 0;        // bytes held by the entries in `db`
+    bool evict_pending = false; // still above maxmemory after the last eviction slice
+    bool expire_backlog = false;// expired keys were left over by the last expiry cycle
+    uint64_t dirty = 0;         // writes since the last successful save
+    pid_t child_pid = -1;       // the BGSAVE, BGREWRITEAOF or replication child, one at a time
+    uint32_t child_type = 0;    // CHILD_RDB, CHILD_AOF or CHILD_REPL
+    uint64_t bgsave_dirty = 0;  // `dirty` when the child was forked
+    uint32_t snap_epoch = 0;    // of the last nofork save, new entries start with it
+    bool snap_running = false;  // a nofork save is walking `db`
+    bool aof_rewrite_scheduled = false;     // BGREWRITEAOF waits for the nofork save
+    bool loading = false;       // replaying the append-only log
+    bool prop_custom = false;   // the handler logged its own version of the command
+    Buffer prop_frame;          // the write being executed, logged once it succeeds
+    Conn* client = nullptr;     // running the command, null for the log and the stream
+    uint32_t frozen = 0;        // offloaded replies in flight, the keyspace doesn't change
+    std::vector<Conn*> parked;  // connections with a write waiting for `frozen` to drop
+    uint64_t exec_ns = 0;       // time taken by the last handle_request()
+    uint64_t exec_end_ns = 0;   // and when it returned
+    struct {
+        uint64_t commands = 0;          // executed, from clients and the primary
+        uint64_t connections = 0;       // accepted
+        uint64_t evicted_keys = 0;
+        uint64_t expired_keys = 0;      // by lookups and by the active cycle
+        uint64_t expire_cycles_cut = 0; // active cycles stopped by the time budget
+        uint64_t last_save_unix_ms = 0;
+        bool last_bgsave_ok = true;
+        bool last_aof_rewrite_ok = true;
+    } stats;
 }g_data;
 
+/*
+    replication state, see the replication section
+    - `offset` is the position in the stream of `replid`, on a primary the bytes
+      produced, on a replica the bytes applied
+    - replicas keep a backlog of the stream they apply too, so that a promoted
+      replica can serve partial resyncs to the others, under `replid2` which
+      is the history it shared with them up to `offset2`
+*/
+static struct {
+    std::string replid;
+    uint64_t offset = 0;
+    std::string replid2;
+    uint64_t offset2 = 0;
+    ReplBacklog backlog;            // empty until the first replica connects
+    std::vector<Conn*> replicas;
+    uint64_t last_ping_ms = 0;
+    // on a replica
+    Conn* master = nullptr;
+    bool applying = false;          // executing a command from the primary
+    uint64_t connect_ms = 0;        // the last connection attempt
+    uint64_t last_io_ms = 0;
+    uint64_t last_ack_ms = 0;
+    int64_t lag_ms = -1;            // stream delay measured by the primary's pings
+    // the snapshot being received
+    std::string transfer_replid;
+    uint64_t transfer_offset = 0;
+    int transfer_fd = -1;
+    uint64_t transfer_left = 0;
+    bool transfer_sized = false;
+    bool aof_rewrite_pending = false;   // the log predates the last full sync
+    struct {
+        uint64_t full_syncs = 0;
+        uint64_t partial_syncs = 0;
+    } stats;
+} g_repl;
+
+static bool is_replica(){
+    return !g_config.replicaof.empty();
+}
+
+static void offload_forget(Conn* conn);
+static void block_forget(Conn* conn);
+static void pubsub_conn_forget(Conn* conn);
+static void memreport_forget(Conn* conn);
+
 static void conn_destroy(Conn *conn){
     (void) close(conn->fd);
+    capture_flush(conn->capture);
+    offload_forget(conn);
+    block_forget(conn);
+    pubsub_conn_forget(conn);
+    memreport_forget(conn);
     g_data.fd2conn[conn->fd] = nullptr;
     cdlist_detach(&conn->idle_node);
+    if (conn->bulk_fd >= 0){
+        close(conn->bulk_fd);
+    }
+    if (conn == g_repl.master){
+        g_repl.master = nullptr;
+        if (g_repl.transfer_fd >= 0){
+            close(g_repl.transfer_fd);
+            g_repl.transfer_fd = -1;
+        }
+    } else if (conn->repl_state != REPL_NONE){
+        std::vector<Conn*> &v = g_repl.replicas;
+        for (size_t i = 0; i < v.size(); i++){
+            if (v[i] == conn){
+                v.erase(v.begin() + i);
+                break;
+            }
+        }
+    }
     delete conn;
 }
 
@@ -117,19 +323,26 @@ static void conn_destroy(Conn *conn){
 
 // application callback when the listening socket is ready
 static int32_t handle_accept(int fd){
-    // accept
-    struct sockaddr_in client_addr = {};
-    socklen_t socklen = sizeof(client_addr);
-    int connfd = accept(fd, (struct sockaddr*) &client_addr, &socklen);
+    // accept, from TCP or the unix socket
+    struct sockaddr_storage ss = {};
+    socklen_t socklen = sizeof(ss);
+    int connfd = accept(fd, (struct sockaddr*) &ss, &socklen);
     if (connfd<0){
         msg_err("accept() error");
         return -1;
     }
-    uint32_t ip = client_addr.sin_addr.s_addr;
-    fprintf(stderr, "new client from %u.%u.%u.%u:%u\n",
-        ip & 255, (ip>>8)&255, (ip>>15)&255, ip>>24,
-        ntohs(client_addr.sin_port)
-    );
+    char addr[128] = "";
+    if (ss.ss_family == AF_INET){
+        struct sockaddr_in &client_addr = *(struct sockaddr_in*) &ss;
+        uint32_t ip = client_addr.sin_addr.s_addr;
+        snprintf(addr, sizeof(addr), "%u.%u.%u.%u:%u",
+            ip & 255, (ip>>8)&255, (ip>>16)&255, ip>>24,
+            ntohs(client_addr.sin_port)
+        );
+    } else {
+        snprintf(addr, sizeof(addr), "unix:%s", g_config.unixsocket.c_str());
+    }
+    fprintf(stderr, "new client %s\n", addr);
 
     // set new connection to nb mode
     fd_set_nb(connfd);
@@ -137,6 +350,7 @@ static int32_t handle_accept(int fd){
     // create new struct Conn
     Conn* conn = new Conn();
     conn->fd = connfd;
+    conn->addr = addr;
     conn->want_read = true;
     conn->last_active_ms = get_monotonic_msecs();
     cdlist_insert_before(&g_data.idle_list, &conn->idle_node);
@@ -146,6 +360,7 @@ static int32_t handle_accept(int fd){
     }
     assert(!g_data.fd2conn[conn->fd]);
     g_data.fd2conn[conn->fd] = conn;
+    g_data.stats.connections++;
     return 0;
 }
 
@@ -204,6 +419,52 @@ parse_req(const uint8_t *data, size_t size, std::vector<std::string> &out){
 }
 
 
+/*
+    RESP clients are told apart by the first bytes of the connection: a
+    request of ours is at most k_max_msg long, so the 4th byte, the top of its
+    length, is small, while RESP starts with '*' or an inline command and the
+    4th byte is text
+*/
+static bool conn_detect_proto(Conn* conn){
+    const Buffer &in = conn->incoming;
+    if (conn->proto == PROTO_UNKNOWN && in.size() >= 4){
+        uint32_t len = 0;
+        memcpy(&len, in.data(), 4);
+        bool text = in[0] == '*' || (in[0] >= 'A' && in[0] <= 'Z') || (in[0] >= 'a' && in[0] <= 'z');
+        conn->proto = text && len > k_max_msg ? PROTO_RESP2 : PROTO_BIN;
+    }
+    return conn->proto != PROTO_UNKNOWN;
+}
+
+// the request at `pos` of `incoming`, 1 with its size in `bytes` if it is
+// complete, 0 if more data is needed and -1 if it is malformed
+static int32_t conn_next_request(Conn* conn, size_t pos, std::vector<std::string> &cmd, size_t* bytes){
+    if (!conn_detect_proto(conn)){
+        return 0;
+    }
+    const Buffer &in = conn->incoming;
+    if (conn->proto != PROTO_BIN){
+        return resp_parse(&conn->resp, in.data() + pos, in.size() - pos, cmd, bytes);
+    }
+    if (in.size() - pos < 4){
+        return 0;
+    }
+    uint32_t len = 0;
+    memcpy(&len, &in[pos], 4);
+    if (len > k_max_msg){
+        return -1;
+    }
+    if (pos + 4 + len > in.size()){
+        return 0;
+    }
+    if (parse_req(&in[pos+4], len, cmd) < 0){
+        return -1;
+    }
+    *bytes = 4 + len;
+    return 1;
+}
+
+
 //================================== Data serialisation and output related code ==================================//
 // error code for TAG_ERR
 enum {
@@ -211,6 +472,8 @@ enum {
     ERR_TOO_BIG = 2,    // response too big
     ERR_BAD_TYP = 3,    // unexpected value type
     ERR_BAD_ARG = 4,    // bad arguments
+    ERR_OOM     = 5,    // above maxmemory and nothing left to evict
+    ERR_READONLY= 6,    // a write sent to a replica
 };
 
 // the data types that we support
@@ -221,6 +484,7 @@ enum {
     TAG_INT = 3,
     TAG_DBL = 4,
     TAG_ARR = 5,
+    TAG_MAP = 6,    // n key value pairs
 };
 
 // helper functions for appending different data types
@@ -252,7 +516,7 @@ static void out_str(Buffer &out, const char *s, size_t size){
 }
 
 static void out_int(Buffer &out, const int64_t val){
-    buf_append_u8(out, TAG_STR);
+    buf_append_u8(out, TAG_INT);
     buf_append_i64(out, val);
 }
 
@@ -273,6 +537,11 @@ static void out_arr(Buffer &out, uint32_t n){
     buf_append_u32(out, n);
 }
 
+static void out_map(Buffer &out, uint32_t n){
+    buf_append_u8(out, TAG_MAP);
+    buf_append_u32(out, n);
+}
+
 // used for zqueries
 static size_t out_begin_arr(Buffer &out){
     out.push_back(TAG_ARR);
@@ -285,11 +554,209 @@ static void out_end_arr(Buffer &out, size_t ctx, uint32_t n){
 }
 
 
+static void response_begin(Buffer &out, size_t *header){
+    *header = out.size();       // message header position
+    buf_append_u32(out, 0);     // reserve space
+}
+static size_t response_size(Buffer &out, size_t header){
+    return out.size()-header-4;
+}
+static void response_end(Buffer &out, size_t header){
+    size_t msg_size = response_size(out, header);
+    if (msg_size > k_max_msg) {
+        out.resize(header+4);   // remove current message
+        out_err(out, ERR_TOO_BIG, "response is too big.");
+        msg_size = response_size(out, header);
+    }
+    // message header
+    uint32_t len = (uint32_t)msg_size;
+    memcpy(&out[header], &len, 4);
+}
+
+/*
+    RESP replies are converted from ours once complete, so the handlers and
+    the pool tasks building replies only know one format
+    - nil is a null bulk in RESP2 and "_" in RESP3
+    - doubles are bulk strings in RESP2 and "," in RESP3
+    - maps are flat arrays in RESP2 and "%" in RESP3
+    - the error code becomes the usual first word of the message
+*/
+static const char *resp_err_prefix(uint32_t code){
+    switch (code){
+    case ERR_BAD_TYP:   return "WRONGTYPE ";
+    case ERR_OOM:       return "OOM ";
+    case ERR_READONLY:  return "READONLY ";
+    default:            return "ERR ";
+    }
+}
+
+static void resp_line(Buffer &out, char type, int64_t val){
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%c%lld\r\n", type, (long long)val);
+    buf_append(out, (const uint8_t*)buf, (size_t)n);
+}
+
+static void resp_bulk(Buffer &out, const uint8_t* data, size_t size){
+    resp_line(out, '$', (int64_t)size);
+    buf_append(out, data, size);
+    buf_append(out, (const uint8_t*)"\r\n", 2);
+}
+
+// converts the value at `cur`, returns the position after it
+static const uint8_t *resp_convert(Buffer &out, const uint8_t* cur, bool resp3){
+    uint8_t tag = *cur++;
+    uint32_t n = 0;
+    switch (tag){
+    case TAG_NIL:
+        buf_append(out, (const uint8_t*)(resp3 ? "_\r\n" : "$-1\r\n"), resp3 ? 3 : 5);
+        return cur;
+    case TAG_ERR: {
+        uint32_t code = 0;
+        memcpy(&code, cur, 4);
+        memcpy(&n, cur + 4, 4);
+        cur += 8;
+        const char *prefix = resp_err_prefix(code);
+        out.push_back('-');
+        buf_append(out, (const uint8_t*)prefix, strlen(prefix));
+        for (uint32_t i = 0; i < n; i++){
+            // a line of its own
+            out.push_back(cur[i] == '\r' || cur[i] == '\n' ? ' ' : cur[i]);
+        }
+        buf_append(out, (const uint8_t*)"\r\n", 2);
+        return cur + n;
+    }
+    case TAG_STR:
+        memcpy(&n, cur, 4);
+        resp_bulk(out, cur + 4, n);
+        return cur + 4 + n;
+    case TAG_INT: {
+        int64_t val = 0;
+        memcpy(&val, cur, 8);
+        resp_line(out, ':', val);
+        return cur + 8;
+    }
+    case TAG_DBL: {
+        double val = 0;
+        memcpy(&val, cur, 8);
+        char buf[64];
+        int len = std::isnan(val) ? snprintf(buf, sizeof(buf), "nan")
+            : std::isinf(val) ? snprintf(buf, sizeof(buf), val > 0 ? "inf" : "-inf")
+            : snprintf(buf, sizeof(buf), "%.17g", val);
+        if (!resp3){
+            resp_bulk(out, (const uint8_t*)buf, (size_t)len);
+        } else {
+            out.push_back(',');
+            buf_append(out, (const uint8_t*)buf, (size_t)len);
+            buf_append(out, (const uint8_t*)"\r\n", 2);
+        }
+        return cur + 8;
+    }
+    case TAG_ARR:
+    case TAG_MAP: {
+        memcpy(&n, cur, 4);
+        cur += 4;
+        uint32_t items = tag == TAG_MAP ? 2*n : n;
+        if (tag == TAG_MAP && resp3){
+            resp_line(out, '%', n);
+        } else {
+            resp_line(out, '*', items);
+        }
+        for (uint32_t i = 0; i < items; i++){
+            cur = resp_convert(out, cur, resp3);
+        }
+        return cur;
+    }
+    default:
+        assert(!"unknown tag");
+        return cur;
+    }
+}
+
+// ends the reply at `header`, converted for RESP connections
+static void conn_response_end(Conn* conn, size_t header){
+    Buffer &out = conn->outgoing;
+    response_end(out, header);
+    if (conn->proto == PROTO_BIN){
+        return;
+    }
+    // the loop thread only
+    static Buffer resp;
+    resp.clear();
+    resp_convert(resp, &out[header+4], conn->proto == PROTO_RESP3);
+    out.resize(header);
+    buf_append(out, resp.data(), resp.size());
+}
+
+//================================== command propagation ==================================//
+
+// a command as a request message, the exact bytes a client would send
+static void cmd_encode(Buffer &out, const std::vector<std::string> &cmd){
+    size_t len = 4;
+    for (const std::string &s : cmd){
+        len += 4 + s.size();
+    }
+    buf_append_u32(out, (uint32_t)len);
+    buf_append_u32(out, (uint32_t)cmd.size());
+    for (const std::string &s : cmd){
+        buf_append_u32(out, (uint32_t)s.size());
+        buf_append(out, (const uint8_t*)s.data(), s.size());
+    }
+}
+
+// the stream to the replicas, kept in the backlog for partial resyncs
+static void repl_feed(const uint8_t* frame, size_t len){
+    if (g_repl.backlog.ring.empty()){
+        return;     // no replica ever connected
+    }
+    backlog_feed(&g_repl.backlog, frame, len);
+    g_repl.offset += len;
+    for (Conn* conn : g_repl.replicas){
+        if (conn->repl_state == REPL_ONLINE){
+            buf_append(conn->outgoing, frame, len);
+            conn->want_write = true;
+        } else if (conn->repl_state == REPL_WAIT_SAVE || conn->repl_state == REPL_SEND_BULK){
+            buf_append(conn->repl_pending, frame, len);
+        }
+        // REPL_WAIT_FORK, its snapshot will include this write
+    }
+}
+
+// writes are logged and streamed to replicas, unless they come from the log
+// itself; the stream from a primary is passed on as is by the replication code
+static bool propagating(){
+    return !g_data.loading && (aof_enabled() || (!g_repl.applying && !g_repl.backlog.ring.empty()));
+}
+
+static void propagate_frame(const uint8_t* frame, size_t len){
+    if (aof_enabled()){
+        aof_append(frame, len);
+    }
+    if (!g_repl.applying){
+        repl_feed(frame, len);
+    }
+}
+
+// propagates a write that differs from what the client sent, such as the DEL
+// of an expired or evicted key, or an EXPIRE as an absolute time
+static void propagate(const std::vector<std::string> &cmd){
+    if (!propagating()){
+        return;
+    }
+    Buffer frame;
+    cmd_encode(frame, cmd);
+    propagate_frame(frame.data(), frame.size());
+}
+
+
 //================================== hashtable entry related code ==================================//
 enum {
     T_INIT  = 0,
     T_STR   = 1,
     T_ZSET  = 2,
+    T_HASH  = 3,
+    T_LIST  = 4,
+    T_HLL   = 5,    // the image in `str`, see hll.h
+    T_BLOOM = 6,    // the same, see bloom.h
 };
 
 struct Entry {
@@ -298,19 +765,53 @@ struct Entry {
     // TTL value, if -1 means it will not be cached
     size_t heap_idx = -1;
 
-    uint32_t type = 0;
+    uint32_t type : 8;
+    uint32_t access : k_access_bits;    // LRU clock or LFU counter, see evict.h
+    uint32_t snap_epoch;                // behind `g_data.snap_epoch` if not saved by a running nofork save
     std::string str;
     ZSet zset;
+    std::unique_ptr<Hash> hash;         // T_HASH only, most keys are not
+    std::unique_ptr<List> list;         // T_LIST only
 };
 
+// copy-before-write for the nofork save, called before an entry of `db` is
+// changed or removed, see the persistence section
+static void entry_snap_cow(Entry* ent);
+
 static Entry *entry_new(uint32_t type){
     Entry *ent = new Entry();
     ent->type = type;
+    if (type == T_HASH){
+        ent->hash.reset(new Hash());
+    } else if (type == T_LIST){
+        ent->list.reset(new List());
+    }
+    ent->snap_epoch = g_data.snap_epoch;
+    ent->access = access_init(g_config.maxmemory_policy);
     return ent;
 }
 
+// bytes held by an entry, kept in `g_data.mem_used` for the keys in `db`
+static size_t entry_mem(Entry* ent){
+    return sizeof(Entry) + ent->key.capacity() + ent->str.capacity() + zset_mem(&ent->zset)
+        + (ent->hash ? sizeof(Hash) + hash_mem(ent->hash.get()) : 0)
+        + (ent->list ? sizeof(List) + list_mem(ent->list.get()) : 0);
+}
+
+// call after changing an entry that is in `db`, with its size from before the change
+static void entry_mem_update(Entry* ent, size_t before){
+    g_data.mem_used += entry_mem(ent);
+    g_data.mem_used -= before;
+}
+
+static void db_insert(Entry* ent){
+    hm_insert(&g_data.db, &ent->node);
+    g_data.mem_used += entry_mem(ent);
+}
+
 // set or remove the TTL value of the entry
 static void entry_set_ttl(Entry* ent, int64_t ttl_ms){
+    entry_snap_cow(ent);
     // negative heap_idx means it will or has been removed from cache
     if (ttl_ms < 0 && ent->heap_idx != (size_t)-1){
         heap_delete(g_data.cache, ent->heap_idx);
@@ -323,32 +824,82 @@ static void entry_set_ttl(Entry* ent, int64_t ttl_ms){
     }
 }
 
-static void entry_del_sync(Entry* ent){
+// whether destroying the value inline would be noticeably slow
+static bool entry_is_large(Entry* ent){
     if (ent->type == T_ZSET){
-        zset_clear(&ent->zset);
+        return hm_size(&ent->zset.hmap) > k_lazyfree_min_items;
+    }
+    if (ent->type == T_HASH){
+        return hash_len(ent->hash.get()) > k_lazyfree_min_items;
+    }
+    if (ent->type == T_LIST){
+        return ent->list->nchunks > k_lazyfree_min_items;   // freed a chunk at a time
+    }
+    return ent->str.capacity() > k_lazyfree_min_str;
+}
+
+// lazy free step for an entry, a container is dismantled a slice at a time
+static bool entry_dispose(void* arg, size_t max_work){
+    Entry* ent = (Entry*) arg;
+    if (ent->type == T_ZSET && !zset_dispose(&ent->zset, max_work)){
+        return false;
+    }
+    if (ent->type == T_HASH && !hash_dispose(ent->hash.get(), max_work)){
+        return false;
+    }
+    if (ent->type == T_LIST && !list_dispose(ent->list.get(), max_work)){
+        return false;
     }
     delete ent;
+    return true;
 }
 
-static void entry_del_func(void* arg){
-    entry_del_sync((Entry*) arg);
+static void entry_del_sync(Entry* ent){
+    entry_dispose(ent, (size_t)-1);
 }
 
+// for entries just removed from `db`
 static void entry_del(Entry* ent){
+    entry_snap_cow(ent);
     // unlink it from any data struture
+    g_data.mem_used -= entry_mem(ent);
     entry_set_ttl(ent, -1);
-    // run the destructor in a thread pool for large data structures
-    size_t set_size = (ent->type == T_ZSET) ? hm_size(&ent->zset.hmap) : 0;
-    const size_t k_large_container_size = 1000;
-    if (set_size > k_large_container_size) {
-        // large, handled by another worker thread
-        g_data.thread_pool.produce(&entry_del_func, ent);
+    if (entry_is_large(ent)) {
+        // large, torn down in slices by the event loop
+        lazyfree_push(&entry_dispose, ent, entry_mem(ent));
+    } else {
+        // small, handled directly
+        entry_del_sync(ent);
+    }
+}
+
+// lazy free step for a detached string value
+static bool str_dispose(void* arg, size_t){
+    delete (std::string*) arg;
+    return true;
+}
+
+// lazy free step for a whole detached keyspace, each entry is either freed
+// on the spot or queued as its own job if large
+static void cb_flush_entry(HNode* node, void*){
+    Entry* ent = container_of(node, Entry, node);
+    ent->heap_idx = -1;     // the TTL heap was cleared along with the keyspace
+    if (entry_is_large(ent)){
+        lazyfree_push(&entry_dispose, ent, entry_mem(ent));
     } else {
-        // small, handled directly to avoid context switches
         entry_del_sync(ent);
     }
 }
 
+static bool db_dispose(void* arg, size_t max_work){
+    HMap* db = (HMap*) arg;
+    if (!hm_dispose(db, max_work, &cb_flush_entry, nullptr)){
+        return false;
+    }
+    delete db;
+    return true;
+}
+
 // used for lookup as it is more compact than Entry
 struct LookupKey {
     struct HNode node;
@@ -362,6 +913,162 @@ static bool entry_eql(HNode* node, HNode* key){
     return ent->key == keydata->key;
 }
 
+// takes over the key string from the request
+static void lookup_key_init(LookupKey* key, std::string &s){
+    key->key.swap(s);
+    key->node.hval = str_hash((uint8_t*)key->key.data(), key->key.size());
+}
+
+// whether the TTL has passed, the key may still be waiting for the active cycle
+static bool entry_expired(Entry* ent, uint64_t now_ms){
+    return ent->heap_idx != (size_t)-1 && g_data.cache[ent->heap_idx].ttl_val <= now_ms;
+}
+
+// removes an expired entry from `db`
+static void entry_expire(Entry* ent){
+    HNode* node = hm_delete(&g_data.db, &ent->node, &hnode_same);
+    assert(node == &ent->node);
+    propagate({"DEL", ent->key});
+    entry_del(ent);
+    g_data.stats.expired_keys++;
+}
+
+// hashtable lookup that also records the access for eviction,
+// keys past their TTL are removed on the spot and reported as missing
+static Entry* entry_lookup(LookupKey* key){
+    HNode* node = hm_lookup(&g_data.db, &key->node, &entry_eql);
+    if (!node){
+        return nullptr;
+    }
+    Entry* ent = container_of(node, Entry, node);
+    if (entry_expired(ent, get_monotonic_msecs())){
+        if (!is_replica() && !g_data.frozen){
+            entry_expire(ent);
+            return nullptr;
+        }
+        // a replica leaves expiry to its primary, which sends a DEL, and
+        // nothing is removed while the pool reads the keyspace
+        if (!g_repl.applying){
+            return nullptr;
+        }
+    }
+    ent->access = access_touch(ent->access, g_config.maxmemory_policy);
+    return ent;
+}
+
+
+// the entry of the key, or null with `*bad_type` set if it holds another type
+static Entry* entry_expect(LookupKey* key, uint32_t type, bool* bad_type){
+    Entry* ent = entry_lookup(key);
+    *bad_type = ent && ent->type != type;
+    return *bad_type ? nullptr : ent;
+}
+
+// same, an empty one of `type` is created if the key is missing
+static Entry* entry_lookup_or_create(std::string &s, uint32_t type, bool* bad_type){
+    LookupKey key;
+    lookup_key_init(&key, s);
+    Entry* ent = entry_expect(&key, type, bad_type);
+    if (!ent && !*bad_type){
+        ent = entry_new(type);
+        ent->key.swap(key.key);
+        ent->node.hval = key.node.hval;
+        db_insert(ent);
+    }
+    return ent;
+}
+
+// for a container emptied by a command, `key` is what found it
+static void db_delete(LookupKey* key, Entry* ent){
+    hm_delete(&g_data.db, &key->node, &entry_eql);
+    entry_del(ent);
+}
+
+// wakes the clients waiting for data on the key, see the blocking pops section
+static void block_signal(const std::string &key);
+
+//================================== eviction ==================================//
+
+// bytes counted against maxmemory, values waiting in the lazy free queue
+// are excluded as they are going away anyway
+static size_t used_memory(){
+    size_t slots = 0;
+    if (g_data.db.newer.tab){
+        slots += g_data.db.newer.mask+1;
+    }
+    if (g_data.db.older.tab){
+        slots += g_data.db.older.mask+1;
+    }
+    return g_data.mem_used + slots*sizeof(HNode*) + g_data.cache.capacity()*sizeof(HeapNode);
+}
+
+static Entry* heap_entry(size_t pos){
+    return container_of(g_data.cache[pos].ref, Entry, heap_idx);
+}
+
+// the best of a few random samples under the current policy
+// the allkeys policies sample random slots of `db`, the volatile ones sample
+// the TTL heap which holds exactly the keys with a TTL
+static Entry* evict_pick(){
+    uint32_t policy = g_config.maxmemory_policy;
+    if (policy == EVICT_VOLATILE_TTL){
+        // the heap already knows the soonest to expire, no sampling needed
+        return g_data.cache.empty() ? nullptr : heap_entry(0);
+    }
+    Entry* best = nullptr;
+    uint64_t best_score = 0;
+    for (uint32_t i = 0; i < g_config.maxmemory_samples || !best; i++){
+        Entry* ent = nullptr;
+        if (policy == EVICT_VOLATILE_LRU){
+            if (g_data.cache.empty()){
+                return nullptr;
+            }
+            ent = heap_entry(evict_rand() % g_data.cache.size());
+        } else {
+            HNode* node = hm_random(&g_data.db, evict_rand());
+            if (!node){
+                return nullptr;
+            }
+            ent = container_of(node, Entry, node);
+        }
+        uint64_t score = access_score(ent->access, policy);
+        if (!best || score > best_score){
+            best = ent;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+// evicts keys until the memory is under maxmemory or the time budget runs out,
+// in which case the event loop carries on; returns false if nothing can be evicted
+static bool evict_run(uint64_t budget_us){
+    g_data.evict_pending = false;
+    if (!g_config.maxmemory || used_memory() <= g_config.maxmemory){
+        return true;
+    }
+    if (g_config.maxmemory_policy == EVICT_NOEVICTION){
+        return false;
+    }
+    uint64_t start_us = get_monotonic_usecs();
+    while (used_memory() > g_config.maxmemory){
+        Entry* ent = evict_pick();
+        if (!ent){
+            return false;
+        }
+        HNode* node = hm_delete(&g_data.db, &ent->node, &hnode_same);
+        assert(node == &ent->node);
+        propagate({"DEL", ent->key});
+        entry_del(ent);
+        g_data.stats.evicted_keys++;
+        if (get_monotonic_usecs() - start_us >= budget_us){
+            g_data.evict_pending = used_memory() > g_config.maxmemory;
+            break;
+        }
+    }
+    return true;
+}
+
 
 //================================== TTL related queries ==================================//
 
@@ -376,15 +1083,40 @@ static void do_expire(std::vector<std::string>& cmd, Buffer& out){
     }
 
     LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hval = str_hash((uint8_t*)key.key.data(), key.key.size());
-
-    HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eql);
-    if (node){
-        Entry* ent = container_of(node, Entry, node);
+    lookup_key_init(&key, cmd[1]);
+    Entry* ent = entry_lookup(&key);
+    if (ent){
         entry_set_ttl(ent, ttl_ms);
+        // logged as an absolute time so a replay doesn't extend the TTL
+        if (ttl_ms < 0){
+            propagate({"PERSIST", ent->key});
+        } else {
+            propagate({"PEXPIREAT", ent->key, std::to_string(get_unix_msecs() + (uint64_t)ttl_ms)});
+        }
+    }
+    g_data.prop_custom = true;
+    return out_int(out, ent ? 1 : 0);
+}
+
+//+-----------+-----+---------+
+//| PEXPIREAT | key | unix_ms |
+//+-----------+-----+---------+
+// sets the TTL as a wall clock deadline, times in the past expire the key
+// on the next lookup or expiry cycle
+static void do_pexpireat(std::vector<std::string>& cmd, Buffer& out){
+    int64_t unix_ms = 0;
+    if (!str2int(cmd[2], unix_ms)){
+        return out_err(out, ERR_BAD_ARG, "Expected int64");
+    }
+
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+    Entry* ent = entry_lookup(&key);
+    if (ent){
+        int64_t ttl_ms = unix_ms - (int64_t)get_unix_msecs();
+        entry_set_ttl(ent, ttl_ms > 0 ? ttl_ms : 0);
     }
-    return out_int(out, node ? 1 : 0);
+    return out_int(out, ent ? 1 : 0);
 }
 
 //+-----+-----+
@@ -393,15 +1125,12 @@ static void do_expire(std::vector<std::string>& cmd, Buffer& out){
 // gets the TTL value
 static void do_ttl(std::vector<std::string>& cmd, Buffer& out){
     LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hval = str_hash((uint8_t*)key.key.data(), key.key.size());
-
-    HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eql);
-    if (!node){
+    lookup_key_init(&key, cmd[1]);
+    Entry* ent = entry_lookup(&key);
+    if (!ent){
         return out_int(out, -2);    // not found
     }
 
-    Entry* ent = container_of(node, Entry, node);
     if (ent->heap_idx == (size_t)-1){
         return out_int(out, -1);    // no TTL
     }
@@ -417,15 +1146,12 @@ static void do_ttl(std::vector<std::string>& cmd, Buffer& out){
 // removes the TTL value making the key entry persistent
 static void do_persist(std::vector<std::string>& cmd, Buffer& out){
     LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hval = str_hash((uint8_t*)key.key.data(), key.key.size());
-
-    HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eql);
-    if (!node){
+    lookup_key_init(&key, cmd[1]);
+    Entry* ent = entry_lookup(&key);
+    if (!ent){
         return out_int(out, -2);    // not found
     }
 
-    Entry* ent = container_of(node, Entry, node);
     if (ent->heap_idx == (size_t)-1){
         return out_int(out, 1);     // already persistent
     }
@@ -436,21 +1162,132 @@ static void do_persist(std::vector<std::string>& cmd, Buffer& out){
 }
 
 
+//================================== offloaded replies ==================================//
+
+/*
+    large KEYS and ZQUERY replies are built on the thread pool
+    - the reply is split into chunks of `k_offload_chunk_items`, each encoded
+      into its own buffer by a pool task
+    - the keyspace is frozen until the job is done: writes wait with their
+      connection, nothing expires or is evicted and `db` doesn't migrate keys
+      on lookups, so the workers read a stable view while the loop keeps
+      serving reads
+    - the connection stops reading meanwhile, the last chunk wakes the loop
+      through an eventfd and the loop splices the chunks into the reply
+*/
+struct OffloadChunk {
+    OffloadJob* job = nullptr;
+    // KEYS, a range of slots of one table
+    HTab* htab = nullptr;
+    size_t begin = 0;
+    size_t end = 0;
+    // ZQUERY, `count` members from `znode` on
+    ZNode* znode = nullptr;
+    size_t count = 0;
+    Buffer out;
+    uint32_t n = 0;
+};
+
+struct OffloadJob {
+    Conn* conn = nullptr;           // null once the client is gone
+    bool keys = false;              // KEYS also freezes the slots of `db`
+    uint64_t now_ms = 0;
+    uint64_t start_ns = 0;
+    SlowCmd slow;                   // the request so far, for the slow log
+    std::vector<OffloadChunk> chunks;
+    std::atomic<size_t> left{0};
+    std::atomic<size_t> bytes{0};   // the chunks give up past `k_max_msg`
+};
+
+static struct {
+    int efd = -1;
+    std::mutex mu;
+    std::vector<OffloadJob*> done;  // under `mu`
+    OffloadJob* started = nullptr;  // by the command being executed
+    struct {
+        uint64_t jobs = 0;
+        uint64_t parked_writes = 0;
+    } stats;
+} g_offload;
+
+static void offload_forget(Conn* conn){
+    if (conn->offload){
+        conn->offload->conn = nullptr;
+    }
+    if (conn->parked){
+        std::vector<Conn*> &v = g_data.parked;
+        v.erase(std::find(v.begin(), v.end(), conn));
+    }
+}
+
+// runs on a pool worker, reads the frozen keyspace
+static void offload_chunk_task(void* arg){
+    OffloadChunk* ch = (OffloadChunk*) arg;
+    OffloadJob* job = ch->job;
+    if (ch->htab){
+        for (size_t i = ch->begin; i < ch->end && job->bytes <= k_max_msg; i++){
+            for (HNode* node = ch->htab->tab[i]; node; node = node->next){
+                Entry* ent = container_of(node, Entry, node);
+                if (!entry_expired(ent, job->now_ms)){
+                    out_str(ch->out, ent->key.data(), ent->key.size());
+                    ch->n++;
+                }
+            }
+        }
+    } else if (job->bytes <= k_max_msg){
+        ZNode* znode = ch->znode;
+        for (size_t i = 0; i < ch->count && znode; i++){
+            out_str(ch->out, znode->name, znode->len);
+            out_dbl(ch->out, znode->score);
+            ch->n += 2;
+            znode = znode_offset(znode, +1);
+        }
+    }
+    job->bytes += ch->out.size();
+    if (--job->left > 0){
+        return;
+    }
+    std::lock_guard<std::mutex> lock(g_offload.mu);
+    g_offload.done.push_back(job);
+    uint64_t one = 1;
+    if (write(g_offload.efd, &one, sizeof(one)) < 0){
+        msg_err("eventfd write() error");
+    }
+}
+
+// whether the running command may reply later
+static bool offload_possible(){
+    return g_data.client && g_offload.efd >= 0;
+}
+
+static void offload_start(OffloadJob* job){
+    g_data.frozen++;
+    if (job->keys){
+        g_data.db.frozen++;
+    }
+    g_offload.started = job;
+    g_offload.stats.jobs++;
+    job->start_ns = get_monotonic_nsecs();
+    job->left = job->chunks.size();
+    for (OffloadChunk &ch : job->chunks){
+        ch.job = job;
+        g_data.thread_pool.produce(&offload_chunk_task, &ch);
+    }
+}
+
 //================================== GET SET DEL KEYS queries ==================================//
 
 
 static void do_get(std::vector<std::string> &cmd, Buffer &out){
     // a dummy struct just for the lookup
     LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hval = str_hash((uint8_t*)key.key.data(), key.key.size());
+    lookup_key_init(&key, cmd[1]);
     // hashtable lookup
-    HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eql);
-    if (!node) {
+    Entry *ent = entry_lookup(&key);
+    if (!ent) {
         return out_nil(out);
     }
     // copy the value
-    Entry *ent = container_of(node, Entry, node);
     if(ent->type != T_STR){
         return out_err(out, ERR_BAD_TYP, "Not a string value");
     }
@@ -459,48 +1296,159 @@ static void do_get(std::vector<std::string> &cmd, Buffer &out){
 
 static void do_set(std::vector<std::string> &cmd, Buffer &out){
     LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hval = str_hash((uint8_t*)key.key.data(), key.key.size());
+    lookup_key_init(&key, cmd[1]);
     // hashtable lookup
-    HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eql);
-    if (node) {
-        Entry *ent = container_of(node, Entry, node);
+    Entry *ent = entry_lookup(&key);
+    if (ent) {
         if(ent->type!=T_STR){
             return out_err(out, ERR_BAD_TYP, "Not a string value!");
         }
+        entry_snap_cow(ent);
+        size_t before = entry_mem(ent);
         ent->str.swap(cmd[2]);
+        entry_mem_update(ent, before);
+        if (cmd[2].capacity() > k_lazyfree_min_str){
+            // the old value is large, don't free it inline
+            std::string* old = new std::string();
+            old->swap(cmd[2]);
+            lazyfree_push(&str_dispose, old, old->capacity());
+        }
     } else {
-        Entry* ent = entry_new(T_STR);
+        ent = entry_new(T_STR);
         ent->key.swap(key.key);
         ent->node.hval = key.node.hval;
         ent->str.swap(cmd[2]);
-        hm_insert(&g_data.db, &ent->node);
+        db_insert(ent);
     }
     return out_nil(out);
 }
 
 static void do_del(std::vector<std::string> &cmd, Buffer &out){
     LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hval = str_hash((uint8_t*)key.key.data(), key.key.size());
+    lookup_key_init(&key, cmd[1]);
     HNode* node = hm_delete(&g_data.db, &key.node, &entry_eql);
+    bool found = node && !entry_expired(container_of(node, Entry, node), get_monotonic_msecs());
     if (node) {
+        g_data.stats.expired_keys += !found;
         entry_del(container_of(node, Entry, node));
     }
-    return out_int(out, node ? 1 : 0);
+    return out_int(out, found ? 1 : 0);
+}
+
+//+--------+-----+
+//| UNLINK | key |
+//+--------+-----+
+// removes the key right away, the value is always released by the lazy free queue
+static void do_unlink(std::vector<std::string> &cmd, Buffer &out){
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+    HNode* node = hm_delete(&g_data.db, &key.node, &entry_eql);
+    bool found = node && !entry_expired(container_of(node, Entry, node), get_monotonic_msecs());
+    if (node) {
+        g_data.stats.expired_keys += !found;
+        Entry* ent = container_of(node, Entry, node);
+        entry_snap_cow(ent);
+        g_data.mem_used -= entry_mem(ent);
+        entry_set_ttl(ent, -1);
+        lazyfree_push(&entry_dispose, ent, entry_mem(ent));
+    }
+    return out_int(out, found ? 1 : 0);
+}
+
+static bool cb_snap_cow(HNode* node, void*){
+    entry_snap_cow(container_of(node, Entry, node));
+    return true;
+}
+
+// drops every key, `async` hands the old keyspace to the lazy free queue
+static void db_flush(bool async){
+    // a running nofork save still needs the keys it hasn't reached
+    if (g_data.snap_running){
+        hm_foreach(&g_data.db, &cb_snap_cow, nullptr);
+    }
+    HMap* db = new HMap();
+    *db = g_data.db;
+    g_data.db = HMap{};
+    g_data.cache.clear();
+    g_data.mem_used = 0;
+    if (async){
+        lazyfree_push(&db_dispose, db, 0);
+    } else {
+        db_dispose(db, (size_t)-1);
+        while (lazyfree_pending()){
+            lazyfree_run((uint64_t)-1);
+        }
+    }
+}
+
+//+----------+---------+
+//| FLUSHALL | [ASYNC] |
+//+----------+---------+
+static void do_flushall(std::vector<std::string> &cmd, Buffer &out){
+    bool async = cmd.size() == 2;
+    if (cmd.size() > 2 || (async && cmd[1] != "ASYNC")){
+        return out_err(out, ERR_BAD_ARG, "Expected ASYNC");
+    }
+    db_flush(async);
+    return out_nil(out);
+}
+
+//+----------+
+//| LAZYFREE |
+//+----------+
+// the lazy free backlog: [pending jobs, pending bytes, freed jobs, freed bytes]
+static void do_lazyfree(std::vector<std::string> &, Buffer &out){
+    const LazyFreeStats &st = lazyfree_stats();
+    out_arr(out, 4);
+    out_int(out, (int64_t)st.pending_jobs);
+    out_int(out, (int64_t)st.pending_bytes);
+    out_int(out, (int64_t)st.freed_jobs);
+    out_int(out, (int64_t)st.freed_bytes);
 }
 
-// the call back function on each key
+struct KeysArg {
+    Buffer* out;
+    uint64_t now_ms;
+    uint32_t n;
+};
+
+// the call back function on each key, skipping the expired ones
 static bool cb_keys(HNode* node, void* arg){
-    Buffer &out = *(Buffer*) arg;
-    const std::string &key = container_of(node, Entry, node)->key;
-    out_str(out, key.data(), key.size());
+    KeysArg &ka = *(KeysArg*) arg;
+    Entry* ent = container_of(node, Entry, node);
+    if (entry_expired(ent, ka.now_ms)){
+        return true;
+    }
+    out_str(*ka.out, ent->key.data(), ent->key.size());
+    ka.n++;
     return true;
 }
 
 static void do_keys(std::vector<std::string> &, Buffer &out){
-    out_arr(out, (uint32_t)hm_size(&g_data.db));
-    hm_foreach(&g_data.db, &cb_keys, (void *)&out);
+    if (offload_possible() && hm_size(&g_data.db) >= k_offload_min_items){
+        OffloadJob* job = new OffloadJob();
+        job->keys = true;
+        job->now_ms = get_monotonic_msecs();
+        for (HTab* htab : {&g_data.db.newer, &g_data.db.older}){
+            if (!htab->tab){
+                continue;
+            }
+            size_t slots = htab->mask + 1;
+            size_t nchunks = htab->size / k_offload_chunk_items + 1;
+            for (size_t i = 0; i < nchunks; i++){
+                OffloadChunk ch;
+                ch.htab = htab;
+                ch.begin = slots * i / nchunks;
+                ch.end = slots * (i + 1) / nchunks;
+                job->chunks.push_back(std::move(ch));
+            }
+        }
+        return offload_start(job);
+    }
+    KeysArg ka = {&out, get_monotonic_msecs(), 0};
+    size_t ctx = out_begin_arr(out);
+    hm_foreach(&g_data.db, &cb_keys, (void *)&ka);
+    out_end_arr(out, ctx, ka.n);
 }
 
 //================================== Redis range and rank related queries ==================================//
@@ -516,45 +1464,44 @@ static void do_zadd(std::vector<std::string>& cmd, Buffer& out){
 
     // lookup or create the zset
     LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hval = str_hash((uint8_t*)key.key.data(), key.key.size());
-    HNode* hnode = hm_lookup(&g_data.db, &key.node, &entry_eql);
-
-    Entry* ent = nullptr;
-    if (!hnode) {
+    lookup_key_init(&key, cmd[1]);
+    Entry* ent = entry_lookup(&key);
+    if (!ent) {
         ent = entry_new(T_ZSET);
         ent->key.swap(key.key);
         ent->node.hval = key.node.hval;
-        hm_insert(&g_data.db, &ent->node);
-    } else {
-        ent = container_of(hnode, Entry, node);
-        if(ent->type != T_ZSET){
-            return out_err(out, ERR_BAD_TYP, "expected zset");
-        }
+        db_insert(ent);
+    } else if(ent->type != T_ZSET){
+        return out_err(out, ERR_BAD_TYP, "expected zset");
     }
 
     const std::string &name = cmd[3];
+    entry_snap_cow(ent);
+    size_t before = entry_mem(ent);
     bool added = zset_insert(&ent->zset, name.data(), name.size(), score);
+    entry_mem_update(ent, before);
+    block_signal(ent->key);
     return out_int(out, (int64_t)added);
 }
 
-static ZSet* expect_zset(std::string& s){
+static Entry* expect_zset(std::string& s, ZSet** zset){
     LookupKey key;
-    key.key.swap(s);
-    key.node.hval = str_hash((uint8_t*)key.key.data(), key.key.size());
-    HNode* hnode = hm_lookup(&g_data.db, &key.node, &entry_eql);
-    if (!hnode){    // a non-existent key is treated as an empty zset
-        return (ZSet*)&k_empty_zset;
+    lookup_key_init(&key, s);
+    Entry* ent = entry_lookup(&key);
+    if (!ent){      // a non-existent key is treated as an empty zset
+        *zset = (ZSet*)&k_empty_zset;
+        return nullptr;
     }
-    Entry* ent = container_of(hnode, Entry, node);
-    return ent->type == T_ZSET ? &ent->zset : nullptr;
+    *zset = ent->type == T_ZSET ? &ent->zset : nullptr;
+    return ent;
 }
 
 //+------+------+------+
 //| ZREM | zset | name |
 //+------+------+------+
 static void do_zrem(std::vector<std::string>& cmd, Buffer &out){
-    ZSet* zset = expect_zset(cmd[1]);
+    ZSet* zset = nullptr;
+    Entry* ent = expect_zset(cmd[1], &zset);
     if (!zset){
         return out_err(out, ERR_BAD_TYP, "Expected zset");
     }
@@ -562,7 +1509,10 @@ static void do_zrem(std::vector<std::string>& cmd, Buffer &out){
     const std::string &name = cmd[2];
     ZNode* znode = zset_lookup(zset, name.data(), name.size());
     if (znode){
+        entry_snap_cow(ent);
+        size_t before = entry_mem(ent);
         zset_delete(zset, znode);
+        entry_mem_update(ent, before);
     }
     return out_int(out, znode ? 1 : 0);
 }
@@ -571,7 +1521,8 @@ static void do_zrem(std::vector<std::string>& cmd, Buffer &out){
 //| ZSCORE | zset | name |
 //+--------+------+------+
 static void do_zscore(std::vector<std::string>& cmd, Buffer &out) {
-    ZSet* zset = expect_zset(cmd[1]);
+    ZSet* zset = nullptr;
+    expect_zset(cmd[1], &zset);
     if (!zset){
         return out_err(out, ERR_BAD_TYP, "Expected zset");
     }
@@ -581,137 +1532,3365 @@ static void do_zscore(std::vector<std::string>& cmd, Buffer &out) {
     return znode ? out_dbl(out, znode->score) : out_nil(out);
 }
 
-//+--------+-----+-------+------+--------+-------+-----+------+
-//| ZQUERY | key | score | name | offset | limit | len | strn |
-//+--------+-----+-------+------+--------+-------+-----+------+
-static void do_zquery(std::vector<std::string>& cmd, Buffer& out) {
-    // parse arguments
-    double score = 0;
-    if (!str2dbl(cmd[2], score)){
-        return out_err(out, ERR_BAD_ARG, "Expected float");
+//+--------+-----+-------+------+--------+-------+-----+------+
+//| ZQUERY | key | score | name | offset | limit | len | strn |
+//+--------+-----+-------+------+--------+-------+-----+------+
+static void do_zquery(std::vector<std::string>& cmd, Buffer& out) {
+    // parse arguments
+    double score = 0;
+    if (!str2dbl(cmd[2], score)){
+        return out_err(out, ERR_BAD_ARG, "Expected float");
+    }
+    const std::string &name = cmd[3];
+    int64_t offset = 0, limit = 0;
+    if (!str2int(cmd[4], offset) || !str2int(cmd[5], limit)){
+        return out_err(out, ERR_BAD_ARG, "Expected int");
+    }
+
+    // get the zset
+    ZSet* zset = nullptr;
+    expect_zset(cmd[1], &zset);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "Expected zset");
+    }
+
+    // seek the key
+    if (limit <= 0){
+        return out_arr(out, 0);
+    }
+    ZNode* znode = zset_seekge(zset, score, name.data(), name.size());
+    znode = znode_offset(znode, offset);
+
+    // `limit` counts names and scores, a large reply is built by the pool
+    size_t items = (size_t)(limit / 2 + limit % 2);
+    if (znode && offload_possible()){
+        size_t left = avl_size(zset->root) - (size_t)avl_rank(&znode->tree);
+        items = items < left ? items : left;
+    }
+    if (znode && offload_possible() && items >= k_offload_min_items){
+        OffloadJob* job = new OffloadJob();
+        for (size_t pos = 0; pos < items; pos += k_offload_chunk_items){
+            OffloadChunk ch;
+            ch.znode = pos ? znode_offset(znode, (int64_t)pos) : znode;
+            ch.count = items - pos < k_offload_chunk_items ? items - pos : k_offload_chunk_items;
+            job->chunks.push_back(std::move(ch));
+        }
+        return offload_start(job);
+    }
+
+    // output
+    size_t ctx = out_begin_arr(out);
+    int64_t n = 0;
+    while(znode && n < limit){
+        out_str(out,znode->name, znode->len);
+        out_dbl(out, znode->score);
+        znode = znode_offset(znode, +1);
+        n += 2;
+    }
+    out_end_arr(out, ctx, (uint32_t)n);
+}
+
+//================================== hash queries ==================================//
+
+static bool hash_set_field(Entry* ent, const std::string &field, const std::string &val){
+    return hash_set(ent->hash.get(), field.data(), field.size(), val.data(), val.size(),
+        g_config.hash_max_packed_entries, g_config.hash_max_packed_value);
+}
+
+//+------+-----+-------+-------+-----+
+//| HSET | key | field | value | ... |
+//+------+-----+-------+-------+-----+
+// the number of fields added, not counting the updated ones
+static void do_hset(std::vector<std::string> &cmd, Buffer &out){
+    if (cmd.size() % 2 != 0){
+        return out_err(out, ERR_BAD_ARG, "Expected field value pairs");
+    }
+    bool bad_type = false;
+    Entry* ent = entry_lookup_or_create(cmd[1], T_HASH, &bad_type);
+    if (!ent){
+        return out_err(out, ERR_BAD_TYP, "Expected hash");
+    }
+    entry_snap_cow(ent);
+    size_t before = entry_mem(ent);
+    int64_t added = 0;
+    for (size_t i = 2; i < cmd.size(); i += 2){
+        added += hash_set_field(ent, cmd[i], cmd[i+1]);
+    }
+    entry_mem_update(ent, before);
+    return out_int(out, added);
+}
+
+//+------+-----+-------+
+//| HGET | key | field |
+//+------+-----+-------+
+static void do_hget(std::vector<std::string> &cmd, Buffer &out){
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+    bool bad_type = false;
+    Entry* ent = entry_expect(&key, T_HASH, &bad_type);
+    if (bad_type){
+        return out_err(out, ERR_BAD_TYP, "Expected hash");
+    }
+    const char* val = nullptr;
+    size_t vlen = 0;
+    if (!ent || !hash_get(ent->hash.get(), cmd[2].data(), cmd[2].size(), &val, &vlen)){
+        return out_nil(out);
+    }
+    return out_str(out, val, vlen);
+}
+
+//+-------+-----+-------+-----+
+//| HMGET | key | field | ... |
+//+-------+-----+-------+-----+
+// a nil for each missing field
+static void do_hmget(std::vector<std::string> &cmd, Buffer &out){
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+    bool bad_type = false;
+    Entry* ent = entry_expect(&key, T_HASH, &bad_type);
+    if (bad_type){
+        return out_err(out, ERR_BAD_TYP, "Expected hash");
+    }
+    out_arr(out, (uint32_t)(cmd.size() - 2));
+    for (size_t i = 2; i < cmd.size(); i++){
+        const char* val = nullptr;
+        size_t vlen = 0;
+        if (ent && hash_get(ent->hash.get(), cmd[i].data(), cmd[i].size(), &val, &vlen)){
+            out_str(out, val, vlen);
+        } else {
+            out_nil(out);
+        }
+    }
+}
+
+//+------+-----+-------+-----+
+//| HDEL | key | field | ... |
+//+------+-----+-------+-----+
+// the key goes away with its last field
+static void do_hdel(std::vector<std::string> &cmd, Buffer &out){
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+    bool bad_type = false;
+    Entry* ent = entry_expect(&key, T_HASH, &bad_type);
+    if (bad_type){
+        return out_err(out, ERR_BAD_TYP, "Expected hash");
+    }
+    if (!ent){
+        return out_int(out, 0);
+    }
+    entry_snap_cow(ent);
+    size_t before = entry_mem(ent);
+    int64_t removed = 0;
+    for (size_t i = 2; i < cmd.size(); i++){
+        removed += hash_del(ent->hash.get(), cmd[i].data(), cmd[i].size());
+    }
+    entry_mem_update(ent, before);
+    if (hash_len(ent->hash.get()) == 0){
+        db_delete(&key, ent);
+    }
+    return out_int(out, removed);
+}
+
+//+------+-----+
+//| HLEN | key |
+//+------+-----+
+static void do_hlen(std::vector<std::string> &cmd, Buffer &out){
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+    bool bad_type = false;
+    Entry* ent = entry_expect(&key, T_HASH, &bad_type);
+    if (bad_type){
+        return out_err(out, ERR_BAD_TYP, "Expected hash");
+    }
+    return out_int(out, ent ? (int64_t)hash_len(ent->hash.get()) : 0);
+}
+
+static bool cb_hgetall(const char* field, size_t flen, const char* val, size_t vlen, void* arg){
+    Buffer &out = *(Buffer*) arg;
+    out_str(out, field, flen);
+    out_str(out, val, vlen);
+    return true;
+}
+
+//+---------+-----+
+//| HGETALL | key |
+//+---------+-----+
+// a map of the fields to their values, a flat array for RESP2 clients
+static void do_hgetall(std::vector<std::string> &cmd, Buffer &out){
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+    bool bad_type = false;
+    Entry* ent = entry_expect(&key, T_HASH, &bad_type);
+    if (bad_type){
+        return out_err(out, ERR_BAD_TYP, "Expected hash");
+    }
+    if (!ent){
+        return out_map(out, 0);
+    }
+    out_map(out, (uint32_t)hash_len(ent->hash.get()));
+    hash_foreach(ent->hash.get(), &cb_hgetall, &out);
+}
+
+//+---------+-----+-------+-----------+
+//| HINCRBY | key | field | increment |
+//+---------+-----+-------+-----------+
+// a missing field counts as 0, the reply is the new value
+static void do_hincrby(std::vector<std::string> &cmd, Buffer &out){
+    int64_t incr = 0;
+    if (!str2int(cmd[3], incr)){
+        return out_err(out, ERR_BAD_ARG, "Expected int");
+    }
+    bool bad_type = false;
+    Entry* ent = entry_lookup_or_create(cmd[1], T_HASH, &bad_type);
+    if (!ent){
+        return out_err(out, ERR_BAD_TYP, "Expected hash");
+    }
+    const char* val = nullptr;
+    size_t vlen = 0;
+    int64_t cur = 0;
+    if (hash_get(ent->hash.get(), cmd[2].data(), cmd[2].size(), &val, &vlen)
+        && !str2int(std::string(val, vlen), cur))
+    {
+        return out_err(out, ERR_BAD_ARG, "Hash value is not an integer");
+    }
+    if (__builtin_add_overflow(cur, incr, &cur)){
+        return out_err(out, ERR_BAD_ARG, "Increment would overflow");
+    }
+    entry_snap_cow(ent);
+    size_t before = entry_mem(ent);
+    hash_set_field(ent, cmd[2], std::to_string(cur));
+    entry_mem_update(ent, before);
+    return out_int(out, cur);
+}
+
+//================================== list queries ==================================//
+
+static void list_push_cmd(std::vector<std::string> &cmd, Buffer &out, bool front){
+    bool bad_type = false;
+    Entry* ent = entry_lookup_or_create(cmd[1], T_LIST, &bad_type);
+    if (!ent){
+        return out_err(out, ERR_BAD_TYP, "Expected list");
+    }
+    entry_snap_cow(ent);
+    size_t before = entry_mem(ent);
+    for (size_t i = 2; i < cmd.size(); i++){
+        list_push(ent->list.get(), front, cmd[i].data(), cmd[i].size(),
+            g_config.list_chunk_size, g_config.list_compress_depth);
+    }
+    entry_mem_update(ent, before);
+    block_signal(ent->key);
+    return out_int(out, (int64_t)list_len(ent->list.get()));
+}
+
+//+-------+-----+-------+-----+
+//| LPUSH | key | value | ... |
+//+-------+-----+-------+-----+
+// each value goes to the head in turn, the reply is the new length
+static void do_lpush(std::vector<std::string> &cmd, Buffer &out){
+    return list_push_cmd(cmd, out, true);
+}
+
+//+-------+-----+-------+-----+
+//| RPUSH | key | value | ... |
+//+-------+-----+-------+-----+
+static void do_rpush(std::vector<std::string> &cmd, Buffer &out){
+    return list_push_cmd(cmd, out, false);
+}
+
+static void list_pop_cmd(std::vector<std::string> &cmd, Buffer &out, bool front){
+    int64_t count = 1;
+    if (cmd.size() > 3 || (cmd.size() == 3 && (!str2int(cmd[2], count) || count < 0))){
+        return out_err(out, ERR_BAD_ARG, "Expected a count");
+    }
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+    bool bad_type = false;
+    Entry* ent = entry_expect(&key, T_LIST, &bad_type);
+    if (bad_type){
+        return out_err(out, ERR_BAD_TYP, "Expected list");
+    }
+    if (!ent){
+        return out_nil(out);
+    }
+    List* list = ent->list.get();
+    size_t n = std::min((size_t)count, list_len(list));
+    if (cmd.size() == 3){
+        out_arr(out, (uint32_t)n);
+    }
+    entry_snap_cow(ent);
+    size_t before = entry_mem(ent);
+    std::string val;
+    for (size_t i = 0; i < n; i++){
+        list_pop(list, front, val, g_config.list_compress_depth);
+        out_str(out, val.data(), val.size());
+    }
+    entry_mem_update(ent, before);
+    if (list_len(list) == 0){
+        db_delete(&key, ent);
+    }
+}
+
+//+------+-----+---------+
+//| LPOP | key | [count] |
+//+------+-----+---------+
+// the head value, or an array of up to `count` of them
+static void do_lpop(std::vector<std::string> &cmd, Buffer &out){
+    return list_pop_cmd(cmd, out, true);
+}
+
+//+------+-----+---------+
+//| RPOP | key | [count] |
+//+------+-----+---------+
+static void do_rpop(std::vector<std::string> &cmd, Buffer &out){
+    return list_pop_cmd(cmd, out, false);
+}
+
+//+------+-----+
+//| LLEN | key |
+//+------+-----+
+static void do_llen(std::vector<std::string> &cmd, Buffer &out){
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+    bool bad_type = false;
+    Entry* ent = entry_expect(&key, T_LIST, &bad_type);
+    if (bad_type){
+        return out_err(out, ERR_BAD_TYP, "Expected list");
+    }
+    return out_int(out, ent ? (int64_t)list_len(ent->list.get()) : 0);
+}
+
+// negative indexes count from the tail, both ends are inclusive; false if
+// nothing is in range
+static bool list_index_range(int64_t start, int64_t stop, size_t len, size_t* from, size_t* to){
+    int64_t n = (int64_t)len;
+    start = start < 0 ? std::max(n + start, (int64_t)0) : start;
+    stop = stop < 0 ? n + stop : std::min(stop, n - 1);
+    if (start > stop || start >= n){
+        return false;
+    }
+    *from = (size_t)start;
+    *to = (size_t)stop;
+    return true;
+}
+
+static bool cb_lrange(const char* val, size_t len, void* arg){
+    out_str(*(Buffer*)arg, val, len);
+    return true;
+}
+
+//+--------+-----+-------+------+
+//| LRANGE | key | start | stop |
+//+--------+-----+-------+------+
+static void do_lrange(std::vector<std::string> &cmd, Buffer &out){
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)){
+        return out_err(out, ERR_BAD_ARG, "Expected int");
+    }
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+    bool bad_type = false;
+    Entry* ent = entry_expect(&key, T_LIST, &bad_type);
+    if (bad_type){
+        return out_err(out, ERR_BAD_TYP, "Expected list");
+    }
+    size_t from = 0, to = 0;
+    if (!ent || !list_index_range(start, stop, list_len(ent->list.get()), &from, &to)){
+        return out_arr(out, 0);
+    }
+    out_arr(out, (uint32_t)(to - from + 1));
+    list_range(ent->list.get(), from, to, &cb_lrange, &out);
+}
+
+//+-------+-----+-------+------+
+//| LTRIM | key | start | stop |
+//+-------+-----+-------+------+
+// keeps [start, stop], the key goes away if that is empty
+static void do_ltrim(std::vector<std::string> &cmd, Buffer &out){
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)){
+        return out_err(out, ERR_BAD_ARG, "Expected int");
+    }
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+    bool bad_type = false;
+    Entry* ent = entry_expect(&key, T_LIST, &bad_type);
+    if (bad_type){
+        return out_err(out, ERR_BAD_TYP, "Expected list");
+    }
+    if (!ent){
+        return out_nil(out);
+    }
+    size_t from = 0, to = 0;
+    if (!list_index_range(start, stop, list_len(ent->list.get()), &from, &to)){
+        db_delete(&key, ent);
+        return out_nil(out);
+    }
+    entry_snap_cow(ent);
+    size_t before = entry_mem(ent);
+    list_trim(ent->list.get(), from, to, g_config.list_compress_depth);
+    entry_mem_update(ent, before);
+    return out_nil(out);
+}
+
+//================================== probabilistic types ==================================//
+
+// HyperLogLogs and Bloom filters keep their image (see hll.h and bloom.h) in
+// `Entry::str`, under their own types so the string commands don't touch them
+
+//+-------+-----+---------+-----+
+//| PFADD | key | element | ... |
+//+-------+-----+---------+-----+
+// 1 if the estimate may have changed, or the key was created
+static void do_pfadd(std::vector<std::string> &cmd, Buffer &out){
+    bool bad_type = false;
+    Entry* ent = entry_lookup_or_create(cmd[1], T_HLL, &bad_type);
+    if (!ent){
+        return out_err(out, ERR_BAD_TYP, "Expected hyperloglog");
+    }
+    entry_snap_cow(ent);
+    size_t before = entry_mem(ent);
+    bool changed = ent->str.empty();
+    if (changed){
+        hll_init(ent->str);
+    }
+    for (size_t i = 2; i < cmd.size(); i++){
+        changed |= hll_add(ent->str, cmd[i].data(), cmd[i].size(), g_config.hll_sparse_max_bytes);
+    }
+    entry_mem_update(ent, before);
+    return out_int(out, changed);
+}
+
+//+---------+-----+-----+
+//| PFCOUNT | key | ... |
+//+---------+-----+-----+
+// the estimated number of distinct elements added to any of the keys
+static void do_pfcount(std::vector<std::string> &cmd, Buffer &out){
+    if (cmd.size() == 2){
+        LookupKey key;
+        lookup_key_init(&key, cmd[1]);
+        bool bad_type = false;
+        Entry* ent = entry_expect(&key, T_HLL, &bad_type);
+        if (bad_type){
+            return out_err(out, ERR_BAD_TYP, "Expected hyperloglog");
+        }
+        if (!ent){
+            return out_int(out, 0);
+        }
+        // the cached estimate is part of the image
+        if (hll_stale(ent->str)){
+            entry_snap_cow(ent);
+        }
+        return out_int(out, (int64_t)hll_count(ent->str));
+    }
+    std::vector<uint8_t> raw(k_hll_registers, 0);
+    for (size_t i = 1; i < cmd.size(); i++){
+        LookupKey key;
+        lookup_key_init(&key, cmd[i]);
+        bool bad_type = false;
+        Entry* ent = entry_expect(&key, T_HLL, &bad_type);
+        if (bad_type){
+            return out_err(out, ERR_BAD_TYP, "Expected hyperloglog");
+        }
+        if (ent){
+            hll_merge(raw.data(), ent->str);
+        }
+    }
+    return out_int(out, (int64_t)hll_count_raw(raw.data()));
+}
+
+//+---------+------+-----+-----+
+//| PFMERGE | dest | src | ... |
+//+---------+------+-----+-----+
+// dest becomes the union of itself and the sources, dense
+static void do_pfmerge(std::vector<std::string> &cmd, Buffer &out){
+    std::vector<uint8_t> raw(k_hll_registers, 0);
+    for (size_t i = 2; i < cmd.size(); i++){
+        LookupKey key;
+        lookup_key_init(&key, cmd[i]);
+        bool bad_type = false;
+        Entry* ent = entry_expect(&key, T_HLL, &bad_type);
+        if (bad_type){
+            return out_err(out, ERR_BAD_TYP, "Expected hyperloglog");
+        }
+        if (ent){
+            hll_merge(raw.data(), ent->str);
+        }
+    }
+    bool bad_type = false;
+    Entry* ent = entry_lookup_or_create(cmd[1], T_HLL, &bad_type);
+    if (!ent){
+        return out_err(out, ERR_BAD_TYP, "Expected hyperloglog");
+    }
+    entry_snap_cow(ent);
+    size_t before = entry_mem(ent);
+    if (!ent->str.empty()){
+        hll_merge(raw.data(), ent->str);
+    }
+    hll_from_raw(ent->str, raw.data());
+    entry_mem_update(ent, before);
+    return out_nil(out);
+}
+
+// the filter of a BF.ADD, created with the defaults if missing
+static Entry* bloom_lookup_or_create(std::string &key, Buffer &out){
+    bool bad_type = false;
+    Entry* ent = entry_lookup_or_create(key, T_BLOOM, &bad_type);
+    if (!ent){
+        out_err(out, ERR_BAD_TYP, "Expected bloom filter");
+        return nullptr;
+    }
+    if (ent->str.empty()){
+        size_t before = entry_mem(ent);
+        bloom_init(ent->str, k_bloom_capacity, k_bloom_error);
+        entry_mem_update(ent, before);
+    }
+    return ent;
+}
+
+//+------------+-----+-------+----------+
+//| BF.RESERVE | key | error | capacity |
+//+------------+-----+-------+----------+
+// an empty filter for `capacity` elements at the false positive rate
+// `error`, it grows past that; BF.ADD creates one for 100 at 1% otherwise
+static void do_bf_reserve(std::vector<std::string> &cmd, Buffer &out){
+    double error = 0;
+    int64_t capacity = 0;
+    if (!str2dbl(cmd[2], error) || !(error > 0 && error < 1)){
+        return out_err(out, ERR_BAD_ARG, "Expected an error rate in (0, 1)");
+    }
+    if (!str2int(cmd[3], capacity) || capacity < 1 || (uint64_t)capacity > k_bloom_max_capacity
+        || bloom_size((uint64_t)capacity, error) > k_bloom_max_size)
+    {
+        return out_err(out, ERR_BAD_ARG, "Expected a capacity, the filter is too large");
+    }
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+    if (entry_lookup(&key)){
+        return out_err(out, ERR_BAD_ARG, "Key already exists");
+    }
+    Entry* ent = entry_new(T_BLOOM);
+    ent->key.swap(key.key);
+    ent->node.hval = key.node.hval;
+    bloom_init(ent->str, (uint64_t)capacity, error);
+    db_insert(ent);
+    return out_nil(out);
+}
+
+//+--------+-----+------+
+//| BF.ADD | key | item |
+//+--------+-----+------+
+// 0 if the item may have been added before
+static void do_bf_add(std::vector<std::string> &cmd, Buffer &out){
+    Entry* ent = bloom_lookup_or_create(cmd[1], out);
+    if (!ent){
+        return;
+    }
+    if (bloom_next_size(ent->str) > k_bloom_max_size){
+        return out_err(out, ERR_TOO_BIG, "Bloom filter is full");
+    }
+    entry_snap_cow(ent);
+    size_t before = entry_mem(ent);
+    bool added = bloom_add(ent->str, cmd[2].data(), cmd[2].size());
+    entry_mem_update(ent, before);
+    return out_int(out, added);
+}
+
+//+-----------+-----+------+
+//| BF.EXISTS | key | item |
+//+-----------+-----+------+
+// 1 if the item may have been added, 0 if it certainly wasn't
+static void do_bf_exists(std::vector<std::string> &cmd, Buffer &out){
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+    bool bad_type = false;
+    Entry* ent = entry_expect(&key, T_BLOOM, &bad_type);
+    if (bad_type){
+        return out_err(out, ERR_BAD_TYP, "Expected bloom filter");
+    }
+    return out_int(out, ent && bloom_exists(ent->str, cmd[2].data(), cmd[2].size()));
+}
+
+//+---------+-----+-------------+-------+
+//| RESTORE | key | hll | bloom | image |
+//+---------+-----+-------------+-------+
+// a HyperLogLog or Bloom filter from its image, as written by BGREWRITEAOF;
+// the key must not exist
+static void do_restore(std::vector<std::string> &cmd, Buffer &out){
+    uint32_t type = cmd[2] == "hll" ? T_HLL : cmd[2] == "bloom" ? T_BLOOM : T_INIT;
+    bool valid = type == T_HLL ? hll_valid(cmd[3]) : type == T_BLOOM && bloom_valid(cmd[3]);
+    if (!valid){
+        return out_err(out, ERR_BAD_ARG, "Bad image");
+    }
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+    if (entry_lookup(&key)){
+        return out_err(out, ERR_BAD_ARG, "Key already exists");
+    }
+    Entry* ent = entry_new(type);
+    ent->key.swap(key.key);
+    ent->node.hval = key.node.hval;
+    ent->str.swap(cmd[3]);
+    db_insert(ent);
+    return out_nil(out);
+}
+
+//================================== blocking pops ==================================//
+
+/*
+    BLPOP, BRPOP and BZPOPMIN wait for data with the connection parked, not the thread
+    - a waiting command is a BlockReq with one BlockWaiter per key, each on
+      the FIFO list of its key in `g_block.keys`; the connection leaves the
+      idle list and only buffers what it reads, so a waiting client costs
+      nothing until data arrives
+    - pushes and ZADD mark their key ready if anyone waits on it, and after
+      the command the ready keys are served oldest waiter first; each served
+      pop is propagated as the plain pop it amounts to, after the push
+    - deadlines are on their own heap, expired by process_timers() and
+      bounding the poll() timeout through nearest_timeout_ms()
+    - the woken connections resume their pipelined requests from the event
+      loop, not from within the command that woke them
+*/
+enum {
+    BLOCK_LPOP      = 0,
+    BLOCK_RPOP      = 1,
+    BLOCK_ZPOPMIN   = 2,
+};
+
+struct BlockReq;
+
+// the waiters on one key, oldest first
+struct BlockKey {
+    HNode node;
+    std::string key;
+    CDNode waiters;
+    bool ready = false;             // in `g_block.ready`
+};
+
+struct BlockWaiter {
+    CDNode node;                    // in BlockKey::waiters
+    BlockKey* bk = nullptr;
+    BlockReq* req = nullptr;
+};
+
+struct BlockReq {
+    Conn* conn = nullptr;
+    uint32_t op = BLOCK_LPOP;
+    size_t heap_idx = -1;           // in `g_block.timeouts`, -1 waits forever
+    std::vector<BlockWaiter> waiters;   // one per key, never resized once linked
+};
+
+static struct {
+    HMap keys;                      // of BlockKey, the keys someone waits on
+    std::vector<std::string> ready; // keys that received data during the command
+    HeapArray timeouts;
+    std::vector<Conn*> woken;       // replied to, resumed by block_resume()
+    struct {
+        uint64_t blocked = 0;       // right now
+        uint64_t served = 0;
+        uint64_t timeouts = 0;
+    } stats;
+} g_block;
+
+static bool block_key_eq(HNode* node, HNode* key){
+    BlockKey* bk = container_of(node, BlockKey, node);
+    LookupKey* lk = container_of(key, LookupKey, node);
+    return bk->key == lk->key;
+}
+
+static BlockKey* block_key_find(const std::string &key){
+    LookupKey lk;
+    lk.key = key;
+    lk.node.hval = str_hash((uint8_t*)key.data(), key.size());
+    HNode* node = hm_lookup(&g_block.keys, &lk.node, &block_key_eq);
+    return node ? container_of(node, BlockKey, node) : nullptr;
+}
+
+static BlockKey* block_key_get(const std::string &key){
+    BlockKey* bk = block_key_find(key);
+    if (!bk){
+        bk = new BlockKey();
+        bk->key = key;
+        bk->node.hval = str_hash((uint8_t*)key.data(), key.size());
+        cdlist_init(&bk->waiters);
+        hm_insert(&g_block.keys, &bk->node);
+    }
+    return bk;
+}
+
+// called by the commands adding data to a key
+static void block_signal(const std::string &key){
+    if (hm_size(&g_block.keys) == 0){
+        return;
+    }
+    BlockKey* bk = block_key_find(key);
+    if (bk && !bk->ready){
+        bk->ready = true;
+        g_block.ready.push_back(key);
+    }
+}
+
+// takes the request off its keys and its timeout, and frees it
+static void block_unlink(BlockReq* req){
+    for (BlockWaiter &w : req->waiters){
+        cdlist_detach(&w.node);
+        if (cdlist_empty(&w.bk->waiters)){
+            hm_delete(&g_block.keys, &w.bk->node, &hnode_same);
+            delete w.bk;
+        }
+    }
+    if (req->heap_idx != (size_t)-1){
+        heap_delete(g_block.timeouts, req->heap_idx);
+    }
+    req->conn->block = nullptr;
+    g_block.stats.blocked--;
+    delete req;
+}
+
+// the reply is in `outgoing`, the connection resumes from the event loop
+static void block_wake(BlockReq* req){
+    g_block.woken.push_back(req->conn);
+    block_unlink(req);
+}
+
+// a waiting client closed
+static void block_forget(Conn* conn){
+    if (conn->block){
+        block_unlink(conn->block);
+    }
+    std::vector<Conn*> &v = g_block.woken;
+    std::vector<Conn*>::iterator it = std::find(v.begin(), v.end(), conn);
+    if (it != v.end()){
+        v.erase(it);
+    }
+}
+
+// pops from `key` for a blocking command into `out`, a [key, value] or a
+// [key, member, score] reply, and propagates the pop; false if the key has
+// nothing to pop, or holds another type
+static bool block_pop(uint32_t op, const std::string &key, Buffer &out, bool* bad_type){
+    LookupKey lk;
+    lk.key = key;
+    lk.node.hval = str_hash((uint8_t*)key.data(), key.size());
+    bool is_list = op != BLOCK_ZPOPMIN;
+    Entry* ent = entry_expect(&lk, is_list ? T_LIST : T_ZSET, bad_type);
+    if (!ent || (is_list ? list_len(ent->list.get()) : hm_size(&ent->zset.hmap)) == 0){
+        return false;
+    }
+    entry_snap_cow(ent);
+    size_t before = entry_mem(ent);
+    if (is_list){
+        std::string val;
+        list_pop(ent->list.get(), op == BLOCK_LPOP, val, g_config.list_compress_depth);
+        out_arr(out, 2);
+        out_str(out, key.data(), key.size());
+        out_str(out, val.data(), val.size());
+        propagate({op == BLOCK_LPOP ? "LPOP" : "RPOP", key});
+    } else {
+        ZNode* znode = zset_seekge(&ent->zset, -INFINITY, "", 0);
+        out_arr(out, 3);
+        out_str(out, key.data(), key.size());
+        out_str(out, znode->name, znode->len);
+        out_dbl(out, znode->score);
+        propagate({"ZREM", key, std::string(znode->name, znode->len)});
+        zset_delete(&ent->zset, znode);
+    }
+    entry_mem_update(ent, before);
+    if (is_list && list_len(ent->list.get()) == 0){
+        db_delete(&lk, ent);
+    }
+    return true;
+}
+
+// the oldest waiter on `bk` not skipped by its kind of pop
+static BlockReq* block_next_waiter(BlockKey* bk, const bool* skip){
+    for (CDNode* node = bk->waiters.next; node != &bk->waiters; node = node->next){
+        BlockReq* req = container_of(node, BlockWaiter, node)->req;
+        if (!skip[req->op == BLOCK_ZPOPMIN]){
+            return req;
+        }
+    }
+    return nullptr;
+}
+
+// after a command, hands the data of the ready keys to their oldest waiters;
+// waiters for the other type (a BZPOPMIN on what is now a list) are passed
+// over and keep waiting
+static void block_serve(){
+    std::vector<std::string> ready;
+    ready.swap(g_block.ready);
+    for (const std::string &key : ready){
+        BlockKey* bk = block_key_find(key);
+        if (bk){
+            bk->ready = false;
+        }
+        bool skip[2] = {false, false};      // list pops, zset pops
+        // the key goes away with its last waiter
+        for (; bk; bk = block_key_find(key)){
+            BlockReq* req = block_next_waiter(bk, skip);
+            if (!req){
+                break;
+            }
+            Buffer &out = req->conn->outgoing;
+            size_t header = 0;
+            response_begin(out, &header);
+            bool bad_type = false;
+            if (!block_pop(req->op, key, out, &bad_type)){
+                out.resize(header);
+                if (!bad_type){
+                    break;      // nothing left
+                }
+                skip[req->op == BLOCK_ZPOPMIN] = true;
+                continue;
+            }
+            conn_response_end(req->conn, header);
+            g_data.dirty++;
+            g_block.stats.served++;
+            block_wake(req);
+        }
+    }
+}
+
+// replies nil to the requests past their deadline
+static void block_timeouts(uint64_t now_ms){
+    while (!g_block.timeouts.empty() && g_block.timeouts[0].ttl_val <= now_ms){
+        BlockReq* req = container_of(g_block.timeouts[0].ref, BlockReq, heap_idx);
+        size_t header = 0;
+        response_begin(req->conn->outgoing, &header);
+        out_nil(req->conn->outgoing);
+        conn_response_end(req->conn, header);
+        g_block.stats.timeouts++;
+        block_wake(req);
+    }
+}
+
+static void conn_process(Conn* conn);
+
+// the woken connections go back on the idle list and run what they buffered
+static void block_resume(){
+    while (!g_block.woken.empty()){
+        std::vector<Conn*> woken;
+        woken.swap(g_block.woken);
+        for (Conn* conn : woken){
+            conn->last_active_ms = get_monotonic_msecs();
+            cdlist_detach(&conn->idle_node);
+            cdlist_insert_before(&g_data.idle_list, &conn->idle_node);
+            conn_process(conn);
+            if (conn->want_close){
+                conn_destroy(conn);
+            }
+        }
+    }
+}
+
+// the keys are tried in order, the first with data is popped right away
+static void block_cmd(std::vector<std::string> &cmd, Buffer &out, uint32_t op){
+    double secs = 0;
+    if (!str2dbl(cmd.back(), secs) || secs < 0){
+        return out_err(out, ERR_BAD_ARG, "Expected a timeout in seconds");
+    }
+    if (isinf(secs)){
+        return out_err(out, ERR_BAD_ARG, "Timeout is out of range");
+    }
+    // so the deadline in ms fits
+    secs = secs > k_block_max_timeout_s ? k_block_max_timeout_s : secs;
+    size_t nkeys = cmd.size() - 2;
+    // the pop is logged, not the blocking command
+    g_data.prop_custom = true;
+    for (size_t i = 1; i <= nkeys; i++){
+        bool bad_type = false;
+        if (block_pop(op, cmd[i], out, &bad_type)){
+            return;
+        }
+        if (bad_type){
+            return out_err(out, ERR_BAD_TYP, op == BLOCK_ZPOPMIN ? "Expected zset" : "Expected list");
+        }
+    }
+    // the log and the stream from the primary never wait
+    Conn* conn = g_data.client;
+    if (!conn){
+        return out_nil(out);
+    }
+    BlockReq* req = new BlockReq();
+    req->conn = conn;
+    req->op = op;
+    req->waiters.resize(nkeys);
+    for (size_t i = 0; i < nkeys; i++){
+        BlockWaiter &w = req->waiters[i];
+        w.req = req;
+        w.bk = block_key_get(cmd[i+1]);
+        cdlist_insert_before(&w.bk->waiters, &w.node);
+    }
+    if (secs > 0){
+        HeapNode item = {get_monotonic_msecs() + (uint64_t)(secs * 1000), &req->heap_idx};
+        heap_upsert(g_block.timeouts, req->heap_idx, item);
+    }
+    conn->block = req;
+    cdlist_detach(&conn->idle_node);
+    cdlist_init(&conn->idle_node);
+    g_block.stats.blocked++;
+}
+
+//+-------+-----+-----+---------+
+//| BLPOP | key | ... | timeout |
+//+-------+-----+-----+---------+
+// [key, value] from the first non-empty list, or waits up to `timeout`
+// seconds for one, 0 waits forever; nil on timeout
+static void do_blpop(std::vector<std::string> &cmd, Buffer &out){
+    return block_cmd(cmd, out, BLOCK_LPOP);
+}
+
+//+-------+-----+-----+---------+
+//| BRPOP | key | ... | timeout |
+//+-------+-----+-----+---------+
+static void do_brpop(std::vector<std::string> &cmd, Buffer &out){
+    return block_cmd(cmd, out, BLOCK_RPOP);
+}
+
+//+----------+-----+-----+---------+
+//| BZPOPMIN | key | ... | timeout |
+//+----------+-----+-----+---------+
+// [key, member, score] of the lowest score
+static void do_bzpopmin(std::vector<std::string> &cmd, Buffer &out){
+    return block_cmd(cmd, out, BLOCK_ZPOPMIN);
+}
+
+//================================== pub/sub ==================================//
+
+/*
+    SUBSCRIBE, PSUBSCRIBE and PUBLISH, the subscriptions are kept by pubsub.cpp
+    - a message is encoded once per protocol (and per pattern for PSUBSCRIBE)
+      into a shared buffer, every subscriber queues a reference to it on
+      `Conn::outq` rather than a copy, and handle_write() sends the queue
+      with writev(), so the fan-out costs a syscall per subscriber, not a memcpy
+    - a reply already in `outgoing` moves to the queue first, it was due
+      before the message; the message to the publisher itself and the
+      confirmations of a multi channel SUBSCRIBE wait in `g_pubsub.self`
+      until the reply of the running command is complete
+    - a subscriber whose unsent output passes `pubsub-hard-limit`, or stays
+      over `pubsub-soft-limit` for `pubsub-soft-seconds`, is dropped: its
+      queue is released at once and the connection closed after the loop
+      iteration, the publisher never waits for it
+    - subscribed connections don't time out and may run any command
+*/
+static struct {
+    std::vector<std::shared_ptr<const Buffer>> self;    // for `g_data.client`
+    std::vector<Conn*> dropped;     // closed by pubsub_close_dropped()
+    struct {
+        uint64_t published = 0;
+        uint64_t delivered = 0;     // queued messages
+        uint64_t dropped = 0;       // slow subscribers
+    } stats;
+} g_pubsub;
+
+// bytes waiting to be sent
+static size_t conn_pending(Conn* conn){
+    return conn->outq_bytes + conn->outgoing.size();
+}
+
+// a complete frame for `proto` from the tagged value in `val`, RESP3 gets a
+// push rather than the array it otherwise converts to
+static void push_frame(Buffer &out, const Buffer &val, uint32_t proto){
+    if (proto == PROTO_BIN){
+        buf_append_u32(out, (uint32_t)val.size());
+        buf_append(out, val.data(), val.size());
+        return;
+    }
+    size_t start = out.size();
+    resp_convert(out, val.data(), proto == PROTO_RESP3);
+    if (proto == PROTO_RESP3){
+        out[start] = '>';
+    }
+}
+
+static void pubsub_drop(Conn* conn){
+    msg("Dropping a slow subscriber");
+    conn->outq.clear();
+    conn->outq_bytes = 0;
+    conn->outgoing.clear();
+    conn->want_write = false;
+    conn->want_close = true;
+    g_pubsub.dropped.push_back(conn);
+    g_pubsub.stats.dropped++;
+}
+
+// queues a shared buffer on a connection, behind what it already has
+static void conn_queue(Conn* conn, const std::shared_ptr<const Buffer> &buf){
+    if (!conn->outgoing.empty()){
+        std::shared_ptr<Buffer> own = std::make_shared<Buffer>();
+        own->swap(conn->outgoing);
+        conn->outq_bytes += own->size();
+        conn->outq.push_back(OutRef{own, 0});
+    }
+    conn->outq_bytes += buf->size();
+    conn->outq.push_back(OutRef{buf, 0});
+    conn->want_write = true;
+    // the output limits
+    size_t pending = conn_pending(conn);
+    if (g_config.pubsub_hard_limit && pending > g_config.pubsub_hard_limit){
+        return pubsub_drop(conn);
+    }
+    if (!g_config.pubsub_soft_limit || pending <= g_config.pubsub_soft_limit){
+        conn->out_soft_ms = 0;
+        return;
+    }
+    uint64_t now_ms = get_monotonic_msecs();
+    if (!conn->out_soft_ms){
+        conn->out_soft_ms = now_ms;
+    } else if (now_ms - conn->out_soft_ms > (uint64_t)g_config.pubsub_soft_seconds * 1000){
+        pubsub_drop(conn);
+    }
+}
+
+// the connection running the command gets it after its reply
+static void conn_push(Conn* conn, const std::shared_ptr<const Buffer> &buf){
+    if (conn == g_data.client){
+        g_pubsub.self.push_back(buf);
+    } else {
+        conn_queue(conn, buf);
+    }
+}
+
+// called once the reply of the command is complete
+static void pubsub_flush_self(Conn* conn){
+    for (const std::shared_ptr<const Buffer> &buf : g_pubsub.self){
+        if (!conn->want_close){
+            conn_queue(conn, buf);
+        }
+    }
+    g_pubsub.self.clear();
+}
+
+static void pubsub_conn_forget(Conn* conn){
+    pubsub_forget(&conn->pubsub);
+    std::vector<Conn*> &v = g_pubsub.dropped;
+    v.erase(std::remove(v.begin(), v.end(), conn), v.end());
+}
+
+// after the loop iteration, the dropped connections may have been on its lists
+static void pubsub_close_dropped(){
+    while (!g_pubsub.dropped.empty()){
+        conn_destroy(g_pubsub.dropped.back());
+    }
+}
+
+// [kind, name or nil, subscription count], the first one is the reply of
+// the command and the others follow it
+static void pubsub_confirm(Conn* conn, Buffer &out, size_t idx, const char* kind, const std::string* name){
+    Buffer val;
+    Buffer &dst = idx == 0 ? out : val;
+    out_arr(dst, 3);
+    out_str(dst, kind, strlen(kind));
+    if (name){
+        out_str(dst, name->data(), name->size());
+    } else {
+        out_nil(dst);
+    }
+    out_int(dst, (int64_t)pubsub_count(&conn->pubsub));
+    if (idx > 0){
+        std::shared_ptr<Buffer> frame = std::make_shared<Buffer>();
+        push_frame(*frame, val, conn->proto);
+        g_pubsub.self.push_back(frame);
+    }
+}
+
+// the log and the stream from the primary have no connection to subscribe
+static Conn* pubsub_client(Buffer &out){
+    if (!g_data.client){
+        out_err(out, ERR_BAD_ARG, "No connection to subscribe");
+    }
+    return g_data.client;
+}
+
+static void pubsub_sub_cmd(std::vector<std::string> &cmd, Buffer &out, bool pattern){
+    Conn* conn = pubsub_client(out);
+    if (!conn){
+        return;
+    }
+    for (size_t i = 1; i < cmd.size(); i++){
+        if (pattern){
+            pubsub_psubscribe(&conn->pubsub, cmd[i]);
+        } else {
+            pubsub_subscribe(&conn->pubsub, cmd[i]);
+        }
+        pubsub_confirm(conn, out, i - 1, pattern ? "psubscribe" : "subscribe", &cmd[i]);
+    }
+}
+
+// without arguments from everything it was subscribed to
+static void pubsub_unsub_cmd(std::vector<std::string> &cmd, Buffer &out, bool pattern){
+    Conn* conn = pubsub_client(out);
+    if (!conn){
+        return;
+    }
+    const char* kind = pattern ? "punsubscribe" : "unsubscribe";
+    std::vector<std::string> names(cmd.begin() + 1, cmd.end());
+    if (names.empty()){
+        names = pattern ? conn->pubsub.patterns : conn->pubsub.channels;
+    }
+    if (names.empty()){
+        return pubsub_confirm(conn, out, 0, kind, nullptr);
+    }
+    for (size_t i = 0; i < names.size(); i++){
+        if (pattern){
+            pubsub_punsubscribe(&conn->pubsub, names[i]);
+        } else {
+            pubsub_unsubscribe(&conn->pubsub, names[i]);
+        }
+        pubsub_confirm(conn, out, i, kind, &names[i]);
+    }
+}
+
+//+-----------+---------+-----+
+//| SUBSCRIBE | channel | ... |
+//+-----------+---------+-----+
+// ["subscribe", channel, count] for each channel, then the messages come as
+// ["message", channel, payload]
+static void do_subscribe(std::vector<std::string> &cmd, Buffer &out){
+    return pubsub_sub_cmd(cmd, out, false);
+}
+
+//+-------------+-----------+
+//| UNSUBSCRIBE | [channel] |
+//+-------------+-----------+
+static void do_unsubscribe(std::vector<std::string> &cmd, Buffer &out){
+    return pubsub_unsub_cmd(cmd, out, false);
+}
+
+//+------------+---------+-----+
+//| PSUBSCRIBE | pattern | ... |
+//+------------+---------+-----+
+// the messages come as ["pmessage", pattern, channel, payload]
+static void do_psubscribe(std::vector<std::string> &cmd, Buffer &out){
+    return pubsub_sub_cmd(cmd, out, true);
+}
+
+//+--------------+-----------+
+//| PUNSUBSCRIBE | [pattern] |
+//+--------------+-----------+
+static void do_punsubscribe(std::vector<std::string> &cmd, Buffer &out){
+    return pubsub_unsub_cmd(cmd, out, true);
+}
+
+// one message, its frames built on first use for each protocol and
+// rebuilt when the pattern changes
+struct PublishArg {
+    const std::string* channel = nullptr;
+    const std::string* payload = nullptr;
+    const std::string* pattern = nullptr;
+    std::shared_ptr<const Buffer> frames[4];    // by PROTO_*
+    size_t delivered = 0;
+};
+
+static void cb_publish(PubSubClient* c, const std::string* pattern, void* arg){
+    PublishArg* pa = (PublishArg*) arg;
+    Conn* conn = container_of(c, Conn, pubsub);
+    if (conn->want_close){
+        return;
+    }
+    if (pattern != pa->pattern){
+        pa->pattern = pattern;
+        for (std::shared_ptr<const Buffer> &f : pa->frames){
+            f.reset();
+        }
+    }
+    std::shared_ptr<const Buffer> &frame = pa->frames[conn->proto];
+    if (!frame){
+        Buffer val;
+        out_arr(val, pattern ? 4 : 3);
+        if (pattern){
+            out_str(val, "pmessage", 8);
+            out_str(val, pattern->data(), pattern->size());
+        } else {
+            out_str(val, "message", 7);
+        }
+        out_str(val, pa->channel->data(), pa->channel->size());
+        out_str(val, pa->payload->data(), pa->payload->size());
+        std::shared_ptr<Buffer> f = std::make_shared<Buffer>();
+        push_frame(*f, val, conn->proto);
+        frame = f;
+    }
+    conn_push(conn, frame);
+    pa->delivered++;
+}
+
+//+---------+---------+---------+
+//| PUBLISH | channel | message |
+//+---------+---------+---------+
+// the number of subscribers it was queued for
+static void do_publish(std::vector<std::string> &cmd, Buffer &out){
+    PublishArg pa;
+    pa.channel = &cmd[1];
+    pa.payload = &cmd[2];
+    pubsub_publish(cmd[1], &cb_publish, &pa);
+    g_pubsub.stats.published++;
+    g_pubsub.stats.delivered += pa.delivered;
+    return out_int(out, (int64_t)pa.delivered);
+}
+
+//================================== persistence ==================================//
+
+// TTLs are monotonic in memory and absolute wall clock time on disk
+static int64_t entry_expire_unix_ms(Entry* ent, uint64_t now_ms, uint64_t now_unix_ms){
+    if (ent->heap_idx == (size_t)-1){
+        return -1;
+    }
+    uint64_t expire_at = g_data.cache[ent->heap_idx].ttl_val;
+    return (int64_t)(now_unix_ms + (expire_at > now_ms ? expire_at - now_ms : 0));
+}
+
+struct SaveArg {
+    SnapWriter* w;
+    uint64_t now_ms;
+    uint64_t now_unix_ms;
+};
+
+static bool cb_save_field(const char* field, size_t flen, const char* val, size_t vlen, void* arg){
+    snap_put_field((SnapWriter*)arg, field, flen, val, vlen);
+    return true;
+}
+
+static bool cb_save_elem(const char* val, size_t len, void* arg){
+    snap_put_elem((SnapWriter*)arg, val, len);
+    return true;
+}
+
+static void save_entry(SaveArg &sa, Entry* ent){
+    if (entry_expired(ent, sa.now_ms)){
+        return;
+    }
+    int64_t expire = entry_expire_unix_ms(ent, sa.now_ms, sa.now_unix_ms);
+    if (ent->type == T_STR){
+        snap_put_str(sa.w, ent->key.data(), ent->key.size(), ent->str.data(), ent->str.size(), expire);
+    } else if (ent->type == T_ZSET){
+        ZSet* zset = &ent->zset;
+        snap_put_zset(sa.w, ent->key.data(), ent->key.size(), hm_size(&zset->hmap), expire);
+        // in (score, name) order, so the tree can be rebuilt without comparisons
+        ZNode* znode = zset_seekge(zset, -INFINITY, "", 0);
+        for (; znode; znode = znode_offset(znode, +1)){
+            snap_put_member(sa.w, znode->name, znode->len, znode->score);
+        }
+    } else if (ent->type == T_HASH){
+        Hash* hash = ent->hash.get();
+        snap_put_hash(sa.w, ent->key.data(), ent->key.size(), hash_len(hash), expire);
+        hash_foreach(hash, &cb_save_field, sa.w);
+    } else if (ent->type == T_HLL || ent->type == T_BLOOM){
+        snap_put_image(sa.w, ent->type == T_HLL ? SNAP_HLL : SNAP_BLOOM,
+            ent->key.data(), ent->key.size(), ent->str.data(), ent->str.size(), expire);
+    } else if (ent->type == T_LIST){
+        List* list = ent->list.get();
+        snap_put_list(sa.w, ent->key.data(), ent->key.size(), list_len(list), expire);
+        if (list_len(list) > 0){
+            list_range(list, 0, list_len(list) - 1, &cb_save_elem, sa.w);
+        }
+    }
+}
+
+static bool cb_save(HNode* node, void* arg){
+    SaveArg &sa = *(SaveArg*) arg;
+    save_entry(sa, container_of(node, Entry, node));
+    return !sa.w->failed;
+}
+
+// writes to a temporary file and renames it, so the old snapshot stays
+// intact until the new one is complete
+static bool rdb_save(const char* path){
+    std::string tmp = std::string(path) + ".tmp." + std::to_string(getpid());
+    SnapWriter w;
+    if (!snap_write_open(&w, tmp.c_str())){
+        return false;
+    }
+    SaveArg sa = {&w, get_monotonic_msecs(), get_unix_msecs()};
+    hm_foreach(&g_data.db, &cb_save, &sa);
+    if (!snap_write_close(&w) || rename(tmp.c_str(), path) < 0 || fsync_dir(path) < 0){
+        msg_err("snapshot save error");
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/*
+    nofork save, BGSAVE with `bgsave-mode nofork`
+    - a thread walks `db` slot by slot in short batches holding `mu`, the loop
+      holds `mu` while it runs commands and timers, so each side sees a stable map
+    - the image is `db` as of the start: entries created later carry the new
+      epoch, and the loop saves an entry of the image before changing or
+      removing it (copy-before-write), the walk skips what is already saved
+    - a rehash can move unsaved entries behind the cursor, so the walk starts
+      over until `pending`, the unsaved entries of the image, drops to zero
+    - the extra memory is the writer's buffer, the cost on the loop is the
+      lock waits and the copies, both reported by STATS
+*/
+static struct {
+    std::thread thread;
+    std::mutex mu;
+    std::atomic<uint32_t> waiters{0};   // the loop wants `mu`, the walk backs off
+    std::atomic<bool> done{false};
+    bool ok = false;
+    SnapWriter w;
+    SaveArg sa = {};
+    std::string tmp;
+    size_t pending = 0;
+    // the walk cursor, older table first
+    bool in_older = true;
+    HNode** tab = nullptr;
+    size_t pos = 0;
+    struct {
+        uint64_t cow_keys = 0;
+        uint64_t cow_us = 0;
+        uint64_t lock_wait_us = 0;
+        uint64_t lock_wait_max_us = 0;
+    } stats;
+} g_nofork;
+
+static void entry_snap_cow(Entry* ent){
+    if (!g_data.snap_running || ent->snap_epoch == g_data.snap_epoch){
+        return;
+    }
+    uint64_t start_us = get_monotonic_usecs();
+    save_entry(g_nofork.sa, ent);
+    ent->snap_epoch = g_data.snap_epoch;
+    g_nofork.pending--;
+    g_nofork.stats.cow_keys++;
+    g_nofork.stats.cow_us += get_monotonic_usecs() - start_us;
+}
+
+// the loop side of `mu`, around anything that touches `db`, returns whether
+// it was taken as BGSAVE may start a save in between
+static bool nofork_lock(){
+    if (!g_data.snap_running){
+        return false;
+    }
+    uint64_t start_us = get_monotonic_usecs();
+    g_nofork.waiters++;
+    g_nofork.mu.lock();
+    g_nofork.waiters--;
+    uint64_t wait_us = get_monotonic_usecs() - start_us;
+    g_nofork.stats.lock_wait_us += wait_us;
+    if (wait_us > g_nofork.stats.lock_wait_max_us){
+        g_nofork.stats.lock_wait_max_us = wait_us;
+    }
+    return true;
+}
+
+static void nofork_unlock(bool locked){
+    if (locked){
+        g_nofork.mu.unlock();
+    }
+}
+
+static void nofork_cursor_reset(){
+    g_nofork.in_older = true;
+    g_nofork.tab = g_data.db.older.tab;
+    g_nofork.pos = 0;
+}
+
+// saves entries for about `budget_us` with `mu` held, true once the image is complete
+static bool nofork_walk(uint64_t budget_us){
+    HMap* db = &g_data.db;
+    uint64_t start_us = get_monotonic_usecs();
+    while (g_nofork.pending > 0){
+        HTab* htab = g_nofork.in_older ? &db->older : &db->newer;
+        if (htab->tab != g_nofork.tab){
+            nofork_cursor_reset();      // the tables were swapped by a rehash
+            continue;
+        }
+        if (!htab->tab || g_nofork.pos > htab->mask){
+            if (g_nofork.in_older){
+                g_nofork.in_older = false;
+                g_nofork.tab = db->newer.tab;
+                g_nofork.pos = 0;
+            } else {
+                nofork_cursor_reset();  // some entries moved behind the cursor
+            }
+            continue;
+        }
+        for (HNode* node = htab->tab[g_nofork.pos]; node; node = node->next){
+            Entry* ent = container_of(node, Entry, node);
+            if (ent->snap_epoch != g_data.snap_epoch){
+                save_entry(g_nofork.sa, ent);
+                ent->snap_epoch = g_data.snap_epoch;
+                g_nofork.pending--;
+            }
+        }
+        g_nofork.pos++;
+        if (get_monotonic_usecs() - start_us >= budget_us){
+            break;
+        }
+    }
+    return g_nofork.pending == 0;
+}
+
+static void nofork_thread(){
+    bool complete = false;
+    std::vector<uint8_t> buf;
+    while (!complete){
+        g_nofork.mu.lock();
+        complete = nofork_walk(k_nofork_batch_us);
+        // the file is written outside of `mu`
+        buf.clear();
+        if (g_nofork.w.buf.size() >= k_snap_flush_size || complete){
+            buf.swap(g_nofork.w.buf);
+        }
+        g_nofork.mu.unlock();
+        snap_write_buf(&g_nofork.w, buf);
+        // let the loop in before taking `mu` again
+        while (g_nofork.waiters > 0){
+            std::this_thread::yield();
+        }
+    }
+    // every entry of the image is saved, the loop won't touch the writer anymore
+    g_nofork.ok = snap_write_close(&g_nofork.w);
+    g_nofork.done = true;
+}
+
+static bool nofork_start(){
+    g_nofork.tmp = g_config.dbfilename + ".tmp.nofork";
+    if (!snap_write_open(&g_nofork.w, g_nofork.tmp.c_str())){
+        return false;
+    }
+    g_nofork.w.deferred = true;
+    g_nofork.sa = SaveArg{&g_nofork.w, get_monotonic_msecs(), get_unix_msecs()};
+    g_nofork.pending = hm_size(&g_data.db);
+    g_nofork.ok = false;
+    g_nofork.done = false;
+    g_data.snap_epoch++;
+    g_data.snap_running = true;
+    nofork_cursor_reset();
+    g_nofork.thread = std::thread(&nofork_thread);
+    return true;
+}
+
+// a section of the snapshot, decoded by a pool worker into detached entries
+// which the event loop thread then links into `db`
+struct LoadJob {
+    const SnapFile* file = nullptr;
+    size_t idx = 0;
+    uint64_t now_ms = 0;
+    uint64_t now_unix_ms = 0;
+    std::vector<Entry*> entries;
+    std::vector<HeapNode> ttls;
+    size_t mem = 0;
+    bool ok = false;
+    std::atomic<bool> done{false};
+};
+
+static bool load_member(void* r, const char** name, size_t* len, double* score){
+    return snap_next_member((SnapReader*)r, name, len, score);
+}
+
+static bool load_hash(Hash* hash, uint64_t count, SnapReader* r){
+    const char* field = nullptr;
+    const char* val = nullptr;
+    size_t flen = 0, vlen = 0;
+    for (uint64_t i = 0; i < count; i++){
+        if (!snap_next_field(r, &field, &flen, &val, &vlen)){
+            return false;
+        }
+        hash_set(hash, field, flen, val, vlen,
+            g_config.hash_max_packed_entries, g_config.hash_max_packed_value);
+    }
+    return true;
+}
+
+static bool load_list(List* list, uint64_t count, SnapReader* r){
+    const char* val = nullptr;
+    size_t len = 0;
+    for (uint64_t i = 0; i < count; i++){
+        if (!snap_next_elem(r, &val, &len)){
+            return false;
+        }
+        list_push(list, false, val, len, g_config.list_chunk_size, g_config.list_compress_depth);
+    }
+    return true;
+}
+
+static bool load_section(LoadJob* job){
+    SnapReader r;
+    if (!snap_section_open(job->file, job->idx, &r)){
+        return false;
+    }
+    job->entries.reserve(job->file->sections[job->idx].nkeys);
+    SnapRecord rec;
+    while (snap_next(&r, &rec)){
+        bool expired = rec.expire_unix_ms >= 0 && (uint64_t)rec.expire_unix_ms <= job->now_unix_ms;
+        if (expired){
+            // skipped without building anything
+            const char* name = nullptr;
+            const char* val = nullptr;
+            size_t len = 0, vlen = 0;
+            double score = 0;
+            for (uint64_t i = 0; i < rec.count; i++){
+                bool ok = rec.type == SNAP_HASH ? snap_next_field(&r, &name, &len, &val, &vlen)
+                    : rec.type == SNAP_LIST ? snap_next_elem(&r, &val, &vlen)
+                    : snap_next_member(&r, &name, &len, &score);
+                if (!ok){
+                    return false;
+                }
+            }
+            continue;
+        }
+        uint32_t type = rec.type == SNAP_ZSET ? T_ZSET : rec.type == SNAP_HASH ? T_HASH
+            : rec.type == SNAP_LIST ? T_LIST : rec.type == SNAP_HLL ? T_HLL
+            : rec.type == SNAP_BLOOM ? T_BLOOM : T_STR;
+        Entry* ent = entry_new(type);
+        job->entries.push_back(ent);
+        ent->key.assign(rec.key, rec.klen);
+        ent->node.hval = str_hash((uint8_t*)rec.key, rec.klen);
+        if (rec.type == SNAP_STR){
+            ent->str.assign(rec.val, rec.vlen);
+        } else if (rec.type == SNAP_HLL || rec.type == SNAP_BLOOM){
+            ent->str.assign(rec.val, rec.vlen);
+            if (rec.type == SNAP_HLL ? !hll_valid(ent->str) : !bloom_valid(ent->str)){
+                return false;
+            }
+        } else if (rec.type == SNAP_HASH){
+            if (!load_hash(ent->hash.get(), rec.count, &r)){
+                return false;
+            }
+        } else if (rec.type == SNAP_LIST){
+            if (!load_list(ent->list.get(), rec.count, &r)){
+                return false;
+            }
+        } else if (!zset_build(&ent->zset, rec.count, &load_member, &r)){
+            return false;
+        }
+        job->mem += entry_mem(ent);
+        if (rec.expire_unix_ms >= 0){
+            uint64_t expire_at = job->now_ms + ((uint64_t)rec.expire_unix_ms - job->now_unix_ms);
+            job->ttls.push_back(HeapNode{expire_at, &ent->heap_idx});
+        }
+    }
+    return snap_section_done(&r);
+}
+
+static void load_section_task(void* arg){
+    LoadJob* job = (LoadJob*) arg;
+    job->ok = load_section(job);
+    job->done = true;
+}
+
+/*
+    startup load of the snapshot
+    - the file is mapped and its sections are verified and decoded in parallel
+      on the thread pool, records point into the mapping until they are copied
+    - `db` is sized from the key count in the index, so it never rehashes
+    - the sections are linked in file order as they complete, with progress
+      reported every `k_load_report_ms`
+    - also loads the snapshot a replica receives, into an empty `db`; on a bad
+      file the keys linked so far are left for the caller to flush
+*/
+static bool rdb_load(const char* path){
+    if (access(path, F_OK) != 0){
+        return true;    // nothing saved yet
+    }
+    uint64_t start_ms = get_monotonic_msecs();
+    SnapFile file;
+    if (!snap_map(&file, path)){
+        return false;
+    }
+    hm_reserve(&g_data.db, file.nkeys);
+    std::vector<LoadJob> jobs(file.sections.size());
+    uint64_t now_ms = get_monotonic_msecs();
+    uint64_t now_unix_ms = get_unix_msecs();
+    for (size_t i = 0; i < jobs.size(); i++){
+        jobs[i].file = &file;
+        jobs[i].idx = i;
+        jobs[i].now_ms = now_ms;
+        jobs[i].now_unix_ms = now_unix_ms;
+        g_data.thread_pool.produce(&load_section_task, &jobs[i]);
+    }
+    std::vector<HeapNode> ttls;
+    uint64_t nread = 0;
+    uint64_t report_ms = start_ms;
+    bool ok = true;
+    for (LoadJob &job : jobs){
+        while (!job.done){
+            usleep(1000);
+            uint64_t now = get_monotonic_msecs();
+            if (now - report_ms >= k_load_report_ms){
+                report_ms = now;
+                fprintf(stderr, "loading %s: %llu/%llu keys (%.1f%%)\n", path,
+                    (unsigned long long)nread, (unsigned long long)file.nkeys,
+                    file.nkeys ? 100.0 * nread / file.nkeys : 100.0);
+            }
+        }
+        if (!job.ok || !ok){
+            // the workers still use the mapping, so every job is waited for
+            ok = false;
+            for (Entry* ent : job.entries){
+                entry_del_sync(ent);
+            }
+            job.entries.clear();
+            continue;
+        }
+        for (Entry* ent : job.entries){
+            hm_insert(&g_data.db, &ent->node);
+        }
+        g_data.mem_used += job.mem;
+        ttls.insert(ttls.end(), job.ttls.begin(), job.ttls.end());
+        nread += file.sections[job.idx].nkeys;
+        job.entries = std::vector<Entry*>();
+        job.ttls = std::vector<HeapNode>();
+    }
+    snap_unmap(&file);
+    if (!ok){
+        return false;
+    }
+    heap_bulk_upsert(g_data.cache, ttls.data(), ttls.size());
+    fprintf(stderr, "loaded %zu keys from %s in %llu ms\n",
+        hm_size(&g_data.db), path, (unsigned long long)(get_monotonic_msecs() - start_ms));
+    return true;
+}
+
+// the kinds of forked children
+enum {
+    CHILD_RDB = 1,
+    CHILD_AOF = 2,
+    CHILD_REPL = 3,     // a snapshot for replicas, see the replication section
+};
+
+static void repl_snapshot_done(pid_t pid, bool ok);
+
+//+------+
+//| SAVE |
+//+------+
+// blocks the event loop until the snapshot is written
+static void do_save(std::vector<std::string> &, Buffer &out){
+    if ((g_data.child_pid > 0 && g_data.child_type == CHILD_RDB) || g_data.snap_running){
+        return out_err(out, ERR_BAD_ARG, "Background save in progress");
+    }
+    if (!rdb_save(g_config.dbfilename.c_str())){
+        return out_err(out, ERR_BAD_ARG, "Save failed");
+    }
+    g_data.dirty = 0;
+    g_data.stats.last_save_unix_ms = get_unix_msecs();
+    return out_nil(out);
+}
+
+//+--------+
+//| BGSAVE |
+//+--------+
+// a forked child writes the snapshot from its copy-on-write view of memory,
+// or a thread walks the keyspace without forking, see `bgsave-mode`
+static void do_bgsave(std::vector<std::string> &, Buffer &out){
+    if (g_data.child_pid > 0 || g_data.snap_running){
+        return out_err(out, ERR_BAD_ARG, "Background save or rewrite already in progress");
+    }
+    const char *reply = "Background saving started";
+    if (g_config.bgsave_mode == BGSAVE_NOFORK){
+        if (!nofork_start()){
+            return out_err(out, ERR_BAD_ARG, "Save failed");
+        }
+        g_data.bgsave_dirty = g_data.dirty;
+        return out_str(out, reply, strlen(reply));
+    }
+    pid_t pid = fork();
+    if (pid < 0){
+        msg_err("fork() error");
+        return out_err(out, ERR_BAD_ARG, "fork() failed");
+    }
+    if (pid == 0){
+        // the child, it only reads the keyspace and never returns to the loop
+        _exit(rdb_save(g_config.dbfilename.c_str()) ? 0 : 1);
+    }
+    g_data.child_pid = pid;
+    g_data.child_type = CHILD_RDB;
+    g_data.bgsave_dirty = g_data.dirty;
+    return out_str(out, reply, strlen(reply));
+}
+
+static void bgsave_done(bool ok){
+    g_data.stats.last_bgsave_ok = ok;
+    if (ok){
+        g_data.dirty -= g_data.bgsave_dirty;
+        g_data.stats.last_save_unix_ms = get_unix_msecs();
+    } else {
+        msg("background save failed");
+    }
+}
+
+// joins the nofork save thread once it is done, called from the event loop
+static void nofork_poll(){
+    if (!g_data.snap_running || !g_nofork.done){
+        return;
+    }
+    g_nofork.thread.join();
+    g_data.snap_running = false;
+    bool ok = g_nofork.ok && rename(g_nofork.tmp.c_str(), g_config.dbfilename.c_str()) == 0
+        && fsync_dir(g_config.dbfilename.c_str()) == 0;
+    if (!ok){
+        unlink(g_nofork.tmp.c_str());
+    }
+    bgsave_done(ok);
+}
+
+// the temporary file of a rewrite, named after the child
+static std::string aof_rewrite_path(pid_t pid){
+    return g_config.appendfilename + ".rewrite." + std::to_string(pid);
+}
+
+struct RewriteArg {
+    int fd;
+    Buffer buf;
+    uint64_t now_ms;
+    uint64_t now_unix_ms;
+    bool failed;
+};
+
+static void rewrite_cmd(RewriteArg &ra, const std::vector<std::string> &cmd){
+    cmd_encode(ra.buf, cmd);
+    if (ra.buf.size() >= 64*1024){
+        ra.failed = ra.failed || write_all(ra.fd, (const char*)ra.buf.data(), ra.buf.size()) < 0;
+        ra.buf.clear();
+    }
+}
+
+// a hash field or list element of `ent`
+struct RewriteItemArg {
+    RewriteArg* ra;
+    Entry* ent;
+};
+
+static bool cb_rewrite_field(const char* field, size_t flen, const char* val, size_t vlen, void* arg){
+    RewriteItemArg &rf = *(RewriteItemArg*) arg;
+    rewrite_cmd(*rf.ra, {"HSET", rf.ent->key, std::string(field, flen), std::string(val, vlen)});
+    return !rf.ra->failed;
+}
+
+static bool cb_rewrite_elem(const char* val, size_t len, void* arg){
+    RewriteItemArg &rf = *(RewriteItemArg*) arg;
+    rewrite_cmd(*rf.ra, {"RPUSH", rf.ent->key, std::string(val, len)});
+    return !rf.ra->failed;
+}
+
+// the shortest sequence of commands that rebuilds an entry
+static bool cb_rewrite(HNode* node, void* arg){
+    RewriteArg &ra = *(RewriteArg*) arg;
+    Entry* ent = container_of(node, Entry, node);
+    if (entry_expired(ent, ra.now_ms)){
+        return true;
+    }
+    if (ent->type == T_STR){
+        rewrite_cmd(ra, {"SET", ent->key, ent->str});
+    } else if (ent->type == T_ZSET){
+        char score[32];
+        ZNode* znode = zset_seekge(&ent->zset, -INFINITY, "", 0);
+        for (; znode; znode = znode_offset(znode, +1)){
+            snprintf(score, sizeof(score), "%.17g", znode->score);
+            rewrite_cmd(ra, {"ZADD", ent->key, score, std::string(znode->name, znode->len)});
+        }
+    } else if (ent->type == T_HASH){
+        RewriteItemArg rf = {&ra, ent};
+        hash_foreach(ent->hash.get(), &cb_rewrite_field, &rf);
+    } else if (ent->type == T_LIST && list_len(ent->list.get()) > 0){
+        RewriteItemArg rf = {&ra, ent};
+        list_range(ent->list.get(), 0, list_len(ent->list.get()) - 1, &cb_rewrite_elem, &rf);
+    } else if (ent->type == T_HLL || ent->type == T_BLOOM){
+        rewrite_cmd(ra, {"RESTORE", ent->key, ent->type == T_HLL ? "hll" : "bloom", ent->str});
+    }
+    int64_t expire = entry_expire_unix_ms(ent, ra.now_ms, ra.now_unix_ms);
+    if (expire >= 0){
+        rewrite_cmd(ra, {"PEXPIREAT", ent->key, std::to_string(expire)});
+    }
+    return !ra.failed;
+}
+
+// runs in the child, the parent appends what arrives meanwhile and fsyncs
+static bool aof_rewrite_child(const char* path){
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0){
+        return false;
+    }
+    RewriteArg ra = {fd, Buffer(), get_monotonic_msecs(), get_unix_msecs(), false};
+    hm_foreach(&g_data.db, &cb_rewrite, &ra);
+    // syncing here leaves only the tail for the parent to sync
+    bool ok = !ra.failed && write_all(fd, (const char*)ra.buf.data(), ra.buf.size()) == 0
+        && fdatasync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+static bool aof_rewrite_start(){
+    // the last rewrite may still be finishing on the pool, and no fork while
+    // the nofork save thread may hold the allocator's locks
+    if (g_data.child_pid > 0 || aof_stats().rewriting || g_data.snap_running){
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid < 0){
+        msg_err("fork() error");
+        return false;
+    }
+    if (pid == 0){
+        _exit(aof_rewrite_child(aof_rewrite_path(getpid()).c_str()) ? 0 : 1);
+    }
+    g_data.child_pid = pid;
+    g_data.child_type = CHILD_AOF;
+    aof_rewrite_begin();
+    return true;
+}
+
+//+--------------+
+//| BGREWRITEAOF |
+//+--------------+
+// compacts the append-only log from a forked child, scheduled for later
+// while a nofork save runs
+static void do_bgrewriteaof(std::vector<std::string> &, Buffer &out){
+    if (!aof_enabled()){
+        return out_err(out, ERR_BAD_ARG, "appendonly is off");
+    }
+    if (g_data.child_pid > 0 || aof_stats().rewriting){
+        return out_err(out, ERR_BAD_ARG, "Background save or rewrite already in progress");
+    }
+    if (g_data.snap_running){
+        // started by process_timers() once the save is done
+        g_data.aof_rewrite_scheduled = true;
+        const char *reply = "Background append only file rewriting scheduled";
+        return out_str(out, reply, strlen(reply));
+    }
+    if (!aof_rewrite_start()){
+        return out_err(out, ERR_BAD_ARG, "fork() failed");
+    }
+    const char *reply = "Background append only file rewriting started";
+    return out_str(out, reply, strlen(reply));
+}
+
+// reaps the BGSAVE or BGREWRITEAOF child, called from the event loop
+static void child_poll(){
+    if (g_data.child_pid <= 0){
+        return;
+    }
+    int status = 0;
+    pid_t pid = g_data.child_pid;
+    if (waitpid(pid, &status, WNOHANG) != pid){
+        return;     // still running
+    }
+    g_data.child_pid = -1;
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (g_data.child_type == CHILD_AOF){
+        std::string tmp = aof_rewrite_path(pid);
+        if (ok){
+            // the pool appends the commands received meanwhile, see aof_rewrite_poll()
+            return aof_rewrite_finish(tmp.c_str(), &g_data.thread_pool);
+        }
+        msg("append only file rewrite failed");
+        aof_rewrite_abort();
+        unlink(tmp.c_str());
+        g_data.stats.last_aof_rewrite_ok = false;
+        return;
+    }
+    if (g_data.child_type == CHILD_REPL){
+        return repl_snapshot_done(pid, ok);
+    }
+    bgsave_done(ok);
+}
+
+static void handle_request(std::vector<std::string> &cmd, Buffer &out);
+
+// executes one logged command, only an unknown command means a broken log
+static bool aof_apply(const uint8_t* frame, size_t len){
+    std::vector<std::string> cmd;
+    if (parse_req(frame, len, cmd) < 0){
+        return false;
+    }
+    Buffer out;
+    handle_request(cmd, out);
+    uint32_t code = 0;
+    if (out.size() >= 5 && out[0] == TAG_ERR){
+        memcpy(&code, &out[1], 4);
+    }
+    return code != ERR_UNKNOWN;
+}
+
+// the log takes precedence over the snapshot as it is the more recent
+static void data_load(){
+    const char* aof_path = g_config.appendfilename.c_str();
+    bool has_aof = g_config.appendonly && access(aof_path, F_OK) == 0;
+    if (has_aof){
+        uint64_t start_ms = get_monotonic_msecs();
+        g_data.loading = true;
+        if (!aof_load(aof_path, &aof_apply)){
+            die("cannot load the append only file");
+        }
+        g_data.loading = false;
+        fprintf(stderr, "loaded %zu keys from %s in %llu ms\n", hm_size(&g_data.db),
+            aof_path, (unsigned long long)(get_monotonic_msecs() - start_ms));
+    } else if (!rdb_load(g_config.dbfilename.c_str())){
+        die("cannot load the snapshot");
+    }
+    if (!g_config.appendonly){
+        return;
+    }
+    // turning the log on over existing data, it starts as a rewrite of it
+    if (!has_aof && hm_size(&g_data.db) > 0){
+        std::string tmp = aof_rewrite_path(getpid());
+        if (!aof_rewrite_child(tmp.c_str()) || rename(tmp.c_str(), aof_path) < 0){
+            die("cannot create the append only file");
+        }
+    }
+    if (!aof_open(aof_path)){
+        die("cannot open the append only file");
+    }
+}
+
+//================================== replication ==================================//
+
+/*
+    primary/replica replication
+    - a replica connects to its primary and sends PSYNC with the id and the
+      offset of the stream it holds
+    - the primary continues from its backlog if it still holds that offset
+      (CONTINUE), otherwise a forked child saves a snapshot, which is sent
+      prefixed by its size and followed by the writes made since the fork
+      (FULLRESYNC); replicas arriving meanwhile wait for the next child
+    - then every write is sent as the request message it came in, plus a
+      `REPLCONF TIME` ping every `k_repl_ping_ms` from which the replica
+      measures its lag; the replica answers with `REPLCONF ACK offset`, from
+      which the primary measures its lag in bytes
+    - replicas refuse writes from clients and leave expiry to the primary,
+      which sends a DEL for every key it expires or evicts
+    - a replica passes the stream on unchanged, so replicas can be chained
+*/
+
+static std::string repl_snapshot_path(pid_t pid){
+    return g_config.dbfilename + ".repl." + std::to_string(pid);
+}
+
+// forks a child saving a snapshot for the replicas waiting for one
+static void repl_snapshot_start(){
+    // no fork while the nofork save thread may hold the allocator's locks
+    if (g_data.child_pid > 0 || g_data.snap_running){
+        return;     // retried by repl_cron()
+    }
+    bool waiting = false;
+    for (Conn* conn : g_repl.replicas){
+        waiting = waiting || conn->repl_state == REPL_WAIT_FORK;
+    }
+    if (!waiting){
+        return;
+    }
+    pid_t pid = fork();
+    if (pid < 0){
+        msg_err("fork() error");
+        return;
+    }
+    if (pid == 0){
+        _exit(rdb_save(repl_snapshot_path(getpid()).c_str()) ? 0 : 1);
+    }
+    g_data.child_pid = pid;
+    g_data.child_type = CHILD_REPL;
+    // the snapshot is the keyspace at `offset`, the stream after it is buffered
+    for (Conn* conn : g_repl.replicas){
+        if (conn->repl_state != REPL_WAIT_FORK){
+            continue;
+        }
+        size_t header = 0;
+        response_begin(conn->outgoing, &header);
+        out_arr(conn->outgoing, 3);
+        out_str(conn->outgoing, "FULLRESYNC", 10);
+        out_str(conn->outgoing, g_repl.replid.data(), g_repl.replid.size());
+        out_int(conn->outgoing, (int64_t)g_repl.offset);
+        response_end(conn->outgoing, header);
+        conn->want_write = true;
+        conn->repl_ack_offset = g_repl.offset;
+        conn->repl_state = REPL_WAIT_SAVE;
+    }
+}
+
+// the child is done, the replicas waiting for it are sent the file
+static void repl_snapshot_done(pid_t pid, bool ok){
+    std::string path = repl_snapshot_path(pid);
+    if (!ok){
+        msg("replication snapshot failed");
+    }
+    for (Conn* conn : g_repl.replicas){
+        if (conn->repl_state != REPL_WAIT_SAVE){
+            continue;
+        }
+        int fd = ok ? open(path.c_str(), O_RDONLY) : -1;
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0){
+            if (fd >= 0){
+                close(fd);
+            }
+            conn->want_close = true;    // it will retry
+            continue;
+        }
+        uint64_t size = (uint64_t)st.st_size;
+        buf_append(conn->outgoing, (const uint8_t*)&size, 8);
+        conn->bulk_fd = fd;
+        conn->want_write = true;
+        conn->repl_state = REPL_SEND_BULK;
+    }
+    // the open descriptors keep the file alive
+    unlink(path.c_str());
+}
+
+// more of the snapshot when `outgoing` ran dry, then the buffered stream
+static void repl_bulk_refill(Conn* conn){
+    uint8_t buf[64*1024];
+    ssize_t n = read(conn->bulk_fd, buf, sizeof(buf));
+    if (n < 0){
+        msg_err("replication snapshot read() error");
+        conn->want_close = true;
+        return;
+    }
+    if (n > 0){
+        buf_append(conn->outgoing, buf, (size_t)n);
+        return;
+    }
+    close(conn->bulk_fd);
+    conn->bulk_fd = -1;
+    conn->outgoing.swap(conn->repl_pending);
+    conn->repl_pending = Buffer();
+    conn->repl_state = REPL_ONLINE;
+}
+
+static void repl_send_reply_str(Conn* conn, const char* s1, const std::string &s2){
+    size_t header = 0;
+    response_begin(conn->outgoing, &header);
+    out_arr(conn->outgoing, 2);
+    out_str(conn->outgoing, s1, strlen(s1));
+    out_str(conn->outgoing, s2.data(), s2.size());
+    response_end(conn->outgoing, header);
+}
+
+//+-------+--------+--------+
+//| PSYNC | replid | offset |
+//+-------+--------+--------+
+// turns the connection into a replica link, replies [CONTINUE, replid] or
+// [FULLRESYNC, replid, offset]
+static void repl_psync(Conn* conn, std::vector<std::string> &cmd){
+    int64_t offset = -1;
+    bool synced = !is_replica() || (g_repl.master && g_repl.master->repl_state == REPL_STREAM);
+    if (conn->repl_state != REPL_NONE || !synced || !str2int(cmd[2], offset)){
+        size_t header = 0;
+        response_begin(conn->outgoing, &header);
+        out_err(conn->outgoing, ERR_BAD_ARG, synced ? "Bad PSYNC" : "Not synced with the primary");
+        response_end(conn->outgoing, header);
+        return;
+    }
+    if (g_repl.backlog.ring.empty()){
+        backlog_reset(&g_repl.backlog, g_config.repl_backlog_size, g_repl.offset);
+    }
+    // replica links never time out
+    cdlist_detach(&conn->idle_node);
+    cdlist_init(&conn->idle_node);
+    g_repl.replicas.push_back(conn);
+    conn->repl_ack_ms = get_monotonic_msecs();
+
+    bool same_history = cmd[1] == g_repl.replid
+        || (cmd[1] == g_repl.replid2 && (uint64_t)offset <= g_repl.offset2);
+    if (same_history && offset >= 0 && backlog_has(&g_repl.backlog, (uint64_t)offset)){
+        repl_send_reply_str(conn, "CONTINUE", g_repl.replid);
+        backlog_copy(&g_repl.backlog, (uint64_t)offset, conn->outgoing);
+        conn->repl_ack_offset = (uint64_t)offset;
+        conn->repl_state = REPL_ONLINE;
+        g_repl.stats.partial_syncs++;
+        return;
+    }
+    conn->repl_state = REPL_WAIT_FORK;
+    g_repl.stats.full_syncs++;
+    repl_snapshot_start();
+}
+
+// replication messages from a client, which get no reply
+static bool repl_intercept(Conn* conn, std::vector<std::string> &cmd){
+    if (cmd.size() == 3 && cmd[0] == "PSYNC"){
+        repl_psync(conn, cmd);
+        return true;
+    }
+    if (conn->repl_state == REPL_NONE){
+        return false;
+    }
+    int64_t offset = 0;
+    if (cmd.size() == 3 && cmd[0] == "REPLCONF" && cmd[1] == "ACK" && str2int(cmd[2], offset)){
+        conn->repl_ack_offset = (uint64_t)offset;
+        conn->repl_ack_ms = get_monotonic_msecs();
+    }
+    return true;
+}
+
+// connects to `replicaof` without blocking, the PSYNC goes out once connected
+static void repl_connect(){
+    const std::string &addr = g_config.replicaof;
+    int fd = -1;
+    int rv = -1;
+    if (addr[0] == '/'){
+        struct sockaddr_un sun = {};
+        sun.sun_family = AF_UNIX;
+        if (addr.size() >= sizeof(sun.sun_path)){
+            msg("replicaof: socket path too long");
+            return;
+        }
+        memcpy(sun.sun_path, addr.c_str(), addr.size() + 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0){
+            fd_set_nb(fd);
+            rv = connect(fd, (const struct sockaddr*)&sun, sizeof(sun));
+        }
+    } else {
+        size_t colon = addr.rfind(':');
+        std::string host = addr.substr(0, colon);
+        int64_t port = 0;
+        struct sockaddr_in sin = {};
+        sin.sin_family = AF_INET;
+        if (host == "localhost"){
+            host = "127.0.0.1";
+        }
+        if (colon == std::string::npos || !str2int(addr.substr(colon + 1), port)
+            || port <= 0 || port > 65535 || inet_pton(AF_INET, host.c_str(), &sin.sin_addr) != 1){
+            msg("replicaof: expected ip:port or a socket path");
+            return;
+        }
+        sin.sin_port = htons((uint16_t)port);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0){
+            fd_set_nb(fd);
+            rv = connect(fd, (const struct sockaddr*)&sin, sizeof(sin));
+        }
+    }
+    if (fd < 0 || (rv < 0 && errno != EINPROGRESS)){
+        msg_err("replication connect() error");
+        if (fd >= 0){
+            close(fd);
+        }
+        return;
+    }
+    Conn* conn = new Conn();
+    conn->fd = fd;
+    conn->want_read = true;
+    conn->want_write = true;
+    conn->repl_state = REPL_HANDSHAKE;
+    conn->proto = PROTO_BIN;
+    cdlist_init(&conn->idle_node);
+    if (g_data.fd2conn.size() <= (size_t)fd){
+        g_data.fd2conn.resize(fd + 1);
+    }
+    g_data.fd2conn[fd] = conn;
+    cmd_encode(conn->outgoing, {"PSYNC", g_repl.replid, std::to_string(g_repl.offset)});
+    g_repl.master = conn;
+    g_repl.last_io_ms = get_monotonic_msecs();
+}
+
+// the PSYNC reply, as strings
+static bool repl_parse_reply(const uint8_t* cur, const uint8_t* end, std::vector<std::string> &out){
+    if (cur == end || *cur++ != TAG_ARR){
+        return false;
+    }
+    uint32_t n = 0;
+    if (!read_prefix(cur, end, n)){
+        return false;
+    }
+    while (n-- > 0){
+        uint8_t tag = cur < end ? *cur++ : 0;
+        if (tag == TAG_STR){
+            uint32_t len = 0;
+            out.push_back(std::string());
+            if (!read_prefix(cur, end, len) || !read_str(cur, end, len, out.back())){
+                return false;
+            }
+        } else if (tag == TAG_INT && end - cur >= 8){
+            int64_t val = 0;
+            memcpy(&val, cur, 8);
+            cur += 8;
+            out.push_back(std::to_string(val));
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the snapshot has arrived, it replaces the keyspace
+static bool repl_load_snapshot(const std::string &tmp){
+    close(g_repl.transfer_fd);
+    g_repl.transfer_fd = -1;
+    uint64_t start_ms = get_monotonic_msecs();
+    bool locked = nofork_lock();
+    db_flush(true);
+    bool ok = rdb_load(tmp.c_str());
+    if (!ok){
+        db_flush(true);
+    }
+    nofork_unlock(locked);
+    if (!ok || rename(tmp.c_str(), g_config.dbfilename.c_str()) < 0){
+        msg("replication: cannot load the snapshot from the primary");
+        unlink(tmp.c_str());
+        // the keyspace no longer matches any history
+        g_repl.replid = repl_new_id();
+        g_repl.offset = 0;
+        g_repl.backlog = ReplBacklog();
+        return false;
+    }
+    g_repl.replid = g_repl.transfer_replid;
+    g_repl.replid2.clear();
+    g_repl.offset = g_repl.transfer_offset;
+    backlog_reset(&g_repl.backlog, g_config.repl_backlog_size, g_repl.offset);
+    g_repl.stats.full_syncs++;
+    g_repl.aof_rewrite_pending = aof_enabled();
+    // the chained replicas followed the old history
+    for (Conn* conn : g_repl.replicas){
+        conn->want_close = true;
+    }
+    fprintf(stderr, "replication: full sync done in %llu ms\n",
+        (unsigned long long)(get_monotonic_msecs() - start_ms));
+    return true;
+}
+
+// input on the link to the primary
+static void repl_master_input(Conn* conn){
+    g_repl.last_io_ms = get_monotonic_msecs();
+    Buffer &in = conn->incoming;
+    std::string tmp = g_config.dbfilename + ".repl.tmp";
+    // applied once no offloaded reply reads the keyspace, see offload_poll()
+    while (!conn->want_close && !g_data.frozen){
+        if (conn->repl_state == REPL_TRANSFER){
+            if (!g_repl.transfer_sized){
+                if (in.size() < 8){
+                    return;
+                }
+                memcpy(&g_repl.transfer_left, in.data(), 8);
+                buf_remove(in, 8);
+                g_repl.transfer_sized = true;
+            }
+            size_t n = in.size() < g_repl.transfer_left ? in.size() : (size_t)g_repl.transfer_left;
+            if (write_all(g_repl.transfer_fd, (const char*)in.data(), n) < 0){
+                msg_err("replication snapshot write() error");
+                conn->want_close = true;
+                return;
+            }
+            buf_remove(in, n);
+            g_repl.transfer_left -= n;
+            if (g_repl.transfer_left > 0){
+                return;
+            }
+            if (!repl_load_snapshot(tmp)){
+                conn->want_close = true;
+                return;
+            }
+            conn->repl_state = REPL_STREAM;
+            continue;
+        }
+        // a message, the PSYNC reply or a command of the stream
+        if (in.size() < 4){
+            return;
+        }
+        uint32_t len = 0;
+        memcpy(&len, in.data(), 4);
+        if (len > k_max_msg){
+            msg("replication: message is too long");
+            conn->want_close = true;
+            return;
+        }
+        if (4 + len > in.size()){
+            return;
+        }
+        if (conn->repl_state == REPL_HANDSHAKE){
+            std::vector<std::string> reply;
+            bool ok = repl_parse_reply(&in[4], &in[4] + len, reply);
+            buf_remove(in, 4 + len);
+            int64_t offset = 0;
+            if (ok && reply.size() == 3 && reply[0] == "FULLRESYNC" && str2int(reply[2], offset)){
+                g_repl.transfer_replid = reply[1];
+                g_repl.transfer_offset = (uint64_t)offset;
+                g_repl.transfer_sized = false;
+                g_repl.transfer_fd = open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+                if (g_repl.transfer_fd < 0){
+                    msg_err("replication snapshot open() error");
+                    conn->want_close = true;
+                    return;
+                }
+                conn->repl_state = REPL_TRANSFER;
+            } else if (ok && reply.size() == 2 && reply[0] == "CONTINUE"){
+                // a promoted replica continues our history under a new id
+                if (reply[1] != g_repl.replid){
+                    g_repl.replid2 = g_repl.replid;
+                    g_repl.offset2 = g_repl.offset;
+                    g_repl.replid = reply[1];
+                }
+                g_repl.stats.partial_syncs++;
+                conn->repl_state = REPL_STREAM;
+                fprintf(stderr, "replication: partial resync from offset %llu\n",
+                    (unsigned long long)g_repl.offset);
+            } else {
+                msg("replication: PSYNC refused");
+                conn->want_close = true;
+            }
+            continue;
+        }
+        std::vector<std::string> cmd;
+        if (parse_req(&in[4], len, cmd) < 0){
+            msg("replication: bad command in the stream");
+            conn->want_close = true;
+            return;
+        }
+        if (cmd.size() == 3 && cmd[0] == "REPLCONF" && cmd[1] == "TIME"){
+            int64_t sent_ms = 0;
+            if (str2int(cmd[2], sent_ms)){
+                g_repl.lag_ms = (int64_t)get_unix_msecs() - sent_ms;
+            }
+        } else {
+            Buffer out;
+            bool locked = nofork_lock();
+            g_repl.applying = true;
+            handle_request(cmd, out);
+            g_repl.applying = false;
+            nofork_unlock(locked);
+        }
+        // the backlog and the chained replicas get the exact bytes
+        repl_feed(&in[0], 4 + len);
+        buf_remove(in, 4 + len);
+    }
+}
+
+// pings, acknowledgements, reconnects and closed links, called from the event loop
+static void repl_cron(uint64_t now_ms){
+    // links closed outside of the poll loop
+    if (g_repl.master && g_repl.master->want_close){
+        conn_destroy(g_repl.master);
+    }
+    for (size_t i = g_repl.replicas.size(); i-- > 0;){
+        if (g_repl.replicas[i]->want_close){
+            conn_destroy(g_repl.replicas[i]);
+        }
+    }
+    if (is_replica()){
+        Conn* conn = g_repl.master;
+        if (!conn && now_ms - g_repl.connect_ms >= k_repl_retry_ms){
+            g_repl.connect_ms = now_ms;
+            repl_connect();
+        } else if (conn && now_ms - g_repl.last_io_ms >= k_repl_timeout_ms){
+            msg("replication: the primary timed out");
+            conn_destroy(conn);
+        } else if (conn && conn->repl_state == REPL_STREAM && now_ms - g_repl.last_ack_ms >= k_repl_ping_ms){
+            g_repl.last_ack_ms = now_ms;
+            cmd_encode(conn->outgoing, {"REPLCONF", "ACK", std::to_string(g_repl.offset)});
+            conn->want_write = true;
+        }
+    } else if (!g_repl.replicas.empty() && now_ms - g_repl.last_ping_ms >= k_repl_ping_ms){
+        g_repl.last_ping_ms = now_ms;
+        Buffer frame;
+        cmd_encode(frame, {"REPLCONF", "TIME", std::to_string(get_unix_msecs())});
+        repl_feed(frame.data(), frame.size());
+    }
+    // replicas waiting for the child slot
+    repl_snapshot_start();
+    // the log was left behind by a full sync
+    if (g_repl.aof_rewrite_pending && aof_enabled() && aof_rewrite_start()){
+        g_repl.aof_rewrite_pending = false;
+    }
+}
+
+//+-----------+---------+------+    +-----------+----+-----+
+//| REPLICAOF | host    | port |    | REPLICAOF | NO | ONE |
+//+-----------+---------+------+    +-----------+----+-----+
+// follows another primary (also REPLICAOF path for a unix socket), or
+// becomes a primary continuing the same stream under a new id
+static void do_replicaof(std::vector<std::string> &cmd, Buffer &out){
+    if (cmd.size() > 3){
+        return out_err(out, ERR_BAD_ARG, "Expected host port, a socket path or NO ONE");
+    }
+    if (cmd.size() == 3 && cmd[1] == "NO" && cmd[2] == "ONE"){
+        if (is_replica()){
+            g_config.replicaof.clear();
+            if (g_repl.master){
+                g_repl.master->want_close = true;
+            }
+            g_repl.replid2 = g_repl.replid;
+            g_repl.offset2 = g_repl.offset;
+            g_repl.replid = repl_new_id();
+            msg("replication: promoted to primary");
+        }
+        return out_nil(out);
+    }
+    g_config.replicaof = cmd.size() == 3 ? cmd[1] + ":" + cmd[2] : cmd[1];
+    if (g_repl.master){
+        g_repl.master->want_close = true;
+    }
+    g_repl.connect_ms = 0;      // connects on the next repl_cron()
+    return out_nil(out);
+}
+
+//================================== memory introspection ==================================//
+
+/*
+    MEMORY USAGE and MEMORY REPORT
+    - entry_mem() counts the bytes asked for, for maxmemory; entry_usage()
+      estimates what the allocator actually hands out: the chunk header and
+      rounding of every allocation, the slot arrays, the string buffers that
+      don't fit inline, the key's share of the keyspace slots and its TTL
+    - container nodes are not walked, their count and total size give the
+      mean node, so MEMORY USAGE is O(1) on any key
+    - MEMORY REPORT parks the client while memreport_run() samples random
+      keys from the event loop under k_memreport_budget_us per iteration,
+      clients asking meanwhile wait for the same report
+    - a keyspace no larger than the sample is walked exactly instead, slot by
+      slot over the same budget, see memreport_walk()
+*/
+static struct {
+    MemReport report;
+    bool running = false;
+    std::vector<Conn*> waiters;
+    // the walk cursor of an exact report
+    HNode** tab = nullptr;
+    size_t pos = 0;
+} g_memreport;
+
+static const char* const k_type_names[k_memreport_types] = {
+    "none", "string", "zset", "hash", "list", "hyperloglog", "bloom", "none",
+};
+
+// glibc's chunk for a malloc(n): a size word, rounded up to 16, 32 at least
+static size_t alloc_size(size_t n){
+    n = (n + 8 + 15) & ~(size_t)15;
+    return n < 32 ? 32 : n;
+}
+
+// the heap buffer of a string, none while it fits inline
+static size_t str_alloc(const std::string &s){
+    return s.capacity() > 15 ? alloc_size(s.capacity() + 1) : 0;
+}
+
+static size_t slots_alloc(HMap* hmap){
+    size_t n = 0;
+    if (hmap->newer.tab){
+        n += alloc_size((hmap->newer.mask + 1)*sizeof(HNode*));
+    }
+    if (hmap->older.tab){
+        n += alloc_size((hmap->older.mask + 1)*sizeof(HNode*));
+    }
+    return n;
+}
+
+// `n` allocations of `bytes` in total
+static size_t nodes_alloc(size_t n, size_t bytes){
+    return n ? n * alloc_size(bytes / n) : 0;
+}
+
+static size_t entry_usage(Entry* ent){
+    size_t n = alloc_size(sizeof(Entry)) + str_alloc(ent->key) + str_alloc(ent->str);
+    size_t nkeys = hm_size(&g_data.db);
+    n += slots_alloc(&g_data.db) / (nkeys ? nkeys : 1);
+    if (ent->heap_idx != (size_t)-1){
+        n += sizeof(HeapNode);
+    }
+    if (ent->type == T_ZSET){
+        ZSet* zset = &ent->zset;
+        n += nodes_alloc(hm_size(&zset->hmap), zset->node_bytes) + slots_alloc(&zset->hmap);
+    } else if (ent->type == T_HASH){
+        Hash* hash = ent->hash.get();
+        n += alloc_size(sizeof(Hash)) + str_alloc(hash->packed)
+            + nodes_alloc(hm_size(&hash->hmap), hash->node_bytes) + slots_alloc(&hash->hmap);
+    } else if (ent->type == T_LIST){
+        // a chunk and its buffer
+        List* list = ent->list.get();
+        size_t heads = list->nchunks * sizeof(ListChunk);
+        n += alloc_size(sizeof(List)) + nodes_alloc(list->nchunks, heads)
+            + nodes_alloc(list->nchunks, list->mem - heads + list->nchunks);
+    }
+    return n;
+}
+
+static bool type_cmp(uint32_t a, uint32_t b){
+    return g_memreport.report.types[a].bytes > g_memreport.report.types[b].bytes;
+}
+
+static void out_memstats(Buffer &out, const char* name, const MemStat &st, double scale){
+    out_arr(out, 3);
+    out_str(out, name, strlen(name));
+    out_int(out, llround(st.keys * scale));
+    out_int(out, llround(st.bytes * scale));
+}
+
+// the estimates for the whole keyspace: [name, keys, bytes] by type and by
+// prefix, the most bytes first, and [key, type, bytes] of the largest keys
+static void out_memreport(Buffer &out, MemReport* r){
+    double scale = r->exact ? 1 : r->taken ? (double)r->nkeys / r->taken : 0;
+    out_map(out, 7);
+    out_str(out, "keys", 4);
+    out_int(out, (int64_t)r->nkeys);
+    out_str(out, "sampled", 7);
+    out_int(out, (int64_t)r->taken);
+    out_str(out, "exact", 5);
+    out_int(out, r->exact);
+    out_str(out, "elapsed_us", 10);
+    out_int(out, (int64_t)(get_monotonic_usecs() - r->start_us));
+    std::vector<uint32_t> types;
+    for (uint32_t t = 0; t < k_memreport_types; t++){
+        if (r->types[t].keys){
+            types.push_back(t);
+        }
+    }
+    std::sort(types.begin(), types.end(), &type_cmp);
+    out_str(out, "by_type", 7);
+    out_arr(out, (uint32_t)types.size());
+    for (uint32_t t : types){
+        out_memstats(out, k_type_names[t], r->types[t], scale);
+    }
+    std::vector<const MemPrefix*> prefixes = memreport_prefixes(r, k_memreport_top_prefixes);
+    out_str(out, "by_prefix", 9);
+    out_arr(out, (uint32_t)prefixes.size());
+    for (const MemPrefix* p : prefixes){
+        out_memstats(out, p->prefix.c_str(), p->stat, scale);
+    }
+    std::vector<MemKey> largest = memreport_largest(r);
+    out_str(out, "largest", 7);
+    out_arr(out, (uint32_t)largest.size());
+    for (const MemKey &k : largest){
+        out_arr(out, 3);
+        out_str(out, k.key.data(), k.key.size());
+        out_str(out, k_type_names[k.type], strlen(k_type_names[k.type]));
+        out_int(out, (int64_t)k.bytes);
+    }
+}
+
+static void memreport_forget(Conn* conn){
+    if (!conn->memreport){
+        return;
+    }
+    std::vector<Conn*> &v = g_memreport.waiters;
+    v.erase(std::remove(v.begin(), v.end(), conn), v.end());
+    if (v.empty()){
+        memreport_clear(&g_memreport.report);
+        g_memreport.running = false;
+    }
+}
+
+// a slice of an exact report, true once every key was counted; a pending
+// rehash is finished first, so the walk covers one table in which keys don't
+// move, and a rehash starting meanwhile starts it over
+static bool memreport_walk(uint64_t start_us){
+    HMap* db = &g_data.db;
+    MemReport* r = &g_memreport.report;
+    while (get_monotonic_usecs() - start_us < k_memreport_budget_us){
+        if (db->older.tab){
+            if (db->frozen){
+                return false;   // offloaded replies read `db`, nothing may move
+            }
+            hm_rehash_step(db);
+            continue;
+        }
+        if (db->newer.tab != g_memreport.tab){
+            if (g_memreport.tab){
+                memreport_restart(r);
+            }
+            g_memreport.tab = db->newer.tab;
+            g_memreport.pos = 0;
+        }
+        if (!db->newer.tab || g_memreport.pos > db->newer.mask){
+            return true;
+        }
+        for (HNode* node = db->newer.tab[g_memreport.pos]; node; node = node->next){
+            Entry* ent = container_of(node, Entry, node);
+            memreport_add(r, ent->key, ent->type, entry_usage(ent));
+        }
+        g_memreport.pos++;
+    }
+    return false;
+}
+
+// a slice of the sample, once complete the waiters get the report and resume
+static void memreport_run(){
+    if (!g_memreport.running){
+        return;
+    }
+    MemReport* r = &g_memreport.report;
+    bool locked = nofork_lock();
+    uint64_t start_us = get_monotonic_usecs();
+    bool done = false;
+    if (r->exact){
+        done = memreport_walk(start_us);
+    } else {
+        while (r->taken < r->samples){
+            HNode* node = hm_random(&g_data.db, evict_rand());
+            if (!node){
+                break;      // the keyspace emptied meanwhile
+            }
+            Entry* ent = container_of(node, Entry, node);
+            memreport_add(r, ent->key, ent->type, entry_usage(ent));
+            if (r->taken % 64 == 0 && get_monotonic_usecs() - start_us >= k_memreport_budget_us){
+                break;
+            }
+        }
+        done = r->taken >= r->samples || hm_size(&g_data.db) == 0;
+    }
+    nofork_unlock(locked);
+    if (!done){
+        return;
+    }
+    std::vector<Conn*> waiters;
+    waiters.swap(g_memreport.waiters);
+    for (Conn* conn : waiters){
+        size_t header = 0;
+        response_begin(conn->outgoing, &header);
+        out_memreport(conn->outgoing, r);
+        conn_response_end(conn, header);
+        conn->memreport = false;
+    }
+    memreport_clear(r);
+    g_memreport.running = false;
+    g_memreport.tab = nullptr;
+    // as block_resume()
+    for (Conn* conn : waiters){
+        conn->last_active_ms = get_monotonic_msecs();
+        cdlist_insert_before(&g_data.idle_list, &conn->idle_node);
+        conn_process(conn);
+        if (conn->want_close){
+            conn_destroy(conn);
+        }
+    }
+}
+
+//+--------+-------+-----+    +--------+--------+-----------+
+//| MEMORY | USAGE | key |    | MEMORY | REPORT | [samples] |
+//+--------+-------+-----+    +--------+--------+-----------+
+// USAGE gives the estimated bytes of a key, nil if it is missing; REPORT
+// samples `samples` keys (k_memreport_samples by default, k_memreport_max_samples
+// at most), see out_memreport(); a client asking while a report runs waits for
+// that one, sampled to its first caller's size
+static void do_memory(std::vector<std::string> &cmd, Buffer &out){
+    const std::string &sub = cmd[1];
+    if (sub == "USAGE" && cmd.size() == 3){
+        LookupKey key;
+        lookup_key_init(&key, cmd[2]);
+        Entry* ent = entry_lookup(&key);
+        if (!ent){
+            return out_nil(out);
+        }
+        return out_int(out, (int64_t)entry_usage(ent));
+    }
+    if (sub != "REPORT" || cmd.size() > 3){
+        return out_err(out, ERR_BAD_ARG, "Expected USAGE key or REPORT [samples]");
+    }
+    int64_t samples = k_memreport_samples;
+    if (cmd.size() == 3 && (!str2int(cmd[2], samples) || samples < 1 || (uint64_t)samples > k_memreport_max_samples)){
+        return out_err(out, ERR_BAD_ARG, "Expected a number of samples up to " + std::to_string(k_memreport_max_samples));
+    }
+    Conn* conn = g_data.client;
+    if (!conn){
+        return out_nil(out);
+    }
+    // joins the report running, if any
+    if (!g_memreport.running){
+        MemReport* r = &g_memreport.report;
+        r->nkeys = hm_size(&g_data.db);
+        r->samples = (uint64_t)samples;
+        r->start_us = get_monotonic_usecs();
+        r->exact = r->nkeys <= r->samples;
+        g_memreport.tab = nullptr;
+        g_memreport.running = true;
+    }
+    g_memreport.waiters.push_back(conn);
+    conn->memreport = true;
+    cdlist_detach(&conn->idle_node);
+    cdlist_init(&conn->idle_node);
+}
+
+//================================== server administration ==================================//
+
+//+--------+-----+------+    +--------+-----+------+-------+
+//| CONFIG | GET | name |    | CONFIG | SET | name | value |
+//+--------+-----+------+    +--------+-----+------+-------+
+static void do_config(std::vector<std::string> &cmd, Buffer &out){
+    std::string err;
+    if (cmd.size() == 3 && cmd[1] == "GET"){
+        std::string val;
+        if (!config_get(cmd[2], val, err)){
+            return out_err(out, ERR_BAD_ARG, err);
+        }
+        return out_str(out, val.data(), val.size());
+    } else if (cmd.size() == 4 && cmd[1] == "SET"){
+        if (!config_set(cmd[2], cmd[3], err)){
+            return out_err(out, ERR_BAD_ARG, err);
+        }
+        // a started backlog takes its new size right away
+        ReplBacklog* b = &g_repl.backlog;
+        if (!b->ring.empty() && b->ring.size() != g_config.repl_backlog_size){
+            backlog_resize(b, g_config.repl_backlog_size);
+        }
+        return out_nil(out);
+    }
+    return out_err(out, ERR_BAD_ARG, "Expected GET or SET");
+}
+
+//+------+-------+
+//| PING | [msg] |
+//+------+-------+
+static void do_ping(std::vector<std::string> &cmd, Buffer &out){
+    if (cmd.size() > 2){
+        return out_err(out, ERR_BAD_ARG, "Expected at most one argument");
+    }
+    if (cmd.size() == 2){
+        return out_str(out, cmd[1].data(), cmd[1].size());
+    }
+    return out_str(out, "PONG", 4);
+}
+
+//+-------+-----------+
+//| HELLO | [protover]|
+//+-------+-----------+
+// switches a RESP connection to RESP2 or RESP3, replies with a map of
+// server properties, what RESP3 clients expect; AUTH and SETNAME are ignored
+static void do_hello(std::vector<std::string> &cmd, Buffer &out){
+    Conn* conn = g_data.client;
+    int64_t ver = conn && conn->proto == PROTO_RESP3 ? 3 : 2;
+    if (cmd.size() > 1 && (!str2int(cmd[1], ver) || ver < 2 || ver > 3)){
+        return out_err(out, ERR_BAD_ARG, "Unsupported protocol version");
+    }
+    if (conn && conn->proto != PROTO_BIN){
+        conn->proto = ver == 3 ? PROTO_RESP3 : PROTO_RESP2;
+    }
+    const char *role = is_replica() ? "replica" : "master";
+    out_map(out, 7);
+    out_str(out, "server", 6);
+    out_str(out, "redis", 5);
+    out_str(out, "version", 7);
+    out_str(out, "7.0.0", 5);
+    out_str(out, "proto", 5);
+    out_int(out, ver);
+    out_str(out, "id", 2);
+    out_int(out, conn ? conn->fd : 0);
+    out_str(out, "mode", 4);
+    out_str(out, "standalone", 10);
+    out_str(out, "role", 4);
+    out_str(out, role, strlen(role));
+    out_str(out, "modules", 7);
+    out_arr(out, 0);
+}
+
+//+-------+
+//| STATS |
+//+-------+
+// flat [name, value, ...] array of counters
+static void out_stat(Buffer &out, const char *name, uint64_t val){
+    out_str(out, name, strlen(name));
+    out_int(out, (int64_t)val);
+}
+
+static void do_stats(std::vector<std::string> &, Buffer &out){
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    out_stat(out, "keys", hm_size(&g_data.db));                         n += 2;
+    out_stat(out, "used_memory", used_memory());                        n += 2;
+    out_stat(out, "maxmemory", g_config.maxmemory);                     n += 2;
+    out_stat(out, "evicted_keys", g_data.stats.evicted_keys);           n += 2;
+    out_stat(out, "expired_keys", g_data.stats.expired_keys);           n += 2;
+    out_stat(out, "expire_cycles_cut", g_data.stats.expire_cycles_cut); n += 2;
+    out_stat(out, "lazyfree_pending_bytes", lazyfree_stats().pending_bytes); n += 2;
+    out_stat(out, "rdb_changes_since_last_save", g_data.dirty);         n += 2;
+    out_stat(out, "rdb_bgsave_in_progress",
+        (g_data.child_type == CHILD_RDB && g_data.child_pid > 0) || g_data.snap_running); n += 2;
+    out_stat(out, "rdb_last_bgsave_ok", g_data.stats.last_bgsave_ok);   n += 2;
+    out_stat(out, "rdb_last_save_unix_ms", g_data.stats.last_save_unix_ms); n += 2;
+    out_stat(out, "rdb_nofork_cow_keys", g_nofork.stats.cow_keys);      n += 2;
+    out_stat(out, "rdb_nofork_cow_us", g_nofork.stats.cow_us);          n += 2;
+    out_stat(out, "rdb_nofork_lock_wait_us", g_nofork.stats.lock_wait_us); n += 2;
+    out_stat(out, "rdb_nofork_lock_wait_max_us", g_nofork.stats.lock_wait_max_us); n += 2;
+    const AofStats &aof = aof_stats();
+    out_stat(out, "aof_enabled", aof_enabled());                        n += 2;
+    out_stat(out, "aof_rewrite_in_progress", aof.rewriting);            n += 2;
+    out_stat(out, "aof_last_rewrite_ok", g_data.stats.last_aof_rewrite_ok); n += 2;
+    out_stat(out, "aof_last_write_ok", aof.last_write_ok);              n += 2;
+    out_stat(out, "aof_current_size", aof.size);                        n += 2;
+    out_stat(out, "aof_pending_bytes", aof.pending);                    n += 2;
+    out_stat(out, "aof_fsyncs", aof.fsyncs);                            n += 2;
+    // replication, the lags are the worst over the replicas on a primary
+    uint64_t now_ms = get_monotonic_msecs();
+    uint64_t max_lag = 0;
+    uint64_t max_ack_age = 0;
+    size_t online = 0;
+    for (Conn* conn : g_repl.replicas){
+        online += conn->repl_state == REPL_ONLINE;
+        uint64_t lag = g_repl.offset - conn->repl_ack_offset;
+        uint64_t age = now_ms - conn->repl_ack_ms;
+        max_lag = lag > max_lag ? lag : max_lag;
+        max_ack_age = age > max_ack_age ? age : max_ack_age;
+    }
+    Conn* master = g_repl.master;
+    out_stat(out, "role_replica", is_replica());                        n += 2;
+    out_stat(out, "master_repl_offset", g_repl.offset);                 n += 2;
+    out_stat(out, "repl_backlog_bytes", g_repl.backlog.end - g_repl.backlog.start); n += 2;
+    out_stat(out, "repl_full_syncs", g_repl.stats.full_syncs);          n += 2;
+    out_stat(out, "repl_partial_syncs", g_repl.stats.partial_syncs);    n += 2;
+    out_stat(out, "connected_replicas", g_repl.replicas.size());        n += 2;
+    out_stat(out, "online_replicas", online);                           n += 2;
+    out_stat(out, "repl_max_lag_bytes", max_lag);                       n += 2;
+    out_stat(out, "repl_max_ack_age_ms", max_ack_age);                  n += 2;
+    out_stat(out, "master_link_up", master && master->repl_state == REPL_STREAM); n += 2;
+    out_stat(out, "master_sync_in_progress",
+        master && (master->repl_state == REPL_HANDSHAKE || master->repl_state == REPL_TRANSFER)); n += 2;
+    out_stat(out, "master_last_io_ms_ago", master ? now_ms - g_repl.last_io_ms : 0); n += 2;
+    out_str(out, "repl_lag_ms", 11);
+    out_int(out, g_repl.lag_ms);                                        n += 2;
+    // thread pool, per worker
+    ThreadPool &pool = g_data.thread_pool;
+    out_stat(out, "pool_threads", pool.size());                         n += 2;
+    out_stat(out, "offload_jobs", g_offload.stats.jobs);                n += 2;
+    const IoStats &io = io_threads_stats();
+    out_stat(out, "io_threads", io_threads_count());                    n += 2;
+    out_stat(out, "io_threaded_batches", io.batches);                   n += 2;
+    out_stat(out, "io_inline_batches", io.inline_batches);              n += 2;
+    out_stat(out, "io_batch_items", io.items);                          n += 2;
+    out_stat(out, "offload_in_flight", g_data.frozen);                  n += 2;
+    out_stat(out, "offload_parked_writes", g_offload.stats.parked_writes); n += 2;
+    out_stat(out, "blocked_clients", g_block.stats.blocked);            n += 2;
+    out_stat(out, "blocked_served", g_block.stats.served);              n += 2;
+    out_stat(out, "blocked_timeouts", g_block.stats.timeouts);          n += 2;
+    out_stat(out, "pubsub_channels", pubsub_nchannels());               n += 2;
+    out_stat(out, "pubsub_patterns", pubsub_npatterns());               n += 2;
+    out_stat(out, "pubsub_published", g_pubsub.stats.published);        n += 2;
+    out_stat(out, "pubsub_delivered", g_pubsub.stats.delivered);        n += 2;
+    out_stat(out, "pubsub_dropped", g_pubsub.stats.dropped);            n += 2;
+    for (size_t i = 0; i < pool.size(); i++){
+        WorkerStats ws = pool.worker_stats(i);
+        std::string prefix = "pool_worker" + std::to_string(i) + "_";
+        out_stat(out, (prefix + "depth").c_str(), ws.depth);            n += 2;
+        out_stat(out, (prefix + "busy_us").c_str(), ws.busy_us);        n += 2;
+        out_stat(out, (prefix + "tasks").c_str(), ws.tasks);            n += 2;
+        out_stat(out, (prefix + "steals").c_str(), ws.steals);          n += 2;
+    }
+    out_end_arr(out, ctx, n);
+}
+
+/*
+    slow log, see slowlog.h
+    - a request is logged when parsing, executing and serializing it took
+      longer than `slowlog-log-slower-than`, with the write time added as its
+      reply leaves
+    - a loop iteration is logged when its work took longer than
+      `slowlog-loop-slower-than`, the wait in poll() is reported but not counted
+*/
+static bool slowlog_over(const SlowCmd &e){
+    return e.parse_ns + e.exec_ns + e.serialize_ns >= (uint64_t)g_config.slowlog_slower_than * 1000;
+}
+
+// logs the request whose reply is `outgoing` from `reply_pos` on
+static void slowlog_cmd(Conn* conn, SlowCmd &e, size_t reply_pos){
+    e.unix_ms = get_unix_msecs();
+    e.client = conn->addr;
+    uint64_t id = slowlog_add_cmd(e, g_config.slowlog_max_len);
+    uint64_t base = conn->written + conn->outq_bytes;
+    SlowPending p = {id, base + reply_pos, base + conn->outgoing.size()};
+    conn->slow_pending.push_back(p);
+}
+
+// a write() of `n` bytes that took `ns` counts for every logged reply it
+// carried a part of, called from the thread writing the replies
+static void slowlog_written(Conn* conn, size_t n, uint64_t ns){
+    uint64_t begin = conn->written - n;
+    size_t done = 0;
+    for (SlowPending &p : conn->slow_pending){
+        if (p.reply_begin < conn->written && p.reply_end > begin){
+            slowlog_add_write(p.id, ns);
+        }
+        done += p.reply_end <= conn->written;
+    }
+    conn->slow_pending.erase(conn->slow_pending.begin(), conn->slow_pending.begin() + done);
+}
+
+//+---------+-----------+    +---------+-------------+    +---------+-----+    +---------+-------+
+//| SLOWLOG | GET [n]   |    | SLOWLOG | LOOPS [n]   |    | SLOWLOG | LEN |    | SLOWLOG | RESET |
+//+---------+-----------+    +---------+-------------+    +---------+-----+    +---------+-------+
+// GET gives [id, unix_ms, total_us, [args], client, [parse_ns, exec_ns, serialize_ns, write_ns]]
+// and LOOPS [id, unix_ms, busy_us, [poll_ns, io_ns, timers_ns, background_ns]],
+// the newest `n` (10 by default) first
+static void do_slowlog(std::vector<std::string> &cmd, Buffer &out){
+    const std::string &sub = cmd[1];
+    if (cmd.size() == 2 && sub == "LEN"){
+        return out_int(out, (int64_t)slowlog_len());
+    }
+    if (cmd.size() == 2 && sub == "RESET"){
+        slowlog_reset();
+        return out_nil(out);
+    }
+    if ((sub != "GET" && sub != "LOOPS") || cmd.size() > 3){
+        return out_err(out, ERR_BAD_ARG, "Expected GET, LOOPS, LEN or RESET");
+    }
+    int64_t n = 10;
+    if (cmd.size() == 3 && (!str2int(cmd[2], n) || n < 0)){
+        return out_err(out, ERR_BAD_ARG, "Expected a count");
+    }
+    if (sub == "LOOPS"){
+        std::vector<SlowLoop> loops = slowlog_loops((size_t)n);
+        out_arr(out, (uint32_t)loops.size());
+        for (SlowLoop &e : loops){
+            out_arr(out, 4);
+            out_int(out, (int64_t)e.id);
+            out_int(out, (int64_t)e.unix_ms);
+            out_int(out, (int64_t)((e.io_ns + e.timers_ns + e.background_ns) / 1000));
+            out_arr(out, 4);
+            out_int(out, (int64_t)e.poll_ns);
+            out_int(out, (int64_t)e.io_ns);
+            out_int(out, (int64_t)e.timers_ns);
+            out_int(out, (int64_t)e.background_ns);
+        }
+        return;
+    }
+    std::vector<SlowCmd> cmds = slowlog_cmds((size_t)n);
+    out_arr(out, (uint32_t)cmds.size());
+    for (SlowCmd &e : cmds){
+        out_arr(out, 6);
+        out_int(out, (int64_t)e.id);
+        out_int(out, (int64_t)e.unix_ms);
+        out_int(out, (int64_t)((e.parse_ns + e.exec_ns + e.serialize_ns + e.write_ns) / 1000));
+        out_arr(out, (uint32_t)e.args.size());
+        for (const std::string &arg : e.args){
+            out_str(out, arg.data(), arg.size());
+        }
+        out_str(out, e.client.data(), e.client.size());
+        out_arr(out, 4);
+        out_int(out, (int64_t)e.parse_ns);
+        out_int(out, (int64_t)e.exec_ns);
+        out_int(out, (int64_t)e.serialize_ns);
+        out_int(out, (int64_t)e.write_ns);
+    }
+}
+
+/*
+    traffic capture, see capture.h
+    - requests are recorded in try_one_request() once they are about to run,
+      so a write parked by an offloaded reply is recorded once, when it runs
+    - the buffers of idle connections are handed over every k_capture_flush_ms
+*/
+static struct {
+    Buffer frame;                   // a RESP request in our framing
+    uint64_t last_flush_ms = 0;
+} g_capture;
+
+static void capture_req(Conn* conn, const std::vector<std::string> &cmd, size_t bytes){
+    uint64_t now_us = get_monotonic_usecs();
+    if (conn->proto == PROTO_BIN){
+        return capture_request(conn->capture, now_us, conn->incoming.data(), bytes);
+    }
+    g_capture.frame.clear();
+    cmd_encode(g_capture.frame, cmd);
+    capture_request(conn->capture, now_us, g_capture.frame.data(), g_capture.frame.size());
+}
+
+static void capture_flush_all(){
+    for (Conn* conn : g_data.fd2conn){
+        if (conn){
+            capture_flush(conn->capture);
+        }
+    }
+}
+
+static void capture_cron(uint64_t now_ms){
+    capture_poll();
+    if (capture_active() && now_ms - g_capture.last_flush_ms >= k_capture_flush_ms){
+        g_capture.last_flush_ms = now_ms;
+        capture_flush_all();
+    }
+}
+
+//+---------+------------+    +---------+------+    +---------+--------+
+//| CAPTURE | START file |    | CAPTURE | STOP |    | CAPTURE | STATUS |
+//+---------+------------+    +---------+------+    +---------+--------+
+// START takes a bare file name, created (or truncated) in `capture-dir`, which
+// only the command line sets; STATUS gives name value pairs like STATS
+static void do_capture(std::vector<std::string> &cmd, Buffer &out){
+    const std::string &sub = cmd[1];
+    if (cmd.size() == 3 && sub == "START"){
+        const std::string &file = cmd[2];
+        if (file.empty() || file == "." || file == ".." || file.find('/') != std::string::npos){
+            return out_err(out, ERR_BAD_ARG, "Expected a file name without a directory");
+        }
+        if (capture_active()){
+            return out_err(out, ERR_BAD_ARG, "A capture is already running");
+        }
+        if (capture_poll()){
+            return out_err(out, ERR_BAD_ARG, "The last capture is still being written");
+        }
+        std::string path = g_config.capture_dir + "/" + file;
+        if (!capture_start(path.c_str(), &g_data.thread_pool)){
+            return out_err(out, ERR_BAD_ARG, "Cannot open the capture file");
+        }
+        g_capture.last_flush_ms = get_monotonic_msecs();
+        return out_nil(out);
+    }
+    if (cmd.size() == 2 && sub == "STOP"){
+        capture_flush_all();
+        capture_stop();
+        return out_nil(out);
+    }
+    if (cmd.size() != 2 || sub != "STATUS"){
+        return out_err(out, ERR_BAD_ARG, "Expected START file, STOP or STATUS");
+    }
+    CaptureStats st = capture_stats();
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    out_stat(out, "capture_active", st.active);                         n += 2;
+    out_stat(out, "capture_stopping", st.stopping);                     n += 2;
+    out_str(out, "capture_path", 12);
+    out_str(out, st.path.data(), st.path.size());                       n += 2;
+    out_stat(out, "capture_requests", st.requests);                     n += 2;
+    out_stat(out, "capture_blocks", st.blocks);                         n += 2;
+    out_stat(out, "capture_bytes", st.bytes);                           n += 2;
+    out_stat(out, "capture_pending_bytes", st.pending);                 n += 2;
+    out_stat(out, "capture_dropped", st.dropped);                       n += 2;
+    out_end_arr(out, ctx, n);
+}
+
+/*
+    ops/s, the command counter is sampled every k_ops_sample_ms by the timers
+    and the rate is taken over the last k_ops_window_ms of samples, an idle
+    loop samples nothing so INFO adds a sample of its own
+*/
+static struct {
+    uint64_t ms[k_ops_samples] = {};
+    uint64_t ops[k_ops_samples] = {};
+    size_t n = 0;                   // samples taken so far
+} g_ops;
+
+static void ops_sample(uint64_t now_ms){
+    size_t last = (g_ops.n + k_ops_samples - 1) % k_ops_samples;
+    if (g_ops.n > 0 && now_ms - g_ops.ms[last] < k_ops_sample_ms){
+        return;
+    }
+    g_ops.ms[g_ops.n % k_ops_samples] = now_ms;
+    g_ops.ops[g_ops.n % k_ops_samples] = g_data.stats.commands;
+    g_ops.n++;
+}
+
+static uint64_t ops_per_sec(uint64_t now_ms){
+    ops_sample(now_ms);
+    // the newest sample at least a window old, or the oldest one kept
+    size_t kept = g_ops.n < k_ops_samples ? g_ops.n : k_ops_samples;
+    size_t from = (g_ops.n - 1) % k_ops_samples;
+    for (size_t i = 1; i < kept; i++){
+        from = (g_ops.n - 1 - i) % k_ops_samples;
+        if (now_ms - g_ops.ms[from] >= k_ops_window_ms){
+            break;
+        }
+    }
+    uint64_t dt = now_ms - g_ops.ms[from];
+    return dt ? (g_data.stats.commands - g_ops.ops[from]) * 1000 / dt : 0;
+}
+
+// they read the command table
+static void do_info(std::vector<std::string> &cmd, Buffer &out);
+static void do_latency(std::vector<std::string> &cmd, Buffer &out);
+
+
+//=================================== handling reads/writes, requests, preparing responses ==================================//
+
+enum {
+    CMD_WRITE   = 1,    // modifies the keyspace
+    CMD_DENYOOM = 2,    // may grow memory, refused above maxmemory if nothing can be evicted
+};
+
+struct Command {
+    const char *name;
+    int32_t arity;      // number of args including the name, -N means at least N
+    uint32_t flags;
+    void (*handler)(std::vector<std::string> &, Buffer &);
+};
+
+static const Command k_commands[] = {
+    {"GET",         2,  0,                      &do_get},
+    {"SET",         3,  CMD_WRITE|CMD_DENYOOM,  &do_set},
+    {"DEL",         2,  CMD_WRITE,              &do_del},
+    {"UNLINK",      2,  CMD_WRITE,              &do_unlink},
+    {"KEYS",        1,  0,                      &do_keys},
+    {"FLUSHALL",    -1, CMD_WRITE,              &do_flushall},
+    {"LAZYFREE",    1,  0,                      &do_lazyfree},
+    {"ZADD",        4,  CMD_WRITE|CMD_DENYOOM,  &do_zadd},
+    {"ZREM",        3,  CMD_WRITE,              &do_zrem},
+    {"ZSCORE",      3,  0,                      &do_zscore},
+    {"ZQUERY",      6,  0,                      &do_zquery},
+    {"HSET",        -4, CMD_WRITE|CMD_DENYOOM,  &do_hset},
+    {"HGET",        3,  0,                      &do_hget},
+    {"HMGET",       -3, 0,                      &do_hmget},
+    {"HDEL",        -3, CMD_WRITE,              &do_hdel},
+    {"HLEN",        2,  0,                      &do_hlen},
+    {"HGETALL",     2,  0,                      &do_hgetall},
+    {"HINCRBY",     4,  CMD_WRITE|CMD_DENYOOM,  &do_hincrby},
+    {"LPUSH",       -3, CMD_WRITE|CMD_DENYOOM,  &do_lpush},
+    {"RPUSH",       -3, CMD_WRITE|CMD_DENYOOM,  &do_rpush},
+    {"LPOP",        -2, CMD_WRITE,              &do_lpop},
+    {"RPOP",        -2, CMD_WRITE,              &do_rpop},
+    {"LLEN",        2,  0,                      &do_llen},
+    {"LRANGE",      4,  0,                      &do_lrange},
+    {"LTRIM",       4,  CMD_WRITE,              &do_ltrim},
+    {"BLPOP",       -3, CMD_WRITE,              &do_blpop},
+    {"BRPOP",       -3, CMD_WRITE,              &do_brpop},
+    {"BZPOPMIN",    -3, CMD_WRITE,              &do_bzpopmin},
+    {"SUBSCRIBE",   -2, 0,                      &do_subscribe},
+    {"UNSUBSCRIBE", -1, 0,                      &do_unsubscribe},
+    {"PSUBSCRIBE",  -2, 0,                      &do_psubscribe},
+    {"PUNSUBSCRIBE",-1, 0,                      &do_punsubscribe},
+    {"PUBLISH",     3,  0,                      &do_publish},
+    {"PFADD",       -2, CMD_WRITE|CMD_DENYOOM,  &do_pfadd},
+    {"PFCOUNT",     -2, 0,                      &do_pfcount},
+    {"PFMERGE",     -2, CMD_WRITE|CMD_DENYOOM,  &do_pfmerge},
+    {"BF.RESERVE",  4,  CMD_WRITE|CMD_DENYOOM,  &do_bf_reserve},
+    {"BF.ADD",      3,  CMD_WRITE|CMD_DENYOOM,  &do_bf_add},
+    {"BF.EXISTS",   3,  0,                      &do_bf_exists},
+    {"RESTORE",     4,  CMD_WRITE|CMD_DENYOOM,  &do_restore},
+    {"EXPIRE",      3,  CMD_WRITE,              &do_expire},
+    {"PEXPIREAT",   3,  CMD_WRITE,              &do_pexpireat},
+    {"TTL",         2,  0,                      &do_ttl},
+    {"PERSIST",     2,  CMD_WRITE,              &do_persist},
+    {"SAVE",        1,  0,                      &do_save},
+    {"BGSAVE",      1,  0,                      &do_bgsave},
+    {"BGREWRITEAOF",1,  0,                      &do_bgrewriteaof},
+    {"CONFIG",      -3, 0,                      &do_config},
+    {"STATS",       1,  0,                      &do_stats},
+    {"REPLICAOF",   -2, 0,                      &do_replicaof},
+    {"INFO",        -1, 0,                      &do_info},
+    {"LATENCY",     -2, 0,                      &do_latency},
+    {"MEMORY",      -2, 0,                      &do_memory},
+    {"SLOWLOG",     -2, 0,                      &do_slowlog},
+    {"CAPTURE",     -2, 0,                      &do_capture},
+    {"PING",        -1, 0,                      &do_ping},
+    {"HELLO",       -1, 0,                      &do_hello},
+};
+
+const size_t k_ncommands = sizeof(k_commands) / sizeof(k_commands[0]);
+
+// execution time of each command of k_commands, see latency.h
+static LatencyHist g_cmd_lat[k_ncommands];
+
+static const Command *cmd_lookup(std::vector<std::string> &cmd){
+    if (cmd.empty()){
+        return nullptr;
+    }
+    for (const Command &c : k_commands){
+        if (strcasecmp(cmd[0].c_str(), c.name) != 0){
+            continue;
+        }
+        bool ok = c.arity >= 0 ? cmd.size() == (size_t)c.arity : cmd.size() >= (size_t)-c.arity;
+        return ok ? &c : nullptr;
+    }
+    return nullptr;
+}
+
+// runs the command, returns null if there is no such command
+static const Command *exec_command(std::vector<std::string> &cmd, Buffer &out){
+    const Command *c = cmd_lookup(cmd);
+    if (!c){
+        out_err(out, ERR_UNKNOWN, "Unknown command.");
+        return nullptr;
     }
-    const std::string &name = cmd[3];
-    int64_t offset = 0, limit = 0;
-    if (!str2int(cmd[4], offset) || !str2int(cmd[5], limit)){
-        return out_err(out, ERR_BAD_ARG, "Expected int");
+    // a replica only changes through its primary
+    if ((c->flags & CMD_WRITE) && is_replica() && !g_repl.applying && !g_data.loading){
+        out_err(out, ERR_READONLY, "You can't write against a read only replica.");
+        return c;
     }
-
-    // get the zset
-    ZSet* zset = expect_zset(cmd[1]);
-    if (!zset) {
-        return out_err(out, ERR_BAD_TYP, "Expected zset");
+    // the log and the stream from the primary are applied as is, even above maxmemory
+    bool replicated = g_data.loading || g_repl.applying;
+    if ((c->flags & CMD_DENYOOM) && !replicated && !evict_run(k_evict_budget_us)){
+        out_err(out, ERR_OOM, "Used memory is above maxmemory.");
+        return c;
     }
-
-    // seek the key
-    if (limit <= 0){
-        return out_arr(out, 0);
+    // handlers take the strings out of `cmd`, so it is encoded beforehand
+    bool logged = (c->flags & CMD_WRITE) && propagating();
+    if (logged){
+        g_data.prop_frame.clear();
+        cmd_encode(g_data.prop_frame, cmd);
     }
-    ZNode* znode = zset_seekge(zset, score, name.data(), name.size());
-    znode = znode_offset(znode, offset);
-
-    // output
-    size_t ctx = out_begin_arr(out);
-    int64_t n = 0;
-    while(znode && n < limit){
-        out_str(out,znode->name, znode->len);
-        out_dbl(out, znode->score);
-        znode = znode_offset(znode, +1);
-        n += 2;
+    g_data.prop_custom = false;
+    size_t reply_pos = out.size();
+    c->handler(cmd, out);
+    if (c->flags & CMD_WRITE){
+        g_data.dirty++;
     }
-    out_end_arr(out, ctx, (uint32_t)n);
+    if (logged && !g_data.prop_custom && out[reply_pos] != TAG_ERR){
+        propagate_frame(g_data.prop_frame.data(), g_data.prop_frame.size());
+    }
+    return c;
 }
 
-//=================================== handling reads/writes, requests, preparing responses ==================================//
-
+// runs the command and times it, into `g_data.exec_ns` and its histogram
 static void handle_request(std::vector<std::string> &cmd, Buffer &out){
-    if (cmd.size()==2 && cmd[0]=="GET"){
-        return do_get(cmd, out);
-    } else if (cmd.size()==3 && cmd[0]=="SET"){
-        return do_set(cmd, out);
-    } else if (cmd.size()==2 && cmd[0]=="DEL"){
-        return do_del(cmd, out);
-    } else if (cmd.size()==1 && cmd[0]=="KEYS"){
-        return do_keys(cmd, out);
-    } else if (cmd.size()==4 && cmd[0]=="ZADD") {
-        return do_zadd(cmd, out);
-    } else if (cmd.size()==3 && cmd[0]=="ZREM") {
-        return do_zrem(cmd, out);
-    } else if (cmd.size()==3 && cmd[0]=="ZSCORE") {
-        return do_zscore(cmd, out);
-    } else if (cmd.size()==6 && cmd[0]=="ZQUERY") {
-        return do_zquery(cmd, out);
-    } else if (cmd.size()==3 && cmd[0]=="EXPIRE") {
-        return do_expire(cmd, out);
-    } else if (cmd.size()==2 && cmd[0]=="TTL") {
-        return do_zquery(cmd, out);
-    } else if (cmd.size()==2 && cmd[0]=="PERSIST") {
-        return do_zquery(cmd, out);
-    } else {
-        return out_err(out, ERR_UNKNOWN, "Unknown command.");
+    uint64_t start_ns = get_monotonic_nsecs();
+    const Command *c = exec_command(cmd, out);
+    g_data.exec_end_ns = get_monotonic_nsecs();
+    g_data.exec_ns = g_data.exec_end_ns - start_ns;
+    // replaying the log at startup is not traffic
+    if (c && !g_data.loading){
+        lat_record(&g_cmd_lat[c - k_commands], g_data.exec_ns);
+        g_data.stats.commands++;
     }
 }
 
-static void response_begin(Buffer &out, size_t *header){
-    *header = out.size();       // message header position
-    buf_append_u32(out, 0);     // reserve space
-}
-static size_t response_size(Buffer &out, size_t header){
-    return out.size()-header-4;
+// removes the request at the front of `incoming`, and its parsed form if any
+static void conn_consume(Conn* conn, size_t bytes){
+    buf_remove(conn->incoming, bytes);
+    if (!conn->parsed.empty()){
+        conn->parsed.pop_front();
+        conn->parsed_bytes -= bytes;
+    }
 }
-static void response_end(Buffer &out, size_t header){
-    size_t msg_size = response_size(out, header);
-    if (msg_size > k_max_msg) {
-        out.resize(header+4);   // remove current message
-        out_err(out, ERR_TOO_BIG, "response is too big.");
-        msg_size = response_size(out, header);
+
+// the first `bytes` of `incoming` parsed again, for the slow log as the
+// handlers take the strings out of the parsed request
+static void conn_reparse(Conn* conn, size_t bytes, std::vector<std::string> &cmd){
+    cmd.clear();
+    if (conn->proto == PROTO_BIN){
+        (void) parse_req(&conn->incoming[4], bytes - 4, cmd);
+    } else {
+        RespParser p;
+        size_t used = 0;
+        (void) resp_parse(&p, conn->incoming.data(), bytes, cmd, &used);
     }
-    // message header
-    uint32_t len = (uint32_t)msg_size;
-    memcpy(&out[header], &len, 4);
 }
 
 // process 1 request if there is enough data
 static bool try_one_request(Conn* conn){
-    // try to parse the header
-    if (conn->incoming.size()<4){
-        return false;   // for want read
+    // a reply is being built by the pool, a write waits for it, a
+    // blocking pop waits for data, a memory report for its sample, or a
+    // slow subscriber was dropped
+    if (conn->offload || conn->parked || conn->block || conn->memreport || conn->want_close){
+        return false;
     }
-    uint32_t len = 0;
-    memcpy(&len, conn->incoming.data(), 4);
-    if(len > k_max_msg){    // protocol error
-        msg("Message is too long");
-        conn->want_close = true;
-        return false;   // set to want close
+    // application logic for one request, an I/O thread may have parsed it
+    std::vector<std::string> cmd;
+    size_t bytes = 0;
+    SlowCmd slow;
+    if (!conn->parsed.empty()){
+        cmd.swap(conn->parsed.front().cmd);
+        bytes = conn->parsed.front().bytes;
+        slow.parse_ns = conn->parsed.front().parse_ns;
+    } else {
+        uint64_t start_ns = get_monotonic_nsecs();
+        int32_t err = conn_next_request(conn, 0, cmd, &bytes);
+        if (err < 0){
+            msg("Error parsing request");
+            conn->want_close = true;
+            return false;   // set to want close
+        }
+        if (err == 0){
+            return false;   // for want read
+        }
+        slow.parse_ns = get_monotonic_nsecs() - start_ns;
     }
-    // message body
-    if (4+len>conn->incoming.size()){
-        return false;   // for want read
+    // an empty RESP line, nothing to reply to
+    if (cmd.empty() && conn->proto != PROTO_BIN){
+        conn_consume(conn, bytes);
+        return true;
     }
-    const uint8_t *request = &conn->incoming[4];
-
-    // application logic for one request
-    std::vector<std::string> cmd;
-    if (parse_req(request, len, cmd)<0){
-        msg("Error parsing request");
-        conn->want_close = true;
+    // replication handshake and acknowledgements, see the replication section
+    if (repl_intercept(conn, cmd)){
+        conn_consume(conn, bytes);
+        return true;
+    }
+    // writes wait while the keyspace is frozen, the request stays in `incoming`
+    // and is parsed again
+    const Command *c = cmd_lookup(cmd);
+    if (g_data.frozen && c && (c->flags & CMD_WRITE)){
+        conn->parsed.clear();
+        conn->parsed_bytes = 0;
+        conn->resp = RespParser();
+        conn->parked = true;
+        g_data.parked.push_back(conn);
+        g_offload.stats.parked_writes++;
         return false;
     }
+    if (capture_active()){
+        capture_req(conn, cmd, bytes);
+    }
     size_t header_pos = 0;
     response_begin(conn->outgoing, &header_pos);
+    bool locked = nofork_lock();
+    g_data.client = conn;
     handle_request(cmd, conn->outgoing);
-    response_end(conn->outgoing, header_pos);
+    g_data.client = nullptr;
+    block_serve();
+    nofork_unlock(locked);
+    slow.exec_ns = g_data.exec_ns;
+    if (conn->block || conn->memreport){
+        // the reply comes from block_serve(), block_timeouts() or memreport_run()
+        conn->outgoing.resize(header_pos);
+        conn_consume(conn, bytes);
+        return false;
+    }
+    if (g_offload.started){
+        // the reply comes from offload_poll(), which also checks the slow log
+        conn->outgoing.resize(header_pos);
+        conn->offload = g_offload.started;
+        conn->offload->conn = conn;
+        conn->offload->slow = slow;
+        conn_reparse(conn, bytes, cmd);
+        slowlog_args(conn->offload->slow.args, cmd);
+        g_offload.started = nullptr;
+        conn_consume(conn, bytes);
+        return false;
+    }
+    conn_response_end(conn, header_pos);
+    slow.serialize_ns = get_monotonic_nsecs() - g_data.exec_end_ns;
+    if (slowlog_over(slow)){
+        conn_reparse(conn, bytes, cmd);
+        slowlog_args(slow.args, cmd);
+        slowlog_cmd(conn, slow, header_pos);
+    }
+    // messages to itself, behind the reply
+    if (!g_pubsub.self.empty()){
+        pubsub_flush_self(conn);
+    }
     
     // application logic done, remove the request message
-    buf_remove(conn->incoming, 4+len);
+    conn_consume(conn, bytes);
     return true;
 }
 
 
 
+// the queued shared buffers and then `outgoing` in one call
+static ssize_t conn_writev(Conn* conn){
+    struct iovec iov[k_max_iov];
+    int n = 0;
+    for (size_t i = 0; i < conn->outq.size() && n < (int)k_max_iov; i++){
+        const OutRef &r = conn->outq[i];
+        iov[n].iov_base = (void*)(r.buf->data() + r.pos);
+        iov[n].iov_len = r.buf->size() - r.pos;
+        n++;
+    }
+    if (n < (int)k_max_iov && !conn->outgoing.empty()){
+        iov[n].iov_base = &conn->outgoing[0];
+        iov[n].iov_len = conn->outgoing.size();
+        n++;
+    }
+    return writev(conn->fd, iov, n);
+}
+
+// drops the first `n` bytes of the output, the last reference to a shared
+// buffer frees it, possibly from an I/O thread
+static void conn_sent(Conn* conn, size_t n){
+    while (n > 0 && !conn->outq.empty()){
+        OutRef &r = conn->outq.front();
+        size_t left = r.buf->size() - r.pos;
+        if (n < left){
+            r.pos += n;
+            conn->outq_bytes -= n;
+            return;
+        }
+        n -= left;
+        conn->outq_bytes -= left;
+        conn->outq.pop_front();
+    }
+    buf_remove(conn->outgoing, n);
+}
+
 // application callback when socket is writable
 static void handle_write(Conn* conn){
-    assert(conn->outgoing.size()>0);
-    ssize_t ret = write(conn->fd, &conn->outgoing[0], conn->outgoing.size());
+    if (conn_pending(conn) == 0 && conn->bulk_fd >= 0){
+        repl_bulk_refill(conn);
+        if (conn->outgoing.empty()){
+            conn->want_write = conn->bulk_fd >= 0 && !conn->want_close;
+            return;
+        }
+    }
+    assert(conn_pending(conn)>0);
+    // only timed when a slow log entry waits for its reply
+    bool timed = !conn->slow_pending.empty();
+    uint64_t start_ns = timed ? get_monotonic_nsecs() : 0;
+    ssize_t ret = conn->outq.empty()
+        ? write(conn->fd, &conn->outgoing[0], conn->outgoing.size())
+        : conn_writev(conn);
+    uint64_t write_ns = timed ? get_monotonic_nsecs() - start_ns : 0;
     if (ret < 0 && errno == EAGAIN){
         return; // not ready
     }
@@ -721,31 +4900,64 @@ static void handle_write(Conn* conn){
         return;
     }
 
-    // remove written data from `outgoing`
-    buf_remove(conn->outgoing, (size_t) ret);
+    // remove written data from `outq`, then from `outgoing`
+    conn_sent(conn, (size_t) ret);
+    conn->written += (size_t) ret;
+    if (timed){
+        slowlog_written(conn, (size_t) ret, write_ns);
+    }
 
     // update the readiness intention
-    if (conn->outgoing.size()==0){
-        conn->want_read = true;
-        conn->want_write = false;
+    if (conn_pending(conn)==0){
+        conn->want_read = !conn->offload && !conn->parked;
+        conn->want_write = conn->bulk_fd >= 0;  // more of the snapshot to send
     }
 }
 
 
 
-// application callback when socket is readable
-static void handle_read(Conn* conn){
+// runs the complete requests in `incoming`, on new data or once a wait is over
+static void conn_process(Conn* conn){
+    // 3. Try to handle this request, using loops for http piplining,
+    // or apply what the primary sent
+    if (conn == g_repl.master){
+        repl_master_input(conn);
+    } else {
+        while(try_one_request(conn)) {}
+    }
+
+    // 4. update the readiness intention, replication links always read,
+    // a connection waiting on an offloaded reply doesn't
+    if (conn_pending(conn)>0){
+        conn->want_read = conn->repl_state != REPL_NONE;
+        conn->want_write = true; 
+        // with appendfsync always, replies wait for the fsync at the end of the iteration,
+        // with I/O threads they are all written there
+        if ((g_config.appendfsync == FSYNC_ALWAYS && aof_pending()) || io_threads_count() > 1){
+            return;
+        }
+        // try to write it without waiting for the next iteration
+        return handle_write(conn);
+    }
+    conn->want_read = !conn->offload && !conn->parked;
+}
+
+
+
+// reads what the socket has, returns whether anything new arrived; safe on
+// an I/O thread as it only touches the connection
+static bool conn_read(Conn* conn){
     // 1. Do a non-blocking read, buf size is set big for batched requests
     uint8_t buf[64*1024];
     ssize_t ret = read(conn->fd, buf, sizeof(buf));
     if (ret < 0 && errno == EAGAIN) {
-        return; // not ready
+        return false; // not ready
     }
     if (ret < 0){
         // handle IO error
         msg_err("read() error");
         conn->want_close = true;
-        return;
+        return false;
     }
     if (ret == 0){
         if(conn->incoming.size()==0){
@@ -754,24 +4966,304 @@ static void handle_read(Conn* conn){
             msg("Unexpected EOF");
         }
         conn->want_close = true;
-        return;
+        return false;
     }
     // 2. Add new data to the Conn::incoming buffer
     buf_append(conn->incoming, buf, (size_t)ret);
+    return true;
+}
 
-    // 3. Try to handle this request, using loops for http piplining
-    while(try_one_request(conn)) {}
+// application callback when socket is readable
+static void handle_read(Conn* conn){
+    if (conn_read(conn)){
+        conn_process(conn);
+    }
+}
 
-    // 4. update the readiness intention
-    if (conn->outgoing.size()>0){
-        conn->want_read = false;
-        conn->want_write = true; 
-        // try to write it without waiting for the next iteration
-        return handle_write(conn);
+// parses the complete requests past `parsed_bytes`, stopping at anything
+// malformed, which try_one_request() then reports
+static void conn_parse(Conn* conn){
+    size_t pos = conn->parsed_bytes;
+    while (true){
+        uint64_t start_ns = get_monotonic_nsecs();
+        ParsedReq req;
+        if (conn_next_request(conn, pos, req.cmd, &req.bytes) <= 0){
+            break;
+        }
+        req.parse_ns = get_monotonic_nsecs() - start_ns;
+        pos += req.bytes;
+        conn->parsed.push_back(std::move(req));
+    }
+    conn->parsed_bytes = pos;
+}
+
+// an I/O thread's part of an iteration, the loop thread waits meanwhile
+static void io_read_task(void* arg){
+    Conn* conn = (Conn*) arg;
+    // the stream from the primary isn't all request messages
+    if (conn_read(conn) && conn != g_repl.master){
+        conn_parse(conn);
+    }
+}
+
+static void io_write_task(void* arg){
+    handle_write((Conn*) arg);
+}
+
+// the eventfd fired, splices the finished offloaded replies and resumes
+// their connections, then the parked writes once nothing is in flight
+static void offload_poll(){
+    uint64_t cnt = 0;
+    if (read(g_offload.efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN){
+        msg_err("eventfd read() error");
+    }
+    std::vector<OffloadJob*> done;
+    {
+        std::lock_guard<std::mutex> lock(g_offload.mu);
+        done.swap(g_offload.done);
+    }
+    for (OffloadJob* job : done){
+        g_data.frozen--;
+        if (job->keys){
+            g_data.db.frozen--;
+        }
+        Conn* conn = job->conn;
+        if (conn){
+            size_t header = 0;
+            response_begin(conn->outgoing, &header);
+            if (job->bytes > k_max_msg){
+                out_err(conn->outgoing, ERR_TOO_BIG, "response is too big.");
+            } else {
+                size_t ctx = out_begin_arr(conn->outgoing);
+                uint32_t n = 0;
+                for (OffloadChunk &ch : job->chunks){
+                    buf_append(conn->outgoing, ch.out.data(), ch.out.size());
+                    n += ch.n;
+                }
+                out_end_arr(conn->outgoing, ctx, n);
+            }
+            conn_response_end(conn, header);
+            job->slow.serialize_ns = get_monotonic_nsecs() - job->start_ns;
+            if (slowlog_over(job->slow)){
+                slowlog_cmd(conn, job->slow, header);
+            }
+            conn->offload = nullptr;
+            conn_process(conn);
+            if (conn->want_close){
+                conn_destroy(conn);
+            }
+        }
+        delete job;
+    }
+    if (g_data.frozen > 0){
+        return;
+    }
+    std::vector<Conn*> parked;
+    parked.swap(g_data.parked);
+    for (Conn* conn : parked){
+        conn->parked = false;
+        conn_process(conn);
+        if (conn->want_close){
+            conn_destroy(conn);
+        }
+    }
+    // the stream from the primary waited too
+    if (g_repl.master){
+        repl_master_input(g_repl.master);
+    }
+}
+
+
+
+//======================================== INFO and latency ========================================//
+
+static void info_int(std::string &s, const char *name, uint64_t val){
+    s += name;
+    s += ':';
+    s += std::to_string(val);
+    s += "\r\n";
+}
+
+// starts section `title` if INFO asked for it, everything by default
+static bool info_section(std::string &s, const char *title, const std::string &want){
+    if (!want.empty() && want != "all" && strcasecmp(want.c_str(), title) != 0){
+        return false;
+    }
+    s += s.empty() ? "# " : "\r\n# ";
+    s += title;
+    s += "\r\n";
+    return true;
+}
+
+static double ns2us(uint64_t ns){
+    return (double)ns / 1000;
+}
+
+//+------+-----------+
+//| INFO | [section] |
+//+------+-----------+
+// "# Section" headers followed by "name:value" lines, like Redis
+static void do_info(std::vector<std::string> &cmd, Buffer &out){
+    const std::string &want = cmd.size() > 1 ? cmd[1] : std::string();
+    uint64_t now_ms = get_monotonic_msecs();
+    std::string s;
+    if (info_section(s, "Clients", want)){
+        size_t clients = 0, waiting = 0, subscribers = 0;
+        for (Conn* conn : g_data.fd2conn){
+            if (conn && conn->repl_state == REPL_NONE && conn != g_repl.master){
+                clients++;
+                waiting += conn->offload || conn->parked || conn->block || conn->memreport;
+                subscribers += pubsub_count(&conn->pubsub) > 0;
+            }
+        }
+        info_int(s, "connected_clients", clients);
+        info_int(s, "waiting_clients", waiting);
+        info_int(s, "blocked_clients", g_block.stats.blocked);
+        info_int(s, "pubsub_clients", subscribers);
+        info_int(s, "connected_replicas", g_repl.replicas.size());
+        info_int(s, "total_connections_received", g_data.stats.connections);
+    }
+    if (info_section(s, "Memory", want)){
+        info_int(s, "used_memory", used_memory());
+        info_int(s, "maxmemory", g_config.maxmemory);
+        info_int(s, "evicted_keys", g_data.stats.evicted_keys);
+        info_int(s, "lazyfree_pending_jobs", lazyfree_stats().pending_jobs);
+        info_int(s, "lazyfree_pending_bytes", lazyfree_stats().pending_bytes);
+    }
+    if (info_section(s, "Persistence", want)){
+        const AofStats &aof = aof_stats();
+        bool bgsave = (g_data.child_type == CHILD_RDB && g_data.child_pid > 0) || g_data.snap_running;
+        info_int(s, "rdb_changes_since_last_save", g_data.dirty);
+        info_int(s, "rdb_bgsave_in_progress", bgsave);
+        info_int(s, "rdb_last_bgsave_ok", g_data.stats.last_bgsave_ok);
+        info_int(s, "rdb_last_save_unix_ms", g_data.stats.last_save_unix_ms);
+        info_int(s, "aof_enabled", aof_enabled());
+        info_int(s, "aof_rewrite_in_progress", aof.rewriting);
+        info_int(s, "aof_last_write_ok", aof.last_write_ok);
+        info_int(s, "aof_current_size", aof.size);
+        info_int(s, "aof_pending_bytes", aof.pending);
+    }
+    if (info_section(s, "Stats", want)){
+        info_int(s, "total_commands_processed", g_data.stats.commands);
+        info_int(s, "instantaneous_ops_per_sec", ops_per_sec(now_ms));
+        info_int(s, "expired_keys", g_data.stats.expired_keys);
+        info_int(s, "expire_cycles_cut", g_data.stats.expire_cycles_cut);
+        info_int(s, "master_repl_offset", g_repl.offset);
+    }
+    if (info_section(s, "Keyspace", want)){
+        info_int(s, "keys", hm_size(&g_data.db));
+        info_int(s, "expires", g_data.cache.size());
+    }
+    // the rehash is progressive, `older` drains into `newer` from `migrate_pos`
+    if (info_section(s, "HMap", want)){
+        const HMap &db = g_data.db;
+        info_int(s, "newer_size", db.newer.size);
+        info_int(s, "newer_slots", db.newer.tab ? db.newer.mask + 1 : 0);
+        info_int(s, "older_size", db.older.size);
+        info_int(s, "older_slots", db.older.tab ? db.older.mask + 1 : 0);
+        info_int(s, "migrate_pos", db.migrate_pos);
+        info_int(s, "rehashing", db.older.tab != nullptr);
+    }
+    if (info_section(s, "Threads", want)){
+        ThreadPool &pool = g_data.thread_pool;
+        uint64_t backlog = 0;
+        for (size_t i = 0; i < pool.size(); i++){
+            backlog += pool.worker_stats(i).depth;
+        }
+        info_int(s, "pool_threads", pool.size());
+        info_int(s, "pool_backlog", backlog);
+        info_int(s, "io_threads", io_threads_count());
+        info_int(s, "offload_in_flight", g_data.frozen);
     }
+    // microseconds, the percentiles are upper bounds of histogram buckets
+    if (info_section(s, "Latency", want)){
+        for (size_t i = 0; i < k_ncommands; i++){
+            const LatencyHist* h = &g_cmd_lat[i];
+            uint64_t calls = h->calls.load(std::memory_order_relaxed);
+            if (calls == 0){
+                continue;
+            }
+            char line[256];
+            snprintf(line, sizeof(line),
+                "cmd_%s:calls=%llu,usec=%.3f,usec_per_call=%.3f,p50=%.3f,p99=%.3f,p999=%.3f,max=%.3f\r\n",
+                k_commands[i].name, (unsigned long long)calls,
+                ns2us(h->total_ns.load(std::memory_order_relaxed)),
+                ns2us(h->total_ns.load(std::memory_order_relaxed)) / (double)calls,
+                ns2us(lat_quantile(h, 0.5)), ns2us(lat_quantile(h, 0.99)),
+                ns2us(lat_quantile(h, 0.999)), ns2us(h->max_ns.load(std::memory_order_relaxed)));
+            s += line;
+        }
+    }
+    out_str(out, s.data(), s.size());
+}
+
+static const Command *cmd_by_name(const std::string &name){
+    for (const Command &c : k_commands){
+        if (strcasecmp(name.c_str(), c.name) == 0){
+            return &c;
+        }
+    }
+    return nullptr;
+}
+
+//+---------+-----------+---------+    +---------+-------+---------+
+//| LATENCY | HISTOGRAM | [cmd..] |    | LATENCY | RESET | [cmd..] |
+//+---------+-----------+---------+    +---------+-------+---------+
+// HISTOGRAM gives [name, calls, [bucket max ns, count, ...]] per command with
+// calls, only the non-empty buckets, RESET the number of histograms cleared
+static void do_latency(std::vector<std::string> &cmd, Buffer &out){
+    bool reset = cmd[1] == "RESET";
+    if (!reset && cmd[1] != "HISTOGRAM"){
+        return out_err(out, ERR_BAD_ARG, "Expected HISTOGRAM or RESET");
+    }
+    std::vector<size_t> picked;
+    for (size_t i = 2; i < cmd.size(); i++){
+        const Command *c = cmd_by_name(cmd[i]);
+        if (!c){
+            return out_err(out, ERR_BAD_ARG, "Unknown command " + cmd[i]);
+        }
+        picked.push_back(c - k_commands);
+    }
+    if (picked.empty()){
+        for (size_t i = 0; i < k_ncommands; i++){
+            picked.push_back(i);
+        }
+    }
+    if (reset){
+        for (size_t i : picked){
+            lat_reset(&g_cmd_lat[i]);
+        }
+        return out_int(out, (int64_t)picked.size());
+    }
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    for (size_t i : picked){
+        const LatencyHist* h = &g_cmd_lat[i];
+        uint64_t calls = h->calls.load(std::memory_order_relaxed);
+        if (calls == 0){
+            continue;
+        }
+        out_arr(out, 3);
+        out_str(out, k_commands[i].name, strlen(k_commands[i].name));
+        out_int(out, (int64_t)calls);
+        size_t bctx = out_begin_arr(out);
+        uint32_t nb = 0;
+        for (size_t b = 0; b < k_lat_buckets; b++){
+            uint64_t cnt = h->counts[b].load(std::memory_order_relaxed);
+            if (cnt){
+                out_int(out, (int64_t)lat_bucket_max(b));
+                out_int(out, (int64_t)cnt);
+                nb += 2;
+            }
+        }
+        out_end_arr(out, bctx, nb);
+        n++;
+    }
+    out_end_arr(out, ctx, n);
 }
 
 
+
 //======================================== timer related code ========================================//
 
 // returns the timeout value of the nearest timer, both idle timers and TTL timers
@@ -784,11 +5276,37 @@ static uint32_t nearest_timeout_ms() {
         next_ms = conn->last_active_ms+k_idle_timeout_ms;
     }
 
-    // ttl timers using a heap
-    if (!g_data.cache.empty() && g_data.cache[0].ttl_val < next_ms){
+    // ttl timers using a heap, a replica waits for its primary's DELs, and
+    // nothing expires while the keyspace is frozen
+    bool expiring = !is_replica() && !g_data.frozen;
+    if (expiring && !g_data.cache.empty() && g_data.cache[0].ttl_val < next_ms){
         next_ms = g_data.cache[0].ttl_val;
     }
 
+    // deadlines of the blocking pops
+    if (!g_block.timeouts.empty() && g_block.timeouts[0].ttl_val < next_ms){
+        next_ms = g_block.timeouts[0].ttl_val;
+    }
+
+    // pending lazy frees, evictions, expired keys or a memory report, don't sleep
+    bool backlog = (g_data.evict_pending || g_data.expire_backlog) && !g_data.frozen;
+    if (lazyfree_pending() || backlog || g_memreport.running){
+        next_ms = now_ms;
+    }
+
+    // check on the BGSAVE or BGREWRITEAOF child, the end of a rewrite, the
+    // nofork save or a stopping capture now and then
+    if ((g_data.child_pid > 0 || g_data.snap_running || aof_stats().rewriting
+        || g_data.aof_rewrite_scheduled || capture_poll()) && next_ms > now_ms + k_child_poll_ms){
+        next_ms = now_ms + k_child_poll_ms;
+    }
+
+    // replication pings, acknowledgements and reconnects
+    bool repl_active = is_replica() || !g_repl.replicas.empty();
+    if (repl_active && next_ms > now_ms + k_repl_cron_ms){
+        next_ms = now_ms + k_repl_cron_ms;
+    }
+
     // timeout value
     if (next_ms == (uint64_t)-1){
         return -1;  // no timers, no timeouts
@@ -801,6 +5319,44 @@ static uint32_t nearest_timeout_ms() {
 }
 
 
+// the share of TTL keys already expired, estimated from random heap samples
+static double expire_backlog_share(uint64_t now_ms){
+    const HeapArray &heap = g_data.cache;
+    uint32_t expired = 0;
+    for (uint32_t i = 0; i < k_expire_samples; i++){
+        expired += heap[evict_rand() % heap.size()].ttl_val <= now_ms;
+    }
+    return (double)expired / k_expire_samples;
+}
+
+/*
+    active expiry, the expired keys are exactly the top of the TTL heap
+    - bounded by time rather than by a key count, the clock is read every few keys
+    - when the last cycle was cut short, the budget grows with the share of
+      expired keys and the loop stops sleeping until the backlog is gone
+*/
+static void expire_cycle(uint64_t now_ms){
+    const HeapArray &heap = g_data.cache;
+    if (heap.empty() || heap[0].ttl_val > now_ms){
+        g_data.expire_backlog = false;
+        return;
+    }
+    uint64_t budget_us = k_expire_budget_us;
+    if (g_data.expire_backlog){
+        double share = expire_backlog_share(now_ms);
+        budget_us += (uint64_t)((k_expire_budget_max_us - k_expire_budget_us) * share);
+    }
+    uint64_t start_us = get_monotonic_usecs();
+    for (size_t nworks = 1; !heap.empty() && heap[0].ttl_val <= now_ms; nworks++){
+        entry_expire(heap_entry(0));
+        if (nworks % k_expire_check_every == 0 && get_monotonic_usecs() - start_us >= budget_us){
+            break;
+        }
+    }
+    g_data.expire_backlog = !heap.empty() && heap[0].ttl_val <= now_ms;
+    g_data.stats.expire_cycles_cut += g_data.expire_backlog;
+}
+
 // runs after each poll() call to clean up idle connections that have exceeded their timeout
 static void process_timers(){
     uint64_t now_ms = get_monotonic_msecs();
@@ -812,45 +5368,71 @@ static void process_timers(){
         if (next_ms >= now_ms){
             break;      // not expired
         }
+        if (conn->offload || conn->parked || conn->block || conn->memreport || pubsub_count(&conn->pubsub)){
+            // not idle, waiting on us or on messages
+            conn->last_active_ms = now_ms;
+            cdlist_detach(&conn->idle_node);
+            cdlist_insert_before(&g_data.idle_list, &conn->idle_node);
+            continue;
+        }
         fprintf(stderr, "Removing idle connection: %d\n", conn->fd);
         conn_destroy(conn);
     }
 
     // TTL timers using a heap
-    size_t nworks = 0;  // track the number of expiring timers being processed
-    const std::vector<HeapNode> &heap = g_data.cache;
-    while(!heap.empty() && heap[0].ttl_val < now_ms){
-        Entry *ent = container_of(heap[0].ref, Entry, heap_idx);
-        HNode* node = hm_delete(&g_data.db, &ent->node, &hnode_same);
-        assert(node==&ent->node);
-        fprintf(stderr, "key expired: %s\n", ent->key.c_str());
-        entry_del(ent);
-        if (nworks++ >= k_max_works){
-            // don't stall the server if too many keys are expiring at once
-            break;
-        }
+    if (!is_replica() && !g_data.frozen){
+        bool locked = nofork_lock();
+        expire_cycle(now_ms);
+        nofork_unlock(locked);
+    }
+
+    block_timeouts(now_ms);
+
+    // background save or rewrite
+    child_poll();
+    nofork_poll();
+    bool ok = false;
+    if (aof_rewrite_poll(g_config.appendfsync, &ok)){
+        g_data.stats.last_aof_rewrite_ok = ok;
     }
+    // a BGREWRITEAOF that waited for the nofork save
+    if (g_data.aof_rewrite_scheduled && (!aof_enabled() || aof_rewrite_start())){
+        g_data.aof_rewrite_scheduled = false;
+    }
+
+    repl_cron(now_ms);
+    ops_sample(now_ms);
+    capture_cron(now_ms);
 }
 
 //======================================== main server program ========================================//
 
-int main(void){
-    // initialisation of the timer list
-    cdlist_init(&g_data.idle_list);
-    g_data.thread_pool.init(4);
-
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
+// a non-blocking listening socket on `port` or on the unix socket `path`
+static int listen_on(uint32_t port, const std::string &path){
+    int fd = socket(path.empty() ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
     if(fd<0){
         die("socket()");
     }
-    int val = 1;
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    int ret = 0;
+    if (path.empty()){
+        int val = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
 
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);        // port: 1234
-    addr.sin_addr.s_addr = ntohl(0);    // wildcard IP: 0.0.0.0
-    int ret = bind(fd, (const struct sockaddr*)&addr, sizeof(addr));
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        addr.sin_addr.s_addr = ntohl(0);    // wildcard IP: 0.0.0.0
+        ret = bind(fd, (const struct sockaddr*)&addr, sizeof(addr));
+    } else {
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)){
+            die("unixsocket path too long");
+        }
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        unlink(path.c_str());               // left over by a previous run
+        ret = bind(fd, (const struct sockaddr*)&addr, sizeof(addr));
+    }
     if (ret){
         die("bind()");      
     }
@@ -863,14 +5445,51 @@ int main(void){
     if (ret){
         die("listen()");    
     }
+    return fd;
+}
+
+int main(int argc, char **argv){
+    config_parse_args(argc, argv);
+
+    // initialisation of the timer list
+    cdlist_init(&g_data.idle_list);
+    if (g_config.pool_threads == 0){
+        die("pool-threads must be at least 1");
+    }
+    g_data.thread_pool.init(g_config.pool_threads);
+    if (g_config.io_threads == 0){
+        die("io-threads must be at least 1");
+    }
+    io_threads_init(g_config.io_threads);
+    bool threaded_io = g_config.io_threads > 1;
+    g_repl.replid = repl_new_id();
+    data_load();
+
+    // offloaded replies signal their completion here
+    g_offload.efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (g_offload.efd < 0){
+        msg_err("eventfd() error, large replies are built inline");
+    }
+
+    std::vector<int> listen_fds = {listen_on(g_config.port, "")};
+    if (!g_config.unixsocket.empty()){
+        listen_fds.push_back(listen_on(0, g_config.unixsocket));
+    }
 
     // the event loop
     std::vector<struct pollfd> poll_args;
+    std::vector<void*> io_batch;        // connections for the I/O threads
     while(true){
-        // 
+        // phase boundaries, for the slow log
+        uint64_t poll_ns = get_monotonic_nsecs();
         poll_args.clear();
-        struct pollfd pfd = {fd, POLLIN, 0};
-        poll_args.push_back(pfd);   // put the listening sockets in the first place
+        for (int fd : listen_fds){
+            struct pollfd pfd = {fd, POLLIN, 0};
+            poll_args.push_back(pfd);   // put the listening sockets in the first place
+        }
+        struct pollfd efd = {g_offload.efd, POLLIN, 0};
+        poll_args.push_back(efd);       // then the eventfd, ignored by poll() if -1
+        size_t nfixed = poll_args.size();
 
         // put the all the remaining connection sockets in
         for (Conn* conn : g_data.fd2conn){
@@ -898,13 +5517,18 @@ int main(void){
         if (ret < 0){
             die("poll()");
         }
+        uint64_t io_ns = get_monotonic_nsecs();
 
-        // handle the listening socket
-        if (poll_args[0].revents){
-            handle_accept(fd);
+        // handle the listening sockets
+        for (size_t i = 0; i < listen_fds.size(); i++){
+            if (poll_args[i].revents){
+                handle_accept(listen_fds[i]);
+            }
         }
-        // handle connection sockets
-        for (size_t i = 1; i < poll_args.size(); i++){
+        // handle connection sockets, with I/O threads the reads are only
+        // collected here and the writes wait for the end of the iteration
+        io_batch.clear();
+        for (size_t i = nfixed; i < poll_args.size(); i++){
             uint32_t ready = poll_args[i].revents;
             if (ready==0){
                 continue;
@@ -912,18 +5536,30 @@ int main(void){
 
             Conn *conn = g_data.fd2conn[poll_args[i].fd];
 
-            // update the idle timer and move it to the end of the list
+            // update the idle timer and move it to the end of the list,
+            // replication links are not on it
             conn->last_active_ms = get_monotonic_msecs();
-            cdlist_detach(&conn->idle_node);
-            cdlist_insert_before(&g_data.idle_list, &conn->idle_node);
+            if (conn->repl_state == REPL_NONE){
+                cdlist_detach(&conn->idle_node);
+                cdlist_insert_before(&g_data.idle_list, &conn->idle_node);
+            }
+
+            if (threaded_io){
+                if (ready & POLLIN){
+                    io_batch.push_back(conn);
+                } else if (ready & POLLERR){
+                    conn_destroy(conn);
+                }
+                continue;
+            }
 
             // read and write
             if (ready & POLLIN){
                 assert(conn->want_read);
                 handle_read(conn);
             }
-            if (ready & POLLOUT){
-                assert(conn->want_write);
+            // a replication link polls both and may have flushed while reading
+            if ((ready & POLLOUT) && conn->want_write){
                 handle_write(conn);
             }
 
@@ -933,8 +5569,79 @@ int main(void){
             }
         }   // loop for each connection socket
 
+        // the I/O threads read and parse, then the requests run here in order
+        if (!io_batch.empty()){
+            io_threads_run(&io_read_task, io_batch.data(), io_batch.size());
+            for (void* item : io_batch){
+                Conn* conn = (Conn*) item;
+                if (!conn->want_close){
+                    conn_process(conn);
+                }
+                if (conn->want_close){
+                    conn_destroy(conn);
+                }
+            }
+        }
+
+        // offloaded replies, after the loop above as it may close connections
+        if (poll_args[nfixed-1].revents){
+            offload_poll();
+        }
+
         // handle the timers
+        uint64_t timers_ns = get_monotonic_nsecs();
         process_timers();
+        // the clients served or timed out by the above
+        block_resume();
+        // a slice of the memory report, it may resume its clients
+        memreport_run();
+        // the subscribers dropped by the above
+        pubsub_close_dropped();
+        uint64_t background_ns = get_monotonic_nsecs();
+
+        // keep evicting if the last slice ran out of time
+        if (g_data.evict_pending && !g_data.frozen){
+            bool locked = nofork_lock();
+            evict_run(k_evict_budget_us);
+            nofork_unlock(locked);
+        }
+
+        // release some of the lazily freed values
+        lazyfree_run(k_lazyfree_budget_us);
+
+        // the writes of this iteration go to the log in one batch
+        aof_flush(g_config.appendfsync, &g_data.thread_pool);
+        uint64_t writes_ns = get_monotonic_nsecs();
+
+        // with I/O threads, so do the replies, after the log is written
+        if (threaded_io){
+            io_batch.clear();
+            for (Conn* conn : g_data.fd2conn){
+                if (conn && conn->want_write && (conn_pending(conn) > 0 || conn->bulk_fd >= 0)){
+                    io_batch.push_back(conn);
+                }
+            }
+            io_threads_run(&io_write_task, io_batch.data(), io_batch.size());
+            for (void* item : io_batch){
+                Conn* conn = (Conn*) item;
+                if (conn->want_close){
+                    conn_destroy(conn);
+                }
+            }
+        }
+
+        // the reply writes count as I/O
+        uint64_t end_ns = get_monotonic_nsecs();
+        SlowLoop slow;
+        slow.poll_ns = io_ns - poll_ns;
+        slow.io_ns = (timers_ns - io_ns) + (end_ns - writes_ns);
+        slow.timers_ns = background_ns - timers_ns;
+        slow.background_ns = writes_ns - background_ns;
+        uint64_t busy_ns = slow.io_ns + slow.timers_ns + slow.background_ns;
+        if (busy_ns >= (uint64_t)g_config.slowlog_loop_slower_than * 1000){
+            slow.unix_ms = get_unix_msecs();
+            slowlog_add_loop(slow, g_config.slowlog_max_len);
+        }
     }   // the event loop
     
     return 0;
@@ -0,0 +1,112 @@
+#include <mutex>
+#include "slowlog.h"
+#include "constants.h"
+
+// entry `id` sits at `id % items.size()`, the last `len` ids are held
+template <class T>
+struct Ring {
+    std::vector<T> items;
+    uint64_t next_id = 0;
+    size_t len = 0;
+};
+
+static struct {
+    std::mutex mu;
+    Ring<SlowCmd> cmds;
+    Ring<SlowLoop> loops;
+} g_slow;
+
+template <class T>
+static uint64_t ring_add(Ring<T> &r, T &e, size_t max_len){
+    uint64_t id = r.next_id++;
+    e.id = id;
+    if (max_len == 0){
+        // turned off, what was logged goes
+        r.items.clear();
+        r.len = 0;
+        return id;
+    }
+    // resized through CONFIG SET, starts over
+    if (r.items.size() != max_len){
+        r.items.clear();
+        r.items.resize(max_len);
+        r.len = 0;
+    }
+    std::swap(r.items[id % max_len], e);
+    r.len += r.len < max_len;
+    return id;
+}
+
+template <class T>
+static std::vector<T> ring_newest(const Ring<T> &r, size_t n){
+    std::vector<T> out;
+    for (size_t i = 0; i < n && i < r.len; i++){
+        out.push_back(r.items[(r.next_id - 1 - i) % r.items.size()]);
+    }
+    return out;
+}
+
+template <class T>
+static T* ring_find(Ring<T> &r, uint64_t id){
+    if (r.len == 0 || id >= r.next_id || id < r.next_id - r.len){
+        return nullptr;
+    }
+    return &r.items[id % r.items.size()];
+}
+
+void slowlog_args(std::vector<std::string> &out, const std::vector<std::string> &cmd){
+    out.clear();
+    for (size_t i = 0; i < cmd.size(); i++){
+        if (i + 1 == k_slowlog_max_args && cmd.size() > k_slowlog_max_args){
+            out.push_back("... (" + std::to_string(cmd.size() - i) + " more arguments)");
+            break;
+        }
+        const std::string &arg = cmd[i];
+        if (arg.size() <= k_slowlog_max_arg_len){
+            out.push_back(arg);
+            continue;
+        }
+        size_t more = arg.size() - k_slowlog_max_arg_len;
+        out.push_back(arg.substr(0, k_slowlog_max_arg_len) +
+            "... (" + std::to_string(more) + " more bytes)");
+    }
+}
+
+uint64_t slowlog_add_cmd(SlowCmd &e, size_t max_len){
+    std::lock_guard<std::mutex> lock(g_slow.mu);
+    return ring_add(g_slow.cmds, e, max_len);
+}
+
+void slowlog_add_write(uint64_t id, uint64_t ns){
+    std::lock_guard<std::mutex> lock(g_slow.mu);
+    if (SlowCmd* e = ring_find(g_slow.cmds, id)){
+        e->write_ns += ns;
+    }
+}
+
+void slowlog_add_loop(SlowLoop &e, size_t max_len){
+    std::lock_guard<std::mutex> lock(g_slow.mu);
+    ring_add(g_slow.loops, e, max_len);
+}
+
+std::vector<SlowCmd> slowlog_cmds(size_t n){
+    std::lock_guard<std::mutex> lock(g_slow.mu);
+    return ring_newest(g_slow.cmds, n);
+}
+
+std::vector<SlowLoop> slowlog_loops(size_t n){
+    std::lock_guard<std::mutex> lock(g_slow.mu);
+    return ring_newest(g_slow.loops, n);
+}
+
+size_t slowlog_len(){
+    std::lock_guard<std::mutex> lock(g_slow.mu);
+    return g_slow.cmds.len;
+}
+
+// ids keep counting, a reset doesn't reuse them
+void slowlog_reset(){
+    std::lock_guard<std::mutex> lock(g_slow.mu);
+    g_slow.cmds.len = 0;
+    g_slow.loops.len = 0;
+}
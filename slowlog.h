@@ -0,0 +1,48 @@
+// 1. Two bounded rings, one of commands that took longer than
+//    `slowlog-log-slower-than` and one of event loop iterations whose work
+//    (everything but the wait in poll()) took longer than
+//    `slowlog-loop-slower-than`; the oldest entries are overwritten
+// 2. A command entry is added once its reply is serialized, the time to
+//    write the reply is added to it later, when the reply has left
+// 3. Entries are added by the loop thread and completed by whichever thread
+//    writes the reply, the log takes a mutex but only slow requests touch it
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct SlowCmd {
+    uint64_t id = 0;
+    uint64_t unix_ms = 0;
+    std::vector<std::string> args;  // truncated, see slowlog_args()
+    std::string client;
+    uint64_t parse_ns = 0;          // framing and parsing the request
+    uint64_t exec_ns = 0;           // the handler, which also encodes the reply
+    uint64_t serialize_ns = 0;      // framing the reply, or building it on the pool
+    uint64_t write_ns = 0;          // write() calls until the reply was sent
+};
+
+struct SlowLoop {
+    uint64_t id = 0;
+    uint64_t unix_ms = 0;
+    uint64_t poll_ns = 0;           // preparing and waiting in poll()
+    uint64_t io_ns = 0;             // accepts, reads, requests and writes
+    uint64_t timers_ns = 0;         // idle connections, expiry, children, replication
+    uint64_t background_ns = 0;     // eviction, lazy free, the log flush
+};
+
+// the first k_slowlog_max_args args of `cmd`, each cut at k_slowlog_max_arg_len
+void slowlog_args(std::vector<std::string> &out, const std::vector<std::string> &cmd);
+// returns the id of the entry, `max_len` is the ring size
+uint64_t slowlog_add_cmd(SlowCmd &e, size_t max_len);
+// adds to the write time of entry `id` if it is still held
+void slowlog_add_write(uint64_t id, uint64_t ns);
+void slowlog_add_loop(SlowLoop &e, size_t max_len);
+// the newest `n` entries, newest first
+std::vector<SlowCmd> slowlog_cmds(size_t n);
+std::vector<SlowLoop> slowlog_loops(size_t n);
+size_t slowlog_len();
+void slowlog_reset();
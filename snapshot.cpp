@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "snapshot.h"
+#include "errhelp.h"
+
+static const uint8_t k_snap_magic[4] = {'R', 'L', 'D', 'B'};
+
+//================================== checksum ==================================//
+
+// CRC-64/Jones, reflected, the variant Redis uses for its dump files
+static uint64_t g_crc64_table[256];
+
+static void crc64_init(){
+    const uint64_t poly = 0x95ac9329ac4bc9b5ull;
+    for (uint32_t i = 0; i < 256; i++){
+        uint64_t crc = i;
+        for (int j = 0; j < 8; j++){
+            crc = (crc & 1) ? (crc >> 1) ^ poly : crc >> 1;
+        }
+        g_crc64_table[i] = crc;
+    }
+}
+
+uint64_t crc64(uint64_t crc, const uint8_t* data, size_t len){
+    if (!g_crc64_table[1]){
+        crc64_init();
+    }
+    for (size_t i = 0; i < len; i++){
+        crc = g_crc64_table[(uint8_t)crc ^ data[i]] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+
+//================================== writing ==================================//
+
+void snap_write_buf(SnapWriter* w, const std::vector<uint8_t>& buf){
+    if (w->failed){
+        return;
+    }
+    const uint8_t* p = buf.data();
+    size_t n = buf.size();
+    while (n > 0){
+        ssize_t ret = write(w->fd, p, n);
+        if (ret < 0 && errno == EINTR){
+            continue;
+        }
+        if (ret <= 0){
+            msg_err("snapshot write() error");
+            w->failed = true;
+            break;
+        }
+        p += ret;
+        n -= (size_t)ret;
+    }
+}
+
+static void snap_flush(SnapWriter* w){
+    snap_write_buf(w, w->buf);
+    w->buf.clear();
+}
+
+static void snap_append(SnapWriter* w, const void* data, size_t len){
+    const uint8_t* p = (const uint8_t*)data;
+    w->crc = crc64(w->crc, p, len);
+    w->offset += len;
+    w->buf.insert(w->buf.end(), p, p+len);
+    if (!w->deferred && w->buf.size() >= k_snap_flush_size){
+        snap_flush(w);
+    }
+}
+
+static void snap_append_u8(SnapWriter* w, uint8_t v){
+    snap_append(w, &v, 1);
+}
+
+static void snap_append_u64(SnapWriter* w, uint64_t v){
+    snap_append(w, &v, 8);
+}
+
+static void snap_append_bytes(SnapWriter* w, const char* s, size_t len){
+    uint32_t n = (uint32_t)len;
+    snap_append(w, &n, 4);
+    snap_append(w, s, len);
+}
+
+// starts the next section at the current offset
+static void snap_section_begin(SnapWriter* w){
+    w->section = SnapSection{};
+    w->section.offset = w->offset;
+    w->crc = 0;
+}
+
+static void snap_section_end(SnapWriter* w){
+    if (w->section.nkeys == 0){
+        return;
+    }
+    w->section.len = w->offset - w->section.offset;
+    w->section.crc = w->crc;
+    w->sections.push_back(w->section);
+}
+
+bool snap_write_open(SnapWriter* w, const char* path){
+    w->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (w->fd < 0){
+        msg_err("snapshot open() error");
+        return false;
+    }
+    w->buf.reserve(k_snap_flush_size + 4096);
+    w->offset = 0;
+    w->crc = 0;
+    w->sections.clear();
+    w->nkeys = 0;
+    w->failed = false;
+    snap_append(w, k_snap_magic, 4);
+    snap_append(w, &k_snap_version, 4);
+    w->head_crc = w->crc;
+    snap_section_begin(w);
+    return true;
+}
+
+// records never straddle sections, a large zset makes a large section
+static void snap_put_header(SnapWriter* w, uint8_t type, const char* key, size_t klen, int64_t expire_unix_ms){
+    if (w->offset - w->section.offset >= k_snap_section_size){
+        snap_section_end(w);
+        snap_section_begin(w);
+    }
+    w->section.nkeys++;
+    w->nkeys++;
+    if (expire_unix_ms >= 0){
+        snap_append_u8(w, SNAP_EXPIRE);
+        snap_append(w, &expire_unix_ms, 8);
+    }
+    snap_append_u8(w, type);
+    snap_append_bytes(w, key, klen);
+}
+
+void snap_put_str(SnapWriter* w, const char* key, size_t klen,
+    const char* val, size_t vlen, int64_t expire_unix_ms)
+{
+    snap_put_header(w, SNAP_STR, key, klen, expire_unix_ms);
+    snap_append_bytes(w, val, vlen);
+}
+
+void snap_put_image(SnapWriter* w, uint32_t type, const char* key, size_t klen,
+    const char* img, size_t len, int64_t expire_unix_ms)
+{
+    snap_put_header(w, type, key, klen, expire_unix_ms);
+    snap_append_bytes(w, img, len);
+}
+
+void snap_put_zset(SnapWriter* w, const char* key, size_t klen, uint64_t count, int64_t expire_unix_ms){
+    snap_put_header(w, SNAP_ZSET, key, klen, expire_unix_ms);
+    snap_append(w, &count, 8);
+}
+
+void snap_put_member(SnapWriter* w, const char* name, size_t len, double score){
+    snap_append_bytes(w, name, len);
+    snap_append(w, &score, 8);
+}
+
+void snap_put_hash(SnapWriter* w, const char* key, size_t klen, uint64_t count, int64_t expire_unix_ms){
+    snap_put_header(w, SNAP_HASH, key, klen, expire_unix_ms);
+    snap_append(w, &count, 8);
+}
+
+void snap_put_field(SnapWriter* w, const char* field, size_t flen, const char* val, size_t vlen){
+    snap_append_bytes(w, field, flen);
+    snap_append_bytes(w, val, vlen);
+}
+
+void snap_put_list(SnapWriter* w, const char* key, size_t klen, uint64_t count, int64_t expire_unix_ms){
+    snap_put_header(w, SNAP_LIST, key, klen, expire_unix_ms);
+    snap_append(w, &count, 8);
+}
+
+void snap_put_elem(SnapWriter* w, const char* val, size_t len){
+    snap_append_bytes(w, val, len);
+}
+
+bool snap_write_close(SnapWriter* w){
+    snap_section_end(w);
+    // the trailing checksum continues from the header
+    w->crc = w->head_crc;
+    uint64_t index_pos = w->offset;
+    snap_append_u8(w, SNAP_EOF);
+    snap_append_u64(w, w->sections.size());
+    snap_append_u64(w, w->nkeys);
+    for (const SnapSection &s : w->sections){
+        snap_append_u64(w, s.offset);
+        snap_append_u64(w, s.len);
+        snap_append_u64(w, s.nkeys);
+        snap_append_u64(w, s.crc);
+    }
+    snap_append_u64(w, index_pos);
+    // the checksum itself is not covered
+    uint64_t crc = w->crc;
+    w->buf.insert(w->buf.end(), (uint8_t*)&crc, (uint8_t*)&crc+8);
+    snap_flush(w);
+    if (!w->failed && fsync(w->fd) < 0){
+        msg_err("snapshot fsync() error");
+        w->failed = true;
+    }
+    close(w->fd);
+    w->fd = -1;
+    return !w->failed;
+}
+
+
+//================================== reading ==================================//
+
+static uint64_t load_u64(const uint8_t* p){
+    uint64_t v = 0;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+bool snap_map(SnapFile* f, const char* path){
+    int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0){
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    // magic + version + EOF + nsections + nkeys + index_pos + crc
+    if (size < 4+4+1+8+8+8+8){
+        close(fd);
+        msg("snapshot is truncated");
+        return false;
+    }
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        msg_err("snapshot mmap() error");
+        return false;
+    }
+    // the sections are read front to back by each worker
+    madvise(map, size, MADV_SEQUENTIAL);
+    f->map = (const uint8_t*)map;
+    f->size = size;
+    crc64(0, nullptr, 0);   // builds the table before the workers use it
+
+    const uint8_t* begin = f->map;
+    uint32_t version = 0;
+    memcpy(&version, begin+4, 4);
+    uint64_t index_pos = load_u64(begin + size - 16);
+    if (memcmp(begin, k_snap_magic, 4) != 0 || version < k_snap_min_version || version > k_snap_version
+        || index_pos < 8 || index_pos > size - 16 - 17 || begin[index_pos] != SNAP_EOF)
+    {
+        msg("snapshot has a bad header");
+        snap_unmap(f);
+        return false;
+    }
+    uint64_t crc = crc64(crc64(0, begin, 8), begin + index_pos, size - 8 - index_pos);
+    if (crc != load_u64(begin + size - 8)){
+        msg("snapshot checksum mismatch");
+        snap_unmap(f);
+        return false;
+    }
+    uint64_t nsections = load_u64(begin + index_pos + 1);
+    f->nkeys = load_u64(begin + index_pos + 9);
+    uint64_t index_len = size - 16 - 17 - index_pos;
+    if (index_len % 32 != 0 || nsections != index_len / 32){
+        msg("snapshot has a bad index");
+        snap_unmap(f);
+        return false;
+    }
+    const uint8_t* p = begin + index_pos + 17;
+    for (uint64_t i = 0; i < nsections; i++, p += 32){
+        SnapSection s;
+        s.offset = load_u64(p);
+        s.len = load_u64(p+8);
+        s.nkeys = load_u64(p+16);
+        s.crc = load_u64(p+24);
+        if (s.offset < 8 || s.offset > index_pos || s.len > index_pos - s.offset){
+            msg("snapshot has a bad index");
+            snap_unmap(f);
+            return false;
+        }
+        f->sections.push_back(s);
+    }
+    return true;
+}
+
+void snap_unmap(SnapFile* f){
+    if (f->map){
+        munmap((void*)f->map, f->size);
+    }
+    *f = SnapFile{};
+}
+
+bool snap_section_open(const SnapFile* f, size_t idx, SnapReader* r){
+    const SnapSection &s = f->sections[idx];
+    const uint8_t* begin = f->map + s.offset;
+    if (crc64(0, begin, s.len) != s.crc){
+        return false;
+    }
+    r->cur = begin;
+    r->end = begin + s.len;
+    return true;
+}
+
+bool snap_section_done(const SnapReader* r){
+    return r->cur == r->end;
+}
+
+static bool snap_read(SnapReader* r, void* out, size_t n){
+    if ((size_t)(r->end - r->cur) < n){
+        return false;
+    }
+    memcpy(out, r->cur, n);
+    r->cur += n;
+    return true;
+}
+
+// points into the image instead of copying
+static bool snap_read_bytes(SnapReader* r, const char** s, size_t* len){
+    uint32_t n = 0;
+    if (!snap_read(r, &n, 4) || (size_t)(r->end - r->cur) < n){
+        return false;
+    }
+    *s = (const char*)r->cur;
+    *len = n;
+    r->cur += n;
+    return true;
+}
+
+bool snap_next(SnapReader* r, SnapRecord* rec){
+    *rec = SnapRecord{};
+    uint8_t type = 0;
+    if (!snap_read(r, &type, 1)){
+        return false;
+    }
+    if (type == SNAP_EXPIRE){
+        if (!snap_read(r, &rec->expire_unix_ms, 8) || !snap_read(r, &type, 1)){
+            return false;
+        }
+    }
+    rec->type = type;
+    if (!snap_read_bytes(r, &rec->key, &rec->klen)){
+        return false;
+    }
+    switch (type){
+    case SNAP_STR:
+    case SNAP_HLL:
+    case SNAP_BLOOM:
+        return snap_read_bytes(r, &rec->val, &rec->vlen);
+    case SNAP_ZSET:
+    case SNAP_HASH:
+    case SNAP_LIST:
+        return snap_read(r, &rec->count, 8);
+    default:
+        return false;
+    }
+}
+
+bool snap_next_member(SnapReader* r, const char** name, size_t* len, double* score){
+    return snap_read_bytes(r, name, len) && snap_read(r, score, 8);
+}
+
+bool snap_next_field(SnapReader* r, const char** field, size_t* flen, const char** val, size_t* vlen){
+    return snap_read_bytes(r, field, flen) && snap_read_bytes(r, val, vlen);
+}
+
+bool snap_next_elem(SnapReader* r, const char** val, size_t* len){
+    return snap_read_bytes(r, val, len);
+}
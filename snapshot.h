@@ -0,0 +1,122 @@
+// 1. A compact binary image of the keyspace, written by SAVE/BGSAVE and loaded at startup
+// 2. Layout, all integers little endian:
+//    +------+---------+---------+-----+---------+-----+-------+-----------+-------+
+//    | RLDB | version | section | ... | section | EOF | index | index_pos | crc64 |
+//    +------+---------+---------+-----+---------+-----+-------+-----------+-------+
+//    section := record*, about k_snap_section_size bytes of whole records
+//    record := [EXPIRE unix_ms:i64] type:u8 key:(u32 len + bytes) value
+//    STR value  := u32 len + bytes
+//    ZSET value := u64 count + count * (u32 len + bytes + score:f64), in (score, name) order
+//    HASH value := u64 count + count * (u32 len + field + u32 len + value)
+//    LIST value := u64 count + count * (u32 len + bytes), head to tail
+//    HLL, BLOOM value := u32 len + the image, see hll.h and bloom.h
+//    index := nsections:u64 nkeys:u64 + nsections * (offset:u64 len:u64 nkeys:u64 crc64:u64)
+// 3. Sections are independently decodable, each has its own checksum in the
+//    index so the loader verifies and decodes them in parallel; the trailing
+//    checksum covers the header and the index, `index_pos` is the EOF offset
+// 4. The key count in the index lets the loader size the keyspace up front
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+enum {
+    SNAP_STR    = 1,
+    SNAP_ZSET   = 2,
+    SNAP_HASH   = 3,
+    SNAP_LIST   = 4,
+    SNAP_HLL    = 5,
+    SNAP_BLOOM  = 6,
+    SNAP_EXPIRE = 0xfc,
+    SNAP_EOF    = 0xff,
+};
+
+const uint32_t k_snap_version = 5;
+const uint32_t k_snap_min_version = 2;      // older files that still load, they lack some types
+const size_t k_snap_section_size = 4<<20;
+const size_t k_snap_flush_size = 64<<10;
+
+struct SnapSection {
+    uint64_t offset = 0;
+    uint64_t len = 0;
+    uint64_t nkeys = 0;
+    uint64_t crc = 0;
+};
+
+// buffered writer, `failed` is sticky and checked once at the end
+struct SnapWriter {
+    int fd = -1;
+    std::vector<uint8_t> buf;
+    uint64_t offset = 0;        // bytes appended so far
+    uint64_t crc = 0;           // of the current section
+    uint64_t head_crc = 0;      // of the header
+    SnapSection section;        // the one being written
+    std::vector<SnapSection> sections;
+    uint64_t nkeys = 0;
+    bool failed = false;
+    // appends never write, the owner takes `buf` and writes it with
+    // snap_write_buf(), for a writer shared with another thread
+    bool deferred = false;
+};
+
+bool snap_write_open(SnapWriter* w, const char* path);
+// expire_unix_ms < 0 means no TTL
+void snap_put_str(SnapWriter* w, const char* key, size_t klen,
+    const char* val, size_t vlen, int64_t expire_unix_ms);
+// SNAP_HLL or SNAP_BLOOM
+void snap_put_image(SnapWriter* w, uint32_t type, const char* key, size_t klen,
+    const char* img, size_t len, int64_t expire_unix_ms);
+void snap_put_zset(SnapWriter* w, const char* key, size_t klen, uint64_t count, int64_t expire_unix_ms);
+void snap_put_member(SnapWriter* w, const char* name, size_t len, double score);
+void snap_put_hash(SnapWriter* w, const char* key, size_t klen, uint64_t count, int64_t expire_unix_ms);
+void snap_put_field(SnapWriter* w, const char* field, size_t flen, const char* val, size_t vlen);
+void snap_put_list(SnapWriter* w, const char* key, size_t klen, uint64_t count, int64_t expire_unix_ms);
+void snap_put_elem(SnapWriter* w, const char* val, size_t len);
+void snap_write_buf(SnapWriter* w, const std::vector<uint8_t>& buf);
+// writes the index and the trailer, fsyncs and closes, returns false if anything failed
+bool snap_write_close(SnapWriter* w);
+
+// the fields point into the file image, nothing is copied
+struct SnapRecord {
+    uint32_t type = 0;
+    int64_t expire_unix_ms = -1;
+    const char* key = nullptr;
+    size_t klen = 0;
+    const char* val = nullptr;  // SNAP_STR, SNAP_HLL and SNAP_BLOOM
+    size_t vlen = 0;
+    uint64_t count = 0;         // SNAP_ZSET, read the members with snap_next_member()
+                                // SNAP_HASH, read the pairs with snap_next_field()
+                                // SNAP_LIST, read the elements with snap_next_elem()
+};
+
+// a memory mapped snapshot, read only and safe to share between threads
+struct SnapFile {
+    const uint8_t* map = nullptr;
+    size_t size = 0;
+    uint64_t nkeys = 0;
+    std::vector<SnapSection> sections;
+};
+
+// decodes one section
+struct SnapReader {
+    const uint8_t* cur = nullptr;
+    const uint8_t* end = nullptr;
+};
+
+// maps the file and verifies the header and the index, false if missing,
+// torn or corrupted; the sections are verified by snap_section_open()
+bool snap_map(SnapFile* f, const char* path);
+void snap_unmap(SnapFile* f);
+// checks the section against its checksum and positions the reader on it
+bool snap_section_open(const SnapFile* f, size_t idx, SnapReader* r);
+// false at the end of the section or on a malformed record
+bool snap_next(SnapReader* r, SnapRecord* rec);
+bool snap_next_member(SnapReader* r, const char** name, size_t* len, double* score);
+bool snap_next_field(SnapReader* r, const char** field, size_t* flen, const char** val, size_t* vlen);
+bool snap_next_elem(SnapReader* r, const char** val, size_t* len);
+// whether the reader consumed its section exactly
+bool snap_section_done(const SnapReader* r);
+
+uint64_t crc64(uint64_t crc, const uint8_t* data, size_t len);
@@ -1,6 +1,7 @@
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <vector>
 #include "zset.h"
 #include "commonops.h"
 
@@ -116,12 +117,67 @@ bool zset_insert(ZSet* zset, const char * name, size_t len, double score){
         return false;   // only updated, no insertion happened
     } else {
         node = znode_new(name, len, score);
+        zset->node_bytes += sizeof(ZNode)+len;
         hm_insert(&zset->hmap, &node->hmap);
         tree_insert(zset, node);
         return true;
     }
 }
 
+// links nodes sorted by (score, name) into a perfectly balanced tree,
+// which always satisfies the AVL invariant
+static AVLNode* tree_build(ZNode** nodes, size_t n, AVLNode* parent){
+    if (n == 0){
+        return nullptr;
+    }
+    size_t mid = n/2;
+    AVLNode* node = &nodes[mid]->tree;
+    node->parent = parent;
+    node->left = tree_build(nodes, mid, node);
+    node->right = tree_build(nodes+mid+1, n-mid-1, node);
+    uint32_t lh = avl_height(node->left), rh = avl_height(node->right);
+    node->height = 1 + (lh > rh ? lh : rh);
+    node->size = 1 + avl_size(node->left) + avl_size(node->right);
+    return node;
+}
+
+// bulk load of an empty zset from `n` members in (score, name) order, such as
+// a snapshot: no searches and no rotations, and the name index is sized once;
+// returns false if `next` runs out or the members are out of order
+bool zset_build(ZSet* zset, size_t n,
+    bool (*next)(void*, const char**, size_t*, double*), void* arg)
+{
+    assert(!zset->root && hm_size(&zset->hmap) == 0);
+    std::vector<ZNode*> nodes;
+    nodes.reserve(n);
+    bool ok = true;
+    for (size_t i = 0; i < n && ok; i++){
+        const char* name = nullptr;
+        size_t len = 0;
+        double score = 0;
+        if (!next(arg, &name, &len, &score)){
+            ok = false;
+            break;
+        }
+        ZNode* node = znode_new(name, len, score);
+        ok = nodes.empty() || zless(&nodes.back()->tree, &node->tree);
+        nodes.push_back(node);
+    }
+    if (!ok){
+        for (ZNode* node : nodes){
+            znode_del(node);
+        }
+        return false;
+    }
+    hm_reserve(&zset->hmap, n);
+    for (ZNode* node : nodes){
+        hm_insert(&zset->hmap, &node->hmap);
+        zset->node_bytes += sizeof(ZNode)+node->len;
+    }
+    zset->root = tree_build(nodes.data(), n, nullptr);
+    return true;
+}
+
 
 //=============================== deletion from the zset ===============================//
 
@@ -134,6 +190,7 @@ void zset_delete(ZSet* zset, ZNode* node){      // no search and delete
     assert(found);
     // remove from the tree
     zset->root = avl_del(&node->tree);
+    zset->node_bytes -= sizeof(ZNode)+node->len;
     znode_del(node);
 }
 
@@ -166,19 +223,52 @@ ZNode* znode_offset(ZNode* node, int64_t offset){
     return tnode ? container_of(tnode, ZNode, tree) : nullptr;
 }
 
-// frees the avl tree and the znodes that contain it
-static void tree_dispose(AVLNode *node){
-    if (!node){
-        return;
+/*
+    frees at most `max_work` znodes and returns true once the zset is empty
+    - no recursion, the tree is eaten leaf by leaf by following the parent pointers
+    - `zset->root` doubles as the resume cursor, every remaining node is
+      reachable from it through its children and its chain of parents
+*/
+bool zset_dispose(ZSet* zset, size_t max_work){
+    hm_clear(&zset->hmap);  // only the slot arrays, the nodes are owned by the tree
+    AVLNode* node = zset->root;
+    size_t nwork = 0;
+    while (node && nwork < max_work){
+        if (node->left){
+            node = node->left;
+        } else if (node->right){
+            node = node->right;
+        } else {
+            // a leaf, unlink it from its parent and go back up
+            AVLNode* parent = node->parent;
+            if (parent){
+                AVLNode **from = parent->left == node ? &parent->left : &parent->right;
+                *from = nullptr;
+            }
+            ZNode* znode = container_of(node, ZNode, tree);
+            zset->node_bytes -= sizeof(ZNode)+znode->len;
+            znode_del(znode);
+            node = parent;
+            nwork++;
+        }
     }
-    tree_dispose(node->left);
-    tree_dispose(node->right);
-    znode_del(container_of(node, ZNode, tree));
+    zset->root = node;
+    return node == nullptr;
 }
 
 // destroy the zset
 void zset_clear(ZSet* zset) {
-    hm_clear(&zset->hmap);
-    tree_dispose(zset->root);
-    zset->root = nullptr;
-}
\ No newline at end of file
+    while (!zset_dispose(zset, (size_t)-1)) {}
+}
+
+// bytes held by the zset, excluding the ZSet struct itself
+size_t zset_mem(ZSet* zset){
+    size_t slots = 0;
+    if (zset->hmap.newer.tab){
+        slots += zset->hmap.newer.mask+1;
+    }
+    if (zset->hmap.older.tab){
+        slots += zset->hmap.older.mask+1;
+    }
+    return zset->node_bytes + slots*sizeof(HNode*);
+}
@@ -6,6 +6,7 @@
 struct ZSet {
     AVLNode *root = nullptr;    // index by (score, name)
     HMap hmap;                  // index by name
+    size_t node_bytes = 0;      // memory held by the znodes
 };
 
 struct ZNode {
@@ -20,8 +21,13 @@ struct ZNode {
 };
 
 bool    zset_insert(ZSet* zset, const char *name, size_t len, double score);
+// bulk load from members in (score, name) order, `next` yields them one by one
+bool    zset_build(ZSet* zset, size_t n,
+            bool (*next)(void* arg, const char** name, size_t* len, double* score), void* arg);
 ZNode*  zset_lookup(ZSet* zset, const char *name, size_t len);
 void    zset_delete(ZSet* zset, ZNode* node);
 ZNode*  zset_seekge(ZSet* zset, double score, const char *name, size_t len);
 void    zset_clear(ZSet* zset);
-ZNode*  znode_offset(ZNode* node, int64_t offset);
\ No newline at end of file
+bool    zset_dispose(ZSet* zset, size_t max_work);
+ZNode*  znode_offset(ZNode* node, int64_t offset);
+size_t  zset_mem(ZSet* zset);
\ No newline at end of file